@@ -0,0 +1,129 @@
+#include "arena.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block
+{
+    arena_block *next;
+    size_t size;                // usable bytes after the header
+};
+
+#define HEADER_LEN ALIGN_UP(sizeof(arena_block))
+
+void arena_init(arena *a)
+{
+    memset(a, 0, sizeof(arena));
+}
+
+// Moves on to the next block that fits, or puts a new one after the
+// current block; blocks at least double so there are few of them
+static int next_block(arena *a, size_t size)
+{
+    arena_block *b = a->current ? a->current->next : a->first;
+
+    while (b && b->size < size) {
+        b = b->next;
+    }
+
+    if (!b) {
+        size_t len = a->current ? a->current->size * 2 : ARENA_BLOCK;
+
+        while (len < size) {
+            len *= 2;
+        }
+
+        b = malloc(HEADER_LEN + len);
+        if (!b) {
+            return -1;
+        }
+
+        b->size = len;
+
+        if (a->current) {
+            b->next = a->current->next;
+            a->current->next = b;
+        } else {
+            b->next = a->first;
+            a->first = b;
+        }
+
+        a->reserved += len;
+        a->blocks++;
+    }
+
+    a->current = b;
+    a->used = 0;
+
+    return 0;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = ALIGN_UP(size ? size : 1);
+
+    if (!a->current || a->current->size - a->used < size) {
+        if (next_block(a, size) != 0) {
+            return NULL;
+        }
+    }
+
+    void *p = (uint8_t *)a->current + HEADER_LEN + a->used;
+
+    a->used += size;
+    a->in_use += size;
+    if (a->in_use > a->peak) {
+        a->peak = a->in_use;
+    }
+
+    return p;
+}
+
+void *arena_copy(arena *a, const void *data, size_t size)
+{
+    void *p = arena_alloc(a, size);
+
+    if (p && size) {
+        memcpy(p, data, size);
+    }
+
+    return p;
+}
+
+void arena_reset(arena *a)
+{
+    a->current = NULL;
+    a->used = 0;
+    a->in_use = 0;
+    a->resets++;
+}
+
+void arena_free(arena *a)
+{
+    // Workers finish at different times, hence the atomics
+    if (g_stats.enabled) {
+        unsigned long peak = __atomic_load_n(&g_stats.arena_peak, __ATOMIC_RELAXED);
+
+        __atomic_fetch_add(&g_stats.arena_blocks, a->blocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_stats.arena_bytes, a->reserved, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_stats.arena_resets, a->resets, __ATOMIC_RELAXED);
+
+        while (a->peak > peak && !__atomic_compare_exchange_n(&g_stats.arena_peak, &peak,
+                a->peak, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    while (a->first) {
+        arena_block *next = a->first->next;
+
+        free(a->first);
+        a->first = next;
+    }
+
+    arena_init(a);
+}
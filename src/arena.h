@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+// Bump allocator for what parsing one input produces. Nothing is freed
+// on its own: arena_reset() drops everything at once and keeps the blocks
+// for the next input, so a worker holds about what its largest input
+// needed however many inputs it goes through, and never touches malloc
+// once it has warmed up.
+
+#define ARENA_BLOCK (256 * 1024)
+
+typedef struct arena_block arena_block;
+
+typedef struct
+{
+    arena_block *first;
+    arena_block *current;
+    size_t used;                // bytes taken from the current block
+    size_t in_use;              // bytes handed out since the last reset
+    size_t peak;                // largest in_use seen
+    size_t reserved;            // bytes in all blocks
+    unsigned long blocks;
+    unsigned long resets;
+} arena;
+
+void arena_init(arena *a);
+
+// size bytes aligned for any type, NULL if out of memory
+void *arena_alloc(arena *a, size_t size);
+void *arena_copy(arena *a, const void *data, size_t size);
+
+void arena_reset(arena *a);
+
+// Frees the blocks and adds the arena's growth to the --stats counters
+void arena_free(arena *a);
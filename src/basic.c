@@ -1,8 +1,8 @@
 #include "basic.h"
-#include "util.h"
+#include "petscii.h"
+#include "stats.h"
 
 #include <stdio.h>
-#include <ctype.h>
 
 #define INBUF_SIZE 80
 #define LINK_SIZE 5
@@ -33,11 +33,13 @@ const char *keywords[] = {
     "left$",   "right$", "mid$",   "unknown"
 };
 
-void basic(const uint8_t *buffer, const int size)
+void basic(FILE *out, const uint8_t *buffer, const size_t size)
 {
     // Get loading address and advance index
     uint16_t address = (uint16_t)(buffer[0] + ((buffer[1] & 0xff) << 8));
-    int index = 2;
+    size_t index = 2;
+
+    STATS_PHASE(STATS_RENDER);
 
     do {
         // next line link
@@ -59,24 +61,39 @@ void basic(const uint8_t *buffer, const int size)
         low = buffer[index++];
         high = buffer[index++];
         uint16_t line = (uint16_t)(low + ((high & 0xff) << 8));
-        printf("%u ", line);
+        fprintf(out, "%u ", line);
 
         // current line
         uint8_t quote = 0;
-        for (int i = 0; i < next-LINK_SIZE; i++) {
-            uint8_t input = buffer[index++];
+        for (int i = 0; i < next-LINK_SIZE; ) {
+            uint8_t input = buffer[index];
 
             // toggle quote mode
             if (input == QUOTE)
               quote ^= input;
 
-            if (quote == 0 && ((input >= LOW) && (input <= HIGH)))
-                printf("%s", keywords[input-LOW]);
-            else
-                printf("%c", isprint(pet_asc[input]) ? pet_asc[input] : ' ');
+            if (quote == 0 && ((input >= LOW) && (input <= HIGH))) {
+                fprintf(out, "%s", keywords[input-LOW]);
+                index++;
+                i++;
+                continue;
+            }
+
+            // Convert the run of text up to the next keyword at once
+            size_t start = index++;
+            for (i++; i < next-LINK_SIZE; i++, index++) {
+                input = buffer[index];
+
+                if (input == QUOTE)
+                  quote ^= input;
+                else if (quote == 0 && ((input >= LOW) && (input <= HIGH)))
+                    break;
+            }
+
+            petscii_write(out, petscii_text, &buffer[start], index - start);
         }
 
         index++;
-        printf("\n");
+        fprintf(out, "\n");
     } while (index < size);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 
-void basic(const uint8_t *buffer, const int size);
+void basic(FILE *out, const uint8_t *buffer, const size_t size);
@@ -0,0 +1,415 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "corpus.h"
+#include "disk.h"
+#include "disasm.h"
+#include "basic.h"
+#include "sid.h"
+#include "crt.h"
+#include "t64.h"
+#include "pxx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <libgen.h>
+
+#define DEFAULT_ITERATIONS 20
+#define DEFAULT_CORPUS 32
+#define DEFAULT_SEED 0x64
+#define DEFAULT_DISK_FILES 100
+#define DEFAULT_FRAGMENTATION 20
+#define DEFAULT_CORRUPTION 5
+#define PRG_SIZE 16384
+#define BASIC_LINES 400
+#define CRT_CHIPS 8
+#define T64_FILES 16
+#define SID_SIZE 4096
+
+typedef enum {TEXT, CSV, JSON} report_format;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+} input;
+
+typedef struct
+{
+    int iterations;
+    int corpus;
+    uint64_t seed;
+    corpus_d64_params d64;
+} bench_options;
+
+typedef struct
+{
+    const char *name;
+    uint8_t *(*generate)(corpus_rng *rng, const bench_options *opt, size_t *size);
+    void (*run)(FILE *out, const uint8_t *buffer, const size_t size);
+    int headers_only;           // reads a fixed header and table, not the data
+} bench_module;
+
+// Allocation counters, fed by the -Wl,--wrap hooks below
+static struct
+{
+    unsigned long count;
+    unsigned long bytes;
+} g_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    g_allocs.count++;
+    g_allocs.bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    g_allocs.count++;
+    g_allocs.bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    g_allocs.count++;
+    g_allocs.bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static uint8_t *gen_d64(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    return corpus_d64(rng, &opt->d64, size);
+}
+
+static uint8_t *gen_prg(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_prg(rng, PRG_SIZE, size);
+}
+
+static uint8_t *gen_basic(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_basic(rng, BASIC_LINES, size);
+}
+
+static uint8_t *gen_crt(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_crt(rng, CRT_CHIPS, size);
+}
+
+static uint8_t *gen_t64(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_t64(rng, T64_FILES, size);
+}
+
+static uint8_t *gen_sid(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_sid(rng, SID_SIZE, size);
+}
+
+static uint8_t *gen_pxx(corpus_rng *rng, const bench_options *opt, size_t *size)
+{
+    (void)opt;
+    return corpus_pxx(rng, BASIC_LINES, size);
+}
+
+static void run_disk(FILE *out, const uint8_t *buffer, const size_t size)
+{
+    disk(out, buffer, size, 1, 1);
+}
+
+static void run_disasm(FILE *out, const uint8_t *buffer, const size_t size)
+{
+    disasm(out, buffer, size, UINT16_MAX, 0);
+}
+
+static void run_disasm_illegal(FILE *out, const uint8_t *buffer, const size_t size)
+{
+    disasm(out, buffer, size, UINT16_MAX, 1);
+}
+
+static const bench_module modules[] = {
+    {"disk",           gen_d64,   run_disk,           0},
+    {"disasm",         gen_prg,   run_disasm,         0},
+    {"disasm-illegal", gen_prg,   run_disasm_illegal, 0},
+    {"basic",          gen_basic, basic,              0},
+    {"sid",            gen_sid,   sid,                1},
+    {"crt",            gen_crt,   crt,                1},
+    {"t64",            gen_t64,   t64,                1},
+    {"pxx",            gen_pxx,   pxx,                0},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int selected(const char *list, const char *name)
+{
+    if (!list) {
+        return 1;
+    }
+
+    size_t len = strlen(name);
+    for (const char *p = list; *p; ) {
+        const char *end = strchr(p, ',');
+        size_t plen = end ? (size_t)(end - p) : strlen(p);
+
+        if (plen == len && strncmp(p, name, len) == 0) {
+            return 1;
+        }
+
+        p += plen + (end ? 1 : 0);
+    }
+
+    return 0;
+}
+
+// Modules that only read headers get no MB/s: the bytes they skip would
+// count as throughput. Their files/s is the comparable figure.
+static void report(FILE *out, report_format format, const bench_module *m, int inputs,
+        int iterations, double bytes, double seconds, unsigned long allocs,
+        unsigned long alloc_bytes)
+{
+    double files = (double)inputs * iterations;
+    double mbps = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    double fps = seconds > 0 ? files / seconds : 0;
+    char rate[32];
+
+    switch (format) {
+        case JSON:
+            if (m->headers_only) {
+                snprintf(rate, sizeof(rate), "null");
+            } else {
+                snprintf(rate, sizeof(rate), "%.3f", mbps);
+            }
+            fprintf(out, "{\"module\":\"%s\",\"inputs\":%d,\"iterations\":%d,"
+                "\"bytes\":%.0f,\"seconds\":%.6f,\"mb_per_s\":%s,"
+                "\"files_per_s\":%.1f,\"allocs\":%lu,\"alloc_bytes\":%lu}\n",
+                m->name, inputs, iterations, bytes, seconds, rate, fps, allocs, alloc_bytes);
+            break;
+
+        case CSV:
+            if (m->headers_only) {
+                rate[0] = '\0';
+            } else {
+                snprintf(rate, sizeof(rate), "%.3f", mbps);
+            }
+            fprintf(out, "%s,%d,%d,%.0f,%.6f,%s,%.1f,%lu,%lu\n",
+                m->name, inputs, iterations, bytes, seconds, rate, fps, allocs, alloc_bytes);
+            break;
+
+        case TEXT:
+        default:
+            if (m->headers_only) {
+                snprintf(rate, sizeof(rate), "%10s", "-");
+            } else {
+                snprintf(rate, sizeof(rate), "%10.3f", mbps);
+            }
+            fprintf(out, "%-15s %s MB/s %12.1f files/s %8lu allocs %10lu bytes\n",
+                m->name, rate, fps, allocs, alloc_bytes);
+            break;
+    }
+}
+
+static int bench(FILE *out, FILE *sink, report_format format, const bench_module *m,
+        const bench_options *opt)
+{
+    corpus_rng rng;
+    corpus_seed(&rng, opt->seed);
+
+    input *inputs = calloc((size_t)opt->corpus, sizeof(input));
+    if (!inputs) {
+        return -1;
+    }
+
+    double bytes = 0;
+    for (int i = 0; i < opt->corpus; ++i) {
+        inputs[i].data = m->generate(&rng, opt, &inputs[i].size);
+
+        if (!inputs[i].data) {
+            for (int j = 0; j < i; ++j) {
+                free(inputs[j].data);
+            }
+
+            free(inputs);
+            return -1;
+        }
+
+        bytes += (double)inputs[i].size;
+    }
+
+    // Warm up caches once before timing, making sure every input renders
+    // something: a module that silently rejects its corpus would time
+    // nothing but the rejection
+    int silent = 0;
+    for (int i = 0; i < opt->corpus; ++i) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *mem = open_memstream(&text, &len);
+
+        if (!mem) {
+            break;
+        }
+
+        m->run(mem, inputs[i].data, inputs[i].size);
+        fclose(mem);
+        silent += len == 0;
+        free(text);
+    }
+
+    g_allocs.count = 0;
+    g_allocs.bytes = 0;
+
+    double start = now();
+    for (int n = 0; n < opt->iterations; ++n) {
+        for (int i = 0; i < opt->corpus; ++i) {
+            m->run(sink, inputs[i].data, inputs[i].size);
+        }
+    }
+    fflush(sink);
+    double seconds = now() - start;
+
+    report(out, format, m, opt->corpus, opt->iterations,
+        bytes * opt->iterations, seconds, g_allocs.count, g_allocs.bytes);
+
+    for (int i = 0; i < opt->corpus; ++i) {
+        free(inputs[i].data);
+    }
+    free(inputs);
+
+    if (silent) {
+        fprintf(stderr, "%s rendered nothing for %d of %d inputs\n", m->name, silent, opt->corpus);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void printhelp(char *program)
+{
+    printf("Usage: %s [options]\n" \
+        "  -n count    iterations over the corpus (default %d)\n" \
+        "  -c count    inputs generated per module (default %d)\n" \
+        "  -s seed     corpus seed (default %d)\n" \
+        "  -f count    files per disk image (default %d)\n" \
+        "  -r percent  disk fragmentation (default %d)\n" \
+        "  -e percent  corrupted file chains (default %d)\n" \
+        "  -t tracks   disk image tracks, 35 or 40 (default 35)\n" \
+        "  -E          append error bytes to disk images\n" \
+        "  -m list     comma separated modules to run\n" \
+        "  -F format   report format: text, csv or json\n" \
+        "  -h          this help text\n",
+        basename(program), DEFAULT_ITERATIONS, DEFAULT_CORPUS, DEFAULT_SEED,
+        DEFAULT_DISK_FILES, DEFAULT_FRAGMENTATION, DEFAULT_CORRUPTION);
+
+    printf("Modules:");
+    for (size_t i = 0; i < sizeof(modules) / sizeof(modules[0]); ++i) {
+        printf(" %s", modules[i].name);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opt = {
+        DEFAULT_ITERATIONS, DEFAULT_CORPUS, DEFAULT_SEED,
+        {35, DEFAULT_DISK_FILES, 40, DEFAULT_FRAGMENTATION, DEFAULT_CORRUPTION, 0}
+    };
+    report_format format = TEXT;
+    const char *list = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:s:f:r:e:t:Em:F:h")) != -1) {
+        switch (c) {
+            case 'n':
+                opt.iterations = atoi(optarg);
+                break;
+            case 'c':
+                opt.corpus = atoi(optarg);
+                break;
+            case 's':
+                opt.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                opt.d64.files = atoi(optarg);
+                break;
+            case 'r':
+                opt.d64.fragmentation = atoi(optarg);
+                break;
+            case 'e':
+                opt.d64.corruption = atoi(optarg);
+                break;
+            case 't':
+                opt.d64.tracks = atoi(optarg);
+                break;
+            case 'E':
+                opt.d64.error_bytes = 1;
+                break;
+            case 'm':
+                list = optarg;
+                break;
+            case 'F':
+                if (strcmp(optarg, "json") == 0) {
+                    format = JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = CSV;
+                } else {
+                    format = TEXT;
+                }
+                break;
+            case 'h':
+            default:
+                printhelp(argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if (opt.iterations < 1 || opt.corpus < 1) {
+        fprintf(stderr, "Iterations and corpus size must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    // Rendered output is discarded, only the report goes to stdout
+    FILE *sink = fopen("/dev/null", "w");
+    if (!sink) {
+        perror("Error");
+        return EXIT_FAILURE;
+    }
+
+    if (format == CSV) {
+        printf("module,inputs,iterations,bytes,seconds,mb_per_s,files_per_s,allocs,alloc_bytes\n");
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(modules) / sizeof(modules[0]); ++i) {
+        if (!selected(list, modules[i].name)) {
+            continue;
+        }
+
+        if (bench(stdout, sink, format, &modules[i], &opt) != 0) {
+            fprintf(stderr, "Benchmark failed for %s\n", modules[i].name);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    fclose(sink);
+
+    return status;
+}
@@ -0,0 +1,548 @@
+#define _DEFAULT_SOURCE
+
+#include "bulk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define BULK_URING
+#endif
+
+#define BULK_DEPTH 16                   // files in flight
+#define BULK_BUFFER (384 * 1024)        // per file; D64, G64 and SID files fit
+#define BULK_STRIDE (BULK_BUFFER + 4096)
+#define RING_ENTRIES 64                 // an open, or a read and a close, per file
+
+// Operation in the low bits of the user data, slot above
+#define OP_OPEN 0
+#define OP_READ 1
+#define OP_CLOSE 2
+#define OP_STAT 3
+#define OP_BITS 2
+
+enum {SLOT_FREE, SLOT_BUSY, SLOT_DONE};
+
+typedef struct
+{
+    bulk_file file;
+    uint8_t *buffer;            // pool slot, BULK_BUFFER bytes and padding
+    int fd;
+    int state;
+    int waiting;                // completions outstanding
+#ifdef BULK_URING
+    struct statx stx;
+#endif
+} slot;
+
+#ifdef BULK_URING
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_len;
+    void *cq_map;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned tail;              // ours until submitted
+    unsigned queued;            // filled in but not submitted
+    int fixed;                  // buffers are registered
+} ring;
+#endif
+
+struct bulk_reader
+{
+    char **paths;
+    int count;
+    int next;                   // file handed out next
+    int started;                // files whose reading has begun
+    uint8_t *pool;
+    slot slots[BULK_DEPTH];
+#ifdef BULK_URING
+    ring *ring;
+#endif
+};
+
+// Whole file with pread into the slot; others are left to the caller
+static void read_file(slot *s)
+{
+    struct stat st;
+    int fd = open(s->file.path, O_RDONLY | O_CLOEXEC);
+
+    s->file.error = 0;
+    s->file.size = 0;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        s->file.error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint8_t *buffer = s->buffer;
+    size_t size = (size_t)st.st_size;
+    size_t got = 0;
+
+    if (!S_ISREG(st.st_mode) || st.st_size > BULK_BUFFER) {
+        s->file.data = NULL;
+        close(fd);
+        return;
+    }
+
+    while (got < size) {
+        ssize_t n = pread(fd, buffer + got, size - got, (off_t)got);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            s->file.error = n < 0 ? errno : 0;
+            break;
+        }
+
+        got += (size_t)n;
+    }
+
+    close(fd);
+    memset(buffer + got, 0, BULK_PAD);
+    s->file.data = buffer;
+    s->file.size = got;
+}
+
+#ifdef BULK_URING
+static void ring_free(ring *g)
+{
+    if (g->sqes) {
+        munmap(g->sqes, g->sqes_len);
+    }
+
+    if (g->cq_map) {
+        munmap(g->cq_map, g->cq_len);
+    }
+
+    if (g->sq_map) {
+        munmap(g->sq_map, g->sq_len);
+    }
+
+    close(g->fd);
+    free(g);
+}
+
+static int ring_supports(int fd)
+{
+    static const int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+        IORING_OP_READ_FIXED, IORING_OP_CLOSE};
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ok = probe != NULL &&
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t k = 0; ok && k < sizeof(needed) / sizeof(needed[0]); ++k) {
+        ok = needed[k] <= probe->last_op && (probe->ops[needed[k]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+
+    return ok;
+}
+
+// NULL where io_uring is missing, disabled or too old for file opens
+static ring *ring_new(uint8_t *pool)
+{
+    struct io_uring_params p;
+    ring *g = calloc(1, sizeof(ring));
+
+    if (!g) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    g->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+
+    if (g->fd < 0) {
+        free(g);
+        return NULL;
+    }
+
+    g->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    g->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    g->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    g->sq_map = mmap(NULL, g->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        g->fd, IORING_OFF_SQ_RING);
+    g->cq_map = mmap(NULL, g->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        g->fd, IORING_OFF_CQ_RING);
+    g->sqes = mmap(NULL, g->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        g->fd, IORING_OFF_SQES);
+
+    if (g->sq_map == MAP_FAILED || g->cq_map == MAP_FAILED || g->sqes == MAP_FAILED ||
+            !ring_supports(g->fd)) {
+        g->sq_map = g->sq_map == MAP_FAILED ? NULL : g->sq_map;
+        g->cq_map = g->cq_map == MAP_FAILED ? NULL : g->cq_map;
+        g->sqes = g->sqes == MAP_FAILED ? NULL : g->sqes;
+        ring_free(g);
+        return NULL;
+    }
+
+    uint8_t *sq = g->sq_map;
+    uint8_t *cq = g->cq_map;
+
+    g->sq_head = (unsigned *)(sq + p.sq_off.head);
+    g->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    g->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    g->sq_array = (unsigned *)(sq + p.sq_off.array);
+    g->cq_head = (unsigned *)(cq + p.cq_off.head);
+    g->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    g->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    g->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    g->tail = *g->sq_tail;
+
+    // Registered buffers save pinning the pages on every read; locked
+    // memory limits may refuse them, plain reads work regardless
+    struct iovec iov[BULK_DEPTH];
+
+    for (int k = 0; k < BULK_DEPTH; ++k) {
+        iov[k].iov_base = pool + (size_t)k * BULK_STRIDE;
+        iov[k].iov_len = BULK_BUFFER;
+    }
+
+    g->fixed = syscall(__NR_io_uring_register, g->fd, IORING_REGISTER_BUFFERS,
+        iov, BULK_DEPTH) == 0;
+
+    return g;
+}
+
+static int ring_submit(ring *g, unsigned wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(g->sq_tail, g->tail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, g->fd, g->queued, wait, flags, NULL, 0);
+
+        if (n >= 0) {
+            g->queued -= (unsigned)n;
+            return 0;
+        }
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+// Free submission entries; never short with RING_ENTRIES above the most
+// operations a full pool queues
+static unsigned ring_space(const ring *g)
+{
+    return *g->sq_mask + 1 - (g->tail - __atomic_load_n(g->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *ring_sqe(ring *g)
+{
+    unsigned k = g->tail++ & *g->sq_mask;
+    struct io_uring_sqe *sqe = &g->sqes[k];
+
+    memset(sqe, 0, sizeof(*sqe));
+    g->sq_array[k] = k;
+    g->queued++;
+
+    return sqe;
+}
+
+static void queue_stat(bulk_reader *r, int k)
+{
+    slot *s = &r->slots[k];
+
+    if (ring_space(r->ring) < 1) {
+        s->file.error = EAGAIN;
+        s->state = SLOT_DONE;
+        return;
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(r->ring);
+
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)s->file.path;
+    sqe->len = STATX_TYPE | STATX_SIZE;
+    sqe->off = (uint64_t)(uintptr_t)&s->stx;
+    sqe->user_data = (uint64_t)k << OP_BITS | OP_STAT;
+    s->waiting = 1;
+}
+
+static void queue_open(bulk_reader *r, int k)
+{
+    slot *s = &r->slots[k];
+
+    if (ring_space(r->ring) < 1) {
+        s->file.error = EAGAIN;
+        s->state = SLOT_DONE;
+        return;
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(r->ring);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)s->file.path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = (uint64_t)k << OP_BITS | OP_OPEN;
+    s->waiting = 1;
+}
+
+// The close is hard linked so it runs even when the read fails
+static void queue_read(bulk_reader *r, int k)
+{
+    slot *s = &r->slots[k];
+
+    if (ring_space(r->ring) < 2) {
+        close(s->fd);
+        s->file.error = EAGAIN;
+        s->state = SLOT_DONE;
+        return;
+    }
+
+    struct io_uring_sqe *read = ring_sqe(r->ring);
+    struct io_uring_sqe *close_sqe = ring_sqe(r->ring);
+
+    read->opcode = r->ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    read->flags = IOSQE_IO_HARDLINK;
+    read->fd = s->fd;
+    read->addr = (uint64_t)(uintptr_t)s->buffer;
+    read->len = BULK_BUFFER;
+    read->buf_index = (uint16_t)k;
+    read->user_data = (uint64_t)k << OP_BITS | OP_READ;
+
+    close_sqe->opcode = IORING_OP_CLOSE;
+    close_sqe->fd = s->fd;
+    close_sqe->user_data = (uint64_t)k << OP_BITS | OP_CLOSE;
+    s->waiting = 2;
+}
+
+static void complete(bulk_reader *r, uint64_t data, int res)
+{
+    int k = (int)(data >> OP_BITS);
+    slot *s = &r->slots[k];
+
+    switch (data & ((1 << OP_BITS) - 1)) {
+        case OP_STAT:
+            if (res < 0) {
+                s->file.error = -res;
+                break;
+            }
+
+            if (!S_ISREG(s->stx.stx_mode) || s->stx.stx_size > BULK_BUFFER) {
+                s->file.data = NULL;
+                break;
+            }
+
+            queue_open(r, k);
+            return;
+
+        case OP_OPEN:
+            if (res < 0) {
+                s->file.error = -res;
+                break;
+            }
+
+            s->fd = res;
+            queue_read(r, k);
+            return;
+
+        case OP_READ:
+            if (res < 0) {
+                s->file.error = -res;
+            } else {
+                s->file.size = (size_t)res;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    if (--s->waiting == 0) {
+        s->state = SLOT_DONE;
+    }
+}
+
+// Submits what is queued and handles at least one completion
+static int ring_wait(bulk_reader *r)
+{
+    ring *g = r->ring;
+
+    if (ring_submit(g, 1) != 0) {
+        return -1;
+    }
+
+    unsigned head = *g->cq_head;
+    unsigned tail = __atomic_load_n(g->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &g->cqes[head & *g->cq_mask];
+
+        complete(r, cqe->user_data, cqe->res);
+        head++;
+    }
+
+    __atomic_store_n(g->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Starts every file that has a free slot, then submits without waiting
+static void ring_fill(bulk_reader *r)
+{
+    while (r->started < r->count && r->started < r->next + BULK_DEPTH) {
+        int k = r->started % BULK_DEPTH;
+        slot *s = &r->slots[k];
+
+        s->file.index = r->started;
+        s->file.path = r->paths[r->started];
+        s->file.data = s->buffer;
+        s->file.size = 0;
+        s->file.error = 0;
+        s->state = SLOT_BUSY;
+        queue_stat(r, k);
+        r->started++;
+    }
+
+    if (r->ring->queued) {
+        ring_submit(r->ring, 0);
+    }
+}
+#endif
+
+bulk_reader *bulk_open(char **paths, int count)
+{
+    bulk_reader *r = calloc(1, sizeof(bulk_reader));
+
+    if (!r) {
+        return NULL;
+    }
+
+    r->paths = paths;
+    r->count = count;
+    r->pool = mmap(NULL, (size_t)BULK_DEPTH * BULK_STRIDE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (r->pool == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+
+    for (int k = 0; k < BULK_DEPTH; ++k) {
+        r->slots[k].buffer = r->pool + (size_t)k * BULK_STRIDE;
+        r->slots[k].fd = -1;
+    }
+
+#ifdef BULK_URING
+    r->ring = ring_new(r->pool);
+#endif
+
+    return r;
+}
+
+void bulk_close(bulk_reader *r)
+{
+    if (!r) {
+        return;
+    }
+
+#ifdef BULK_URING
+    if (r->ring) {
+        // Files still in flight have to land before the pool goes
+        for (int k = 0; k < BULK_DEPTH; ++k) {
+            while (r->slots[k].state == SLOT_BUSY && ring_wait(r) == 0) {
+            }
+        }
+
+        ring_free(r->ring);
+    }
+#endif
+
+    munmap(r->pool, (size_t)BULK_DEPTH * BULK_STRIDE);
+    free(r);
+}
+
+const bulk_file *bulk_next(bulk_reader *r)
+{
+    // The previous file's slot goes back to the pool
+    if (r->next > 0) {
+        r->slots[(r->next - 1) % BULK_DEPTH].state = SLOT_FREE;
+    }
+
+    if (r->next >= r->count) {
+        return NULL;
+    }
+
+    slot *s = &r->slots[r->next % BULK_DEPTH];
+
+#ifdef BULK_URING
+    if (r->ring) {
+        ring_fill(r);
+
+        while (s->state == SLOT_BUSY) {
+            if (ring_wait(r) != 0) {
+                s->file.error = errno;
+                break;
+            }
+        }
+
+        // The linked close has run by now, so a short read is redone
+        // with pread from the start
+        if (s->file.data && s->file.error == 0 && s->file.size < s->stx.stx_size) {
+            read_file(s);
+        }
+
+        if (s->file.data && s->file.error == 0) {
+            memset(s->buffer + s->file.size, 0, BULK_PAD);
+        }
+
+        r->next++;
+        return &s->file;
+    }
+#endif
+
+    s->file.index = r->next;
+    s->file.path = r->paths[r->next];
+    s->file.data = s->buffer;
+    read_file(s);
+    r->next++;
+
+    return &s->file;
+}
+
+const char *bulk_impl(const bulk_reader *r)
+{
+#ifdef BULK_URING
+    if (r->ring) {
+        return r->ring->fixed ? "io_uring fixed buffers" : "io_uring";
+    }
+#else
+    (void)r;
+#endif
+
+    return "pread";
+}
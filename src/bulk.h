@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Reads many small files ahead of their consumer. Opens, reads and
+// closes go through io_uring, many files deep, into a pool of registered
+// buffers; files are handed out in input order as soon as they are in
+// memory while later ones are still being read. Without io_uring the
+// files are read one at a time with pread. Anything but regular files
+// that fit a pool buffer comes back unread, with data NULL, for the
+// caller to open itself.
+
+typedef struct bulk_reader bulk_reader;
+
+typedef struct
+{
+    int index;                  // position in the path list
+    const char *path;
+    const uint8_t *data;        // followed by BULK_PAD zero bytes, NULL if unread
+    size_t size;
+    int error;                  // errno of the failed step, 0 if read
+} bulk_file;
+
+// Parsers may read a little past the end of a truncated structure, as
+// they could within the last page of a mapping
+#define BULK_PAD 16
+
+// Returns NULL if out of memory
+bulk_reader *bulk_open(char **paths, int count);
+void bulk_close(bulk_reader *r);
+
+// The next file in input order, NULL after the last. Its data stays
+// valid until the following call.
+const bulk_file *bulk_next(bulk_reader *r);
+
+// "io_uring fixed buffers", "io_uring" or "pread"
+const char *bulk_impl(const bulk_reader *r);
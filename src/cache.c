@@ -0,0 +1,577 @@
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "D64CACHE"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_VERSION 3
+#define CACHE_BUCKETS 65536
+#define CACHE_BUCKETS_OFF 64
+#define CACHE_LOG_START (CACHE_BUCKETS_OFF + CACHE_BUCKETS * sizeof(uint64_t))
+#define CACHE_GROWTH (1L << 20)
+#define CACHE_ALIGN 8
+#define CACHE_HASH_PREFIX 4096
+#define CACHE_MAX_PATH 4096
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct
+{
+    char magic[CACHE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t buckets;
+    uint64_t log_start;
+    uint64_t log_end;
+    uint64_t records;
+} cache_header;
+
+typedef struct
+{
+    uint64_t next;          // older record in the same bucket, 0 ends the chain
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+    uint32_t variant;
+    uint32_t path_len;
+    uint32_t data_len;
+    uint32_t fill;
+} cache_record;
+
+struct cache
+{
+    int fd;
+    int writable;
+    char *path;
+    uint8_t *map;
+    size_t map_size;
+};
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+// All versions of a file hash to the same bucket, which lets compaction
+// find superseded records by walking a single chain.
+static uint32_t key_bucket(const cache_key *key)
+{
+    uint64_t h = mix64(key->dev ^ mix64(key->ino ^ mix64(key->variant)));
+
+    return (uint32_t)(h % CACHE_BUCKETS);
+}
+
+static size_t record_size(size_t path_len, size_t data_len)
+{
+    size_t len = sizeof(cache_record) + path_len + data_len;
+
+    return (len + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+static int same_key(const cache_record *rec, const cache_key *key)
+{
+    return rec->dev == key->dev && rec->ino == key->ino &&
+        rec->size == key->size && rec->mtime_sec == key->mtime_sec &&
+        rec->mtime_nsec == key->mtime_nsec && rec->variant == key->variant;
+}
+
+static uint64_t *buckets(cache *c)
+{
+    return (uint64_t *)(c->map + CACHE_BUCKETS_OFF);
+}
+
+static cache_header *header(cache *c)
+{
+    return (cache_header *)c->map;
+}
+
+static int cache_map(cache *c)
+{
+    struct stat st;
+
+    if (fstat(c->fd, &st) < 0) {
+        return -1;
+    }
+
+    if ((size_t)st.st_size < CACHE_LOG_START) {
+        return -1;
+    }
+
+    if (c->map && (size_t)st.st_size == c->map_size) {
+        return 0;
+    }
+
+    if (c->map) {
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+    }
+
+    int prot = PROT_READ | (c->writable ? PROT_WRITE : 0);
+    void *map = mmap(NULL, (size_t)st.st_size, prot, MAP_SHARED, c->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    c->map = map;
+    c->map_size = (size_t)st.st_size;
+
+    return 0;
+}
+
+// Another process may have grown the file since we mapped it.
+static int ensure_mapped(cache *c, uint64_t end)
+{
+    if (end <= c->map_size) {
+        return 0;
+    }
+
+    if (cache_map(c) != 0 || end > c->map_size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void init_header(uint8_t *map)
+{
+    cache_header *hdr = (cache_header *)map;
+
+    memcpy(hdr->magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    hdr->version = CACHE_VERSION;
+    hdr->buckets = CACHE_BUCKETS;
+    hdr->log_start = CACHE_LOG_START;
+    hdr->log_end = CACHE_LOG_START;
+    hdr->records = 0;
+}
+
+static int cache_init_file(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    if (st.st_size != 0) {
+        return 0;
+    }
+
+    cache_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    init_header((uint8_t *)&hdr);
+
+    if (ftruncate(fd, (off_t)(CACHE_LOG_START + CACHE_GROWTH)) < 0 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cache_attach(cache *c)
+{
+    c->writable = 1;
+    c->fd = open(c->path, O_RDWR | O_CREAT, 0644);
+    if (c->fd < 0) {
+        c->writable = 0;
+        c->fd = open(c->path, O_RDONLY);
+    }
+
+    if (c->fd < 0) {
+        return -1;
+    }
+
+    if (c->writable) {
+        flock(c->fd, LOCK_EX);
+        int status = cache_init_file(c->fd);
+        flock(c->fd, LOCK_UN);
+
+        if (status != 0) {
+            return -1;
+        }
+    }
+
+    if (cache_map(c) != 0) {
+        return -1;
+    }
+
+    cache_header *hdr = header(c);
+    if (memcmp(hdr->magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0 ||
+            hdr->version != CACHE_VERSION || hdr->buckets != CACHE_BUCKETS) {
+        fprintf(stderr, "Not a valid cache file: %s\n", c->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cache_detach(cache *c)
+{
+    if (c->map) {
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+    }
+
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+cache *cache_open(const char *path)
+{
+    cache *c = calloc(1, sizeof(cache));
+    if (!c) {
+        return NULL;
+    }
+
+    c->fd = -1;
+    c->path = malloc(strlen(path) + 1);
+    if (!c->path) {
+        free(c);
+        return NULL;
+    }
+    strcpy(c->path, path);
+
+    if (cache_attach(c) != 0) {
+        cache_close(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+void cache_close(cache *c)
+{
+    if (!c) {
+        return;
+    }
+
+    cache_detach(c);
+    free(c->path);
+    free(c);
+}
+
+int cache_lookup(cache *c, const cache_key *key, cache_entry *entry)
+{
+    uint64_t off = __atomic_load_n(&buckets(c)[key_bucket(key)], __ATOMIC_ACQUIRE);
+
+    while (off != 0) {
+        if (off < CACHE_LOG_START || ensure_mapped(c, off + sizeof(cache_record)) != 0) {
+            return 0;
+        }
+
+        const cache_record *rec = (const cache_record *)(c->map + off);
+        uint64_t next = rec->next;
+
+        if (same_key(rec, key)) {
+            if (ensure_mapped(c, off + record_size(rec->path_len, rec->data_len)) != 0) {
+                return 0;
+            }
+
+            // The mapping may have moved
+            rec = (const cache_record *)(c->map + off);
+            entry->data = (const uint8_t *)(rec + 1) + rec->path_len;
+            entry->length = rec->data_len;
+            entry->content_hash = rec->content_hash;
+
+            return 1;
+        }
+
+        // Chains always point backwards in the log
+        if (next >= off) {
+            return 0;
+        }
+
+        off = next;
+    }
+
+    return 0;
+}
+
+// Compaction renames a new file over the old one; writers holding the
+// old inode must switch over before appending.
+static int lock_current(cache *c)
+{
+    for (;;) {
+        struct stat cur, ours;
+
+        if (flock(c->fd, LOCK_EX) < 0) {
+            return -1;
+        }
+
+        if (stat(c->path, &cur) == 0 && fstat(c->fd, &ours) == 0 &&
+                cur.st_dev == ours.st_dev && cur.st_ino == ours.st_ino) {
+            return 0;
+        }
+
+        flock(c->fd, LOCK_UN);
+        cache_detach(c);
+
+        if (cache_attach(c) != 0) {
+            return -1;
+        }
+    }
+}
+
+int cache_store(cache *c, const cache_key *key, uint64_t content_hash,
+        const char *path, const uint8_t *data, size_t length)
+{
+    size_t path_len = strlen(path);
+
+    // Lengths are stored in 32 bits, and longer paths never count as current
+    if (path_len > CACHE_MAX_PATH || length > UINT32_MAX) {
+        return -1;
+    }
+
+    if (!c->writable || lock_current(c) != 0) {
+        return -1;
+    }
+
+    size_t need = record_size(path_len, length);
+    int status = -1;
+
+    // Another writer may have grown the file
+    if (cache_map(c) != 0) {
+        goto out;
+    }
+
+    uint64_t end = header(c)->log_end;
+    if (end + need > c->map_size) {
+        size_t grow = c->map_size / 2 > CACHE_GROWTH ? c->map_size / 2 : CACHE_GROWTH;
+
+        if (ftruncate(c->fd, (off_t)(end + need + grow)) < 0 || cache_map(c) != 0) {
+            goto out;
+        }
+    }
+
+    uint64_t *bucket = &buckets(c)[key_bucket(key)];
+    cache_record *rec = (cache_record *)(c->map + end);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->next = *bucket;
+    rec->dev = key->dev;
+    rec->ino = key->ino;
+    rec->size = key->size;
+    rec->mtime_sec = key->mtime_sec;
+    rec->mtime_nsec = key->mtime_nsec;
+    rec->content_hash = content_hash;
+    rec->variant = key->variant;
+    rec->path_len = (uint32_t)path_len;
+    rec->data_len = (uint32_t)length;
+    memcpy(rec + 1, path, path_len);
+    memcpy((uint8_t *)(rec + 1) + path_len, data, length);
+
+    // Publish only once the record is complete
+    __atomic_store_n(bucket, end, __ATOMIC_RELEASE);
+    __atomic_store_n(&header(c)->log_end, end + need, __ATOMIC_RELEASE);
+    header(c)->records++;
+    status = 0;
+
+out:
+    flock(c->fd, LOCK_UN);
+
+    return status;
+}
+
+static int still_current(const cache_record *rec)
+{
+    char path[CACHE_MAX_PATH + 1];
+    struct stat st;
+
+    if (rec->path_len > CACHE_MAX_PATH) {
+        return 0;
+    }
+
+    memcpy(path, rec + 1, rec->path_len);
+    path[rec->path_len] = '\0';
+
+    if (stat(path, &st) < 0) {
+        return 0;
+    }
+
+    return (uint64_t)st.st_dev == rec->dev && (uint64_t)st.st_ino == rec->ino &&
+        (uint64_t)st.st_size == rec->size && st.st_mtim.tv_sec == rec->mtime_sec &&
+        st.st_mtim.tv_nsec == rec->mtime_nsec;
+}
+
+// Readers keep their mapping of the old inode until they reopen
+static int replace_file(const char *path, const uint8_t *data, size_t len)
+{
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char tmp[tmp_len];
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t written = write(fd, data, len);
+
+    if (written != (ssize_t)len || fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int cache_compact(const char *path, long *kept, long *dropped)
+{
+    cache *c = cache_open(path);
+    if (!c) {
+        return -1;
+    }
+
+    if (!c->writable || lock_current(c) != 0 || cache_map(c) != 0) {
+        cache_close(c);
+        return -1;
+    }
+
+    *kept = 0;
+    *dropped = 0;
+
+    int status = -1;
+    uint64_t *old_buckets = buckets(c);
+    size_t *first = malloc((CACHE_BUCKETS + 1) * sizeof(*first));
+    uint64_t *live = NULL;
+    size_t live_count = 0;
+    size_t live_cap = 0;
+    size_t new_size = CACHE_LOG_START + CACHE_GROWTH;
+    uint8_t *out = NULL;
+
+    if (!first) {
+        goto out;
+    }
+
+    // Collect the newest still-valid record of every file, newest first
+    // within each bucket.
+    for (uint32_t b = 0; b < CACHE_BUCKETS; ++b) {
+        first[b] = live_count;
+
+        for (uint64_t off = old_buckets[b]; off != 0; ) {
+            const cache_record *rec = (const cache_record *)(c->map + off);
+            int superseded = 0;
+
+            for (size_t i = first[b]; i < live_count; ++i) {
+                const cache_record *newer = (const cache_record *)(c->map + live[i]);
+
+                if (newer->dev == rec->dev && newer->ino == rec->ino &&
+                        newer->variant == rec->variant) {
+                    superseded = 1;
+                    break;
+                }
+            }
+
+            if (!superseded && still_current(rec)) {
+                if (live_count == live_cap) {
+                    live_cap = live_cap ? live_cap * 2 : 1024;
+                    uint64_t *grown = realloc(live, live_cap * sizeof(*live));
+
+                    if (!grown) {
+                        goto out;
+                    }
+                    live = grown;
+                }
+
+                live[live_count++] = off;
+                new_size += record_size(rec->path_len, rec->data_len);
+            } else {
+                (*dropped)++;
+            }
+
+            if (rec->next >= off) {
+                break;
+            }
+            off = rec->next;
+        }
+    }
+    first[CACHE_BUCKETS] = live_count;
+
+    out = calloc(1, new_size);
+    if (!out) {
+        goto out;
+    }
+
+    init_header(out);
+
+    // Append oldest first so chains keep pointing backwards
+    uint64_t end = CACHE_LOG_START;
+    for (uint32_t b = 0; b < CACHE_BUCKETS; ++b) {
+        uint64_t prev = 0;
+
+        for (size_t i = first[b + 1]; i-- > first[b]; ) {
+            const cache_record *rec = (const cache_record *)(c->map + live[i]);
+            cache_record *copy = (cache_record *)(out + end);
+
+            memcpy(copy, rec, sizeof(cache_record) + rec->path_len + rec->data_len);
+            copy->next = prev;
+            prev = end;
+            end += record_size(rec->path_len, rec->data_len);
+        }
+
+        ((uint64_t *)(out + CACHE_BUCKETS_OFF))[b] = prev;
+    }
+
+    ((cache_header *)out)->log_end = end;
+    ((cache_header *)out)->records = live_count;
+
+    if (replace_file(path, out, new_size) != 0) {
+        goto out;
+    }
+
+    *kept = (long)live_count;
+    status = 0;
+
+out:
+    free(out);
+    free(live);
+    free(first);
+    flock(c->fd, LOCK_UN);
+    cache_close(c);
+
+    return status;
+}
+
+// FNV-1a
+uint64_t cache_content_hash(const uint8_t *buffer, size_t size)
+{
+    uint64_t h = FNV_OFFSET;
+
+    if (size > CACHE_HASH_PREFIX) {
+        size = CACHE_HASH_PREFIX;
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+        h ^= buffer[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Persistent result cache: a single mmapped file holding a hash index
+// over an append-only log of rendered module output. Entries are keyed
+// by file identity (device, inode, size, mtime) plus an output variant,
+// so lookups only need a stat() of the input. Readers never lock;
+// writers serialize with flock() and publish records atomically.
+
+typedef struct cache cache;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t variant;
+} cache_key;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t length;
+    uint64_t content_hash;
+} cache_entry;
+
+cache *cache_open(const char *path);
+void cache_close(cache *c);
+
+// Returns 1 on a hit and fills entry (valid until the next cache call),
+// 0 on a miss.
+int cache_lookup(cache *c, const cache_key *key, cache_entry *entry);
+int cache_store(cache *c, const cache_key *key, uint64_t content_hash,
+        const char *path, const uint8_t *data, size_t length);
+
+// Rewrites the cache keeping only the newest record per file whose
+// source still exists unchanged. Safe against concurrent readers.
+int cache_compact(const char *path, long *kept, long *dropped);
+
+// Hash over the first bytes of a file, stored alongside every record.
+uint64_t cache_content_hash(const uint8_t *buffer, size_t size);
@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "checksum.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+#define CRC32_POLY 0xEDB88320u      // reflected 0x04C11DB7
+#define CRC32_FOLD_MIN 64
+#define SHA1_BLOCK 64
+
+typedef uint32_t (*crc32_fold_fn)(const uint8_t *data, size_t len, uint32_t crc);
+typedef void (*sha1_blocks_fn)(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static uint32_t g_crc_table[8][256];
+static crc32_fold_fn g_crc_fold = NULL;
+static sha1_blocks_fn g_sha1_blocks = NULL;
+
+// Slicing by 8: one table lookup per byte, eight independent per step
+static uint32_t crc32_tables(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+            (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+            (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+
+        crc = g_crc_table[7][lo & 0xff] ^ g_crc_table[6][(lo >> 8) & 0xff] ^
+            g_crc_table[5][(lo >> 16) & 0xff] ^ g_crc_table[4][lo >> 24] ^
+            g_crc_table[3][hi & 0xff] ^ g_crc_table[2][(hi >> 8) & 0xff] ^
+            g_crc_table[1][(hi >> 16) & 0xff] ^ g_crc_table[0][hi >> 24];
+    }
+
+    while (len-- > 0) {
+        crc = g_crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+static void sha1_blocks(uint32_t state[5], const uint8_t *p, size_t blocks)
+{
+    for (; blocks > 0; --blocks, p += SHA1_BLOCK) {
+        uint32_t w[80];
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+        uint32_t e = state[4];
+
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+
+        for (int i = 16; i < 80; ++i) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f;
+            uint32_t k;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#ifdef CHECKSUM_X86
+
+// Folds 64 bytes per step with carry-less multiplies and reduces with
+// Barrett's method, after Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ". len is a multiple of 16, at least 64;
+// crc is the inverted running value.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(const uint8_t *p, size_t len, uint32_t crc)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0;
+    __m128i x1 = _mm_loadu_si128((const __m128i *)p);
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+    __m128i x5;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    p += 64;
+    len -= 64;
+
+    for (; len >= 64; len -= 64, p += 64) {
+        __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), _mm_loadu_si128((const __m128i *)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), _mm_loadu_si128((const __m128i *)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), _mm_loadu_si128((const __m128i *)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, y4), _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+
+    // Four lanes into one, then the remaining 16 byte blocks
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+    for (; len >= 16; len -= 16, p += 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, low32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_and_si128(x1, low32);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+    x0 = _mm_and_si128(x0, low32);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x0);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+// Four rounds of SHA-1 with the SHA extensions. Message words g + 1 to
+// g + 3 are scheduled while group g runs; e and f alternate between the
+// rotated E input and the saved ABCD the next group derives it from.
+#define SHA1_GROUP(g, e, f)                                             \
+    do {                                                                \
+        e = _mm_sha1nexte_epu32(e, m[(g) % 4]);                         \
+        f = abcd;                                                       \
+        if ((g) + 3 <= 19) {                                            \
+            m[((g) + 3) % 4] = _mm_sha1msg1_epu32(m[((g) + 3) % 4], m[(g) % 4]); \
+        }                                                               \
+        if ((g) >= 2 && (g) + 2 <= 19) {                                \
+            m[((g) + 2) % 4] = _mm_xor_si128(m[((g) + 2) % 4], m[(g) % 4]); \
+        }                                                               \
+        if ((g) >= 3 && (g) + 1 <= 19) {                                \
+            m[((g) + 1) % 4] = _mm_sha1msg2_epu32(m[((g) + 1) % 4], m[(g) % 4]); \
+        }                                                               \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5);                   \
+    } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_ni(uint32_t state[5], const uint8_t *p, size_t blocks)
+{
+    const __m128i order = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1;
+    __m128i m[4];
+
+    for (; blocks > 0; --blocks, p += SHA1_BLOCK) {
+        __m128i abcd_save = abcd;
+        __m128i e_save = e0;
+
+        for (int i = 0; i < 4; ++i) {
+            m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), order);
+        }
+
+        e0 = _mm_add_epi32(e0, m[0]);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHA1_GROUP(1, e1, e0);
+        SHA1_GROUP(2, e0, e1);
+        SHA1_GROUP(3, e1, e0);
+        SHA1_GROUP(4, e0, e1);
+        SHA1_GROUP(5, e1, e0);
+        SHA1_GROUP(6, e0, e1);
+        SHA1_GROUP(7, e1, e0);
+        SHA1_GROUP(8, e0, e1);
+        SHA1_GROUP(9, e1, e0);
+        SHA1_GROUP(10, e0, e1);
+        SHA1_GROUP(11, e1, e0);
+        SHA1_GROUP(12, e0, e1);
+        SHA1_GROUP(13, e1, e0);
+        SHA1_GROUP(14, e0, e1);
+        SHA1_GROUP(15, e1, e0);
+        SHA1_GROUP(16, e0, e1);
+        SHA1_GROUP(17, e1, e0);
+        SHA1_GROUP(18, e0, e1);
+        SHA1_GROUP(19, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#endif
+
+static void init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k) {
+            c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        }
+
+        g_crc_table[0][i] = c;
+    }
+
+    for (int t = 1; t < 8; ++t) {
+        for (int i = 0; i < 256; ++i) {
+            uint32_t c = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (c >> 8) ^ g_crc_table[0][c & 0xff];
+        }
+    }
+
+    g_sha1_blocks = sha1_blocks;
+
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        g_crc_fold = crc32_pclmul;
+    }
+
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        g_sha1_blocks = sha1_blocks_ni;
+    }
+#endif
+}
+
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    pthread_once(&g_once, init);
+
+    crc = ~crc;
+
+    if (g_crc_fold && len >= CRC32_FOLD_MIN) {
+        size_t n = len & ~(size_t)15;
+
+        crc = g_crc_fold(data, n, crc);
+        data += n;
+        len -= n;
+    }
+
+    return ~crc32_tables(crc, data, len);
+}
+
+void checksum_sha1_init(checksum_sha1 *s)
+{
+    static const uint32_t iv[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    pthread_once(&g_once, init);
+
+    memcpy(s->state, iv, sizeof(iv));
+    s->len = 0;
+    s->fill = 0;
+}
+
+void checksum_sha1_update(checksum_sha1 *s, const uint8_t *data, size_t len)
+{
+    s->len += len;
+
+    if (s->fill > 0) {
+        size_t n = SHA1_BLOCK - s->fill < len ? SHA1_BLOCK - s->fill : len;
+
+        memcpy(&s->block[s->fill], data, n);
+        s->fill += n;
+        data += n;
+        len -= n;
+
+        if (s->fill < SHA1_BLOCK) {
+            return;
+        }
+
+        g_sha1_blocks(s->state, s->block, 1);
+        s->fill = 0;
+    }
+
+    // Whole blocks straight from the input
+    g_sha1_blocks(s->state, data, len / SHA1_BLOCK);
+    data += len - len % SHA1_BLOCK;
+
+    memcpy(s->block, data, len % SHA1_BLOCK);
+    s->fill = len % SHA1_BLOCK;
+}
+
+void checksum_sha1_final(checksum_sha1 *s, uint8_t digest[CHECKSUM_SHA1_LEN])
+{
+    uint64_t bits = s->len * 8;
+
+    s->block[s->fill++] = 0x80;
+
+    if (s->fill > SHA1_BLOCK - 8) {
+        memset(&s->block[s->fill], 0, SHA1_BLOCK - s->fill);
+        g_sha1_blocks(s->state, s->block, 1);
+        s->fill = 0;
+    }
+
+    memset(&s->block[s->fill], 0, SHA1_BLOCK - 8 - s->fill);
+    for (int i = 0; i < 8; ++i) {
+        s->block[SHA1_BLOCK - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    g_sha1_blocks(s->state, s->block, 1);
+
+    for (int i = 0; i < 5; ++i) {
+        digest[4 * i] = (uint8_t)(s->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(s->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(s->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)s->state[i];
+    }
+}
+
+const char *checksum_crc32_impl(void)
+{
+    pthread_once(&g_once, init);
+
+    return g_crc_fold ? "pclmul" : "table";
+}
+
+const char *checksum_sha1_impl(void)
+{
+    pthread_once(&g_once, init);
+
+    return g_sha1_blocks == sha1_blocks ? "scalar" : "sha-ni";
+}
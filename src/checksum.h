@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32 (zlib/PKZIP polynomial) and SHA-1 for checking files against
+// DAT collections. Both pick a CPU specific implementation on first use:
+// carry-less multiply folding for the CRC (the SSE4.2 crc32 instruction
+// computes CRC32C, a different polynomial) and the SHA extensions for
+// SHA-1, with portable table and scalar code as fallback.
+
+#define CHECKSUM_SHA1_LEN 20
+
+// Continues crc over len bytes; start with 0
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+typedef struct
+{
+    uint32_t state[5];
+    uint64_t len;
+    uint8_t block[64];
+    size_t fill;
+} checksum_sha1;
+
+void checksum_sha1_init(checksum_sha1 *s);
+void checksum_sha1_update(checksum_sha1 *s, const uint8_t *data, size_t len);
+void checksum_sha1_final(checksum_sha1 *s, uint8_t digest[CHECKSUM_SHA1_LEN]);
+
+// Names of the implementations in use, e.g. "pclmul" and "sha-ni"
+const char *checksum_crc32_impl(void);
+const char *checksum_sha1_impl(void);
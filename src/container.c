@@ -0,0 +1,176 @@
+#define _DEFAULT_SOURCE
+
+#include "container.h"
+#include "disk.h"
+#include "t64.h"
+#include "tap.h"
+#include "crt.h"
+#include "petscii.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRG_LOAD_ADDR_LEN 2
+#define PXX_SIGNATURE "C64File"
+#define PXX_HEADER_LEN 26
+#define PXX_NAME_OFF 8
+#define PXX_NAME_LEN 16
+#define DIR_FILETYPE_MASK 0x07
+#define DIR_FILETYPE_PRG 0x02
+#define CHIP_NAME_LEN 16
+
+typedef struct
+{
+    container_fn fn;
+    void *ctx;
+    uint8_t *buffer;            // chain contents of the current D64 file
+} walk;
+
+static int plain_file(const uint8_t *data, size_t size, const char *name, int prg,
+        container_fn fn, void *ctx)
+{
+    container_file f = {name, data, size, 0, -1};
+
+    if (prg && size >= PRG_LOAD_ADDR_LEN) {
+        f.header = PRG_LOAD_ADDR_LEN;
+        f.load = data[0] | (data[1] << 8);
+    }
+
+    return fn(&f, ctx);
+}
+
+static int disk_file(const disk_dirent *e, void *ctx)
+{
+    walk *w = ctx;
+    char name[DISK_NAME_LEN + 1];
+
+    if (e->track == 0) {
+        return 0;
+    }
+
+    petscii_name(e->name, DISK_NAME_LEN, name);
+    long len = disk_read_chain(e->track, e->sector, w->buffer);
+
+    return plain_file(w->buffer, (size_t)len, name,
+        (e->type & DIR_FILETYPE_MASK) == DIR_FILETYPE_PRG, w->fn, w->ctx);
+}
+
+static int tape_file(const t64_entry *e, void *ctx)
+{
+    walk *w = ctx;
+    char name[T64_NAME_LEN + 1];
+    size_t len = petscii_name(e->name, T64_NAME_LEN, name);
+
+    // Tape names are usually padded with spaces rather than 0xA0
+    while (len > 0 && name[len - 1] == ' ') {
+        name[--len] = '\0';
+    }
+
+    container_file f = {name, e->data, e->size, 0, e->start};
+
+    return w->fn(&f, w->ctx);
+}
+
+static int pulse_file(const tap_file *t, void *ctx)
+{
+    walk *w = ctx;
+    char name[TAP_NAME_LEN + 1];
+    size_t len = petscii_name(t->name, TAP_NAME_LEN, name);
+
+    while (len > 0 && name[len - 1] == ' ') {
+        name[--len] = '\0';
+    }
+
+    int seq = t->format == TAP_CBM && t->type == TAP_CBM_SEQ;
+    container_file f = {name, t->data, t->size, 0, seq ? -1 : t->start};
+
+    return w->fn(&f, w->ctx);
+}
+
+static int cartridge_chip(const crt_chip *c, void *ctx)
+{
+    walk *w = ctx;
+    char name[CHIP_NAME_LEN];
+
+    snprintf(name, sizeof(name), "bank %d", c->bank);
+
+    container_file f = {name, c->data, c->size, 0, c->address};
+
+    return w->fn(&f, w->ctx);
+}
+
+int container_files(container_kind kind, const uint8_t *buffer, size_t size,
+        container_fn fn, void *ctx)
+{
+    return container_files_arena(NULL, kind, buffer, size, fn, ctx);
+}
+
+int container_files_arena(arena *a, container_kind kind, const uint8_t *buffer, size_t size,
+        container_fn fn, void *ctx)
+{
+    walk w = {fn, ctx, NULL};
+    int status = 0;
+
+    switch (kind) {
+        case CONTAINER_D64:
+            w.buffer = a ? arena_alloc(a, DISK_MAX_FILE_SIZE) : malloc(DISK_MAX_FILE_SIZE);
+            if (!w.buffer) {
+                return -1;
+            }
+
+            status = disk_directory(buffer, size, disk_file, &w);
+            if (!a) {
+                free(w.buffer);
+            }
+            break;
+
+        case CONTAINER_T64:
+            status = t64_entries(buffer, size, tape_file, &w);
+            break;
+
+        case CONTAINER_TAP:
+            status = tap_files(buffer, size, pulse_file, &w);
+            break;
+
+        case CONTAINER_CRT:
+            status = crt_chips(buffer, size, cartridge_chip, &w);
+            break;
+
+        case CONTAINER_P00: {
+            char name[PXX_NAME_LEN + 1];
+
+            if (size < PXX_HEADER_LEN ||
+                    memcmp(buffer, PXX_SIGNATURE, strlen(PXX_SIGNATURE)) != 0) {
+                fprintf(stderr, "Not a valid Pxx file\n");
+                return -1;
+            }
+
+            // The name is NUL padded
+            const uint8_t *raw = &buffer[PXX_NAME_OFF];
+            petscii_name(raw, strnlen((const char *)raw, PXX_NAME_LEN), name);
+            plain_file(&buffer[PXX_HEADER_LEN], size - PXX_HEADER_LEN, name, 1, fn, ctx);
+            break;
+        }
+
+        case CONTAINER_PRG:
+            plain_file(buffer, size, NULL, 1, fn, ctx);
+            break;
+
+        case CONTAINER_RAW:
+        default:
+            plain_file(buffer, size, NULL, 0, fn, ctx);
+            break;
+    }
+
+    return status;
+}
+
+long container_address(const container_file *file, size_t offset)
+{
+    if (file->load < 0 || offset < file->header) {
+        return -1;
+    }
+
+    return (file->load + (long)(offset - file->header)) & 0xFFFF;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Uniform access to the files held by a container image, so tools that
+// look at file contents don't need to know about every image format.
+
+typedef enum
+{
+    CONTAINER_RAW,              // plain file without a known load address
+    CONTAINER_PRG,              // plain file starting with a load address
+    CONTAINER_P00,
+    CONTAINER_D64,
+    CONTAINER_T64,
+    CONTAINER_TAP,
+    CONTAINER_CRT
+} container_kind;
+
+// A file inside a container, valid for the duration of the callback
+typedef struct
+{
+    const char *name;           // ASCII name, NULL for plain files
+    const uint8_t *data;        // whole file as stored
+    size_t size;
+    size_t header;              // leading bytes that are not loaded
+    long load;                  // C64 address of data[header], -1 if unknown
+} container_file;
+
+typedef int (*container_fn)(const container_file *file, void *ctx);
+
+// Calls fn for every file in the buffer; plain files yield a single file.
+// fn returning non-zero stops the walk.
+int container_files(container_kind kind, const uint8_t *buffer, size_t size,
+        container_fn fn, void *ctx);
+
+// The same taking scratch memory, like the assembled chain of a D64 file,
+// from a worker's arena instead of the heap
+int container_files_arena(arena *a, container_kind kind, const uint8_t *buffer, size_t size,
+        container_fn fn, void *ctx);
+
+// C64 address of a file offset, -1 if it isn't loaded
+long container_address(const container_file *file, size_t offset);
@@ -0,0 +1,570 @@
+#include "corpus.h"
+#include "disk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define SECTOR_SIZE 256
+#define MAX_TRACKS 40
+#define MAX_SECTORS 21
+
+#define DIR_TRACK 18
+#define DIR_ENTRY_SIZE 32
+#define DIR_ENTRIES_PER_SECTOR 8
+#define DIR_MAX_SECTORS 18
+#define NAME_LEN 16
+#define PETSCII_PAD 0xA0
+#define DATA_BYTES_PER_SECTOR 254
+#define BAM_SPEED_BASE 0xC0
+
+#define BASIC_START 0x0801
+#define BASIC_MAX_LINE 70
+#define TOKEN_LOW 0x80
+#define TOKEN_HIGH 0xCA
+
+#define CRT_HEADER_LEN 0x40
+#define CHIP_HEADER_LEN 0x10
+#define CHIP_ROM_SIZE 0x2000
+
+#define T64_HEADER_LEN 64
+#define T64_RECORD_LEN 32
+
+#define SID_HEADER_LEN 0x7C
+
+#define PXX_HEADER_LEN 26
+
+// Directory sectors in the order the 1541 allocates them (interleave 3)
+static const int dir_sectors[DIR_MAX_SECTORS] = {
+    1, 4, 7, 10, 13, 16, 2, 5, 8, 11, 14, 17, 3, 6, 9, 12, 15, 18
+};
+
+void corpus_seed(corpus_rng *rng, uint64_t seed)
+{
+    rng->state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// xorshift64*
+uint32_t corpus_next(corpus_rng *rng)
+{
+    uint64_t x = rng->state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static int chance(corpus_rng *rng, int percent)
+{
+    return (int)(corpus_next(rng) % 100) < percent;
+}
+
+static void fill_random(corpus_rng *rng, uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        p[i] = (uint8_t)corpus_next(rng);
+    }
+}
+
+static void random_name(corpus_rng *rng, uint8_t *name, int len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 -.";
+    int used = 1 + (int)(corpus_next(rng) % len);
+
+    for (int i = 0; i < len; ++i) {
+        if (i < used) {
+            name[i] = (uint8_t)alphabet[corpus_next(rng) % (sizeof(alphabet) - 1)];
+        } else {
+            name[i] = PETSCII_PAD;
+        }
+    }
+}
+
+typedef struct
+{
+    uint8_t *image;
+    int tracks;
+    long offset[MAX_TRACKS + 2];
+    uint8_t used[MAX_TRACKS + 1][MAX_SECTORS];
+    int cursor_track;
+    int cursor_sector;
+} d64_builder;
+
+static uint8_t *sector_at(d64_builder *b, int track, int sector)
+{
+    return b->image + b->offset[track] + (long)sector * SECTOR_SIZE;
+}
+
+// Scans on from the cursor and wraps around to track 1, so sectors left
+// behind by random placement are still found
+static int next_free_sector(d64_builder *b, int *track, int *sector)
+{
+    for (int n = 0; n <= b->tracks; ++n) {
+        int t = (b->cursor_track - 1 + n) % b->tracks + 1;
+
+        if (t == DIR_TRACK) {
+            continue;
+        }
+
+        // The cursor track is seen twice: from the cursor on, then before it
+        int first = (n == 0) ? b->cursor_sector : 0;
+        int last = (n == b->tracks) ? b->cursor_sector : sectors_per_track(t);
+
+        for (int s = first; s < last; ++s) {
+            if (!b->used[t][s]) {
+                b->cursor_track = t;
+                b->cursor_sector = s;
+                *track = t;
+                *sector = s;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static int random_free_sector(d64_builder *b, corpus_rng *rng, int *track, int *sector)
+{
+    for (int tries = 0; tries < 64; ++tries) {
+        int t = 1 + (int)(corpus_next(rng) % b->tracks);
+        int s = (int)(corpus_next(rng) % sectors_per_track(t));
+
+        if (t != DIR_TRACK && !b->used[t][s]) {
+            *track = t;
+            *sector = s;
+            return 0;
+        }
+    }
+
+    return next_free_sector(b, track, sector);
+}
+
+static int write_file(d64_builder *b, corpus_rng *rng, const corpus_d64_params *params,
+        int *start_track, int *start_sector)
+{
+    int blocks = 1 + (int)(corpus_next(rng) % (params->max_blocks > 0 ? params->max_blocks : 1));
+    int written = 0;
+    uint8_t *prev = NULL;
+    int first_track = 0;
+    int first_sector = 0;
+
+    for (; written < blocks; ++written) {
+        int t, s;
+        int found = chance(rng, params->fragmentation) ?
+            random_free_sector(b, rng, &t, &s) : next_free_sector(b, &t, &s);
+
+        if (found != 0) {
+            break;
+        }
+
+        b->used[t][s] = 1;
+        uint8_t *sec = sector_at(b, t, s);
+        fill_random(rng, sec + 2, DATA_BYTES_PER_SECTOR);
+
+        if (prev) {
+            prev[0] = (uint8_t)t;
+            prev[1] = (uint8_t)s;
+        } else {
+            first_track = t;
+            first_sector = s;
+            // PRG load address
+            sec[2] = BASIC_START & 0xff;
+            sec[3] = BASIC_START >> 8;
+        }
+
+        prev = sec;
+    }
+
+    if (!prev) {
+        return 0;
+    }
+
+    prev[0] = 0;
+    prev[1] = (uint8_t)(2 + corpus_next(rng) % DATA_BYTES_PER_SECTOR);
+
+    if (chance(rng, params->corruption)) {
+        switch (corpus_next(rng) % 3) {
+            case 0:
+                // Link to a track beyond the image
+                prev[0] = (uint8_t)(b->tracks + 1 + corpus_next(rng) % 50);
+                break;
+            case 1:
+                // Link to a sector beyond the track
+                prev[0] = (uint8_t)first_track;
+                prev[1] = (uint8_t)(MAX_SECTORS + corpus_next(rng) % 200);
+                break;
+            default:
+                // Loop back to the first sector
+                prev[0] = (uint8_t)first_track;
+                prev[1] = (uint8_t)first_sector;
+                break;
+        }
+    }
+
+    *start_track = first_track;
+    *start_sector = first_sector;
+
+    return written;
+}
+
+static void write_bam(d64_builder *b, corpus_rng *rng, int dir_sector_count)
+{
+    uint8_t *bam = sector_at(b, DIR_TRACK, 0);
+
+    b->used[DIR_TRACK][0] = 1;
+    for (int i = 0; i < dir_sector_count; ++i) {
+        b->used[DIR_TRACK][dir_sectors[i]] = 1;
+    }
+
+    bam[0] = DIR_TRACK;
+    bam[1] = 1;
+    bam[2] = 'A';
+
+    for (int t = 1; t <= b->tracks; ++t) {
+        int base = (t <= 35) ? 4 + (t - 1) * 4 : BAM_SPEED_BASE + (t - 36) * 4;
+        int free = 0;
+        uint8_t map[3] = {0, 0, 0};
+
+        for (int s = 0; s < sectors_per_track(t); ++s) {
+            if (!b->used[t][s]) {
+                free++;
+                map[s / 8] |= (uint8_t)(1u << (s % 8));
+            }
+        }
+
+        bam[base] = (uint8_t)free;
+        memcpy(&bam[base + 1], map, sizeof(map));
+    }
+
+    memset(&bam[0x90], PETSCII_PAD, 0x1B);
+    memcpy(&bam[0x90], "SYNTHETIC", 9);
+    bam[0x9A] = (uint8_t)('0' + corpus_next(rng) % 10);
+    bam[0xA2] = (uint8_t)('0' + corpus_next(rng) % 10);
+    bam[0xA3] = (uint8_t)('A' + corpus_next(rng) % 26);
+    bam[0xA5] = '2';
+    bam[0xA6] = 'A';
+}
+
+uint8_t *corpus_d64(corpus_rng *rng, const corpus_d64_params *params, size_t *size)
+{
+    d64_builder b;
+    memset(&b, 0, sizeof(b));
+
+    b.tracks = (params->tracks == 40) ? 40 : 35;
+    b.cursor_track = 1;
+
+    int total_sectors = 0;
+    for (int t = 1; t <= b.tracks; ++t) {
+        b.offset[t] = (long)total_sectors * SECTOR_SIZE;
+        total_sectors += sectors_per_track(t);
+    }
+
+    size_t data_size = (size_t)total_sectors * SECTOR_SIZE;
+    size_t image_size = data_size + (params->error_bytes ? (size_t)total_sectors : 0);
+
+    b.image = calloc(image_size, 1);
+    if (!b.image) {
+        return NULL;
+    }
+
+    int files = params->files;
+    if (files > DIR_MAX_SECTORS * DIR_ENTRIES_PER_SECTOR) {
+        files = DIR_MAX_SECTORS * DIR_ENTRIES_PER_SECTOR;
+    }
+
+    int dir_sector_count = (files + DIR_ENTRIES_PER_SECTOR - 1) / DIR_ENTRIES_PER_SECTOR;
+    if (dir_sector_count == 0) {
+        dir_sector_count = 1;
+    }
+
+    for (int i = 0; i < dir_sector_count; ++i) {
+        uint8_t *dir = sector_at(&b, DIR_TRACK, dir_sectors[i]);
+
+        if (i + 1 < dir_sector_count) {
+            dir[0] = DIR_TRACK;
+            dir[1] = (uint8_t)dir_sectors[i + 1];
+        } else {
+            dir[0] = 0;
+            dir[1] = 0xFF;
+        }
+    }
+
+    for (int f = 0; f < files; ++f) {
+        uint8_t *dir = sector_at(&b, DIR_TRACK, dir_sectors[f / DIR_ENTRIES_PER_SECTOR]);
+        uint8_t *entry = dir + (f % DIR_ENTRIES_PER_SECTOR) * DIR_ENTRY_SIZE;
+        int track = 0;
+        int sector = 0;
+        int blocks = write_file(&b, rng, params, &track, &sector);
+
+        static const uint8_t types[] = {0x82, 0x82, 0x82, 0x81, 0x83, 0xC2};
+        entry[2] = types[corpus_next(rng) % sizeof(types)];
+        entry[3] = (uint8_t)track;
+        entry[4] = (uint8_t)sector;
+        random_name(rng, &entry[5], NAME_LEN);
+        entry[0x1E] = (uint8_t)(blocks & 0xff);
+        entry[0x1F] = (uint8_t)(blocks >> 8);
+    }
+
+    write_bam(&b, rng, dir_sector_count);
+
+    if (params->error_bytes) {
+        uint8_t *errors = b.image + data_size;
+
+        memset(errors, 0x01, (size_t)total_sectors);
+        for (int i = 0; i < total_sectors; ++i) {
+            if (chance(rng, 1)) {
+                errors[i] = (uint8_t)(2 + corpus_next(rng) % 10);
+            }
+        }
+    }
+
+    *size = image_size;
+
+    return b.image;
+}
+
+uint8_t *corpus_prg(corpus_rng *rng, size_t len, size_t *size)
+{
+    uint8_t *prg = malloc(len + 2);
+    if (!prg) {
+        return NULL;
+    }
+
+    uint16_t load = (uint16_t)(0x0800 + (corpus_next(rng) % 0x80) * 0x100);
+    prg[0] = (uint8_t)(load & 0xff);
+    prg[1] = (uint8_t)(load >> 8);
+    fill_random(rng, prg + 2, len);
+
+    *size = len + 2;
+
+    return prg;
+}
+
+// Writes a tokenized BASIC program starting at 'out' (load address included)
+// and returns the number of bytes used.
+static size_t write_basic(corpus_rng *rng, uint8_t *out, int lines)
+{
+    static const char text[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ,;:$()";
+    uint16_t address = BASIC_START;
+    size_t index = 0;
+
+    out[index++] = BASIC_START & 0xff;
+    out[index++] = BASIC_START >> 8;
+
+    for (int l = 0; l < lines; ++l) {
+        int len = 1 + (int)(corpus_next(rng) % BASIC_MAX_LINE);
+        uint16_t next = (uint16_t)(address + 4 + len + 1);
+        uint16_t line = (uint16_t)((l + 1) * 10);
+
+        out[index++] = (uint8_t)(next & 0xff);
+        out[index++] = (uint8_t)(next >> 8);
+        out[index++] = (uint8_t)(line & 0xff);
+        out[index++] = (uint8_t)(line >> 8);
+
+        for (int i = 0; i < len; ++i) {
+            uint32_t r = corpus_next(rng);
+
+            if (r % 8 == 0) {
+                out[index++] = (uint8_t)(TOKEN_LOW + (r >> 8) % (TOKEN_HIGH - TOKEN_LOW + 1));
+            } else if (r % 16 == 1) {
+                out[index++] = '"';
+            } else {
+                out[index++] = (uint8_t)text[(r >> 8) % (sizeof(text) - 1)];
+            }
+        }
+
+        out[index++] = 0;
+        address = next;
+    }
+
+    out[index++] = 0;
+    out[index++] = 0;
+
+    return index;
+}
+
+static size_t basic_capacity(int lines)
+{
+    return 2 + (size_t)lines * (4 + BASIC_MAX_LINE + 1) + 2;
+}
+
+uint8_t *corpus_basic(corpus_rng *rng, int lines, size_t *size)
+{
+    uint8_t *prg = malloc(basic_capacity(lines));
+    if (!prg) {
+        return NULL;
+    }
+
+    *size = write_basic(rng, prg, lines);
+
+    return prg;
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    uint16_t be = htons(v);
+    memcpy(p, &be, sizeof(be));
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    uint32_t be = htonl(v);
+    memcpy(p, &be, sizeof(be));
+}
+
+uint8_t *corpus_crt(corpus_rng *rng, int chips, size_t *size)
+{
+    if (chips < 1) {
+        chips = 1;
+    }
+
+    size_t len = CRT_HEADER_LEN + (size_t)chips * (CHIP_HEADER_LEN + CHIP_ROM_SIZE);
+    uint8_t *crt = calloc(len, 1);
+    if (!crt) {
+        return NULL;
+    }
+
+    memcpy(crt, "C64 CARTRIDGE   ", 16);
+    put_be32(&crt[0x10], CRT_HEADER_LEN);
+    put_be16(&crt[0x14], 0x0100);
+    put_be16(&crt[0x16], (uint16_t)(corpus_next(rng) % 64));
+    crt[0x18] = 0;
+    crt[0x19] = 1;
+    memcpy(&crt[0x20], "SYNTHETIC CARTRIDGE", 19);
+
+    uint8_t *p = crt + CRT_HEADER_LEN;
+    for (int i = 0; i < chips; ++i) {
+        memcpy(p, "CHIP", 4);
+        put_be32(&p[0x04], CHIP_HEADER_LEN + CHIP_ROM_SIZE);
+        put_be16(&p[0x08], 0);
+        put_be16(&p[0x0A], (uint16_t)i);
+        put_be16(&p[0x0C], 0x8000);
+        put_be16(&p[0x0E], CHIP_ROM_SIZE);
+        fill_random(rng, p + CHIP_HEADER_LEN, CHIP_ROM_SIZE);
+        p += CHIP_HEADER_LEN + CHIP_ROM_SIZE;
+    }
+
+    *size = len;
+
+    return crt;
+}
+
+uint8_t *corpus_t64(corpus_rng *rng, int files, size_t *size)
+{
+    if (files < 1) {
+        files = 1;
+    }
+
+    size_t *file_len = malloc((size_t)files * sizeof(*file_len));
+    if (!file_len) {
+        return NULL;
+    }
+
+    size_t len = T64_HEADER_LEN + (size_t)files * T64_RECORD_LEN;
+
+    for (int i = 0; i < files; ++i) {
+        file_len[i] = 256 + corpus_next(rng) % 16384;
+        len += file_len[i];
+    }
+
+    uint8_t *t64 = calloc(len, 1);
+    if (!t64) {
+        free(file_len);
+        return NULL;
+    }
+
+    memcpy(t64, "C64S tape image file", 20);
+    t64[0x20] = 0x01;
+    t64[0x21] = 0x01;
+    t64[0x22] = (uint8_t)(files & 0xff);
+    t64[0x23] = (uint8_t)(files >> 8);
+    t64[0x24] = (uint8_t)(files & 0xff);
+    t64[0x25] = (uint8_t)(files >> 8);
+    memset(&t64[0x28], ' ', 24);
+    memcpy(&t64[0x28], "SYNTHETIC TAPE", 14);
+
+    uint32_t offset = T64_HEADER_LEN + (uint32_t)files * T64_RECORD_LEN;
+    for (int i = 0; i < files; ++i) {
+        uint8_t *rec = &t64[T64_HEADER_LEN + i * T64_RECORD_LEN];
+        uint16_t start = BASIC_START;
+        uint16_t end = (uint16_t)(start + file_len[i]);
+
+        rec[0] = 1;
+        rec[1] = 0x82;
+        rec[2] = (uint8_t)(start & 0xff);
+        rec[3] = (uint8_t)(start >> 8);
+        rec[4] = (uint8_t)(end & 0xff);
+        rec[5] = (uint8_t)(end >> 8);
+        rec[8] = (uint8_t)(offset & 0xff);
+        rec[9] = (uint8_t)((offset >> 8) & 0xff);
+        rec[10] = (uint8_t)((offset >> 16) & 0xff);
+        rec[11] = (uint8_t)(offset >> 24);
+
+        uint8_t name[NAME_LEN];
+        random_name(rng, name, NAME_LEN);
+        for (int j = 0; j < NAME_LEN; ++j) {
+            rec[16 + j] = (name[j] == PETSCII_PAD) ? ' ' : name[j];
+        }
+
+        fill_random(rng, &t64[offset], file_len[i]);
+        offset += (uint32_t)file_len[i];
+    }
+
+    free(file_len);
+    *size = len;
+
+    return t64;
+}
+
+uint8_t *corpus_sid(corpus_rng *rng, size_t len, size_t *size)
+{
+    uint8_t *sid = calloc(SID_HEADER_LEN + 2 + len, 1);
+    if (!sid) {
+        return NULL;
+    }
+
+    memcpy(sid, "PSID", 4);
+    put_be16(&sid[0x04], 2);
+    put_be16(&sid[0x06], SID_HEADER_LEN);
+    put_be16(&sid[0x08], 0);
+    put_be16(&sid[0x0A], 0x1000);
+    put_be16(&sid[0x0C], 0x1003);
+    put_be16(&sid[0x0E], (uint16_t)(1 + corpus_next(rng) % 16));
+    put_be16(&sid[0x10], 1);
+    put_be32(&sid[0x12], corpus_next(rng) & 1);
+    memcpy(&sid[0x16], "Synthetic Tune", 14);
+    memcpy(&sid[0x36], "Corpus Generator", 16);
+    memcpy(&sid[0x56], "2026 d64", 8);
+
+    sid[SID_HEADER_LEN] = 0x00;
+    sid[SID_HEADER_LEN + 1] = 0x10;
+    fill_random(rng, &sid[SID_HEADER_LEN + 2], len);
+
+    *size = SID_HEADER_LEN + 2 + len;
+
+    return sid;
+}
+
+uint8_t *corpus_pxx(corpus_rng *rng, int lines, size_t *size)
+{
+    uint8_t *pxx = calloc(PXX_HEADER_LEN + basic_capacity(lines), 1);
+    if (!pxx) {
+        return NULL;
+    }
+
+    memcpy(pxx, "C64File", 7);
+    random_name(rng, &pxx[8], NAME_LEN);
+    for (int i = 8; i < 8 + NAME_LEN; ++i) {
+        if (pxx[i] == PETSCII_PAD) {
+            pxx[i] = 0;
+        }
+    }
+
+    *size = PXX_HEADER_LEN + write_basic(rng, pxx + PXX_HEADER_LEN, lines);
+
+    return pxx;
+}
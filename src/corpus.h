@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Deterministic generators for synthetic test inputs. Every generator
+// returns a malloc'ed buffer (caller frees) and stores its size in *size.
+
+typedef struct
+{
+    uint64_t state;
+} corpus_rng;
+
+typedef struct
+{
+    int tracks;         // 35 or 40
+    int files;          // number of directory entries (max 144)
+    int max_blocks;     // upper bound for a single file in blocks
+    int fragmentation;  // 0..100, chance of jumping to a random free sector
+    int corruption;     // 0..100, chance of a broken chain per file
+    int error_bytes;    // append the per-sector error byte block
+} corpus_d64_params;
+
+void corpus_seed(corpus_rng *rng, uint64_t seed);
+uint32_t corpus_next(corpus_rng *rng);
+
+uint8_t *corpus_d64(corpus_rng *rng, const corpus_d64_params *params, size_t *size);
+uint8_t *corpus_prg(corpus_rng *rng, size_t len, size_t *size);
+uint8_t *corpus_basic(corpus_rng *rng, int lines, size_t *size);
+uint8_t *corpus_crt(corpus_rng *rng, int chips, size_t *size);
+uint8_t *corpus_t64(corpus_rng *rng, int files, size_t *size);
+uint8_t *corpus_sid(corpus_rng *rng, size_t len, size_t *size);
+uint8_t *corpus_pxx(corpus_rng *rng, int lines, size_t *size);
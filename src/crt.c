@@ -1,8 +1,10 @@
 #include "crt.h"
 #include "util.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 
 typedef struct
@@ -93,10 +95,10 @@ const char *type[] = {
     "Unknown"
 };
 
-void crt(const uint8_t *buffer, const int size)
+void crt(FILE *out, const uint8_t *buffer, const size_t size)
 {
     if (size < (int)(sizeof(cartridge) + sizeof(chip))) {
-        fprintf(stderr, "Not a valid cartridge image.\n");
+        diagnostic("Not a valid cartridge image.\n");
         return;
     }
 
@@ -105,31 +107,73 @@ void crt(const uint8_t *buffer, const int size)
 
     if (strncmp(crt->signature, "C64 CARTRIDGE", 13) != 0 ||
             strncmp(ch->signature, "CHIP", 4) != 0) {
-        fprintf(stderr, "Not a valid cartridge image.\n");
+        diagnostic("Not a valid cartridge image.\n");
         return;
     }
 
-    printf("Name: %s\n", crt->name);
+    STATS_PHASE(STATS_RENDER);
+
+    fprintf(out, "Name: %s\n", crt->name);
 
     int tsize = sizeof(type) / sizeof(type[0]);
-    printf("Type: %s\n", (ntohs(crt->hwtype) > tsize) ?
+    fprintf(out, "Type: %s\n", (ntohs(crt->hwtype) >= tsize) ?
             type[tsize - 1] : type[ntohs(crt->hwtype)]);
 
-    printf("Total packet length: %d\n", ntohl(ch->plen));
-    printf("Chip type: ");
+    fprintf(out, "Total packet length: %d\n", ntohl(ch->plen));
+    fprintf(out, "Chip type: ");
     switch (ch->ctype) {
         case 2:
-            printf("Flash ROM");
+            fprintf(out, "Flash ROM");
             break;
         case 1:
-            printf("RAM, no ROM data");
+            fprintf(out, "RAM, no ROM data");
             break;
         case 0:
         default:
-            printf("ROM");
+            fprintf(out, "ROM");
             break;
     }
-    printf("\nBank number: %d\n", ntohs(ch->bank));
-    printf("Load address: %d\n", ntohs(ch->loadaddr));
-    printf("ROM image size: %d\n", ntohs(ch->size));
+    fprintf(out, "\nBank number: %d\n", ntohs(ch->bank));
+    fprintf(out, "Load address: %d\n", ntohs(ch->loadaddr));
+    fprintf(out, "ROM image size: %d\n", ntohs(ch->size));
+}
+
+int crt_chips(const uint8_t *buffer, size_t size, crt_chip_fn fn, void *ctx)
+{
+    // The data pointer member is not part of the packet header on disk
+    const size_t chip_header = offsetof(chip, data);
+
+    if (size < sizeof(cartridge) ||
+            strncmp(((const cartridge*)buffer)->signature, "C64 CARTRIDGE", 13) != 0) {
+        diagnostic("Not a valid cartridge image.\n");
+        return -1;
+    }
+
+    size_t index = ntohl(((const cartridge*)buffer)->fhlen);
+
+    while (index + chip_header <= size) {
+        const chip *ch = (const chip*)&buffer[index];
+        size_t plen = ntohl(ch->plen);
+
+        if (strncmp(ch->signature, "CHIP", 4) != 0 || plen < chip_header) {
+            break;
+        }
+
+        size_t len = ntohs(ch->size);
+        if (len > size - index - chip_header) {
+            len = size - index - chip_header;
+        }
+
+        crt_chip c = {
+            ntohs(ch->bank), ntohs(ch->loadaddr), &buffer[index + chip_header], len
+        };
+
+        if (fn(&c, ctx) != 0) {
+            break;
+        }
+
+        index += plen;
+    }
+
+    return 0;
 }
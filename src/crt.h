@@ -1,5 +1,22 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-void crt(const uint8_t *buffer, const int size);
+// A CHIP packet, valid for the duration of the callback
+typedef struct
+{
+    int bank;
+    uint16_t address;           // load address of data[0]
+    const uint8_t *data;        // ROM contents
+    size_t size;
+} crt_chip;
+
+typedef int (*crt_chip_fn)(const crt_chip *chip, void *ctx);
+
+void crt(FILE *out, const uint8_t *buffer, const size_t size);
+
+// Calls fn for every CHIP packet in the image; fn returning non-zero
+// stops the walk.
+int crt_chips(const uint8_t *buffer, size_t size, crt_chip_fn fn, void *ctx);
@@ -0,0 +1,863 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "dat.h"
+#include "checksum.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HASH_WINDOW (64 * 1024)     // both hashes run over it while it is cached
+#define MAX_THREADS 64
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+
+typedef struct
+{
+    char *game;
+    char *name;
+    uint64_t size;
+    uint32_t crc;
+    uint8_t sha1[CHECKSUM_SHA1_LEN];
+    int has_crc;
+    int has_sha1;
+    int found;
+} dat_rom;
+
+struct dat
+{
+    dat_rom *roms;
+    size_t roms_len;
+    size_t roms_cap;
+    uint32_t *buckets;          // rom id + 1 of the first rom in each bucket
+    uint32_t *next;             // rom id + 1 of the next rom in the same bucket
+    size_t buckets_len;
+};
+
+typedef struct
+{
+    char *name;                 // file inside an image, NULL for the input
+    uint64_t size;
+    uint32_t crc;
+    uint8_t sha1[CHECKSUM_SHA1_LEN];
+} dat_hash;
+
+typedef struct
+{
+    dat_hash *hashes;
+    size_t hashes_len;
+    size_t hashes_cap;
+    int failed;
+} dat_input;
+
+static int grow(void **ptr, size_t *cap, size_t need, size_t elem)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap : 16;
+    while (n < need) {
+        n *= 2;
+    }
+
+    void *p = realloc(*ptr, n * elem);
+    if (!p) {
+        return -1;
+    }
+
+    *ptr = p;
+    *cap = n;
+
+    return 0;
+}
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+static int parse_hex(const char *s, size_t len, uint8_t *out, size_t bytes)
+{
+    if (len != 2 * bytes) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < bytes; ++i) {
+        int hi = hex_value((unsigned char)s[2 * i]);
+        int lo = hex_value((unsigned char)s[2 * i + 1]);
+
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+
+    return 0;
+}
+
+// Copies an XML attribute value, resolving the predefined and numeric
+// character references
+static char *xml_value(const char *s, size_t len)
+{
+    static const struct
+    {
+        const char *ref;
+        char c;
+    } refs[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}
+    };
+    char *out = malloc(len + 1);
+    size_t n = 0;
+
+    if (!out) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < len; ) {
+        size_t k = 0;
+
+        if (s[i] != '&') {
+            out[n++] = s[i++];
+            continue;
+        }
+
+        for (k = 0; k < sizeof(refs) / sizeof(refs[0]); ++k) {
+            size_t rlen = strlen(refs[k].ref);
+
+            if (len - i >= rlen && strncmp(&s[i], refs[k].ref, rlen) == 0) {
+                out[n++] = refs[k].c;
+                i += rlen;
+                break;
+            }
+        }
+
+        if (k < sizeof(refs) / sizeof(refs[0])) {
+            continue;
+        }
+
+        // &#65; or &#x41;, ASCII only
+        const char *semi = memchr(&s[i], ';', len - i);
+        char *end = NULL;
+        long c = -1;
+
+        if (semi && i + 2 < len && s[i + 1] == '#') {
+            c = s[i + 2] == 'x' ? strtol(&s[i + 3], &end, 16) : strtol(&s[i + 2], &end, 10);
+        }
+
+        if (c > 0 && c < 0x80 && end == semi) {
+            out[n++] = (char)c;
+            i = (size_t)(semi - s) + 1;
+        } else {
+            out[n++] = s[i++];
+        }
+    }
+
+    out[n] = '\0';
+
+    return out;
+}
+
+static char *copy_string(const char *s, size_t len)
+{
+    char *out = malloc(len + 1);
+
+    if (out) {
+        memcpy(out, s, len);
+        out[len] = '\0';
+    }
+
+    return out;
+}
+
+// Applies one name/size/crc/sha1 field to a rom; others are ignored
+static int rom_field(dat_rom *r, const char *key, size_t key_len, const char *val,
+        size_t val_len, int xml)
+{
+    uint8_t crc[4];
+
+    if (key_len == 4 && strncmp(key, "name", 4) == 0) {
+        free(r->name);
+        r->name = xml ? xml_value(val, val_len) : copy_string(val, val_len);
+        return r->name ? 0 : -1;
+    }
+
+    if (key_len == 4 && strncmp(key, "size", 4) == 0) {
+        r->size = strtoull(val, NULL, 10);
+    } else if (key_len == 3 && strncasecmp(key, "crc", 3) == 0) {
+        r->has_crc = parse_hex(val, val_len, crc, sizeof(crc)) == 0;
+        r->crc = (uint32_t)crc[0] << 24 | (uint32_t)crc[1] << 16 | (uint32_t)crc[2] << 8 | crc[3];
+    } else if (key_len == 4 && strncasecmp(key, "sha1", 4) == 0) {
+        r->has_sha1 = parse_hex(val, val_len, r->sha1, CHECKSUM_SHA1_LEN) == 0;
+    }
+
+    return 0;
+}
+
+static int add_rom(dat *d, dat_rom *r, const char *game)
+{
+    // Entries without a CRC can't be looked up
+    if (!r->name || !r->has_crc) {
+        free(r->name);
+        return 0;
+    }
+
+    if (grow((void **)&d->roms, &d->roms_cap, d->roms_len + 1, sizeof(dat_rom)) != 0 ||
+            !(r->game = strdup(game ? game : ""))) {
+        free(r->name);
+        return -1;
+    }
+
+    d->roms[d->roms_len++] = *r;
+
+    return 0;
+}
+
+// Next attribute of the tag p points into; NULL at the end of the tag
+static const char *xml_attr(const char *p, const char *end, const char **key, size_t *key_len,
+        const char **val, size_t *val_len)
+{
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    *key = p;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '-' || *p == ':')) {
+        p++;
+    }
+    *key_len = (size_t)(p - *key);
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (*key_len == 0 || p + 1 >= end || *p != '=') {
+        return NULL;
+    }
+
+    for (p++; p < end && isspace((unsigned char)*p); ++p) {
+    }
+
+    if (p >= end || (*p != '"' && *p != '\'')) {
+        return NULL;
+    }
+
+    const char *close = memchr(p + 1, *p, (size_t)(end - p - 1));
+    if (!close) {
+        return NULL;
+    }
+
+    *val = p + 1;
+    *val_len = (size_t)(close - p - 1);
+
+    return close + 1;
+}
+
+// Past the element name of a tag, at its first attribute
+static const char *tag_attrs(const char *p, const char *end)
+{
+    while (p < end && !isspace((unsigned char)*p) && *p != '/') {
+        p++;
+    }
+
+    return p;
+}
+
+static int tag_is(const char *p, const char *end, const char *name)
+{
+    size_t len = strlen(name);
+
+    return (size_t)(end - p) > len && strncmp(p, name, len) == 0 &&
+        (isspace((unsigned char)p[len]) || p[len] == '>' || p[len] == '/');
+}
+
+static int parse_xml(dat *d, const char *p, const char *end)
+{
+    char *game = NULL;
+    int status = 0;
+
+    while (status == 0 && (p = memchr(p, '<', (size_t)(end - p))) != NULL) {
+        const char *tag = ++p;
+        const char *close = memchr(p, '>', (size_t)(end - p));
+        const char *key;
+        const char *val;
+        size_t key_len;
+        size_t val_len;
+
+        if (!close) {
+            break;
+        }
+
+        if (tag_is(tag, close, "game") || tag_is(tag, close, "machine")) {
+            free(game);
+            game = NULL;
+
+            for (p = tag_attrs(tag, close); (p = xml_attr(p, close, &key, &key_len, &val, &val_len)) != NULL; ) {
+                if (key_len == 4 && strncmp(key, "name", 4) == 0) {
+                    free(game);
+                    game = xml_value(val, val_len);
+                }
+            }
+        } else if (tag_is(tag, close, "rom")) {
+            dat_rom r;
+            memset(&r, 0, sizeof(r));
+
+            for (p = tag_attrs(tag, close); p && status == 0; ) {
+                p = xml_attr(p, close, &key, &key_len, &val, &val_len);
+
+                if (p) {
+                    status = rom_field(&r, key, key_len, val, val_len, 1);
+                }
+            }
+
+            if (status == 0) {
+                status = add_rom(d, &r, game);
+            } else {
+                free(r.name);
+            }
+        }
+
+        p = close + 1;
+    }
+
+    free(game);
+
+    return status;
+}
+
+// clrmamepro tokens: parentheses, quoted strings and bare words
+static const char *cmp_token(const char *p, const char *end, const char **tok, size_t *len)
+{
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    if (*p == '"') {
+        const char *close = memchr(p + 1, '"', (size_t)(end - p - 1));
+
+        if (!close) {
+            return NULL;
+        }
+
+        *tok = p + 1;
+        *len = (size_t)(close - p - 1);
+
+        return close + 1;
+    }
+
+    *tok = p;
+    if (*p == '(' || *p == ')') {
+        *len = 1;
+        return p + 1;
+    }
+
+    while (p < end && !isspace((unsigned char)*p) && *p != '(' && *p != ')') {
+        p++;
+    }
+    *len = (size_t)(p - *tok);
+
+    return p;
+}
+
+static int token_is(const char *tok, size_t len, const char *word)
+{
+    return len == strlen(word) && strncmp(tok, word, len) == 0;
+}
+
+static int parse_clrmamepro(dat *d, const char *p, const char *end)
+{
+    char *game = NULL;
+    const char *tok;
+    size_t len;
+    int depth = 0;
+    int in_game = 0;
+    int status = 0;
+
+    while (status == 0 && (p = cmp_token(p, end, &tok, &len)) != NULL) {
+        if (token_is(tok, len, "(")) {
+            depth++;
+        } else if (token_is(tok, len, ")")) {
+            depth -= depth > 0;
+            in_game = in_game && depth > 0;
+        } else if (depth == 0 && (token_is(tok, len, "game") || token_is(tok, len, "machine") ||
+                    token_is(tok, len, "resource"))) {
+            in_game = 1;
+        } else if (in_game && depth == 1 && token_is(tok, len, "name")) {
+            if ((p = cmp_token(p, end, &tok, &len)) == NULL) {
+                break;
+            }
+
+            free(game);
+            game = copy_string(tok, len);
+        } else if (in_game && depth == 1 && token_is(tok, len, "rom")) {
+            dat_rom r;
+            const char *key;
+            size_t key_len;
+
+            memset(&r, 0, sizeof(r));
+
+            if ((p = cmp_token(p, end, &tok, &len)) == NULL || !token_is(tok, len, "(")) {
+                break;
+            }
+
+            // Key value pairs up to the closing parenthesis
+            while (status == 0 && (p = cmp_token(p, end, &key, &key_len)) != NULL &&
+                    !token_is(key, key_len, ")") &&
+                    (p = cmp_token(p, end, &tok, &len)) != NULL) {
+                status = rom_field(&r, key, key_len, tok, len, 0);
+            }
+
+            if (status == 0 && p) {
+                status = add_rom(d, &r, game);
+            } else {
+                free(r.name);
+            }
+        }
+    }
+
+    free(game);
+
+    return status;
+}
+
+static size_t bucket(const dat *d, uint64_t size, uint32_t crc)
+{
+    return (size_t)(((crc ^ size * HASH_MUL) * HASH_MUL) >> 32) & (d->buckets_len - 1);
+}
+
+static int build_index(dat *d)
+{
+    d->buckets_len = 16;
+    while (d->buckets_len < 2 * d->roms_len) {
+        d->buckets_len *= 2;
+    }
+
+    d->buckets = calloc(d->buckets_len, sizeof(uint32_t));
+    d->next = calloc(d->roms_len + 1, sizeof(uint32_t));
+    if (!d->buckets || !d->next) {
+        return -1;
+    }
+
+    // Inserted back to front so each bucket lists roms in DAT order
+    for (size_t i = d->roms_len; i-- > 0; ) {
+        size_t b = bucket(d, d->roms[i].size, d->roms[i].crc);
+
+        d->next[i] = d->buckets[b];
+        d->buckets[b] = (uint32_t)i + 1;
+    }
+
+    return 0;
+}
+
+dat *dat_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Not a valid DAT file: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    const char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        return NULL;
+    }
+
+    dat *d = calloc(1, sizeof(dat));
+    const char *end = map + st.st_size;
+    const char *p = map;
+    int status = -1;
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (d) {
+        status = p < end && *p == '<' ? parse_xml(d, p, end) : parse_clrmamepro(d, p, end);
+    }
+
+    munmap((void *)map, (size_t)st.st_size);
+
+    if (status == 0 && d->roms_len == 0) {
+        fprintf(stderr, "Not a valid DAT file: %s\n", path);
+        status = -1;
+    } else if (status == 0 && build_index(d) != 0) {
+        perror("Error");
+        status = -1;
+    }
+
+    if (status != 0) {
+        dat_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+void dat_free(dat *d)
+{
+    if (!d) {
+        return;
+    }
+
+    for (size_t i = 0; i < d->roms_len; ++i) {
+        free(d->roms[i].game);
+        free(d->roms[i].name);
+    }
+
+    free(d->roms);
+    free(d->buckets);
+    free(d->next);
+    free(d);
+}
+
+long dat_roms(const dat *d)
+{
+    return (long)d->roms_len;
+}
+
+static void hash_data(const uint8_t *data, size_t size, dat_hash *h)
+{
+    checksum_sha1 sha1;
+    uint32_t crc = 0;
+
+    checksum_sha1_init(&sha1);
+
+    for (size_t off = 0; off < size; off += HASH_WINDOW) {
+        size_t n = size - off < HASH_WINDOW ? size - off : HASH_WINDOW;
+
+        crc = checksum_crc32(crc, data + off, n);
+        checksum_sha1_update(&sha1, data + off, n);
+    }
+
+    h->size = size;
+    h->crc = crc;
+    checksum_sha1_final(&sha1, h->sha1);
+}
+
+static int add_hash(dat_input *in, const char *name, const uint8_t *data, size_t size)
+{
+    if (grow((void **)&in->hashes, &in->hashes_cap, in->hashes_len + 1, sizeof(dat_hash)) != 0) {
+        return -1;
+    }
+
+    dat_hash *h = &in->hashes[in->hashes_len];
+    h->name = NULL;
+
+    if (name && !(h->name = strdup(name))) {
+        return -1;
+    }
+
+    hash_data(data, size, h);
+    in->hashes_len++;
+
+    return 0;
+}
+
+typedef struct
+{
+    char **paths;
+    const container_kind *kinds;
+    dat_input *inputs;
+    int count;
+    int next;                   // next input to claim
+    pthread_mutex_t lock;       // image walkers keep state in globals
+} verify_job;
+
+// A file of an image, copied out while the walker is locked
+typedef struct copied_file
+{
+    char *name;
+    uint8_t *data;
+    size_t size;
+    struct copied_file *next;
+} copied_file;
+
+typedef struct
+{
+    arena *arena;
+    copied_file *first;
+    copied_file *last;
+} copied_files;
+
+static int copy_file(const container_file *f, void *ctx)
+{
+    copied_files *c = ctx;
+
+    if (!f->name) {
+        return 0;
+    }
+
+    copied_file *cf = arena_alloc(c->arena, sizeof(copied_file));
+    if (!cf || (cf->name = arena_copy(c->arena, f->name, strlen(f->name) + 1)) == NULL ||
+            (cf->data = arena_copy(c->arena, f->data, f->size)) == NULL) {
+        return -1;
+    }
+
+    cf->size = f->size;
+    cf->next = NULL;
+
+    if (c->last) {
+        c->last->next = cf;
+    } else {
+        c->first = cf;
+    }
+    c->last = cf;
+
+    return 0;
+}
+
+// The copies live in the worker's arena until the next input
+static void hash_contents(verify_job *j, int i, const uint8_t *data, size_t size, arena *a)
+{
+    copied_files c = {a, NULL, NULL};
+
+    pthread_mutex_lock(&j->lock);
+    container_files_arena(a, j->kinds[i], data, size, copy_file, &c);
+    pthread_mutex_unlock(&j->lock);
+
+    for (copied_file *cf = c.first; cf; cf = cf->next) {
+        if (add_hash(&j->inputs[i], cf->name, cf->data, cf->size) != 0) {
+            j->inputs[i].failed = 1;
+        }
+    }
+
+    arena_reset(a);
+}
+
+static void hash_input(verify_job *j, int i, arena *a)
+{
+    dat_input *in = &j->inputs[i];
+    struct stat st;
+    int fd = open(j->paths[i], O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error");
+        in->failed = 1;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    // An empty file can't be mapped but still has hashes
+    if (st.st_size == 0) {
+        close(fd);
+        in->failed = add_hash(in, NULL, (const uint8_t *)"", 0) != 0;
+        return;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        in->failed = 1;
+        return;
+    }
+
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    if (add_hash(in, NULL, map, (size_t)st.st_size) != 0) {
+        in->failed = 1;
+    }
+
+    if (j->kinds && j->kinds[i] != CONTAINER_RAW && j->kinds[i] != CONTAINER_PRG) {
+        hash_contents(j, i, map, (size_t)st.st_size, a);
+    }
+
+    munmap(map, (size_t)st.st_size);
+}
+
+static void *worker(void *arg)
+{
+    verify_job *j = arg;
+    arena a;
+    int i;
+
+    arena_init(&a);
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->count) {
+        hash_input(j, i, &a);
+    }
+
+    arena_free(&a);
+
+    return NULL;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    const char *backslash = strrchr(path, '\\');
+
+    if (backslash > slash) {
+        slash = backslash;
+    }
+
+    return slash ? slash + 1 : path;
+}
+
+// Image file names carry no extension, the DAT names usually do
+static int inner_name_matches(const char *name, const char *rom)
+{
+    const char *dot = strrchr(rom, '.');
+
+    return strcasecmp(name, rom) == 0 ||
+        (dot && strlen(name) == (size_t)(dot - rom) && strncasecmp(name, rom, (size_t)(dot - rom)) == 0);
+}
+
+// A rom with this content, preferring one of the same name and one not
+// found yet; NULL if none
+static dat_rom *lookup(dat *d, const char *path, const dat_hash *h)
+{
+    dat_rom *best = NULL;
+    int best_score = -1;
+
+    for (uint32_t id = d->buckets[bucket(d, h->size, h->crc)]; id != 0; id = d->next[id - 1]) {
+        dat_rom *r = &d->roms[id - 1];
+
+        if (r->size != h->size || r->crc != h->crc ||
+                (r->has_sha1 && memcmp(r->sha1, h->sha1, CHECKSUM_SHA1_LEN) != 0)) {
+            continue;
+        }
+
+        int named = h->name ? inner_name_matches(h->name, base_name(r->name)) :
+            strcmp(base_name(path), base_name(r->name)) == 0;
+        int score = 2 * named + !r->found;
+
+        if (score > best_score) {
+            best = r;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+long dat_verify(FILE *out, dat *d, char **paths, const container_kind *kinds, int count)
+{
+    verify_job j;
+    pthread_t threads[MAX_THREADS];
+    // The calling thread is one of the workers
+    long threads_len = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (threads_len > count - 1) {
+        threads_len = count - 1;
+    }
+    if (threads_len > MAX_THREADS) {
+        threads_len = MAX_THREADS;
+    }
+
+    j.paths = paths;
+    j.kinds = kinds;
+    j.inputs = calloc((size_t)count + 1, sizeof(dat_input));
+    j.count = count;
+    j.next = 0;
+    if (!j.inputs) {
+        perror("Error");
+        return -1;
+    }
+    pthread_mutex_init(&j.lock, NULL);
+
+    long started = 0;
+    while (started < threads_len && pthread_create(&threads[started], NULL, worker, &j) == 0) {
+        started++;
+    }
+
+    // Whatever no thread claims is done here
+    worker(&j);
+
+    for (long t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&j.lock);
+
+    long verified = 0;
+    long renamed = 0;
+    long unknown = 0;
+    long missing = 0;
+    long failed = 0;
+
+    // Results in input order, matched against the DAT in one thread
+    for (int i = 0; i < count; ++i) {
+        dat_input *in = &j.inputs[i];
+
+        failed += in->failed;
+
+        for (size_t k = 0; k < in->hashes_len; ++k) {
+            dat_hash *h = &in->hashes[k];
+            dat_rom *r = lookup(d, paths[i], h);
+            const char *name = h->name ? h->name : base_name(paths[i]);
+            const char *sep = h->name ? ":" : "";
+            const char *image = h->name ? paths[i] : "";
+            const char *file = h->name ? name : paths[i];
+
+            if (!r) {
+                if (!h->name) {
+                    fprintf(out, "unknown   %s\n", paths[i]);
+                    unknown++;
+                }
+            } else if (h->name ? inner_name_matches(name, base_name(r->name)) :
+                    strcmp(name, base_name(r->name)) == 0) {
+                fprintf(out, "verified  %s%s%s\n", image, sep, file);
+                verified++;
+            } else {
+                fprintf(out, "renamed   %s%s%s -> %s\n", image, sep, file, r->name);
+                renamed++;
+            }
+
+            if (r) {
+                r->found = 1;
+            }
+
+            free(h->name);
+        }
+
+        free(in->hashes);
+    }
+
+    for (size_t i = 0; i < d->roms_len; ++i) {
+        const dat_rom *r = &d->roms[i];
+
+        if (!r->found) {
+            fprintf(out, "missing   %s (%s)\n", r->name, r->game);
+            missing++;
+        }
+    }
+
+    fprintf(out, "%ld verified, %ld renamed, %ld missing, %ld unknown\n",
+        verified, renamed, missing, unknown);
+
+    free(j.inputs);
+
+    return renamed + missing + unknown + failed;
+}
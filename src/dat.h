@@ -0,0 +1,26 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// DAT collection files (Logiqx XML as used by TOSEC and No-Intro, or
+// clrmamepro text) indexed by size and CRC32; SHA-1 confirms matches
+// where the DAT lists it.
+
+typedef struct dat dat;
+
+// Returns NULL after printing the reason
+dat *dat_load(const char *path);
+void dat_free(dat *d);
+
+long dat_roms(const dat *d);
+
+// Hashes the inputs in parallel and prints every verified, renamed and
+// unknown input, then every DAT entry no input matched. With kinds, the
+// files inside container images are checked too; only those matching an
+// entry are listed. Returns the number of renamed, missing, unknown and
+// unreadable files.
+long dat_verify(FILE *out, dat *d, char **paths, const container_kind *kinds, int count);
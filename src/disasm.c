@@ -1,6 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "disasm.h"
+#include "stats.h"
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 
 // Addressing modes
 enum {
@@ -18,6 +24,9 @@ enum {
     RELATIVE      // BNE $9000
 };
 
+#define OPCODE_JSR 0x20
+#define OPCODE_JMP 0x4c
+
 // Length of addressing modes
 const int op_length[] = {1, 2, 3, 3, 3, 2, 2, 2, 2, 2, 3, 2};
 
@@ -163,92 +172,224 @@ const mnemonics mne_illegal[] = {
     {"nop", ABSOLUTE_X}, {"sbc", ABSOLUTE_X}, {"inc", ABSOLUTE_X}, {"isc", ABSOLUTE_X}
 };
 
-void disasm(const uint8_t *buffer, const int size, const uint16_t address, const int illegal)
+// Whole instructions of buffer[0, len), and with final a truncated last
+// one as data. Returns the bytes used; the rest starts the next block.
+static size_t disasm_block(FILE *out, const uint8_t *buffer, size_t len, uint16_t *pc,
+        const mnemonics *mne, int final)
 {
-    mnemonics *mne = illegal ? (mnemonics*)&mne_illegal : (mnemonics*)&mne_legal;
-
-    int index = 0;
-    uint16_t addr;
-
-    if (address == UINT16_MAX) {
-        // Get loading address and advance index
-        addr = (uint16_t)(buffer[0] + ((buffer[1] & 0xff) << 8));
-        index = 2;
-    } else
-        addr = address;
+    size_t index = 0;
+    uint16_t addr = *pc;
 
-    while (index < size) {
+    while (index < len) {
         uint8_t low = 0;
         uint8_t high = 0;
-        uint8_t opcode = buffer[index++];
+        uint8_t opcode = buffer[index];
+        size_t length = (size_t)op_length[mne[opcode].type];
+
+        if (length > len - index) {
+            if (!final) {
+                break;
+            }
+
+            // The input ends inside the operand; what there is stays data
+            if (len - index == 2) {
+                low = buffer[index + 1];
+                fprintf(out, "%04x %02x %02x     .byte $%02x,$%02x\n", addr, opcode, low,
+                    opcode, low);
+            } else {
+                fprintf(out, "%04x %02x        .byte $%02x\n", addr, opcode, opcode);
+            }
+
+            addr += (uint16_t)(len - index);
+            index = len;
+            break;
+        }
+
+        index++;
+        STATS_ADD(instructions, 1);
 
         // address
-        printf("%04x ", addr);
+        fprintf(out, "%04x ", addr);
 
         // hexdump
-        switch (op_length[mne[opcode].type]) {
+        switch (length) {
             case 2:
                 low = buffer[index++];
-                printf("%02x %02x     ", opcode, low);
+                fprintf(out, "%02x %02x     ", opcode, low);
                 break;
 
             case 3:
                 low = buffer[index++];
                 high = buffer[index++];
-                printf("%02x %02x %02x  ", opcode, low, high);
+                fprintf(out, "%02x %02x %02x  ", opcode, low, high);
                 break;
 
             default:
-                printf("%02x        ", opcode);
+                fprintf(out, "%02x        ", opcode);
                 break;
         }
         addr += op_length[mne[opcode].type];
-
         // mnemonic
-        printf("%s", mne[opcode].mnemonic);
+        fprintf(out, "%s", mne[opcode].mnemonic);
 
         // Type
         switch (mne[opcode].type) {
             case IMMEDIATE:
-                printf(" #$%02x", low);
+                fprintf(out, " #$%02x", low);
                 break;
             case ABSOLUTE:
-                printf(" $%02x%02x", high, low);
+                fprintf(out, " $%02x%02x", high, low);
                 break;
             case ABSOLUTE_X:
-                printf(" $%02x%02x,x", high, low);
+                fprintf(out, " $%02x%02x,x", high, low);
                 break;
             case ABSOLUTE_Y:
-                printf(" $%02x%02x,y", high, low);
+                fprintf(out, " $%02x%02x,y", high, low);
                 break;
             case ZEROPAGE:
-                printf(" $%02x", low);
+                fprintf(out, " $%02x", low);
                 break;
             case INDIRECT_X:
-                printf(" ($%02x,x)", low);
+                fprintf(out, " ($%02x,x)", low);
                 break;
             case INDIRECT_Y:
-                printf(" ($%02x),y", low);
+                fprintf(out, " ($%02x),y", low);
                 break;
             case ZEROPAGE_X:
-                printf(" $%02x,x", low);
+                fprintf(out, " $%02x,x", low);
                 break;
             case ZEROPAGE_Y:
-                printf(" $%02x,y", low);
+                fprintf(out, " $%02x,y", low);
                 break;
             case INDIRECT:
-                printf(" ($%02x%02x)", high, low);
+                fprintf(out, " ($%02x%02x)", high, low);
                 break;
             case RELATIVE:
-                printf(" $%04x", (low <= 127) ? addr + low : addr - (256 - low));
+                fprintf(out, " $%04x", (low <= 127) ? addr + low : addr - (256 - low));
                 break;
             default:
                 /* IMPLIED */
                 break;
         }
 
-        printf("\n");
+        fprintf(out, "\n");
+    }
+
+    *pc = addr;
+
+    return index;
+}
+
+void disasm(FILE *out, const uint8_t *buffer, const size_t size, const uint16_t address, const int illegal)
+{
+    const mnemonics *mne = illegal ? mne_illegal : mne_legal;
+    size_t index = 0;
+    uint16_t addr = address;
+
+    if (address == UINT16_MAX) {
+        // Get loading address and advance index
+        if (size < 2) {
+            return;
+        }
+
+        addr = (uint16_t)(buffer[0] + ((buffer[1] & 0xff) << 8));
+        index = 2;
+    }
+
+    STATS_PHASE(STATS_RENDER);
+    disasm_block(out, buffer + index, size - index, &addr, mne, 1);
+}
+
+int disasm_file(FILE *out, int fd, uint64_t size, const uint16_t address, const int illegal)
+{
+    const mnemonics *mne = illegal ? mne_illegal : mne_legal;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t pos = 0;
+    uint16_t addr = address;
+
+    if (address == UINT16_MAX) {
+        uint8_t load[2];
+
+        if (size < 2) {
+            return 0;
+        }
+
+        if (pread(fd, load, sizeof(load), 0) != (ssize_t)sizeof(load)) {
+            return -1;
+        }
+
+        addr = (uint16_t)(load[0] + (load[1] << 8));
+        pos = 2;
     }
 
-    return;
+    STATS_PHASE(STATS_RENDER);
+
+    // Each window starts at the page holding the next instruction, so
+    // one cut in two by the previous window is decoded whole
+    while (pos < size) {
+        uint64_t base = pos - pos % page;
+        size_t len = size - base < DISASM_WINDOW ? (size_t)(size - base) : DISASM_WINDOW;
+        uint8_t *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)base);
+
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+
+        posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+
+        size_t skip = (size_t)(pos - base);
+        pos += disasm_block(out, map + skip, len - skip, &addr, mne, base + len == size);
+        munmap(map, len);
+    }
+
+    return 0;
+}
+
+static const char *mode_names[] = {
+    "implied", "immediate", "absolute", "absolute,x", "absolute,y", "zeropage",
+    "(indirect,x)", "(indirect),y", "zeropage,x", "zeropage,y", "(indirect)", "relative"
+};
+
+void disasm_count(disasm_counts *c, const uint8_t *buffer, size_t size)
+{
+    size_t index = 0;
+
+    while (index < size) {
+        uint8_t opcode = buffer[index];
+        size_t length = (size_t)op_length[mne_illegal[opcode].type];
+
+        if (length > size - index) {
+            break;
+        }
+
+        c->opcodes[opcode]++;
+
+        if (opcode == OPCODE_JSR) {
+            c->jsr[buffer[index + 1] | buffer[index + 2] << 8]++;
+        } else if (opcode == OPCODE_JMP) {
+            c->jmp[buffer[index + 1] | buffer[index + 2] << 8]++;
+        }
+
+        index += length;
+    }
+}
+
+const char *disasm_mnemonic(uint8_t opcode)
+{
+    return mne_illegal[opcode].mnemonic;
+}
+
+int disasm_mode(uint8_t opcode)
+{
+    return mne_illegal[opcode].type;
+}
+
+const char *disasm_mode_name(int mode)
+{
+    return mode >= 0 && mode < DISASM_MODES ? mode_names[mode] : "";
+}
+
+int disasm_illegal(uint8_t opcode)
+{
+    return mne_legal[opcode].mnemonic[0] == '?';
 }
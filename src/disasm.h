@@ -1,5 +1,35 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-void disasm(const uint8_t *buffer, const int size, const uint16_t address, const int illegal);
+// Inputs beyond this are disassembled through a sliding mapping of this
+// size, so memory use doesn't grow with the input
+#define DISASM_WINDOW (64 * 1024 * 1024)
+
+void disasm(FILE *out, const uint8_t *buffer, const size_t size, const uint16_t address, const int illegal);
+
+// The same for a regular file of size bytes; -1 with errno set if it
+// can't be read
+int disasm_file(FILE *out, int fd, uint64_t size, const uint16_t address, const int illegal);
+
+#define DISASM_MODES 12
+
+typedef struct
+{
+    uint64_t opcodes[256];
+    uint64_t jsr[65536];        // by target address
+    uint64_t jmp[65536];        // absolute jumps by target address
+} disasm_counts;
+
+// Decodes like disasm() with illegal opcodes but only counts, adding to
+// c. A truncated last instruction isn't counted.
+void disasm_count(disasm_counts *c, const uint8_t *buffer, size_t size);
+
+// Decoding of an opcode with illegal opcodes enabled; disasm_illegal()
+// tells the undocumented ones
+const char *disasm_mnemonic(uint8_t opcode);
+int disasm_mode(uint8_t opcode);
+const char *disasm_mode_name(int mode);
+int disasm_illegal(uint8_t opcode);
@@ -1,9 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "disk.h"
+#include "g64.h"
+#include "stats.h"
+#include "petscii.h"
+#include "checksum.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SECTOR_SIZE 256
 
@@ -55,6 +68,33 @@
 #define DIR_FILENAME_LEN             16
 #define DIR_FILESIZE_LO_OFF          0x1E
 #define DIR_FILESIZE_HI_OFF          0x1F
+#define DIR_SIDE_TRACK_OFF           0x15
+#define DIR_SIDE_SECTOR_OFF          0x16
+#define DIR_RECORD_LEN_OFF           0x17
+
+// GEOS fields, sharing bytes 0x15-0x17 with REL files
+#define DIR_INFO_TRACK_OFF           0x15
+#define DIR_INFO_SECTOR_OFF          0x16
+#define DIR_GEOS_STRUCTURE_OFF       0x17
+#define DIR_GEOS_TYPE_OFF            0x18
+#define DIR_GEOS_DATE_OFF            0x19   // year, month, day, hour, minute
+#define GEOS_STRUCTURE_SEQ           0
+#define GEOS_STRUCTURE_VLIR          1
+#define GEOS_ICON_WIDTH              3      // info block starts with a 24x21 icon
+#define GEOS_ICON_HEIGHT             21
+#define GEOS_ICON_FORMAT             0xBF
+#define GEOS_VLIR_RECORDS            127
+#define GEOS_VLIR_EMPTY              0xFF
+#define CVT_DIR_ENTRY_LEN            30
+#define CVT_SIGNATURE_OFF            30
+
+// REL side sectors
+#define SIDE_NUMBER_OFF              2
+#define SIDE_RECORD_LEN_OFF          3
+#define SIDE_TABLE_OFF               4      // T/S of all side sectors
+#define SIDE_DATA_OFF                16     // T/S of the data sectors
+#define SIDE_SECTORS_MAX             6
+#define SIDE_DATA_ENTRIES            120
 
 // Sector link
 #define SECTOR_LINK_TRACK_OFF        0
@@ -86,13 +126,30 @@
 // Extended BAM for tracks 36-40
 #define BAM_DOLPHIN_BASE             0xAC
 #define BAM_SPEED_BASE               0xC0
+#define BAM_DIR_TRACK_OFF            0x00
+#define BAM_DIR_SECTOR_OFF           0x01
+#define BAM_DOS_VERSION_OFF          0x02
+#define BAM_PAD_END                  0xAB
+#define DOS_VERSION                  0x41
+#define DOS_TYPE                     "2A"
+
+// 1541 allocation
+#define FILE_INTERLEAVE              10
+#define DIR_INTERLEAVE               3
+#define DIR_LAST_SECTOR_LINK         0xFF
 
 static int g_total_tracks = D64_TRACKS_35;
 static const uint8_t *g_image = NULL;
 static size_t g_image_size = 0;
 static size_t g_data_bytes = 0;   // size of main data area (without error bytes)
-
-static int sectors_per_track(int track)
+static uint8_t g_decoded[G64_MAX_D64_SIZE];  // G64 images decoded to D64 layout, one at a time
+static const uint8_t *g_errors = NULL;  // per sector error codes, error bytes or G64 decode status
+static uint64_t g_bad[(DISK_MAX_SECTORS + 63) / 64];   // sectors whose code is an error
+static long g_bad_reads = 0;
+static int g_bad_track = 0;       // last bad sector read
+static int g_bad_sector = 0;
+
+int sectors_per_track(int track)
 {
     if (track < 1) {
         return 0;
@@ -117,9 +174,9 @@ static int sectors_per_track(int track)
     return 0;
 }
 
-static long ts_offset(int track, int sector)
+static long sector_offset(int tracks, int track, int sector)
 {
-    if (track < 1 || track > g_total_tracks) {
+    if (track < 1 || track > tracks) {
         return -1;
     }
 
@@ -140,6 +197,44 @@ static long ts_offset(int track, int sector)
     return off;
 }
 
+static long ts_offset(int track, int sector)
+{
+    return sector_offset(g_total_tracks, track, sector);
+}
+
+// Error codes as stored in D64 error bytes and the G64 decode status,
+// with the DOS error the drive reports for them
+static const struct
+{
+    uint8_t code;
+    int dos;
+    const char *text;
+} error_codes[] = {
+    {0x02, 20, "header block not found"},
+    {0x03, 21, "no sync"},
+    {0x04, 22, "data block not found"},
+    {0x05, 23, "data checksum"},
+    {0x06, 24, "byte decoding"},
+    {0x07, 25, "write verify"},
+    {0x08, 26, "write protect"},
+    {0x09, 27, "header checksum"},
+    {0x0A, 28, "long data block"},
+    {0x0B, 29, "disk id mismatch"},
+    {0x0F, 74, "drive not ready"}
+};
+
+// DOS error number of a code, 0 for none (0x00 and 0x01 both mean ok)
+static int dos_error(uint8_t code)
+{
+    for (size_t k = 0; k < sizeof(error_codes) / sizeof(error_codes[0]); ++k) {
+        if (error_codes[k].code == code) {
+            return error_codes[k].dos;
+        }
+    }
+
+    return 0;
+}
+
 static int read_sector(int track, int sector, const uint8_t **out)
 {
     long off = ts_offset(track, sector);
@@ -152,7 +247,26 @@ static int read_sector(int track, int sector, const uint8_t **out)
         return -1;
     }
 
+    // One bit test on the common path, the codes only for bad sectors
+    long i = off / SECTOR_SIZE;
+
+    if (g_bad[i / 64] & (1ull << (i % 64))) {
+        uint8_t status = g_errors[i];
+
+        g_bad_reads++;
+        g_bad_track = track;
+        g_bad_sector = sector;
+
+        // Sectors a G64 track didn't yield are unreadable, as on the drive;
+        // D64 error bytes keep whatever data the image was made with
+        if (g_image == g_decoded &&
+                (status == G64_NO_HEADER || status == G64_NO_SYNC || status == G64_NO_DATA)) {
+            return -1;
+        }
+    }
+
     *out = g_image + off;
+    STATS_ADD(sectors_read, 1);
 
     return 0;
 }
@@ -253,13 +367,14 @@ static long compute_file_size_bytes(int start_track, int start_sector)
             break;
         }
 
+        STATS_ADD(chain_steps, 1);
+
         int nt = sec[SECTOR_LINK_TRACK_OFF];
         int ns = sec[SECTOR_LINK_SECTOR_OFF];
 
+        // The last sector's link holds the index of its final data byte
         if (nt == END_OF_CHAIN_TRACK) {
-            if (ns >= 0 && ns <= FILE_DATA_BYTES_PER_SECTOR) {
-                total += ns;
-            }
+            total += ns >= 2 ? ns - 1 : 0;
             break;
         }
 
@@ -271,47 +386,46 @@ static long compute_file_size_bytes(int start_track, int start_sector)
     return total;
 }
 
-static void detect_image_layout(void)
+size_t disk_layout(size_t size, int *tracks)
 {
-    if (g_image_size == D64_IMAGE_SIZE_35) {
-        g_total_tracks = D64_TRACKS_35;
-        g_data_bytes = D64_IMAGE_SIZE_35;
-        return;
-    }
-
-    if (g_image_size == D64_IMAGE_SIZE_40) {
-        g_total_tracks = D64_TRACKS_40;
-        g_data_bytes = D64_IMAGE_SIZE_40;
-        return;
-    }
-
-    if (g_image_size == D64_IMAGE_SIZE_42) {
-        g_total_tracks = D64_TRACKS_42;
-        g_data_bytes = D64_IMAGE_SIZE_42;
-        return;
+    static const struct
+    {
+        size_t size;
+        int tracks;
+        size_t data;
+    } layouts[] = {
+        {D64_IMAGE_SIZE_35, D64_TRACKS_35, D64_IMAGE_SIZE_35},
+        {D64_IMAGE_SIZE_40, D64_TRACKS_40, D64_IMAGE_SIZE_40},
+        {D64_IMAGE_SIZE_42, D64_TRACKS_42, D64_IMAGE_SIZE_42},
+        {D64_IMAGE_SIZE_35_ERR, D64_TRACKS_35, D64_IMAGE_SIZE_35},
+        {D64_IMAGE_SIZE_40_ERR, D64_TRACKS_40, D64_IMAGE_SIZE_40},
+        {D64_IMAGE_SIZE_42_ERR, D64_TRACKS_42, D64_IMAGE_SIZE_42}
+    };
+
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        if (size == layouts[i].size) {
+            *tracks = layouts[i].tracks;
+            return layouts[i].data;
+        }
     }
 
-    if (g_image_size == D64_IMAGE_SIZE_35_ERR) {
-        g_total_tracks = D64_TRACKS_35;
-        g_data_bytes = D64_IMAGE_SIZE_35;
-        return;
-    }
+    return 0;
+}
 
-    if (g_image_size == D64_IMAGE_SIZE_40_ERR) {
-        g_total_tracks = D64_TRACKS_40;
-        g_data_bytes = D64_IMAGE_SIZE_40;
-        return;
-    }
+long disk_sector_offset(int tracks, int track, int sector)
+{
+    return sector_offset(tracks, track, sector);
+}
 
-    if (g_image_size == D64_IMAGE_SIZE_42_ERR) {
-        g_total_tracks = D64_TRACKS_42;
-        g_data_bytes = D64_IMAGE_SIZE_42;
-        return;
-    }
+static void detect_image_layout(void)
+{
+    g_data_bytes = disk_layout(g_image_size, &g_total_tracks);
 
     // Fallback: assume 35 tracks, clamp to buffer size
-    g_total_tracks = D64_TRACKS_35;
-    g_data_bytes = g_image_size;
+    if (g_data_bytes == 0) {
+        g_total_tracks = D64_TRACKS_35;
+        g_data_bytes = g_image_size;
+    }
 }
 
 static int read_bam(const uint8_t **bam)
@@ -321,29 +435,9 @@ static int read_bam(const uint8_t **bam)
 
 static void petscii_to_ascii_trim(const uint8_t *in, size_t len, char *out, size_t outsz)
 {
-    size_t j = 0;
-
-    for (size_t i = 0; i < len && j + 1 < outsz; ++i) {
-        uint8_t c = in[i];
-        uint8_t a = pet_asc[c];
-
-        // Normalize PETSCII pad to ASCII space
-        if (c == PETSCII_PAD) {
-            a = ASCII_SPACE;
-        }
-
-        // Ensure printable ASCII; otherwise fallback placeholder
-        if (a < ASCII_MIN_PRINTABLE || a > 0x7E) {
-            a = '?';
-        }
-
-        // Lowercase ASCII letters for stylistic consistency in header/disk name
-        if (a >= 'A' && a <= 'Z') {
-            a = (uint8_t)(a - 'A' + 'a');
-        }
+    size_t j = len < outsz - 1 ? len : outsz - 1;
 
-        out[j++] = (char)a;
-    }
+    petscii_map(petscii_title, in, j, out);
 
     while (j > 0 && out[j-1] == ' ') {
         j--;
@@ -352,201 +446,61 @@ static void petscii_to_ascii_trim(const uint8_t *in, size_t len, char *out, size
     out[j] = '\0';
 }
 
-// Map PETSCII directory name bytes to display ASCII, preserving 16 chars.
-// - Pads (0xA0) -> space
-// - ASCII letters -> lowercase
-// - Known graphics -> ASCII approximations (B, ., M, N, V, etc.)
-static void petscii_dirname_16(const uint8_t *in, char *out /* size >= 17 */)
+// Length of a PETSCII name without trailing pads
+static int petscii_trimmed_len(const uint8_t *in, int len)
 {
-    for (int i = 0; i < DIR_FILENAME_LEN; ++i) {
-        uint8_t c = in[i];
-
-        char o = '?';
-
-        if (c == PETSCII_PAD) {
-            o = ' ';
-        } else {
-            // First try generic PETSCII->ASCII mapping used across the repo
-            uint8_t a = pet_asc[c];
-
-            if (a >= 0x20 && a <= 0x7E) {
-                o = (char)a;
-
-                if (o == '`') {
-                    o = '.'; // prefer dot over backtick in art
-                }
-            } else if (a >= 0xC1 && a <= 0xDA) {
-                // pet_asc mapped to PETSCII graphics letters; convert to ASCII A..Z
-                o = (char)('A' + (a - 0xC1));
-            } else {
-                // Graphics and special PETSCII seen in directory art.
-                switch (c) {
-                    // Dots / background
-                    case 0xAD:
-                    case 0xAE:
-                    case 0xAF:
-                    case 0xB0:
-                    case 0xB1:
-                    case 0xB2:
-                    case 0xB3:
-                    case 0xBD:
-                    case 0xC0:
-                    case 0xDB:
-                        o = '.'; break;
-
-                    // Block / border
-                    case 0xC2:
-                        o = 'B';
-                        break;  // solid block
-
-                    // Map PETSCII graphic letter block range to ASCII letters
-                    case 0xC1:
-                        o = 'A';
-                        break;
-                    case 0xC3:
-                        o = 'C';
-                        break;
-                    case 0xC5:
-                        o = 'E';
-                        break;
-                    case 0xCC:
-                        o = 'L';
-                        break;
-                    case 0xD0:
-                        o = 'P';
-                        break;
-                    case 0xD1:
-                        o = 'Q';
-                        break;
-                    case 0xD2:
-                        o = 'R';
-                        break;
-                    case 0xD7:
-                        o = 'W';
-                        break;
-                    case 0xD8:
-                        o = 'X';
-                        break;
-                    case 0xDA:
-                        o = 'Z';
-                        break;
-
-                    // Corners/edges and markers
-                    case 0xD4:
-                        o = 'T';
-                        break;  // top
-
-                    case 0xD9:
-                        o = 'Y';
-                        break;  // top-right/right marker
-
-                    case 0xCA:
-                        o = 'J';
-                        break;  // bottom-left
-
-                    case 0xCB:
-                        o = 'K';
-                        break;  // bottom-right
-
-                    case 0xD5:
-                        o = 'U';
-                        break;  // up
-
-                    case 0xC4:
-                        o = 'D';
-                        break;  // horizontal line
-
-                    case 0xC9:
-                        o = 'I';
-                        break;  // right marker
-
-                    case 0xC6:
-                        o = 'F';
-                        break;
-
-                    case 0xC7:
-                        o = 'G';
-                        break;
-
-                    case 0xC8:
-                        o = 'H';
-                        break;
-
-                    case 0xCF:
-                        o = 'O';
-                        break;
-
-                    case 0xD3:
-                        o = 'S';
-                        break;
-
-                    case 0xCD:
-                        o = 'M';
-                        break;
-
-                    case 0xCE:
-                        o = 'N';
-                        break;
-
-                    case 0xD6:
-                        o = 'V';
-                        break;
-
-                    default:
-                        o = '.'; // fall back to dot for other graphics
-                        break;
-                }
-            }
-        }
-
-        out[i] = o;
+    while (len > 0 && in[len - 1] == PETSCII_PAD) {
+        len--;
     }
 
-    out[DIR_FILENAME_LEN] = '\0';
+    return len;
 }
 
-static void print_header_from_bam(const uint8_t *bam)
+static void print_header_from_bam(FILE *out, const uint8_t *bam)
 {
     char disk_name[BAM_DISK_NAME_LEN + 1];
     char id_str[DISK_ID_LEN + 1];
     char type_str[DOS_TYPE_LEN + 1];
     char ver_char = 0;
 
-    petscii_to_ascii_trim(&bam[BAM_DISK_NAME_OFF], BAM_DISK_NAME_LEN, disk_name, sizeof(disk_name));
+    const uint8_t *id = &bam[BAM_DISK_ID_OFF];
+    const uint8_t *type = &bam[BAM_DOS_TYPE_OFF];
+    const uint8_t *ver = &bam[BAM_DOS_TYPE_OFF - 1];
 
-    // Extract ID (2 bytes) and DOS type (2 bytes), lowercased
-    uint8_t id0 = bam[BAM_DISK_ID_OFF + 0];
-    uint8_t id1 = bam[BAM_DISK_ID_OFF + 1];
-    uint8_t ver = bam[BAM_DOS_TYPE_OFF - 1];
-    uint8_t dt0 = bam[BAM_DOS_TYPE_OFF + 0];
-    uint8_t dt1 = bam[BAM_DOS_TYPE_OFF + 1];
+    // Decide whether to include the DOS version char between ID and TYPE.
+    // Include when it's meaningful (not pad or plain 'a'/'A').
+    int include_ver = *ver != 0 && *ver != PETSCII_PAD && *ver != ' ' && *ver != 'A' && *ver != 'a';
 
-    id_str[0] = (char)id0;
-    id_str[1] = (char)id1;
-    id_str[2] = '\0';
+    if (petscii_get_charset() != PETSCII_ASCII) {
+        const uint8_t *raw = &bam[BAM_DISK_NAME_OFF];
+        int len = petscii_trimmed_len(raw, BAM_DISK_NAME_LEN);
 
-    type_str[0] = (char)dt0;
-    type_str[1] = (char)dt1;
-    type_str[2] = '\0';
+        fprintf(out, "0 \"");
+        petscii_write(out, petscii_title, raw, (size_t)len);
+        fprintf(out, "%*s\" ", BAM_DISK_NAME_LEN - len, "");
+        petscii_write(out, petscii_title, id, DISK_ID_LEN);
 
-    for (char *p = id_str; *p; ++p) {
-        if (*p >= 'A' && *p <= 'Z') {
-            *p = (char)(*p - 'A' + 'a');
+        if (include_ver) {
+            petscii_write(out, petscii_title, ver, 1);
+        } else {
+            fputc(' ', out);
         }
-    }
 
-    for (char *p = type_str; *p; ++p) {
-        if (*p >= 'A' && *p <= 'Z') {
-            *p = (char)(*p - 'A' + 'a');
-        }
-    }
+        petscii_write(out, petscii_title, type, DOS_TYPE_LEN);
+        fputc('\n', out);
 
-    // Lowercase version if included
-    ver_char = (char)ver;
-    if (ver_char >= 'A' && ver_char <= 'Z') {
-        ver_char = (char)(ver_char - 'A' + 'a');
+        return;
     }
 
+    petscii_to_ascii_trim(&bam[BAM_DISK_NAME_OFF], BAM_DISK_NAME_LEN, disk_name, sizeof(disk_name));
+
+    // ID, DOS version and DOS type map to lowercase like the name
+    petscii_map(petscii_title, id, DISK_ID_LEN, id_str);
+    id_str[DISK_ID_LEN] = '\0';
+    petscii_map(petscii_title, type, DOS_TYPE_LEN, type_str);
+    type_str[DOS_TYPE_LEN] = '\0';
+    petscii_map(petscii_title, ver, 1, &ver_char);
+
     char padded_name[BAM_DISK_NAME_LEN + 1];
 
     size_t dnlen = strlen(disk_name);
@@ -565,54 +519,62 @@ static void print_header_from_bam(const uint8_t *bam)
 
     padded_name[BAM_DISK_NAME_LEN] = '\0';
 
-    // Decide whether to include the DOS version char between ID and TYPE.
-    // Include when it's meaningful (not pad or plain 'a'/'A').
-    int include_ver = (ver_char != 0) && (ver_char != (char)PETSCII_PAD) && (ver_char != ' ') && (ver_char != 'a');
-
     if (include_ver) {
         // Print as: 0 "<name>" <id><ver><type>
-        printf("0 \"%s\" %s%c%s\n", padded_name, id_str, ver_char, type_str);
+        fprintf(out, "0 \"%s\" %s%c%s\n", padded_name, id_str, ver_char, type_str);
     } else {
         // Print as: 0 "<name>" <id> <type>
-        printf("0 \"%s\" %s %s\n", padded_name, id_str, type_str);
+        fprintf(out, "0 \"%s\" %s %s\n", padded_name, id_str, type_str);
     }
 }
 
-static int list_directory(const uint8_t *bam, int show_sizes)
+static int image_sectors(void)
+{
+    int total = 0;
+
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        total += sectors_per_track(t);
+    }
+
+    return total;
+}
+
+// Calls fn for every used directory slot; a non-zero return stops the walk.
+static int walk_directory(disk_dirent_fn fn, void *ctx)
 {
-    (void)bam;
     const uint8_t *sec = NULL;
     int track = DIRECTORY_TRACK;
     int sector = DIR_FIRST_SECTOR;
-    int total_blocks = 0;
+    int max_sectors = image_sectors();
 
-    while (track != END_OF_CHAIN_TRACK) {
+    // A directory can't hold more sectors than the image, so stop cyclic chains
+    for (int steps = 0; track != END_OF_CHAIN_TRACK && steps < max_sectors; ++steps) {
         if (read_sector(track, sector, &sec) != 0) {
-            fprintf(stderr, "Failed to read directory sector %d/%d.\n", track, sector);
-            break;
+            diagnostic("Failed to read directory sector %d/%d.\n", track, sector);
+            return -1;
         }
 
+        STATS_ADD(chain_steps, 1);
+
         int next_track = sec[SECTOR_LINK_TRACK_OFF];
         int next_sector = sec[SECTOR_LINK_SECTOR_OFF];
 
         for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; ++i) {
             int off = i * DIR_ENTRY_SIZE;
-            uint8_t file_type = sec[off + DIR_FILETYPE_OFF];
-
-            char name[DIR_FILENAME_LEN + 1];
-            petscii_dirname_16(&sec[off + DIR_FILENAME_OFF], name);
+            const uint8_t *ent = &sec[off];
+            uint8_t file_type = ent[DIR_FILETYPE_OFF];
 
             // Determine if this directory slot is entirely unused (empty),
             // which we still want to skip. We now keep DEL entries too, so
             // we only skip when everything relevant is empty.
-            int start_track = sec[off + DIR_START_TRACK_OFF];
-            int start_sector = sec[off + DIR_START_SECTOR_OFF];
-            int blocks = sec[off + DIR_FILESIZE_LO_OFF] + (sec[off + DIR_FILESIZE_HI_OFF] << 8);
+            int start_track = ent[DIR_START_TRACK_OFF];
+            int start_sector = ent[DIR_START_SECTOR_OFF];
+            int blocks = ent[DIR_FILESIZE_LO_OFF] + (ent[DIR_FILESIZE_HI_OFF] << 8);
 
             int name_all_pad_or_zero = 1;
 
             for (int k = 0; k < DIR_FILENAME_LEN; ++k) {
-                uint8_t c = sec[off + DIR_FILENAME_OFF + k];
+                uint8_t c = ent[DIR_FILENAME_OFF + k];
 
                 if (c != PETSCII_PAD && c != 0x00) {
                     name_all_pad_or_zero = 0;
@@ -625,233 +587,2115 @@ static int list_directory(const uint8_t *bam, int show_sizes)
                 continue;
             }
 
-            const char *type_base = "???";
+            disk_dirent e = {
+                ent, &ent[DIR_FILENAME_OFF], file_type, start_track, start_sector,
+                blocks, track, sector, i
+            };
 
-            switch (file_type & FILETYPE_MASK) {
-                case FILETYPE_DEL:
-                    type_base = "del";
-                    break;
+            if (fn(&e, ctx) != 0) {
+                return 0;
+            }
+        }
 
-                case FILETYPE_SEQ:
-                    type_base = "seq";
-                    break;
+        track = next_track;
+        sector = next_sector;
+    }
 
-                case FILETYPE_PRG:
-                    type_base = "prg";
-                    break;
+    return 0;
+}
 
-                case FILETYPE_USR:
-                    type_base = "usr";
-                    break;
+long disk_read_chain(int track, int sector, uint8_t *out)
+{
+    const uint8_t *sec = NULL;
+    long total = 0;
+    int max_sectors = image_sectors();
 
-                case FILETYPE_REL:
-                    type_base = "rel";
-                    break;
+    for (int steps = 0; track != END_OF_CHAIN_TRACK && steps < max_sectors; ++steps) {
+        if (read_sector(track, sector, &sec) != 0) {
+            break;
+        }
 
-                default:
-                    type_base = "???";
-                    break;
-            }
+        int nt = sec[SECTOR_LINK_TRACK_OFF];
+        int ns = sec[SECTOR_LINK_SECTOR_OFF];
+        int len = FILE_DATA_BYTES_PER_SECTOR;
 
-            char type_marked[8];
-            int ti = 0;
+        // The last sector's link holds the index of its final data byte
+        if (nt == END_OF_CHAIN_TRACK) {
+            len = ns >= 2 ? ns - 1 : 0;
+        }
 
-            if (file_type & FILE_FLAG_LOCKED) {
-                type_marked[ti++] = '>';
-            }
+        STATS_ADD(chain_steps, 1);
+        memcpy(out + total, sec + 2, (size_t)len);
+        total += len;
+        track = nt;
+        sector = ns;
+    }
 
-            size_t tlen = strlen(type_base);
-            memcpy(&type_marked[ti], type_base, tlen);
-            ti += (int)tlen;
+    return total;
+}
 
-            if ((file_type & FILE_FLAG_CLOSED) == 0) {
-                type_marked[ti++] = '*';
-            }
+int disk_chain(int track, int sector, uint8_t *ts)
+{
+    const uint8_t *sec = NULL;
+    int count = 0;
+    int max_sectors = image_sectors();
+
+    while (track != END_OF_CHAIN_TRACK && count < max_sectors &&
+            read_sector(track, sector, &sec) == 0) {
+        ts[2 * count] = (uint8_t)track;
+        ts[2 * count + 1] = (uint8_t)sector;
+        count++;
+        track = sec[SECTOR_LINK_TRACK_OFF];
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+    }
 
-            type_marked[ti] = '\0';
+    return count;
+}
 
-            // For art/graphics lines (commonly have 0 blocks), keep full 16 chars
-            // and preserve trailing spaces inside the quotes.
-            if (blocks == 0) {
-                // Art rows: choose case based on original PETSCII bytes to
-                // emulate C64 upper/graphics set appearance:
-                // - raw 'a'..'z' -> display as uppercase
-                // - raw 'A'..'Z' -> display as lowercase
-                // - other raw codes -> keep mapped glyphs (often uppercase placeholders)
-                for (int li = 0; li < DIR_FILENAME_LEN; ++li) {
-                    uint8_t raw = sec[off + DIR_FILENAME_OFF + li];
-                    unsigned char mapped = (unsigned char)name[li];
+int disk_sector_error(int track, int sector)
+{
+    long off = ts_offset(track, sector);
 
-                    if (raw >= 'a' && raw <= 'z') {
-                        if (mapped >= 'a' && mapped <= 'z') {
-                            name[li] = (char)(mapped - 'a' + 'A');
-                        }
-                    } else if (raw >= 'A' && raw <= 'Z') {
-                        if (mapped >= 'A' && mapped <= 'Z') {
-                            name[li] = (char)(mapped - 'A' + 'a');
-                        }
-                    }
-                }
+    if (off < 0 || (size_t)off >= g_data_bytes) {
+        return 0;
+    }
 
-                printf("%-5d\"%.*s\" ", blocks, DIR_FILENAME_LEN, name);
-            } else {
-                // Trim trailing spaces inside the quotes for regular entries
-                int name_len = DIR_FILENAME_LEN;
+    long i = off / SECTOR_SIZE;
 
-                while (name_len > 0 && name[name_len - 1] == ' ') {
-                    name_len--;
-                }
+    return g_bad[i / 64] & (1ull << (i % 64)) ? dos_error(g_errors[i]) : 0;
+}
 
-                // Lowercase ASCII letters for regular filenames for stylistic consistency
-                for (int li = 0; li < name_len; ++li) {
-                    if (name[li] >= 'A' && name[li] <= 'Z') {
-                        name[li] = (char)(name[li] - 'A' + 'a');
-                    }
-                }
+long disk_bad_reads(int *track, int *sector)
+{
+    if (track) {
+        *track = g_bad_track;
+    }
 
-                // Print blocks, then quoted trimmed name
-                printf("%-5d\"%.*s\"", blocks, name_len, name);
+    if (sector) {
+        *sector = g_bad_sector;
+    }
 
-                // Pad spacing so file type aligns after the closing quote
-                // Target width (including quotes) for name column
-                const int name_field_width = 18; // 16 chars + 2 quotes
-                int printed_name_width = name_len + 2;
+    return g_bad_reads;
+}
 
-                int pad = name_field_width - printed_name_width;
-                if (pad < 1) {
-                    pad = 1;
-                }
+// Reads side sector k of a REL file through the table in side sector 0
+static const uint8_t *side_sector(const uint8_t *ent, int k)
+{
+    const uint8_t *first = NULL;
+    const uint8_t *sec = NULL;
 
-                printf("%*s", pad, "");
-            }
+    if (k < 0 || k >= SIDE_SECTORS_MAX ||
+            read_sector(ent[DIR_SIDE_TRACK_OFF], ent[DIR_SIDE_SECTOR_OFF], &first) != 0) {
+        return NULL;
+    }
+
+    if (k == 0) {
+        return first;
+    }
+
+    if (read_sector(first[SIDE_TABLE_OFF + 2 * k], first[SIDE_TABLE_OFF + 2 * k + 1], &sec) != 0) {
+        return NULL;
+    }
 
-            printf("%s", type_marked);
+    return sec;
+}
 
-            if (show_sizes) {
-                int start_track = sec[off + DIR_START_TRACK_OFF];
-                int start_sector = sec[off + DIR_START_SECTOR_OFF];
-                long bytes = compute_file_size_bytes(start_track, start_sector);
+int disk_rel_info(const disk_dirent *e, disk_rel *info)
+{
+    const uint8_t *ent = e->entry;
+    int record_length = ent[DIR_RECORD_LEN_OFF];
+    const uint8_t *first = side_sector(ent, 0);
 
-                printf("  %ld bytes", bytes);
+    memset(info, 0, sizeof(*info));
 
-                if ((file_type & FILETYPE_MASK) == FILETYPE_PRG && start_track > 0) {
-                    const uint8_t *first_sec = NULL;
+    if (!first || record_length == 0 || first[SIDE_NUMBER_OFF] != 0) {
+        return -1;
+    }
 
-                    if (read_sector(start_track, start_sector, &first_sec) == 0 && bytes >= PRG_LOAD_ADDR_LEN) {
-                        uint16_t load = (uint16_t)first_sec[PRG_LOAD_ADDR_LO_OFF] | ((uint16_t)first_sec[PRG_LOAD_ADDR_HI_OFF] << 8);
-                        long data_bytes = bytes - 2;
+    info->record_length = record_length;
+    info->valid = 1;
 
-                        if (data_bytes < 0) {
-                            data_bytes = 0;
-                        }
+    // Side sectors must form a chain that matches the table in side sector 0
+    int side_track = ent[DIR_SIDE_TRACK_OFF];
+    int side_sector_no = ent[DIR_SIDE_SECTOR_OFF];
+    int entries = 0;
+    const uint8_t *sides[SIDE_SECTORS_MAX];
 
-                        uint32_t end_addr_inclusive = (uint32_t)load + (uint32_t)(data_bytes ? (data_bytes - 1) : 0);
-                        printf("  $%04x-$%04x", load, (unsigned)end_addr_inclusive);
-                    }
-                }
-            }
+    for (int k = 0; k < SIDE_SECTORS_MAX && side_track != END_OF_CHAIN_TRACK; ++k) {
+        const uint8_t *sec = NULL;
 
-            printf("\n");
-            total_blocks += blocks;
+        if (read_sector(side_track, side_sector_no, &sec) != 0 ||
+                sec[SIDE_NUMBER_OFF] != k || sec[SIDE_RECORD_LEN_OFF] != record_length ||
+                first[SIDE_TABLE_OFF + 2 * k] != side_track ||
+                first[SIDE_TABLE_OFF + 2 * k + 1] != side_sector_no) {
+            info->valid = 0;
+            break;
         }
 
-        track = next_track;
-        sector = next_sector;
+        sides[info->side_sectors++] = sec;
+        side_track = sec[SECTOR_LINK_TRACK_OFF];
+        side_sector_no = sec[SECTOR_LINK_SECTOR_OFF];
+    }
+
+    // Every data block must appear in order in the side sector index
+    const uint8_t *sec = NULL;
+    int track = e->track;
+    int sector = e->sector;
+    int max_sectors = image_sectors();
+    long bytes = 0;
+
+    for (int steps = 0; track != END_OF_CHAIN_TRACK && steps < max_sectors; ++steps) {
+        int k = entries / SIDE_DATA_ENTRIES;
+        int slot = SIDE_DATA_OFF + 2 * (entries % SIDE_DATA_ENTRIES);
+
+        if (k >= info->side_sectors || sides[k][slot] != track || sides[k][slot + 1] != sector) {
+            info->valid = 0;
+        }
+
+        if (read_sector(track, sector, &sec) != 0) {
+            info->valid = 0;
+            break;
+        }
+
+        STATS_ADD(chain_steps, 1);
+        entries++;
+        track = sec[SECTOR_LINK_TRACK_OFF];
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+        bytes += track == END_OF_CHAIN_TRACK ? (sector >= 2 ? sector - 1 : 0) : FILE_DATA_BYTES_PER_SECTOR;
     }
 
-    return total_blocks;
+    // No entries may follow the last data block
+    int k = entries / SIDE_DATA_ENTRIES;
+    int slot = SIDE_DATA_OFF + 2 * (entries % SIDE_DATA_ENTRIES);
+    if (k < info->side_sectors && sides[k][slot] != END_OF_CHAIN_TRACK) {
+        info->valid = 0;
+    }
+
+    info->data_blocks = entries;
+    info->records = bytes / record_length;
+
+    return 0;
 }
 
-static int compute_free_blocks(const uint8_t *bam, int total_file_blocks)
+long disk_rel_record(const disk_dirent *e, long n, uint8_t *out)
 {
-    (void)total_file_blocks;
+    int record_length = e->entry[DIR_RECORD_LEN_OFF];
 
-    int free_blocks = 0;
+    // Past the last side sector there are no records, and checking first
+    // keeps the offset from overflowing
+    if (n < 0 || record_length == 0 ||
+            n > (long)SIDE_SECTORS_MAX * SIDE_DATA_ENTRIES * FILE_DATA_BYTES_PER_SECTOR / record_length) {
+        return -1;
+    }
 
-    for (int t = 1; t <= g_total_tracks; ++t) {
-        int free = 0;
-        uint8_t b1 = 0;
-        uint8_t b2 = 0;
-        uint8_t b3 = 0;
+    // The side sector index turns a record number into its data block
+    long offset = n * record_length;
+    long block = offset / FILE_DATA_BYTES_PER_SECTOR;
+    int pos = (int)(offset % FILE_DATA_BYTES_PER_SECTOR);
+    const uint8_t *side = side_sector(e->entry, (int)(block / SIDE_DATA_ENTRIES));
 
-        if (get_bam_entry(bam, t, &free, &b1, &b2, &b3)) {
-            // Use the per-track free count reported in BAM
-            free_blocks += free;
-        } else {
-            // Fallback: bit-count if BAM entry unavailable
-            int spt = sectors_per_track(t);
+    if (block / SIDE_DATA_ENTRIES >= SIDE_SECTORS_MAX || !side) {
+        return -1;
+    }
 
-            for (int s = 0; s < spt; ++s) {
-                uint8_t bb = (s < BITS_PER_BYTE) ? b1 : (s < 2 * BITS_PER_BYTE) ? b2 : b3;
+    int slot = SIDE_DATA_OFF + 2 * (int)(block % SIDE_DATA_ENTRIES);
+    int track = side[slot];
+    int sector = side[slot + 1];
+    int copied = 0;
 
-                if (bb & (1u << (s & (BITS_PER_BYTE - 1)))) {
-                    free_blocks++;
-                }
-            }
+    // A record can continue in the next data block
+    while (copied < record_length && track != END_OF_CHAIN_TRACK) {
+        const uint8_t *sec = NULL;
+
+        if (read_sector(track, sector, &sec) != 0) {
+            return -1;
         }
-    }
 
-    // c1541 "dir" output appears to exclude any free sectors on the
-    // directory track (track 18) from the free-blocks summary.
-    // Adjust to match that behavior.
-    if (DIRECTORY_TRACK >= 1 && DIRECTORY_TRACK <= g_total_tracks) {
-        int dir_free = 0;
-        uint8_t b1 = 0, b2 = 0, b3 = 0;
+        int nt = sec[SECTOR_LINK_TRACK_OFF];
+        int ns = sec[SECTOR_LINK_SECTOR_OFF];
+        int used = nt == END_OF_CHAIN_TRACK ? ns - 1 : FILE_DATA_BYTES_PER_SECTOR;
+        int len = used - pos;
 
-        if (get_bam_entry(bam, DIRECTORY_TRACK, &dir_free, &b1, &b2, &b3)) {
-            free_blocks -= dir_free;
+        if (len > record_length - copied) {
+            len = record_length - copied;
+        }
 
-            if (free_blocks < 0) {
-                free_blocks = 0;
-            }
+        if (len <= 0) {
+            break;
         }
+
+        memcpy(out + copied, sec + 2 + pos, (size_t)len);
+        copied += len;
+        pos = 0;
+        track = nt;
+        sector = ns;
     }
 
-    return free_blocks;
+    return copied == record_length ? copied : -1;
 }
 
-static void print_bam_summary(const uint8_t *bam)
+typedef struct
 {
-    printf("BAM:\n");
-    for (int t = 1; t <= g_total_tracks; ++t) {
-        int free = 0;
-        uint8_t b1 = 0, b2 = 0, b3 = 0;
+    FILE *out;
+    int show_sizes;
+    int total_blocks;
+} listing;
 
-        if (!get_bam_entry(bam, t, &free, &b1, &b2, &b3)) {
-            free = 0;
-            b1 = b2 = b3 = 0;
-        }
+static int list_entry(const disk_dirent *e, void *ctx)
+{
+    listing *l = ctx;
+    const uint8_t *ent = e->entry;
+    uint8_t file_type = ent[DIR_FILETYPE_OFF];
 
-        printf("T%02d free=%3d map=%02x %02x %02x\n", t, free, b1, b2, b3);
-    }
-}
+    char name[DIR_FILENAME_LEN + 1];
+    petscii_name16(petscii_dirname, &ent[DIR_FILENAME_OFF], name);
 
-void disk(const uint8_t *buffer, const int size, const int baminfo)
-{
-    if (!buffer || size <= 0) {
-        fprintf(stderr, "Not a valid D64 disk image\n");
-        return;
-    }
+    int blocks = e->blocks;
 
-    g_image = buffer;
-    g_image_size = (size_t)size;
+    const char *type_base = "???";
 
-    detect_image_layout();
+    switch (file_type & FILETYPE_MASK) {
+        case FILETYPE_DEL:
+            type_base = "del";
+            break;
 
-    const uint8_t *bam = NULL;
-    if (!read_bam(&bam)) {
-        fprintf(stderr, "Failed to read BAM sector.\n");
-        return;
+        case FILETYPE_SEQ:
+            type_base = "seq";
+            break;
+
+        case FILETYPE_PRG:
+            type_base = "prg";
+            break;
+
+        case FILETYPE_USR:
+            type_base = "usr";
+            break;
+
+        case FILETYPE_REL:
+            type_base = "rel";
+            break;
+
+        default:
+            type_base = "???";
+            break;
     }
 
-    print_header_from_bam(bam);
+    char type_marked[8];
+    int ti = 0;
 
-    int total_blocks = list_directory(bam, 1);
-    int free_blocks = compute_free_blocks(bam, total_blocks);
+    if (file_type & FILE_FLAG_LOCKED) {
+        type_marked[ti++] = '>';
+    }
 
-    printf("%d blocks free.\n", free_blocks);
+    size_t tlen = strlen(type_base);
+    memcpy(&type_marked[ti], type_base, tlen);
+    ti += (int)tlen;
 
-    if (baminfo) {
-        print_bam_summary(bam);
+    if ((file_type & FILE_FLAG_CLOSED) == 0) {
+        type_marked[ti++] = '*';
     }
+
+    type_marked[ti] = '\0';
+
+    if (petscii_get_charset() != PETSCII_ASCII) {
+        // Charset output shows names as the C64 would, art rows included
+        const uint8_t *raw = &ent[DIR_FILENAME_OFF];
+        int name_len = blocks == 0 ? DIR_FILENAME_LEN : petscii_trimmed_len(raw, DIR_FILENAME_LEN);
+
+        fprintf(l->out, "%-5d\"", blocks);
+        petscii_write(l->out, petscii_dirname, raw, (size_t)name_len);
+        fprintf(l->out, "\"%*s", name_len < DIR_FILENAME_LEN ? DIR_FILENAME_LEN - name_len : 1, "");
+    } else if (blocks == 0) {
+        // For art/graphics lines (commonly have 0 blocks), keep full 16 chars
+        // and preserve trailing spaces inside the quotes.
+        // Art rows: choose case based on original PETSCII bytes to
+        // emulate C64 upper/graphics set appearance:
+        // - raw 'a'..'z' -> display as uppercase
+        // - raw 'A'..'Z' -> display as lowercase
+        // - other raw codes -> keep mapped glyphs (often uppercase placeholders)
+        for (int li = 0; li < DIR_FILENAME_LEN; ++li) {
+            uint8_t raw = ent[DIR_FILENAME_OFF + li];
+            unsigned char mapped = (unsigned char)name[li];
+
+            if (raw >= 'a' && raw <= 'z') {
+                if (mapped >= 'a' && mapped <= 'z') {
+                    name[li] = (char)(mapped - 'a' + 'A');
+                }
+            } else if (raw >= 'A' && raw <= 'Z') {
+                if (mapped >= 'A' && mapped <= 'Z') {
+                    name[li] = (char)(mapped - 'A' + 'a');
+                }
+            }
+        }
+
+        fprintf(l->out, "%-5d\"%.*s\" ", blocks, DIR_FILENAME_LEN, name);
+    } else {
+        // Trim trailing spaces inside the quotes for regular entries
+        int name_len = DIR_FILENAME_LEN;
+
+        while (name_len > 0 && name[name_len - 1] == ' ') {
+            name_len--;
+        }
+
+        // Lowercase ASCII letters for regular filenames for stylistic consistency
+        for (int li = 0; li < name_len; ++li) {
+            if (name[li] >= 'A' && name[li] <= 'Z') {
+                name[li] = (char)(name[li] - 'A' + 'a');
+            }
+        }
+
+        // Print blocks, then quoted trimmed name
+        fprintf(l->out, "%-5d\"%.*s\"", blocks, name_len, name);
+
+        // Pad spacing so file type aligns after the closing quote
+        // Target width (including quotes) for name column
+        const int name_field_width = 18; // 16 chars + 2 quotes
+        int printed_name_width = name_len + 2;
+
+        int pad = name_field_width - printed_name_width;
+        if (pad < 1) {
+            pad = 1;
+        }
+
+        fprintf(l->out, "%*s", pad, "");
+    }
+
+    fprintf(l->out, "%s", type_marked);
+
+    // The info block is one sector away; record chains are only walked
+    // below, when sizes are wanted
+    disk_geos geos;
+    int is_geos = disk_geos_info(e, &geos);
+
+    if (l->show_sizes) {
+        int start_track = e->track;
+        int start_sector = e->sector;
+        long bytes = is_geos && geos.vlir ? disk_geos_size(e) :
+            compute_file_size_bytes(start_track, start_sector);
+
+        // Records sharing sectors have no meaningful size
+        if (bytes < 0) {
+            bytes = 0;
+        }
+
+        fprintf(l->out, "  %ld bytes", bytes);
+
+        if ((file_type & FILETYPE_MASK) == FILETYPE_PRG && start_track > 0 && !is_geos) {
+            const uint8_t *first_sec = NULL;
+
+            if (read_sector(start_track, start_sector, &first_sec) == 0 && bytes >= PRG_LOAD_ADDR_LEN) {
+                uint16_t load = (uint16_t)first_sec[PRG_LOAD_ADDR_LO_OFF] | ((uint16_t)first_sec[PRG_LOAD_ADDR_HI_OFF] << 8);
+                long data_bytes = bytes - 2;
+
+                if (data_bytes < 0) {
+                    data_bytes = 0;
+                }
+
+                uint32_t end_addr_inclusive = (uint32_t)load + (uint32_t)(data_bytes ? (data_bytes - 1) : 0);
+                fprintf(l->out, "  $%04x-$%04x", load, (unsigned)end_addr_inclusive);
+            }
+        }
+    }
+
+    if (is_geos) {
+        fprintf(l->out, "  geos %s%s  %04d-%02d-%02d %02d:%02d", disk_geos_type(geos.type),
+            geos.vlir ? " vlir" : "", geos.year, geos.month, geos.day, geos.hour, geos.minute);
+    }
+
+    if (l->show_sizes && (file_type & FILETYPE_MASK) == FILETYPE_REL) {
+        disk_rel rel;
+
+        if (disk_rel_info(e, &rel) == 0) {
+            fprintf(l->out, "  %d byte records  %ld records", rel.record_length, rel.records);
+
+            if (!rel.valid) {
+                fprintf(l->out, "  side sectors don't match data");
+            }
+        } else {
+            fprintf(l->out, "  bad side sectors");
+        }
+    }
+
+    fprintf(l->out, "\n");
+    l->total_blocks += blocks;
+
+    return 0;
+}
+
+static int list_directory(FILE *out, const uint8_t *bam, int show_sizes)
+{
+    (void)bam;
+    listing l = {out, show_sizes, 0};
+
+    walk_directory(list_entry, &l);
+
+    return l.total_blocks;
+}
+
+static int compute_free_blocks(const uint8_t *bam, int total_file_blocks)
+{
+    (void)total_file_blocks;
+
+    int free_blocks = 0;
+
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        int free = 0;
+        uint8_t b1 = 0;
+        uint8_t b2 = 0;
+        uint8_t b3 = 0;
+
+        if (get_bam_entry(bam, t, &free, &b1, &b2, &b3)) {
+            // Use the per-track free count reported in BAM
+            free_blocks += free;
+        } else {
+            // Fallback: bit-count if BAM entry unavailable
+            int spt = sectors_per_track(t);
+
+            for (int s = 0; s < spt; ++s) {
+                uint8_t bb = (s < BITS_PER_BYTE) ? b1 : (s < 2 * BITS_PER_BYTE) ? b2 : b3;
+
+                if (bb & (1u << (s & (BITS_PER_BYTE - 1)))) {
+                    free_blocks++;
+                }
+            }
+        }
+    }
+
+    // c1541 "dir" output appears to exclude any free sectors on the
+    // directory track (track 18) from the free-blocks summary.
+    // Adjust to match that behavior.
+    if (DIRECTORY_TRACK >= 1 && DIRECTORY_TRACK <= g_total_tracks) {
+        int dir_free = 0;
+        uint8_t b1 = 0, b2 = 0, b3 = 0;
+
+        if (get_bam_entry(bam, DIRECTORY_TRACK, &dir_free, &b1, &b2, &b3)) {
+            free_blocks -= dir_free;
+
+            if (free_blocks < 0) {
+                free_blocks = 0;
+            }
+        }
+    }
+
+    return free_blocks;
+}
+
+static void print_bam_summary(FILE *out, const uint8_t *bam)
+{
+    fprintf(out, "BAM:\n");
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        int free = 0;
+        uint8_t b1 = 0, b2 = 0, b3 = 0;
+
+        if (!get_bam_entry(bam, t, &free, &b1, &b2, &b3)) {
+            free = 0;
+            b1 = b2 = b3 = 0;
+        }
+
+        fprintf(out, "T%02d free=%3d map=%02x %02x %02x\n", t, free, b1, b2, b3);
+    }
+}
+
+// One line per track with errors, a code digit per sector and '.' for
+// good ones, then what the codes mean
+static void print_error_map(FILE *out)
+{
+    int counts[sizeof(error_codes) / sizeof(error_codes[0])] = {0};
+    int shown = 0;
+
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        char line[32];
+        int spt = sectors_per_track(t);
+        int any = 0;
+
+        for (int sec = 0; sec < spt; ++sec) {
+            int dos = disk_sector_error(t, sec);
+            uint8_t code = 0;
+
+            for (size_t k = 0; dos && k < sizeof(error_codes) / sizeof(error_codes[0]); ++k) {
+                if (error_codes[k].dos == dos) {
+                    code = error_codes[k].code;
+                    counts[k]++;
+                }
+            }
+
+            line[sec] = code ? "0123456789abcdef"[code] : '.';
+            any |= code != 0;
+        }
+
+        line[spt] = '\0';
+
+        if (any && shown++ == 0) {
+            fprintf(out, "Errors:\n");
+        }
+
+        if (any) {
+            fprintf(out, "T%02d %s\n", t, line);
+        }
+    }
+
+    for (size_t k = 0; k < sizeof(error_codes) / sizeof(error_codes[0]); ++k) {
+        if (counts[k]) {
+            fprintf(out, "%x = %d %s: %d sector%s\n", error_codes[k].code, error_codes[k].dos,
+                error_codes[k].text, counts[k], counts[k] == 1 ? "" : "s");
+        }
+    }
+}
+
+// Decodes the error table following the data area into the bad sector
+// bitmap read_sector() tests
+static void load_errors(void)
+{
+    size_t sectors = g_data_bytes / SECTOR_SIZE;
+
+    memset(g_bad, 0, sizeof(g_bad));
+    g_errors = NULL;
+    g_bad_reads = 0;
+
+    if (g_image_size <= g_data_bytes) {
+        return;
+    }
+
+    if (sectors > g_image_size - g_data_bytes) {
+        sectors = g_image_size - g_data_bytes;
+    }
+
+    if (sectors > DISK_MAX_SECTORS) {
+        sectors = DISK_MAX_SECTORS;
+    }
+
+    g_errors = &g_image[g_data_bytes];
+
+    for (size_t i = 0; i < sectors; ++i) {
+        if (dos_error(g_errors[i])) {
+            g_bad[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
+
+static int open_image(const uint8_t *buffer, size_t size)
+{
+    if (!buffer || size == 0) {
+        diagnostic("Not a valid D64 disk image\n");
+        return -1;
+    }
+
+    g_image = buffer;
+    g_image_size = size;
+
+    if (g64_detect(buffer, size)) {
+        long decoded = g64_decode(buffer, size, g_decoded);
+        if (decoded < 0) {
+            return -1;
+        }
+
+        g_image = g_decoded;
+        g_image_size = (size_t)decoded;
+    }
+
+    detect_image_layout();
+    load_errors();
+
+    return 0;
+}
+
+int disk_directory(const uint8_t *buffer, size_t size, disk_dirent_fn fn, void *ctx)
+{
+    if (open_image(buffer, size) != 0) {
+        return -1;
+    }
+
+    return walk_directory(fn, ctx);
+}
+
+void disk(FILE *out, const uint8_t *buffer, const size_t size, const int baminfo, const int sizes)
+{
+    if (open_image(buffer, size > 0 ? (size_t)size : 0) != 0) {
+        return;
+    }
+
+    const uint8_t *bam = NULL;
+    if (!read_bam(&bam)) {
+        diagnostic("Failed to read BAM sector.\n");
+        return;
+    }
+
+    STATS_PHASE(STATS_RENDER);
+
+    print_header_from_bam(out, bam);
+
+    int total_blocks = list_directory(out, bam, sizes);
+    int free_blocks = compute_free_blocks(bam, total_blocks);
+
+    fprintf(out, "%d blocks free.\n", free_blocks);
+
+    if (baminfo) {
+        print_bam_summary(out, bam);
+        print_error_map(out);
+    }
+}
+
+static const char *geos_types[] = {
+    "non-geos", "basic", "assembler", "data", "system", "desk accessory",
+    "application", "application data", "font", "printer driver",
+    "input driver", "disk driver", "boot", "temporary", "auto-exec",
+    "input 128"
+};
+
+int disk_geos_info(const disk_dirent *e, disk_geos *info)
+{
+    const uint8_t *ent = e->entry;
+    const uint8_t *block = NULL;
+
+    memset(info, 0, sizeof(*info));
+
+    if ((e->type & FILETYPE_MASK) == FILETYPE_REL || ent[DIR_GEOS_TYPE_OFF] == 0 ||
+            ent[DIR_GEOS_STRUCTURE_OFF] > GEOS_STRUCTURE_VLIR) {
+        return 0;
+    }
+
+    // Only trust the fields when they lead to a real info block
+    if (read_sector(ent[DIR_INFO_TRACK_OFF], ent[DIR_INFO_SECTOR_OFF], &block) != 0 ||
+            block[2] != GEOS_ICON_WIDTH || block[3] != GEOS_ICON_HEIGHT ||
+            block[4] != GEOS_ICON_FORMAT) {
+        return 0;
+    }
+
+    const uint8_t *date = &ent[DIR_GEOS_DATE_OFF];
+
+    info->info_track = ent[DIR_INFO_TRACK_OFF];
+    info->info_sector = ent[DIR_INFO_SECTOR_OFF];
+    info->info = block;
+    info->vlir = ent[DIR_GEOS_STRUCTURE_OFF] == GEOS_STRUCTURE_VLIR;
+    info->type = ent[DIR_GEOS_TYPE_OFF];
+    // Two digit years, GEOS appeared in 1986
+    info->year = date[0] + (date[0] < 86 ? 2000 : 1900);
+    info->month = date[1];
+    info->day = date[2];
+    info->hour = date[3];
+    info->minute = date[4];
+
+    return 1;
+}
+
+const char *disk_geos_type(int type)
+{
+    int count = sizeof(geos_types) / sizeof(geos_types[0]);
+
+    return type >= 0 && type < count ? geos_types[type] : "unknown";
+}
+
+// Sectors and data bytes of a VLIR record chain, whose sectors are
+// marked in seen. Returns -1 if the chain reaches a sector already seen:
+// records sharing a chain would count, and copy, the same sectors again.
+static long record_extent(int track, int sector, uint64_t *seen, int *blocks)
+{
+    const uint8_t *sec = NULL;
+    long bytes = 0;
+
+    *blocks = 0;
+
+    while (track != END_OF_CHAIN_TRACK) {
+        long off = sector_offset(D64_TRACKS_42, track, sector);
+
+        if (off < 0 || read_sector(track, sector, &sec) != 0) {
+            break;
+        }
+
+        long i = off / SECTOR_SIZE;
+        if (seen[i / 64] & (1ULL << (i % 64))) {
+            return -1;
+        }
+        seen[i / 64] |= 1ULL << (i % 64);
+
+        STATS_ADD(chain_steps, 1);
+        (*blocks)++;
+        track = sec[SECTOR_LINK_TRACK_OFF];
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+        bytes += track == END_OF_CHAIN_TRACK ? (sector >= 2 ? sector - 1 : 0) : FILE_DATA_BYTES_PER_SECTOR;
+    }
+
+    return bytes;
+}
+
+// Marks the index sector of a VLIR file as seen
+static void seen_index(const disk_dirent *e, uint64_t *seen)
+{
+    long off = sector_offset(D64_TRACKS_42, e->track, e->sector);
+
+    if (off >= 0) {
+        seen[off / SECTOR_SIZE / 64] |= 1ULL << (off / SECTOR_SIZE % 64);
+    }
+}
+
+long disk_geos_size(const disk_dirent *e)
+{
+    uint64_t seen[(DISK_MAX_SECTORS + 63) / 64] = {0};
+    const uint8_t *index = NULL;
+    long total = 0;
+    int blocks = 0;
+
+    if (read_sector(e->track, e->sector, &index) != 0) {
+        return 0;
+    }
+
+    seen_index(e, seen);
+
+    // The start sector of a VLIR file is an index of record chains
+    for (int r = 0; r < GEOS_VLIR_RECORDS; ++r) {
+        int track = index[2 + 2 * r];
+        int sector = index[3 + 2 * r];
+
+        if (track == END_OF_CHAIN_TRACK) {
+            if (sector == GEOS_VLIR_EMPTY) {
+                continue;
+            }
+            break;
+        }
+
+        long bytes = record_extent(track, sector, seen, &blocks);
+        if (bytes < 0) {
+            return -1;
+        }
+
+        total += bytes;
+    }
+
+    return total;
+}
+
+long disk_geos_cvt(const disk_dirent *e, uint8_t *out)
+{
+    disk_geos info;
+    const uint8_t *sec = NULL;
+    long len = 0;
+
+    if (!disk_geos_info(e, &info)) {
+        return DISK_GEOS_UNREADABLE;
+    }
+
+    // Header block: directory entry and format signature
+    memset(out, 0, 2 * FILE_DATA_BYTES_PER_SECTOR);
+    memcpy(out, &e->entry[DIR_FILETYPE_OFF], CVT_DIR_ENTRY_LEN);
+    snprintf((char *)&out[CVT_SIGNATURE_OFF], FILE_DATA_BYTES_PER_SECTOR - CVT_SIGNATURE_OFF,
+        "%s formatted GEOS file V1.0", (e->type & FILETYPE_MASK) == FILETYPE_SEQ ? "SEQ" : "PRG");
+    len += FILE_DATA_BYTES_PER_SECTOR;
+
+    memcpy(&out[len], info.info + 2, FILE_DATA_BYTES_PER_SECTOR);
+    len += FILE_DATA_BYTES_PER_SECTOR;
+
+    if (!info.vlir) {
+        return len + disk_read_chain(e->track, e->sector, &out[len]);
+    }
+
+    // VLIR: the record index with block counts instead of T/S links,
+    // then every record padded to whole blocks
+    if (read_sector(e->track, e->sector, &sec) != 0) {
+        return DISK_GEOS_UNREADABLE;
+    }
+
+    uint64_t seen[(DISK_MAX_SECTORS + 63) / 64] = {0};
+    uint8_t *index = &out[len];
+    memcpy(index, sec + 2, FILE_DATA_BYTES_PER_SECTOR);
+    len += FILE_DATA_BYTES_PER_SECTOR;
+    seen_index(e, seen);
+
+    for (int r = 0; r < GEOS_VLIR_RECORDS; ++r) {
+        int track = sec[2 + 2 * r];
+        int sector = sec[3 + 2 * r];
+        int blocks = 0;
+
+        if (track == END_OF_CHAIN_TRACK) {
+            if (sector == GEOS_VLIR_EMPTY) {
+                continue;
+            }
+            break;
+        }
+
+        // Every sector is copied once at most, but a record must never
+        // be written past the buffer however the image is broken
+        long bytes = record_extent(track, sector, seen, &blocks);
+        if (bytes < 0 || len + (long)blocks * FILE_DATA_BYTES_PER_SECTOR > DISK_MAX_CVT_SIZE) {
+            return DISK_GEOS_SHARED;
+        }
+
+        disk_read_chain(track, sector, &out[len]);
+
+        if (blocks == 0) {
+            index[2 * r] = END_OF_CHAIN_TRACK;
+            index[2 * r + 1] = GEOS_VLIR_EMPTY;
+            continue;
+        }
+
+        long padded = (long)blocks * FILE_DATA_BYTES_PER_SECTOR;
+        memset(&out[len + bytes], 0, (size_t)(padded - bytes));
+        len += padded;
+
+        index[2 * r] = (uint8_t)blocks;
+        index[2 * r + 1] = (uint8_t)(bytes - (long)(blocks - 1) * FILE_DATA_BYTES_PER_SECTOR + 1);
+    }
+
+    return len;
+}
+
+typedef struct
+{
+    FILE *out;
+    long n;
+} record_dump;
+
+static int dump_record(const disk_dirent *e, void *ctx)
+{
+    record_dump *d = ctx;
+    uint8_t record[SECTOR_SIZE];
+    char name[DIR_FILENAME_LEN + 1];
+
+    if ((e->type & FILETYPE_MASK) != FILETYPE_REL) {
+        return 0;
+    }
+
+    petscii_name(e->name, DIR_FILENAME_LEN, name);
+    fprintf(d->out, "\"%s\" record %ld:\n", name, d->n + 1);
+
+    long len = disk_rel_record(e, d->n, record);
+    if (len < 0) {
+        fprintf(d->out, "no such record\n");
+        return 0;
+    }
+
+    for (long i = 0; i < len; i += 16) {
+        int line = len - i < 16 ? (int)(len - i) : 16;
+        char text[16];
+
+        fprintf(d->out, "%04lx ", i);
+        for (int j = 0; j < 16; ++j) {
+            if (j < line) {
+                fprintf(d->out, " %02x", record[i + j]);
+            } else {
+                fprintf(d->out, "   ");
+            }
+        }
+
+        petscii_map(petscii_text, &record[i], (size_t)line, text);
+        fprintf(d->out, "  %.*s\n", line, text);
+    }
+
+    return 0;
+}
+
+void disk_records(FILE *out, const uint8_t *buffer, size_t size, long n)
+{
+    record_dump d = {out, n};
+
+    disk_directory(buffer, size, dump_record, &d);
+}
+
+// Recovery scan
+#define CHAIN_END                    -1
+#define CHAIN_BROKEN                 -2
+#define CHAIN_UNKNOWN                0
+#define CHAIN_VISITING               1
+#define CHAIN_DONE                   2
+#define MIN_PRG_LOAD_ADDR            0x0200
+#define C64_ADDRESS_SPACE            0x10000L
+
+typedef struct
+{
+    int first[D64_TRACKS_42 + 2];           // index of each track's sector 0
+    int count;
+    int16_t next[DISK_MAX_SECTORS];         // successor, CHAIN_END or CHAIN_BROKEN
+    uint8_t preds[DISK_MAX_SECTORS];        // predecessor count, saturating
+    uint8_t state[DISK_MAX_SECTORS];
+    int16_t length[DISK_MAX_SECTORS];       // sectors from here to the end, -1 if broken
+    int32_t bytes[DISK_MAX_SECTORS];        // data bytes from here to the end
+    int16_t path[DISK_MAX_SECTORS];
+    const uint8_t *names[DISK_MAX_SECTORS]; // scratched entries by first sector
+} sector_graph;
+
+static int sector_index(const sector_graph *g, int track, int sector)
+{
+    if (track < 1 || track > g_total_tracks || sector < 0 || sector >= sectors_per_track(track)) {
+        return -1;
+    }
+
+    return g->first[track] + sector;
+}
+
+// Marks a chain as used so recovered chains can't run into it
+static void mark_live(sector_graph *g, int i)
+{
+    for (int steps = 0; i >= 0 && steps < g->count; ++steps) {
+        if (g->state[i] == CHAIN_DONE) {
+            break;
+        }
+
+        g->state[i] = CHAIN_DONE;
+        g->length[i] = -1;
+        i = g->next[i];
+    }
+}
+
+// Calls fn for the start of every chain a live entry owns: the GEOS
+// info block and VLIR record chains, REL side sectors and the data
+static void entry_chains(const disk_dirent *e, void (*fn)(int track, int sector, void *ctx),
+        void *ctx)
+{
+    disk_geos geos;
+
+    if (disk_geos_info(e, &geos)) {
+        const uint8_t *index = NULL;
+
+        fn(geos.info_track, geos.info_sector, ctx);
+
+        // VLIR files are an index sector of record chains
+        if (geos.vlir && read_sector(e->track, e->sector, &index) == 0) {
+            for (int r = 0; r < GEOS_VLIR_RECORDS; ++r) {
+                int track = index[2 + 2 * r];
+
+                if (track != END_OF_CHAIN_TRACK) {
+                    fn(track, index[3 + 2 * r], ctx);
+                }
+            }
+        }
+    } else if ((e->type & FILETYPE_MASK) == FILETYPE_REL) {
+        fn(e->entry[DIR_SIDE_TRACK_OFF], e->entry[DIR_SIDE_SECTOR_OFF], ctx);
+    }
+
+    fn(e->track, e->sector, ctx);
+}
+
+static void live_chain(int track, int sector, void *ctx)
+{
+    sector_graph *g = ctx;
+
+    mark_live(g, sector_index(g, track, sector));
+}
+
+static int mark_entry(const disk_dirent *e, void *ctx)
+{
+    sector_graph *g = ctx;
+
+    if (e->type == FILETYPE_DEL) {
+        int i = sector_index(g, e->track, e->sector);
+
+        // Scratching only clears the type byte, the name survives
+        if (i >= 0) {
+            g->names[i] = e->name;
+        }
+    } else {
+        entry_chains(e, live_chain, g);
+    }
+
+    return 0;
+}
+
+// Chain length from sector i, memoized along the walked path so the
+// whole scan stays linear in the number of sectors
+static void resolve_chain(sector_graph *g, int i)
+{
+    int n = 0;
+    int len = -1;
+    long bytes = 0;
+
+    for (;;) {
+        if (g->state[i] == CHAIN_DONE) {
+            len = g->length[i];
+            bytes = g->bytes[i];
+            break;
+        }
+
+        // Back on the current path: a cycle never ends
+        if (g->state[i] == CHAIN_VISITING) {
+            break;
+        }
+
+        g->state[i] = CHAIN_VISITING;
+        g->path[n++] = (int16_t)i;
+
+        if (g->next[i] == CHAIN_BROKEN) {
+            break;
+        }
+
+        if (g->next[i] == CHAIN_END) {
+            const uint8_t *sec = g_image + (long)i * SECTOR_SIZE;
+            len = 0;
+            bytes = -(FILE_DATA_BYTES_PER_SECTOR - (sec[SECTOR_LINK_SECTOR_OFF] - 1));
+            break;
+        }
+
+        i = g->next[i];
+    }
+
+    while (n > 0) {
+        int k = g->path[--n];
+
+        if (len >= 0) {
+            len++;
+            bytes += FILE_DATA_BYTES_PER_SECTOR;
+        }
+
+        g->state[k] = CHAIN_DONE;
+        g->length[k] = (int16_t)len;
+        g->bytes[k] = (int32_t)bytes;
+    }
+}
+
+static int bam_allocated(const uint8_t *bam, int track, int sector)
+{
+    uint8_t map[3] = {0, 0, 0};
+
+    if (!bam || !get_bam_entry(bam, track, NULL, &map[0], &map[1], &map[2])) {
+        return 1;
+    }
+
+    return (map[sector / BITS_PER_BYTE] & (1u << (sector % BITS_PER_BYTE))) == 0;
+}
+
+int disk_recover(const uint8_t *buffer, size_t size, disk_recovered_fn fn, void *ctx)
+{
+    if (open_image(buffer, size) != 0) {
+        return -1;
+    }
+
+    sector_graph *g = calloc(1, sizeof(sector_graph));
+    if (!g) {
+        return -1;
+    }
+
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        g->first[t] = g->count;
+        g->count += sectors_per_track(t);
+    }
+
+    // One pass over all sectors builds the link graph
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        for (int s = 0; s < sectors_per_track(t); ++s) {
+            const uint8_t *sec = NULL;
+            int i = g->first[t] + s;
+
+            g->next[i] = CHAIN_BROKEN;
+            if (read_sector(t, s, &sec) != 0) {
+                continue;
+            }
+
+            int nt = sec[SECTOR_LINK_TRACK_OFF];
+            int ns = sec[SECTOR_LINK_SECTOR_OFF];
+
+            // The last sector holds the index of its final data byte
+            if (nt == END_OF_CHAIN_TRACK) {
+                if (ns >= 2) {
+                    g->next[i] = CHAIN_END;
+                }
+                continue;
+            }
+
+            int n = sector_index(g, nt, ns);
+            if (n >= 0) {
+                g->next[i] = (int16_t)n;
+                if (g->preds[n] < UINT8_MAX) {
+                    g->preds[n]++;
+                }
+            }
+        }
+    }
+
+    // BAM, directory and live files are never recovered
+    const uint8_t *bam = NULL;
+    if (!read_bam(&bam)) {
+        bam = NULL;
+    }
+
+    mark_live(g, sector_index(g, BAM_TRACK, BAM_SECTOR));
+    mark_live(g, sector_index(g, DIRECTORY_TRACK, DIR_FIRST_SECTOR));
+    walk_directory(mark_entry, g);
+
+    int stop = 0;
+    for (int t = 1; t <= g_total_tracks && !stop; ++t) {
+        for (int s = 0; s < sectors_per_track(t) && !stop; ++s) {
+            int i = g->first[t] + s;
+
+            if (g->preds[i] != 0) {
+                continue;
+            }
+
+            resolve_chain(g, i);
+            if (g->length[i] <= 0) {
+                continue;
+            }
+
+            const uint8_t *sec = g_image + (long)i * SECTOR_SIZE;
+            long load = sec[PRG_LOAD_ADDR_LO_OFF] | (sec[PRG_LOAD_ADDR_HI_OFF] << 8);
+
+            if (g->bytes[i] <= PRG_LOAD_ADDR_LEN || load < MIN_PRG_LOAD_ADDR ||
+                    load + g->bytes[i] - PRG_LOAD_ADDR_LEN > C64_ADDRESS_SPACE) {
+                load = -1;
+            }
+
+            disk_recovered r = {
+                t, s, g->length[i], g->bytes[i], load, g->names[i], bam_allocated(bam, t, s)
+            };
+
+            stop = fn(&r, ctx);
+        }
+    }
+
+    free(g);
+
+    return 0;
+}
+
+typedef struct
+{
+    FILE *out;
+    int count;
+} recovery_listing;
+
+static int list_recovered(const disk_recovered *r, void *ctx)
+{
+    recovery_listing *l = ctx;
+    char name[DIR_FILENAME_LEN + 1] = "";
+
+    if (r->name) {
+        petscii_name(r->name, DIR_FILENAME_LEN, name);
+    }
+
+    int name_len = (int)strlen(name);
+
+    fprintf(l->out, "%-5d\"%s\"%*s%s  %ld bytes", r->blocks, name,
+        name_len < DIR_FILENAME_LEN ? DIR_FILENAME_LEN - name_len : 1, "",
+        r->load >= 0 ? "prg" : "seq", r->size);
+
+    if (r->load >= 0) {
+        fprintf(l->out, "  $%04lx-$%04lx", r->load, r->load + r->size - PRG_LOAD_ADDR_LEN - 1);
+    }
+
+    fprintf(l->out, "  %d/%d %s%s\n", r->track, r->sector, r->name ? "scratched" : "orphan",
+        r->allocated ? "" : ", free");
+    l->count++;
+
+    return 0;
+}
+
+void disk_recover_list(FILE *out, const uint8_t *buffer, size_t size)
+{
+    recovery_listing l = {out, 0};
+
+    if (disk_recover(buffer, size, list_recovered, &l) != 0) {
+        return;
+    }
+
+    fprintf(out, "%d files recovered.\n", l.count);
+}
+
+struct disk_image
+{
+    uint8_t *data;
+    size_t size;
+    int tracks;
+};
+
+static uint8_t *image_sector(const disk_image *img, int track, int sector)
+{
+    long off = sector_offset(img->tracks, track, sector);
+
+    return off < 0 ? NULL : &img->data[off];
+}
+
+// Free count and bitmap of a track. Tracks 36-40 use the SpeedDOS
+// layout unless the image already has Dolphin DOS entries, the same
+// order get_bam_entry() reads them in.
+static uint8_t *bam_track(const disk_image *img, int track)
+{
+    uint8_t *bam = image_sector(img, BAM_TRACK, BAM_SECTOR);
+
+    if (track <= D64_TRACKS_35) {
+        return &bam[BAM_ENTRIES_BASE + (track - 1) * BAM_ENTRY_STRIDE];
+    }
+
+    uint8_t *dolphin = &bam[BAM_DOLPHIN_BASE + (track - 36) * BAM_ENTRY_STRIDE];
+    if (dolphin[0] || dolphin[1] || dolphin[2] || dolphin[3]) {
+        return dolphin;
+    }
+
+    return &bam[BAM_SPEED_BASE + (track - 36) * BAM_ENTRY_STRIDE];
+}
+
+static uint32_t track_bitmap(const disk_image *img, int track)
+{
+    const uint8_t *e = bam_track(img, track);
+    uint32_t map = e[BAM_ENTRY_BITMAP1_OFF] | e[BAM_ENTRY_BITMAP2_OFF] << 8 |
+        (uint32_t)e[BAM_ENTRY_BITMAP3_OFF] << 16;
+
+    return map & ((1u << sectors_per_track(track)) - 1);
+}
+
+static void allocate(disk_image *img, int track, int sector)
+{
+    uint8_t *e = bam_track(img, track);
+
+    e[BAM_ENTRY_BITMAP1_OFF + sector / BITS_PER_BYTE] &= (uint8_t)~(1 << (sector % BITS_PER_BYTE));
+    e[BAM_ENTRY_FREECOUNT_OFF]--;
+}
+
+// First free sector at or after sector, wrapping around the track
+static int free_sector(const disk_image *img, int track, int sector)
+{
+    uint32_t map = track_bitmap(img, track);
+    int spt = sectors_per_track(track);
+
+    for (int k = 0; map && k < spt; ++k) {
+        int s = (sector + k) % spt;
+
+        if (map >> s & 1) {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+// Moves away from the directory track, continuing on the other half of
+// the disk once an edge is reached
+static int next_track(const disk_image *img, int track)
+{
+    if (track < DIRECTORY_TRACK) {
+        return track > 1 ? track - 1 : DIRECTORY_TRACK + 1;
+    }
+
+    return track < img->tracks ? track + 1 : DIRECTORY_TRACK - 1;
+}
+
+// A file starts on the free track nearest the directory, below it first
+static int first_block(disk_image *img, int *track, int *sector)
+{
+    for (int d = 1; d < img->tracks; ++d) {
+        int candidates[2] = {DIRECTORY_TRACK - d, DIRECTORY_TRACK + d};
+
+        for (int k = 0; k < 2; ++k) {
+            int t = candidates[k];
+            int s = t >= 1 && t <= img->tracks ? free_sector(img, t, 0) : -1;
+
+            if (s >= 0) {
+                allocate(img, t, s);
+                *track = t;
+                *sector = s;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Further blocks follow at the file interleave on the same track
+static int next_block(disk_image *img, int *track, int *sector)
+{
+    int t = *track;
+    int s = *sector + FILE_INTERLEAVE;
+
+    for (int tries = 0; tries < 2 * img->tracks; ++tries) {
+        int spt = sectors_per_track(t);
+
+        // Wrapping past the end moves back one sector, as the 1541 does
+        if (s >= spt) {
+            s -= spt;
+            if (s > 0) {
+                s--;
+            }
+        }
+
+        int found = t == DIRECTORY_TRACK ? -1 : free_sector(img, t, s);
+        if (found >= 0) {
+            allocate(img, t, found);
+            *track = t;
+            *sector = found;
+            return 0;
+        }
+
+        t = next_track(img, t);
+        s = 0;
+    }
+
+    return -1;
+}
+
+static int dir_has(const disk_image *img, const uint8_t *name)
+{
+    int sector = DIR_FIRST_SECTOR;
+
+    for (int steps = 0; steps < sectors_per_track(DIRECTORY_TRACK); ++steps) {
+        const uint8_t *sec = image_sector(img, DIRECTORY_TRACK, sector);
+
+        for (int i = 0; sec && i < DIR_ENTRIES_PER_SECTOR; ++i) {
+            const uint8_t *ent = &sec[i * DIR_ENTRY_SIZE];
+
+            if (ent[DIR_FILETYPE_OFF] != FILETYPE_DEL &&
+                    memcmp(&ent[DIR_FILENAME_OFF], name, DIR_FILENAME_LEN) == 0) {
+                return 1;
+            }
+        }
+
+        if (!sec || sec[SECTOR_LINK_TRACK_OFF] != DIRECTORY_TRACK) {
+            break;
+        }
+
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+    }
+
+    return 0;
+}
+
+// A free (or scratched) directory slot; when every sector is full the
+// chain grows on the directory track at the directory interleave
+static uint8_t *dir_slot(disk_image *img)
+{
+    int sector = DIR_FIRST_SECTOR;
+    uint8_t *sec = NULL;
+
+    for (int steps = 0; steps < sectors_per_track(DIRECTORY_TRACK); ++steps) {
+        sec = image_sector(img, DIRECTORY_TRACK, sector);
+        if (!sec) {
+            return NULL;
+        }
+
+        for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; ++i) {
+            uint8_t *ent = &sec[i * DIR_ENTRY_SIZE];
+
+            if (ent[DIR_FILETYPE_OFF] == FILETYPE_DEL) {
+                return ent;
+            }
+        }
+
+        if (sec[SECTOR_LINK_TRACK_OFF] == END_OF_CHAIN_TRACK) {
+            break;
+        }
+
+        if (sec[SECTOR_LINK_TRACK_OFF] != DIRECTORY_TRACK) {
+            return NULL;
+        }
+
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+    }
+
+    int next = free_sector(img, DIRECTORY_TRACK,
+        (sector + DIR_INTERLEAVE) % sectors_per_track(DIRECTORY_TRACK));
+    if (!sec || next < 0) {
+        return NULL;
+    }
+
+    allocate(img, DIRECTORY_TRACK, next);
+    sec[SECTOR_LINK_TRACK_OFF] = DIRECTORY_TRACK;
+    sec[SECTOR_LINK_SECTOR_OFF] = (uint8_t)next;
+
+    uint8_t *fresh = image_sector(img, DIRECTORY_TRACK, next);
+    memset(fresh, 0, SECTOR_SIZE);
+    fresh[SECTOR_LINK_SECTOR_OFF] = DIR_LAST_SECTOR_LINK;
+
+    return fresh;
+}
+
+disk_image *disk_image_new(const char *name, const char *id, int tracks)
+{
+    if (tracks != D64_TRACKS_35 && tracks != D64_TRACKS_40) {
+        fprintf(stderr, "Disk images have 35 or 40 tracks\n");
+        return NULL;
+    }
+
+    disk_image *img = malloc(sizeof(disk_image));
+    if (!img) {
+        return NULL;
+    }
+
+    img->tracks = tracks;
+    img->size = tracks == D64_TRACKS_35 ? D64_IMAGE_SIZE_35 : D64_IMAGE_SIZE_40;
+    img->data = calloc(1, img->size);
+    if (!img->data) {
+        free(img);
+        return NULL;
+    }
+
+    uint8_t *bam = image_sector(img, BAM_TRACK, BAM_SECTOR);
+
+    for (int t = 1; t <= tracks; ++t) {
+        uint8_t *e = bam_track(img, t);
+        uint32_t map = (1u << sectors_per_track(t)) - 1;
+
+        e[BAM_ENTRY_FREECOUNT_OFF] = (uint8_t)sectors_per_track(t);
+        e[BAM_ENTRY_BITMAP1_OFF] = map & 0xFF;
+        e[BAM_ENTRY_BITMAP2_OFF] = map >> 8 & 0xFF;
+        e[BAM_ENTRY_BITMAP3_OFF] = map >> 16 & 0xFF;
+    }
+
+    bam[BAM_DIR_TRACK_OFF] = DIRECTORY_TRACK;
+    bam[BAM_DIR_SECTOR_OFF] = DIR_FIRST_SECTOR;
+    bam[BAM_DOS_VERSION_OFF] = DOS_VERSION;
+
+    memset(&bam[BAM_DISK_NAME_OFF], PETSCII_PAD, BAM_PAD_END - BAM_DISK_NAME_OFF);
+    petscii_encode_name(name, &bam[BAM_DISK_NAME_OFF], BAM_DISK_NAME_LEN);
+    petscii_encode_name(id, &bam[BAM_DISK_ID_OFF], DISK_ID_LEN);
+    memcpy(&bam[BAM_DOS_TYPE_OFF], DOS_TYPE, DOS_TYPE_LEN);
+
+    allocate(img, BAM_TRACK, BAM_SECTOR);
+    allocate(img, DIRECTORY_TRACK, DIR_FIRST_SECTOR);
+    image_sector(img, DIRECTORY_TRACK, DIR_FIRST_SECTOR)[SECTOR_LINK_SECTOR_OFF] =
+        DIR_LAST_SECTOR_LINK;
+
+    return img;
+}
+
+disk_image *disk_image_load(const uint8_t *buffer, size_t size)
+{
+    int tracks;
+
+    if (size == D64_IMAGE_SIZE_35 || size == D64_IMAGE_SIZE_35_ERR) {
+        tracks = D64_TRACKS_35;
+    } else if (size == D64_IMAGE_SIZE_40 || size == D64_IMAGE_SIZE_40_ERR) {
+        tracks = D64_TRACKS_40;
+    } else {
+        fprintf(stderr, "Only 35 and 40 track D64 images can be written\n");
+        return NULL;
+    }
+
+    disk_image *img = malloc(sizeof(disk_image));
+    if (!img) {
+        return NULL;
+    }
+
+    img->tracks = tracks;
+    img->size = size;
+    img->data = malloc(size);
+    if (!img->data) {
+        free(img);
+        return NULL;
+    }
+
+    memcpy(img->data, buffer, size);
+
+    return img;
+}
+
+void disk_image_free(disk_image *img)
+{
+    if (img) {
+        free(img->data);
+        free(img);
+    }
+}
+
+int disk_image_blocks_free(const disk_image *img)
+{
+    int blocks = 0;
+
+    for (int t = 1; t <= img->tracks; ++t) {
+        if (t != DIRECTORY_TRACK) {
+            blocks += __builtin_popcount(track_bitmap(img, t));
+        }
+    }
+
+    return blocks;
+}
+
+int disk_image_blocks(size_t len)
+{
+    return len ? (int)((len + FILE_DATA_BYTES_PER_SECTOR - 1) / FILE_DATA_BYTES_PER_SECTOR) : 1;
+}
+
+int disk_image_add(disk_image *img, const char *name, uint8_t type,
+        const uint8_t *data, size_t len)
+{
+    uint8_t pname[DIR_FILENAME_LEN];
+    int blocks = disk_image_blocks(len);
+    int track = 0;
+    int sector = 0;
+
+    petscii_encode_name(name, pname, DIR_FILENAME_LEN);
+
+    if (dir_has(img, pname)) {
+        fprintf(stderr, "File exists: %s\n", name);
+        return -1;
+    }
+
+    if (blocks > disk_image_blocks_free(img)) {
+        fprintf(stderr, "Disk full: %s\n", name);
+        return -1;
+    }
+
+    uint8_t *ent = dir_slot(img);
+    if (!ent) {
+        fprintf(stderr, "Directory full: %s\n", name);
+        return -1;
+    }
+
+    // Enough blocks are free, so allocation can't fail from here on
+    first_block(img, &track, &sector);
+
+    memset(&ent[DIR_FILETYPE_OFF], 0, DIR_ENTRY_SIZE - DIR_FILETYPE_OFF);
+    ent[DIR_FILETYPE_OFF] = type;
+    ent[DIR_START_TRACK_OFF] = (uint8_t)track;
+    ent[DIR_START_SECTOR_OFF] = (uint8_t)sector;
+    memcpy(&ent[DIR_FILENAME_OFF], pname, DIR_FILENAME_LEN);
+    ent[DIR_FILESIZE_LO_OFF] = blocks & 0xFF;
+    ent[DIR_FILESIZE_HI_OFF] = blocks >> 8;
+
+    for (int b = 0; b < blocks; ++b) {
+        uint8_t *sec = image_sector(img, track, sector);
+        size_t done = (size_t)b * FILE_DATA_BYTES_PER_SECTOR;
+        size_t n = len - done < FILE_DATA_BYTES_PER_SECTOR ? len - done : FILE_DATA_BYTES_PER_SECTOR;
+
+        memset(sec, 0, SECTOR_SIZE);
+        if (n > 0) {
+            memcpy(&sec[SECTOR_SIZE - FILE_DATA_BYTES_PER_SECTOR], &data[done], n);
+        }
+
+        // The last sector links to track 0 and the offset of its last byte
+        if (b == blocks - 1) {
+            sec[SECTOR_LINK_TRACK_OFF] = END_OF_CHAIN_TRACK;
+            sec[SECTOR_LINK_SECTOR_OFF] = (uint8_t)(n + 1);
+        } else {
+            next_block(img, &track, &sector);
+            sec[SECTOR_LINK_TRACK_OFF] = (uint8_t)track;
+            sec[SECTOR_LINK_SECTOR_OFF] = (uint8_t)sector;
+        }
+    }
+
+    return 0;
+}
+
+int disk_image_write(const disk_image *img, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        perror("Error");
+        return -1;
+    }
+
+    ssize_t written = write(fd, img->data, img->size);
+    if (written != (ssize_t)img->size) {
+        perror("Error");
+        close(fd);
+        return -1;
+    }
+
+    return close(fd);
+}
+
+// Sector owners for --diff, besides indexes into the file names
+#define OWNER_FREE                   -1
+#define OWNER_BAM                    -2
+#define OWNER_DIRECTORY              -3
+#define ERROR_NONE                   0x01
+
+typedef struct
+{
+    const char *path;
+    uint8_t *image;             // own copy, G64 images share one decode buffer
+    int tracks;
+    size_t data_bytes;
+    const uint8_t *errors;      // error bytes, NULL without
+    int16_t owner[DISK_MAX_SECTORS];
+    char (*names)[DISK_NAME_LEN + 1];
+    int count;
+    int cap;
+} diff_image;
+
+typedef struct
+{
+    char label[DISK_NAME_LEN + 3];
+    int sectors;
+    long bytes;
+} diff_total;
+
+// Every owner of both images at most, plus bam, directory and free
+#define DIFF_TOTALS_MAX              (2 * DISK_MAX_SECTORS + 3)
+#define DIFF_BUCKETS                 4096   // power of two, under half full
+
+// Totals in order of appearance, found by label through an open
+// addressed table of indexes plus one
+typedef struct
+{
+    diff_total totals[DIFF_TOTALS_MAX];
+    int count;
+    int16_t buckets[DIFF_BUCKETS];
+} diff_totals;
+
+// A run of zero filled sectors only one image has, listed as one line
+typedef struct
+{
+    const diff_image *only;
+    char label[DISK_NAME_LEN + 3];
+    int first_track;
+    int first_sector;
+    int last_track;
+    int last_sector;
+    int last;                   // linear index of the last sector
+    int count;
+} zero_run;
+
+static int linear_index(int track, int sector)
+{
+    long off = sector_offset(D64_TRACKS_42, track, sector);
+
+    return off < 0 ? -1 : (int)(off / SECTOR_SIZE);
+}
+
+static void mark_owner(diff_image *d, int track, int sector, int owner)
+{
+    // Cross-linked chains stay with whoever claimed the sector first
+    for (int steps = 0; steps < DISK_MAX_SECTORS; ++steps) {
+        const uint8_t *sec = NULL;
+        int i = linear_index(track, sector);
+
+        if (i < 0 || d->owner[i] != OWNER_FREE || read_sector(track, sector, &sec) != 0) {
+            return;
+        }
+
+        d->owner[i] = (int16_t)owner;
+        track = sec[SECTOR_LINK_TRACK_OFF];
+        sector = sec[SECTOR_LINK_SECTOR_OFF];
+
+        if (track == END_OF_CHAIN_TRACK) {
+            return;
+        }
+    }
+}
+
+typedef struct
+{
+    diff_image *d;
+    int owner;
+} owned;
+
+static void own_chain(int track, int sector, void *ctx)
+{
+    owned *o = ctx;
+
+    mark_owner(o->d, track, sector, o->owner);
+}
+
+static int diff_entry(const disk_dirent *e, void *ctx)
+{
+    diff_image *d = ctx;
+
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 64;
+        char (*names)[DISK_NAME_LEN + 1] = realloc(d->names, (size_t)cap * sizeof(*names));
+
+        if (!names) {
+            return 1;
+        }
+
+        d->names = names;
+        d->cap = cap;
+    }
+
+    int owner = d->count++;
+    petscii_name(e->name, DISK_NAME_LEN, d->names[owner]);
+
+    owned o = {d, owner};
+    entry_chains(e, own_chain, &o);
+
+    return 0;
+}
+
+// Attributes the sectors of the open image to the BAM, the directory
+// and the files reached from it; everything else stays OWNER_FREE
+static void assign_owners(diff_image *d)
+{
+    for (int i = 0; i < DISK_MAX_SECTORS; ++i) {
+        d->owner[i] = OWNER_FREE;
+    }
+
+    d->owner[linear_index(BAM_TRACK, BAM_SECTOR)] = OWNER_BAM;
+    mark_owner(d, DIRECTORY_TRACK, DIR_FIRST_SECTOR, OWNER_DIRECTORY);
+
+    // A broken directory only leaves sectors unattributed
+    walk_directory(diff_entry, d);
+}
+
+static int diff_load(diff_image *d, const char *path, const uint8_t *buffer, size_t size)
+{
+    memset(d, 0, sizeof(*d));
+    d->path = path;
+
+    if (open_image(buffer, size) != 0) {
+        return -1;
+    }
+
+    d->image = malloc(g_image_size);
+    if (!d->image) {
+        perror("Error");
+        return -1;
+    }
+
+    memcpy(d->image, g_image, g_image_size);
+    d->tracks = g_total_tracks;
+    d->data_bytes = g_data_bytes;
+    d->errors = g_image_size > g_data_bytes ? &d->image[g_data_bytes] : NULL;
+    assign_owners(d);
+
+    return 0;
+}
+
+static void diff_free(diff_image *d)
+{
+    free(d->image);
+    free(d->names);
+}
+
+static const uint8_t *diff_sector(const diff_image *d, int track, int i)
+{
+    if (track > d->tracks || (size_t)(i + 1) * SECTOR_SIZE > d->data_bytes) {
+        return NULL;
+    }
+
+    return &d->image[(size_t)i * SECTOR_SIZE];
+}
+
+static void owner_label(const diff_image *d, int i, char *out, size_t len)
+{
+    switch (d->owner[i]) {
+        case OWNER_FREE:
+            snprintf(out, len, "free");
+            break;
+        case OWNER_BAM:
+            snprintf(out, len, "bam");
+            break;
+        case OWNER_DIRECTORY:
+            snprintf(out, len, "directory");
+            break;
+        default:
+            snprintf(out, len, "\"%s\"", d->names[d->owner[i]]);
+            break;
+    }
+}
+
+// Number of differing bytes. Equal sectors, by far the common case, cost
+// one branch free pass of wide compares and no counting.
+static int sector_diff(const uint8_t *a, const uint8_t *b)
+{
+    int n = 0;
+
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+
+    for (int i = 0; i < SECTOR_SIZE; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+
+        acc = _mm_or_si128(acc, _mm_xor_si128(x, y));
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF) {
+        return 0;
+    }
+
+    for (int i = 0; i < SECTOR_SIZE; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+
+        n += 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+    }
+#else
+    if (memcmp(a, b, SECTOR_SIZE) == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < SECTOR_SIZE; ++i) {
+        n += a[i] != b[i];
+    }
+#endif
+
+    return n;
+}
+
+static void add_total(diff_totals *t, const char *label, int bytes)
+{
+    uint32_t h = 2166136261u;
+
+    for (const char *p = label; *p; ++p) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+
+    uint32_t slot = h & (DIFF_BUCKETS - 1);
+
+    while (t->buckets[slot] && strcmp(t->totals[t->buckets[slot] - 1].label, label) != 0) {
+        slot = (slot + 1) & (DIFF_BUCKETS - 1);
+    }
+
+    if (!t->buckets[slot]) {
+        diff_total *n = &t->totals[t->count++];
+
+        snprintf(n->label, sizeof(n->label), "%s", label);
+        t->buckets[slot] = (int16_t)t->count;
+    }
+
+    diff_total *total = &t->totals[t->buckets[slot] - 1];
+    total->sectors++;
+    total->bytes += bytes;
+}
+
+static void flush_zero_run(FILE *out, zero_run *r)
+{
+    if (r->count == 1) {
+        fprintf(out, "%2d/%-2d  only in %s  %s\n", r->first_track, r->first_sector,
+            r->only->path, r->label);
+    } else if (r->count > 1) {
+        fprintf(out, "%d/%d-%d/%d  only in %s  %s  %d zero sectors\n", r->first_track,
+            r->first_sector, r->last_track, r->last_sector, r->only->path, r->label, r->count);
+    }
+
+    r->count = 0;
+}
+
+// Extends the pending run with sector t/s, or starts a new one
+static void add_zero_run(FILE *out, zero_run *r, const diff_image *only, const char *label,
+        int t, int s, int i)
+{
+    if (r->count > 0 && (r->only != only || r->last + 1 != i || strcmp(r->label, label) != 0)) {
+        flush_zero_run(out, r);
+    }
+
+    if (r->count == 0) {
+        r->only = only;
+        snprintf(r->label, sizeof(r->label), "%s", label);
+        r->first_track = t;
+        r->first_sector = s;
+    }
+
+    r->last_track = t;
+    r->last_sector = s;
+    r->last = i;
+    r->count++;
+}
+
+int disk_diff(FILE *out, const char *path_a, const uint8_t *a, size_t asize,
+        const char *path_b, const uint8_t *b, size_t bsize)
+{
+    static const uint8_t zero[SECTOR_SIZE];
+    diff_image *d = calloc(2, sizeof(diff_image));
+    diff_totals *totals = calloc(1, sizeof(diff_totals));
+    zero_run run = {0};
+    int changed = -1;
+
+    if (!d || !totals) {
+        perror("Error");
+        free(d);
+        free(totals);
+        return -1;
+    }
+
+    if (diff_load(&d[0], path_a, a, asize) != 0 || diff_load(&d[1], path_b, b, bsize) != 0) {
+        goto done;
+    }
+
+    STATS_PHASE(STATS_RENDER);
+
+    for (int k = 0; k < 2; ++k) {
+        fprintf(out, "%s %s  %d tracks%s\n", k ? "+++" : "---", d[k].path, d[k].tracks,
+            d[k].errors ? ", error bytes" : "");
+    }
+
+    changed = 0;
+    int tracks = d[0].tracks > d[1].tracks ? d[0].tracks : d[1].tracks;
+
+    for (int t = 1; t <= tracks; ++t) {
+        for (int s = 0; s < sectors_per_track(t); ++s) {
+            int i = linear_index(t, s);
+            const uint8_t *sa = diff_sector(&d[0], t, i);
+            const uint8_t *sb = diff_sector(&d[1], t, i);
+            char la[DISK_NAME_LEN + 3];
+            char lb[DISK_NAME_LEN + 3];
+
+            if (!sa && !sb) {
+                continue;
+            }
+
+            if (!sa || !sb) {
+                const diff_image *only = sa ? &d[0] : &d[1];
+
+                owner_label(only, i, la, sizeof(la));
+                add_total(totals, la, SECTOR_SIZE);
+                changed++;
+
+                // Blank extra tracks collapse into ranges
+                if (sector_diff(sa ? sa : sb, zero) == 0) {
+                    add_zero_run(out, &run, only, la, t, s, i);
+                    continue;
+                }
+
+                flush_zero_run(out, &run);
+                fprintf(out, "%2d/%-2d  only in %s  %s\n", t, s, only->path, la);
+                continue;
+            }
+
+            int ea = d[0].errors ? d[0].errors[i] : ERROR_NONE;
+            int eb = d[1].errors ? d[1].errors[i] : ERROR_NONE;
+            int n = sector_diff(sa, sb);
+            // 0x00 and 0x01 both mean no error, as for disk_sector_error()
+            int error_changed = dos_error((uint8_t)ea) != dos_error((uint8_t)eb);
+
+            if (n == 0 && !error_changed) {
+                continue;
+            }
+
+            owner_label(&d[0], i, la, sizeof(la));
+            owner_label(&d[1], i, lb, sizeof(lb));
+
+            flush_zero_run(out, &run);
+            fprintf(out, "%2d/%-2d  %s", t, s, la);
+            if (strcmp(la, lb) != 0) {
+                fprintf(out, " -> %s", lb);
+            }
+            if (n > 0) {
+                fprintf(out, "  %d bytes", n);
+            }
+            if (error_changed) {
+                fprintf(out, "  error %02x -> %02x", ea, eb);
+            }
+            fprintf(out, "\n");
+
+            // Sectors are counted for their old owner unless they were free
+            add_total(totals, d[0].owner[i] == OWNER_FREE ? lb : la, n);
+            changed++;
+        }
+    }
+
+    flush_zero_run(out, &run);
+
+    if (changed > 0) {
+        fprintf(out, "Summary:\n");
+    }
+
+    for (int k = 0; k < totals->count; ++k) {
+        const diff_total *total = &totals->totals[k];
+
+        fprintf(out, "%-18s %4d sector%s %6ld bytes\n", total->label, total->sectors,
+            total->sectors == 1 ? " " : "s", total->bytes);
+    }
+
+    fprintf(out, "%d sectors differ.\n", changed);
+
+done:
+    diff_free(&d[0]);
+    diff_free(&d[1]);
+    free(d);
+    free(totals);
+
+    return changed;
+}
+
+// Allocation map of every track, masked to its sectors, then disk name,
+// id and DOS type. Free counts and unused bytes are left out; validating
+// the disk rewrites them anyway.
+static size_t fingerprint_bam(uint8_t *out)
+{
+    const uint8_t *bam = NULL;
+    size_t n = 0;
+
+    out[n++] = (uint8_t)g_total_tracks;
+
+    if (!read_bam(&bam)) {
+        return n;
+    }
+
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        uint8_t map[3] = {0, 0, 0};
+
+        if (get_bam_entry(bam, t, NULL, &map[0], &map[1], &map[2])) {
+            uint32_t bits = map[0] | map[1] << 8 | (uint32_t)map[2] << 16;
+
+            bits &= (1u << sectors_per_track(t)) - 1;
+            out[n++] = (uint8_t)bits;
+            out[n++] = (uint8_t)(bits >> 8);
+            out[n++] = (uint8_t)(bits >> 16);
+        }
+    }
+
+    memcpy(&out[n], &bam[BAM_DISK_NAME_OFF], BAM_DISK_NAME_LEN);
+    n += BAM_DISK_NAME_LEN;
+    memcpy(&out[n], &bam[BAM_DISK_ID_OFF], 2);
+    n += 2;
+    memcpy(&out[n], &bam[BAM_DOS_TYPE_OFF], 2);
+
+    return n + 2;
+}
+
+// Used slots in directory order without the link bytes, which only the
+// first slot of a sector uses
+static int fingerprint_entry(const disk_dirent *e, void *ctx)
+{
+    checksum_sha1_update(ctx, &e->entry[DIR_FILETYPE_OFF], DIR_ENTRY_SIZE - DIR_FILETYPE_OFF);
+
+    return 0;
+}
+
+int disk_fingerprint(const uint8_t *buffer, size_t size, uint64_t *key, uint8_t *fp)
+{
+    uint8_t bam[1 + 3 * D64_TRACKS_42 + BAM_DISK_NAME_LEN + 4];
+    uint8_t digest[CHECKSUM_SHA1_LEN];
+    checksum_sha1 s;
+
+    if (open_image(buffer, size) != 0) {
+        return -1;
+    }
+
+    size_t n = fingerprint_bam(bam);
+
+    checksum_sha1_init(&s);
+    checksum_sha1_update(&s, bam, n);
+
+    if (key) {
+        checksum_sha1 k = s;
+
+        checksum_sha1_final(&k, digest);
+        memcpy(key, digest, sizeof(*key));
+    }
+
+    if (!fp) {
+        return 0;
+    }
+
+    diff_image *d = calloc(1, sizeof(diff_image));
+    const uint8_t *map = NULL;
+
+    if (!d) {
+        perror("Error");
+        return -1;
+    }
+
+    assign_owners(d);
+    walk_directory(fingerprint_entry, &s);
+
+    if (!read_bam(&map)) {
+        map = NULL;
+    }
+
+    // Sectors in use by the BAM or by a chain, with their position so
+    // that moving data around is a change
+    for (int t = 1; t <= g_total_tracks; ++t) {
+        for (int sec = 0; sec < sectors_per_track(t); ++sec) {
+            int owner = d->owner[linear_index(t, sec)];
+            const uint8_t *data = NULL;
+            uint8_t ts[2] = {(uint8_t)t, (uint8_t)sec};
+
+            if (owner == OWNER_BAM || owner == OWNER_DIRECTORY ||
+                    (owner == OWNER_FREE && !bam_allocated(map, t, sec))) {
+                continue;
+            }
+
+            checksum_sha1_update(&s, ts, sizeof(ts));
+
+            // Unreadable G64 sectors count by position only
+            if (read_sector(t, sec, &data) == 0) {
+                checksum_sha1_update(&s, data, SECTOR_SIZE);
+            }
+        }
+    }
+
+    checksum_sha1_final(&s, fp);
+    free(d->names);
+    free(d);
+
+    return 0;
 }
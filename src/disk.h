@@ -1,5 +1,174 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-void disk(const uint8_t *buffer, const int size, const int baminfo);
+#define DISK_NAME_LEN 16
+// Sectors of a 42 track image, and the largest file a chain can hold
+#define DISK_MAX_SECTORS 802
+#define DISK_MAX_FILE_SIZE (DISK_MAX_SECTORS * 254)
+
+// A used directory slot, valid for the duration of the callback
+typedef struct
+{
+    const uint8_t *entry;       // raw 32 byte directory entry
+    const uint8_t *name;        // raw PETSCII name, DISK_NAME_LEN bytes, 0xA0 padded
+    uint8_t type;               // file type byte including flags
+    int track;                  // first data sector
+    int sector;
+    int blocks;                 // block count stored in the directory
+    int dir_track;              // directory sector holding the entry
+    int dir_sector;
+    int slot;
+} disk_dirent;
+
+typedef int (*disk_dirent_fn)(const disk_dirent *entry, void *ctx);
+
+// Lists an image; sizes adds byte sizes, load addresses and REL records,
+// which walks the chain of every file
+void disk(FILE *out, const uint8_t *buffer, const size_t size, const int baminfo, const int sizes);
+int sectors_per_track(int track);
+
+// Data area size of a D64 of the given file size and its track count,
+// 0 for sizes that are no D64 layout
+size_t disk_layout(size_t size, int *tracks);
+
+// Byte offset of a sector in an image of the given track count, or -1
+long disk_sector_offset(int tracks, int track, int sector);
+
+// Walks the directory of an image; fn returning non-zero stops the walk.
+int disk_directory(const uint8_t *buffer, size_t size, disk_dirent_fn fn, void *ctx);
+
+// Copies the data bytes of the sector chain starting at track/sector into
+// out, which must hold DISK_MAX_FILE_SIZE bytes. Returns the byte count.
+// Only valid inside a disk_directory() or disk_recover() callback.
+long disk_read_chain(int track, int sector, uint8_t *out);
+
+// Stores the track/sector pairs of the same chain in ts, which must hold
+// 2 * DISK_MAX_SECTORS bytes. Returns the sector count.
+int disk_chain(int track, int sector, uint8_t *ts);
+
+// DOS error number (20-29, 74) the image's error bytes or G64 decode
+// record for a sector, 0 for none. Only valid inside a callback.
+int disk_sector_error(int track, int sector);
+
+// Reads of sectors with an error since the image was opened, and the
+// last one read. Comparing the count around a chain walk flags files
+// crossing bad sectors.
+long disk_bad_reads(int *track, int *sector);
+
+// REL file layout from its side sectors
+typedef struct
+{
+    int record_length;
+    long records;
+    int side_sectors;
+    int data_blocks;
+    int valid;                  // side sector index matches the data chain
+} disk_rel;
+
+// CBM DOS record numbers are 16 bits and start at 1
+#define DISK_REL_RECORDS_MAX 65535
+
+// Both only valid inside a disk_directory() callback. disk_rel_record()
+// copies record n (record_length bytes) to out in constant time and
+// returns its length, or -1 past the end.
+int disk_rel_info(const disk_dirent *entry, disk_rel *info);
+long disk_rel_record(const disk_dirent *entry, long n, uint8_t *out);
+
+// GEOS fields of a directory entry
+typedef struct
+{
+    int info_track;             // info block holding icon and description
+    int info_sector;
+    const uint8_t *info;
+    int vlir;                   // start sector is an index of record chains
+    int type;                   // GEOS file type
+    int year;
+    int month;
+    int day;
+    int hour;
+    int minute;
+} disk_geos;
+
+// Largest CVT file: header and info blocks, record index, and every
+// sector of the image
+#define DISK_MAX_CVT_SIZE (DISK_MAX_FILE_SIZE + 3 * 254)
+
+// disk_geos_cvt() failures
+#define DISK_GEOS_UNREADABLE (-1)   // no info block or VLIR index sector
+#define DISK_GEOS_SHARED (-2)       // VLIR records share sectors
+
+// All only valid inside a disk_directory() callback. disk_geos_info()
+// returns 1 for GEOS entries. disk_geos_size() walks all VLIR records,
+// -1 if two of them share a sector, which disk_geos_cvt() also refuses.
+// disk_geos_cvt() writes the file in Convert (CVT) format to out, which
+// must hold DISK_MAX_CVT_SIZE bytes, and returns its length or one of
+// the failures above.
+int disk_geos_info(const disk_dirent *entry, disk_geos *info);
+const char *disk_geos_type(int type);
+long disk_geos_size(const disk_dirent *entry);
+long disk_geos_cvt(const disk_dirent *entry, uint8_t *out);
+
+// Prints record n of every REL file in the image as a hex dump
+void disk_records(FILE *out, const uint8_t *buffer, size_t size, long n);
+
+// A sector chain no directory entry of a live file leads to
+typedef struct
+{
+    int track;                  // chain head
+    int sector;
+    int blocks;                 // sectors in the chain
+    long size;                  // data bytes
+    long load;                  // PRG load address, -1 if implausible
+    const uint8_t *name;        // name of a scratched entry, NULL for orphans
+    int allocated;              // head still marked used in the BAM
+} disk_recovered;
+
+typedef int (*disk_recovered_fn)(const disk_recovered *file, void *ctx);
+
+// Scans every sector once and calls fn for every intact chain that
+// nothing links to and no live file uses; fn returning non-zero stops.
+int disk_recover(const uint8_t *buffer, size_t size, disk_recovered_fn fn, void *ctx);
+void disk_recover_list(FILE *out, const uint8_t *buffer, size_t size);
+
+// An image built or modified in memory and written out in one go
+typedef struct disk_image disk_image;
+
+// Formats a blank 35 or 40 track image; name and id are ASCII
+disk_image *disk_image_new(const char *name, const char *id, int tracks);
+
+// Copies a 35 or 40 track D64 (error bytes are kept) for modification
+disk_image *disk_image_load(const uint8_t *buffer, size_t size);
+void disk_image_free(disk_image *img);
+
+// Blocks available for files, not counting the directory track
+int disk_image_blocks_free(const disk_image *img);
+
+// Sectors a file of len bytes occupies
+int disk_image_blocks(size_t len);
+
+// Stores a file using the 1541 allocation order; name is ASCII, type a
+// directory type byte such as 0x82 for PRG. Returns -1 and leaves the
+// image unchanged if the name exists or the disk or directory is full.
+int disk_image_add(disk_image *img, const char *name, uint8_t type,
+        const uint8_t *data, size_t len);
+
+int disk_image_write(const disk_image *img, const char *path);
+
+// Compares two images sector by sector, attributing every difference
+// to a file, the BAM, the directory or free space. Returns the number
+// of differing sectors or -1.
+int disk_diff(FILE *out, const char *path_a, const uint8_t *a, size_t asize,
+        const char *path_b, const uint8_t *b, size_t bsize);
+
+#define DISK_FINGERPRINT_LEN 20
+
+// Identity of an image's content as DOS sees it: the BAM's allocation
+// map, disk name and id, the used directory slots and every sector the
+// BAM or a file chain uses. Garbage in free sectors, error bytes and
+// unused BAM bytes don't count. key covers only the track count and the
+// BAM, so images with different keys never share a fingerprint; fp may
+// be NULL to compute just the key. Returns 0 or -1.
+int disk_fingerprint(const uint8_t *buffer, size_t size, uint64_t *key, uint8_t *fp);
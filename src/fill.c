@@ -0,0 +1,478 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fill.h"
+#include "disk.h"
+#include "petscii.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define LOAD_ADDR_LEN 2
+#define FILL_TYPE_PRG 0x82
+#define FILL_DIR_ENTRIES 144        // 18 directory sectors of 8 entries
+#define FILL_MIN_DIGITS 3
+
+typedef struct
+{
+    const char *name;           // ASCII, as given to disk_image_add()
+    uint8_t key[DISK_NAME_LEN]; // the name as the directory stores it
+    const uint8_t *data;        // starting with the load address
+    size_t size;
+    int blocks;
+    int image;
+    int next;                   // next file of the same image, -1 at the end
+} fill_file;
+
+typedef struct
+{
+    arena arena;                // names and contents of every file
+    fill_file *files;           // in input order
+    int len;
+    int cap;
+    int capacity;               // blocks free on a blank image
+    const char *fallback;       // host name for files without their own
+    int failed;
+} fill_state;
+
+typedef struct
+{
+    const fill_state *s;
+    const int *members;         // file indexes grouped by image
+    const int *start;           // first member of each image, images + 1
+    int *blocks_free;           // left on each image, -1 if it failed
+    const char *prefix;
+    const char *name;
+    const char *id;
+    int tracks;
+    int width;
+    int images;
+    int next;                   // next image to claim
+} fill_job;
+
+static int add_file(const container_file *f, void *ctx)
+{
+    fill_state *s = ctx;
+    // Tape entries are stored without the load address a PRG starts with
+    size_t lead = f->header == 0 && f->load >= 0 ? LOAD_ADDR_LEN : 0;
+    const char *name = f->name && f->name[0] ? f->name : s->fallback;
+    int blocks = disk_image_blocks(f->size + lead);
+
+    if (blocks > s->capacity) {
+        fprintf(stderr, "Too large for a disk: %s\n", name);
+        s->failed++;
+        return 0;
+    }
+
+    if (s->len == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 256;
+        fill_file *grown = realloc(s->files, (size_t)cap * sizeof(fill_file));
+
+        if (!grown) {
+            return -1;
+        }
+
+        s->files = grown;
+        s->cap = cap;
+    }
+
+    fill_file *file = &s->files[s->len];
+    uint8_t *data = arena_alloc(&s->arena, f->size + lead);
+
+    file->name = arena_copy(&s->arena, name, strlen(name) + 1);
+    if (!data || !file->name) {
+        return -1;
+    }
+
+    if (lead) {
+        data[0] = f->load & 0xFF;
+        data[1] = f->load >> 8 & 0xFF;
+    }
+    memcpy(data + lead, f->data, f->size);
+
+    petscii_encode_name(file->name, file->key, DISK_NAME_LEN);
+    file->data = data;
+    file->size = f->size + lead;
+    file->blocks = blocks;
+    file->image = -1;
+    file->next = -1;
+    s->len++;
+
+    return 0;
+}
+
+static void read_input(fill_state *s, const char *path, container_kind kind)
+{
+    char host[PATH_MAX];
+    struct stat st;
+
+    if (kind != CONTAINER_RAW && kind != CONTAINER_PRG && kind != CONTAINER_P00 &&
+            kind != CONTAINER_T64) {
+        fprintf(stderr, "Not a PRG, P00 or T64 file: %s\n", path);
+        s->failed++;
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    int opened = fd >= 0 && fstat(fd, &st) == 0;
+
+    // Empty inputs fail as they do to mmap
+    if (opened && st.st_size == 0) {
+        errno = EINVAL;
+        opened = 0;
+    }
+
+    if (!opened) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", path);
+        s->failed++;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", path);
+        s->failed++;
+        return;
+    }
+
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    // The C64 name of a loose file is the host name without its extension
+    const char *base = strrchr(path, '/');
+    snprintf(host, sizeof(host), "%s", base ? base + 1 : path);
+    char *ext = strrchr(host, '.');
+    if (ext && ext != host) {
+        *ext = '\0';
+    }
+    s->fallback = host;
+
+    // Loose files of unknown type are stored as they are, like --write
+    if (kind == CONTAINER_RAW) {
+        kind = CONTAINER_PRG;
+    }
+
+    // P00 and T64 headers are skipped by the walk, only contents are kept
+    if (container_files(kind, map, (size_t)st.st_size, add_file, s) != 0) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        s->failed++;
+    }
+
+    munmap(map, (size_t)st.st_size);
+}
+
+// qsort has no context argument in C99
+static const fill_file *g_sort_files;
+
+// Largest first, then in input order
+static int by_blocks(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    if (g_sort_files[x].blocks != g_sort_files[y].blocks) {
+        return g_sort_files[y].blocks - g_sort_files[x].blocks;
+    }
+
+    return x - y;
+}
+
+// Leftmost image from index from on whose room is at least need; tree
+// holds the largest room of every subtree, leaves for images lo to hi
+static int first_fit(const int *tree, int node, int lo, int hi, int from, int need)
+{
+    if (hi <= from || tree[node] < need) {
+        return -1;
+    }
+
+    if (hi - lo == 1) {
+        return lo;
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    int found = first_fit(tree, 2 * node, lo, mid, from, need);
+
+    return found >= 0 ? found : first_fit(tree, 2 * node + 1, mid, hi, from, need);
+}
+
+static void set_room(int *tree, int leaves, int image, int room)
+{
+    int node = leaves + image;
+
+    tree[node] = room;
+    for (node /= 2; node >= 1; node /= 2) {
+        int l = tree[2 * node];
+        int r = tree[2 * node + 1];
+
+        tree[node] = l > r ? l : r;
+    }
+}
+
+static int has_name(const fill_file *files, int head, const uint8_t *key)
+{
+    for (int i = head; i >= 0; i = files[i].next) {
+        if (memcmp(files[i].key, key, DISK_NAME_LEN) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// First fit decreasing: every file, largest first, goes to the first
+// image it fits. Returns the number of images, or -1 if out of memory.
+static int place_files(fill_state *s)
+{
+    int leaves = 1;
+    int images = 0;
+
+    while (leaves < s->len) {
+        leaves *= 2;
+    }
+
+    int *order = malloc((size_t)(s->len ? s->len : 1) * sizeof(int));
+    int *tree = malloc(2 * (size_t)leaves * sizeof(int));
+    int *head = malloc((size_t)leaves * sizeof(int));
+    int *free_blocks = malloc((size_t)leaves * sizeof(int));
+    int *entries = calloc((size_t)leaves, sizeof(int));
+
+    if (!order || !tree || !head || !free_blocks || !entries) {
+        free(order);
+        free(tree);
+        free(head);
+        free(free_blocks);
+        free(entries);
+        return -1;
+    }
+
+    for (int i = 0; i < s->len; ++i) {
+        order[i] = i;
+    }
+
+    g_sort_files = s->files;
+    qsort(order, (size_t)s->len, sizeof(int), by_blocks);
+
+    // Every file fits a blank image, so there are never more images than
+    // files; the padding leaves take nothing
+    for (int i = 0; i < leaves; ++i) {
+        head[i] = -1;
+        free_blocks[i] = s->capacity;
+        tree[leaves + i] = i < s->len ? s->capacity : -1;
+    }
+    for (int node = leaves - 1; node >= 1; --node) {
+        int l = tree[2 * node];
+        int r = tree[2 * node + 1];
+
+        tree[node] = l > r ? l : r;
+    }
+
+    for (int k = 0; k < s->len; ++k) {
+        fill_file *f = &s->files[order[k]];
+        int image = first_fit(tree, 1, 0, leaves, 0, f->blocks);
+
+        // A name can only be once in a directory
+        while (has_name(s->files, head[image], f->key)) {
+            image = first_fit(tree, 1, 0, leaves, image + 1, f->blocks);
+        }
+
+        f->image = image;
+        f->next = head[image];
+        head[image] = order[k];
+        free_blocks[image] -= f->blocks;
+        entries[image]++;
+
+        set_room(tree, leaves, image, entries[image] < FILL_DIR_ENTRIES ? free_blocks[image] : -1);
+
+        if (image >= images) {
+            images = image + 1;
+        }
+    }
+
+    free(order);
+    free(tree);
+    free(head);
+    free(free_blocks);
+    free(entries);
+
+    return images;
+}
+
+static int image_path(char *path, size_t size, const fill_job *j, int image)
+{
+    int n = snprintf(path, size, "%s-%0*d.d64", j->prefix, j->width, image + 1);
+
+    return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+static void write_one(fill_job *j, int image)
+{
+    char path[PATH_MAX];
+    disk_image *img = disk_image_new(j->name, j->id, j->tracks);
+
+    j->blocks_free[image] = -1;
+
+    if (!img) {
+        perror("Error");
+        return;
+    }
+
+    // Files are stored in input order, whatever order they were placed in
+    for (int m = j->start[image]; m < j->start[image + 1]; ++m) {
+        const fill_file *f = &j->s->files[j->members[m]];
+
+        if (disk_image_add(img, f->name, FILL_TYPE_PRG, f->data, f->size) != 0) {
+            disk_image_free(img);
+            return;
+        }
+    }
+
+    if (image_path(path, sizeof(path), j, image) != 0) {
+        errno = ENAMETOOLONG;
+        perror("Error");
+    } else if (disk_image_write(img, path) == 0) {
+        j->blocks_free[image] = disk_image_blocks_free(img);
+    }
+
+    disk_image_free(img);
+}
+
+static void *worker(void *arg)
+{
+    fill_job *j = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->images) {
+        write_one(j, i);
+    }
+
+    return NULL;
+}
+
+static int write_images(fill_job *j)
+{
+    pthread_t threads[MAX_THREADS];
+    // The calling thread is one of the workers
+    long threads_len = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (threads_len > j->images - 1) {
+        threads_len = j->images - 1;
+    }
+    if (threads_len > MAX_THREADS) {
+        threads_len = MAX_THREADS;
+    }
+    if (threads_len < 0) {
+        threads_len = 0;
+    }
+
+    long started = 0;
+    while (started < threads_len &&
+            pthread_create(&threads[started], NULL, worker, j) == 0) {
+        started++;
+    }
+
+    // Whatever no thread claims is done here
+    worker(j);
+
+    for (long t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    return 0;
+}
+
+int fill_images(FILE *out, const char *prefix, const char *name, const char *id,
+        int tracks, char **paths, const container_kind *kinds, int count)
+{
+    fill_state s;
+    disk_image *blank = disk_image_new(name, id, tracks);
+
+    if (!blank) {
+        return -1;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.capacity = disk_image_blocks_free(blank);
+    disk_image_free(blank);
+    arena_init(&s.arena);
+
+    for (int i = 0; i < count; ++i) {
+        read_input(&s, paths[i], kinds[i]);
+    }
+
+    int images = place_files(&s);
+    int *members = malloc((size_t)(s.len ? s.len : 1) * sizeof(int));
+    int *start = calloc((size_t)(images > 0 ? images : 0) + 1, sizeof(int));
+    int *blocks_free = malloc((size_t)(images > 0 ? images : 1) * sizeof(int));
+
+    if (images < 0 || !members || !start || !blocks_free) {
+        perror("Error");
+        free(members);
+        free(start);
+        free(blocks_free);
+        free(s.files);
+        arena_free(&s.arena);
+        return -1;
+    }
+
+    // Counting sort by image keeps the input order within each
+    for (int i = 0; i < s.len; ++i) {
+        start[s.files[i].image + 1]++;
+    }
+    for (int i = 0; i < images; ++i) {
+        start[i + 1] += start[i];
+    }
+    // blocks_free is the write cursor of each image until written
+    for (int i = 0; i < images; ++i) {
+        blocks_free[i] = start[i];
+    }
+    for (int i = 0; i < s.len; ++i) {
+        members[blocks_free[s.files[i].image]++] = i;
+    }
+
+    fill_job j = {&s, members, start, blocks_free, prefix, name, id, tracks,
+        FILL_MIN_DIGITS, images, 0};
+
+    for (int n = images; n >= 1000; n /= 10) {
+        j.width++;
+    }
+
+    write_images(&j);
+
+    int status = s.failed ? -1 : 0;
+
+    for (int i = 0; i < images; ++i) {
+        char path[PATH_MAX];
+
+        if (blocks_free[i] < 0) {
+            status = -1;
+            continue;
+        }
+
+        image_path(path, sizeof(path), &j, i);
+        fprintf(out, "%s: %d files, %d blocks free.\n", path, start[i + 1] - start[i],
+            blocks_free[i]);
+    }
+
+    fprintf(out, "%d files packed into %d images.\n", s.len, images);
+
+    free(members);
+    free(start);
+    free(blocks_free);
+    free(s.files);
+    arena_free(&s.arena);
+
+    return status;
+}
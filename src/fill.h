@@ -0,0 +1,18 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+
+// Spreads loose programs over as many new D64 images as they need.
+// P00 headers are skipped and T64 entries get their load address back,
+// then files are placed largest first into the first image with enough
+// free blocks, a free directory entry and no file of the same name
+// (first fit decreasing). Finished images are built and written in
+// parallel.
+
+// Writes prefix-001.d64, prefix-002.d64 and so on from PRG, P00 and T64
+// inputs (plain files are taken as PRGs) and lists them on out. Returns
+// 0, or -1 if an input couldn't be read or placed, or an image written.
+int fill_images(FILE *out, const char *prefix, const char *name, const char *id,
+        int tracks, char **paths, const container_kind *kinds, int count);
@@ -0,0 +1,297 @@
+#include "g64.h"
+#include "disk.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define G64_SIGNATURE "GCR-1541"
+#define G64_HALF_TRACKS_OFF 9
+#define G64_TABLE_OFF 12
+#define G64_TRACK_LEN_SIZE 2
+
+#define SECTOR_SIZE 256
+#define MAX_TRACKS 42
+#define SYNC_BITS 10
+#define MAX_SYNCS 256
+
+// Decoded block layouts
+#define HEADER_ID 0x08
+#define HEADER_LEN 8            // id, checksum, sector, track, id2, id1, 0x0f 0x0f
+#define HEADER_GCR_LEN 10
+#define HEADER_CHECKSUM_OFF 1
+#define HEADER_SECTOR_OFF 2
+#define HEADER_TRACK_OFF 3
+#define HEADER_ID2_OFF 4
+#define HEADER_ID1_OFF 5
+#define DATA_ID 0x07
+#define DATA_LEN 260            // id, 256 bytes, checksum, 0x00 0x00
+#define DATA_GCR_LEN 325
+#define DATA_CHECKSUM_OFF (1 + SECTOR_SIZE)
+
+// 5 bit GCR code to nibble, 0xff for codes the 1541 never writes
+static const uint8_t gcr_nibble[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x08, 0x00, 0x01, 0xff, 0x0c, 0x04, 0x05,
+    0xff, 0xff, 0x02, 0x03, 0xff, 0x0f, 0x06, 0x07,
+    0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
+};
+
+typedef struct
+{
+    const uint8_t *gcr;         // track data twice in a row, so blocks can wrap
+    size_t len;
+    size_t syncs[MAX_SYNCS];    // bit positions right after each sync mark
+    int count;
+} gcr_track;
+
+int g64_detect(const uint8_t *buffer, size_t size)
+{
+    return size >= G64_TABLE_OFF &&
+        memcmp(buffer, G64_SIGNATURE, strlen(G64_SIGNATURE)) == 0;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Decodes groups of 40 GCR bits into 4 bytes each, starting at any bit
+// position. Returns non-zero if any code was invalid.
+static int gcr_decode(const gcr_track *t, size_t bit, uint8_t *out, size_t groups)
+{
+    const uint8_t *in = &t->gcr[bit >> 3];
+    unsigned shift = bit & 7;
+    unsigned bad = 0;
+
+    for (size_t g = 0; g < groups; ++g, in += 5, out += 4) {
+        // 48 bits cover the group at any shift
+        uint64_t v = (uint64_t)in[0] << 40 | (uint64_t)in[1] << 32 | (uint64_t)in[2] << 24 |
+            (uint64_t)in[3] << 16 | (uint64_t)in[4] << 8 | in[5];
+        v >>= 8 - shift;
+
+        for (int k = 0; k < 4; ++k) {
+            uint8_t hi = gcr_nibble[(v >> (35 - 10 * k)) & 0x1f];
+            uint8_t lo = gcr_nibble[(v >> (30 - 10 * k)) & 0x1f];
+
+            bad |= hi | lo;
+            out[k] = (uint8_t)(hi << 4 | lo);
+        }
+    }
+
+    return (bad & 0xf0) != 0;
+}
+
+static void add_sync(gcr_track *t, size_t bit)
+{
+    if (t->count < MAX_SYNCS) {
+        t->syncs[t->count++] = bit;
+    }
+}
+
+// A sync mark is a run of at least 10 one bits; whole 0xff bytes are
+// counted at once and the run edges taken from leading/trailing ones
+static void find_syncs(gcr_track *t)
+{
+    unsigned run = 0;
+
+    t->count = 0;
+
+    for (size_t i = 0; i < 2 * t->len; ++i) {
+        uint8_t b = t->gcr[i];
+
+        if (b == 0xff) {
+            run += 8;
+            continue;
+        }
+
+        unsigned lead = (unsigned)__builtin_clz(~(unsigned)b << 24);
+        if (run + lead >= SYNC_BITS) {
+            size_t end = i * 8 + lead;
+
+            // The second copy only contributes a sync wrapping the end
+            if (i >= t->len) {
+                if (t->count == 0 || end - t->len * 8 != t->syncs[0]) {
+                    add_sync(t, end - t->len * 8);
+                }
+                break;
+            }
+
+            add_sync(t, end);
+        }
+
+        run = (unsigned)__builtin_ctz(~(unsigned)b);
+    }
+
+    // A sync wrapping the end is found last but comes first
+    if (t->count > 1 && t->syncs[t->count - 1] < t->syncs[0]) {
+        size_t wrapped = t->syncs[t->count - 1];
+
+        memmove(&t->syncs[1], &t->syncs[0], (size_t)(t->count - 1) * sizeof(size_t));
+        t->syncs[0] = wrapped;
+    }
+}
+
+static int rank(uint8_t status)
+{
+    switch (status) {
+        case G64_SECTOR_OK:
+            return 3;
+        case G64_DATA_CHECKSUM:
+        case G64_HEADER_CHECKSUM:
+            return 2;
+        case G64_NO_DATA:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void decode_track(gcr_track *t, int track, uint8_t *data, uint8_t *errors)
+{
+    int spt = sectors_per_track(track);
+    uint8_t header[HEADER_LEN + 4];
+    uint8_t block[DATA_LEN + 4];
+
+    find_syncs(t);
+
+    if (t->count == 0) {
+        memset(errors, G64_NO_SYNC, (size_t)spt);
+        return;
+    }
+
+    for (int j = 0; j < t->count; ++j) {
+        if (gcr_decode(t, t->syncs[j], header, HEADER_GCR_LEN / 5) != 0 ||
+                header[0] != HEADER_ID) {
+            continue;
+        }
+
+        int sector = header[HEADER_SECTOR_OFF];
+        uint8_t sum = header[HEADER_SECTOR_OFF] ^ header[HEADER_TRACK_OFF] ^
+            header[HEADER_ID2_OFF] ^ header[HEADER_ID1_OFF];
+
+        if (header[HEADER_TRACK_OFF] != track || sector >= spt) {
+            continue;
+        }
+
+        uint8_t status = sum == header[HEADER_CHECKSUM_OFF] ? G64_SECTOR_OK : G64_HEADER_CHECKSUM;
+
+        // The data block follows after the next sync
+        size_t next = t->syncs[(j + 1) % t->count];
+        if (next < t->syncs[j]) {
+            next += t->len * 8;
+        }
+
+        if (t->count < 2 || next + DATA_GCR_LEN * 8 > 2 * t->len * 8 ||
+                gcr_decode(t, next, block, DATA_GCR_LEN / 5) != 0 ||
+                block[0] != DATA_ID) {
+            status = G64_NO_DATA;
+        } else if (status == G64_SECTOR_OK) {
+            uint8_t check = 0;
+
+            for (int k = 1; k <= SECTOR_SIZE; ++k) {
+                check ^= block[k];
+            }
+
+            if (check != block[DATA_CHECKSUM_OFF]) {
+                status = G64_DATA_CHECKSUM;
+            }
+        }
+
+        // Duplicate headers are common on protected disks; the best copy wins
+        if (rank(status) <= rank(errors[sector])) {
+            continue;
+        }
+
+        errors[sector] = status;
+        if (status != G64_NO_DATA) {
+            memcpy(&data[sector * SECTOR_SIZE], &block[1], SECTOR_SIZE);
+        }
+    }
+}
+
+long g64_decode(const uint8_t *buffer, size_t size, uint8_t *out)
+{
+    if (!g64_detect(buffer, size)) {
+        diagnostic("Not a valid G64 disk image\n");
+        return -1;
+    }
+
+    int half_tracks = buffer[G64_HALF_TRACKS_OFF];
+    if (G64_TABLE_OFF + (size_t)half_tracks * 4 > size) {
+        diagnostic("Truncated G64 track table\n");
+        return -1;
+    }
+
+    // Sector offsets of each track, data first then the error bytes
+    int first[MAX_TRACKS + 2];
+    first[1] = 0;
+    for (int t = 1; t <= MAX_TRACKS; ++t) {
+        first[t + 1] = first[t] + sectors_per_track(t);
+    }
+
+    long sectors = first[MAX_TRACKS + 1];
+    uint8_t *errors = &out[sectors * SECTOR_SIZE];
+    uint8_t *twice = NULL;
+    size_t twice_len = 0;
+    int tracks = 35;
+
+    memset(out, 0, (size_t)sectors * SECTOR_SIZE);
+    memset(errors, G64_NO_HEADER, (size_t)sectors);
+
+    // Only whole tracks hold DOS sectors; half tracks are skipped
+    for (int h = 0; h < half_tracks && h / 2 < MAX_TRACKS; h += 2) {
+        int track = h / 2 + 1;
+        uint32_t off = le32(&buffer[G64_TABLE_OFF + 4 * h]);
+
+        if (off == 0 || (size_t)off + G64_TRACK_LEN_SIZE > size) {
+            memset(&errors[first[track]], G64_NO_SYNC, (size_t)sectors_per_track(track));
+            continue;
+        }
+
+        size_t len = buffer[off] | buffer[off + 1] << 8;
+        if (len < DATA_GCR_LEN || off + G64_TRACK_LEN_SIZE + len > size) {
+            memset(&errors[first[track]], G64_NO_SYNC, (size_t)sectors_per_track(track));
+            continue;
+        }
+
+        // Doubled and padded, so decoding never needs to wrap
+        if (2 * len + 8 > twice_len) {
+            uint8_t *p = realloc(twice, 2 * len + 8);
+
+            if (!p) {
+                perror("Error");
+                free(twice);
+                return -1;
+            }
+
+            twice = p;
+            twice_len = 2 * len + 8;
+        }
+
+        memcpy(twice, &buffer[off + G64_TRACK_LEN_SIZE], len);
+        memcpy(&twice[len], &buffer[off + G64_TRACK_LEN_SIZE], len);
+        memset(&twice[2 * len], 0, 8);
+
+        gcr_track t;
+        t.gcr = twice;
+        t.len = len;
+
+        decode_track(&t, track, &out[(long)first[track] * SECTOR_SIZE], &errors[first[track]]);
+
+        for (int s = first[track]; s < first[track + 1] && track > tracks; ++s) {
+            if (rank(errors[s]) > 1) {
+                tracks = track > 40 ? 42 : 40;
+            }
+        }
+    }
+
+    free(twice);
+
+    // Error bytes follow the data of the tracks actually used
+    long used = first[tracks + 1];
+    memmove(&out[used * SECTOR_SIZE], errors, (size_t)used);
+
+    return used * SECTOR_SIZE + used;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest decoded image: 42 tracks plus one error byte per sector
+#define G64_MAX_D64_SIZE 206114L
+
+// 1541 error codes as stored in D64 error bytes
+#define G64_SECTOR_OK 0x01
+#define G64_NO_HEADER 0x02
+#define G64_NO_SYNC 0x03
+#define G64_NO_DATA 0x04
+#define G64_DATA_CHECKSUM 0x05
+#define G64_HEADER_CHECKSUM 0x09
+
+int g64_detect(const uint8_t *buffer, size_t size);
+
+// Decodes the GCR tracks of a G64 image into D64 layout followed by one
+// error byte per sector, so it reads like a D64 with error info. out
+// needs G64_MAX_D64_SIZE bytes. Returns the decoded size or -1.
+long g64_decode(const uint8_t *buffer, size_t size, uint8_t *out);
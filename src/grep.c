@@ -0,0 +1,176 @@
+#include "grep.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct
+{
+    FILE *out;
+    const grep_pattern *pattern;
+    const char *path;
+    const container_file *file;
+    long matches;
+} search;
+
+static int hex_digit(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+int grep_compile(grep_pattern *p, const char *hex)
+{
+    memset(p, 0, sizeof(*p));
+
+    for (const char *s = hex; *s; ) {
+        if (isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+
+        if (!s[1] || p->len == GREP_MAX_PATTERN) {
+            return -1;
+        }
+
+        if (s[0] == '?' && s[1] == '?') {
+            p->len++;
+        } else {
+            int hi = hex_digit((unsigned char)s[0]);
+            int lo = hex_digit((unsigned char)s[1]);
+
+            if (hi < 0 || lo < 0) {
+                return -1;
+            }
+
+            if (!p->fixed[p->first]) {
+                p->first = p->len;
+            }
+
+            p->bytes[p->len] = (uint8_t)(hi << 4 | lo);
+            p->fixed[p->len] = 1;
+            p->last = p->len;
+            p->len++;
+        }
+
+        s += 2;
+    }
+
+    // A pattern of wildcards only would match everywhere
+    return p->fixed[p->first] ? 0 : -1;
+}
+
+static int verify(const grep_pattern *p, const uint8_t *data)
+{
+    for (size_t i = 0; i < p->len; ++i) {
+        if (p->fixed[i] && data[i] != p->bytes[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+long grep_scan(const grep_pattern *p, const uint8_t *data, size_t size,
+        grep_hit_fn fn, void *ctx)
+{
+    if (size < p->len) {
+        return 0;
+    }
+
+    // Candidate start positions
+    size_t n = size - p->len + 1;
+    const uint8_t *a = data + p->first;
+    const uint8_t *b = data + p->last;
+    long matches = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8((char)p->bytes[p->first]);
+    const __m128i vb = _mm_set1_epi8((char)p->bytes[p->last]);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i ea = _mm_cmpeq_epi8(va, _mm_loadu_si128((const __m128i *)(a + i)));
+        __m128i eb = _mm_cmpeq_epi8(vb, _mm_loadu_si128((const __m128i *)(b + i)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(ea, eb));
+
+        while (mask) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            mask &= mask - 1;
+
+            if (verify(p, data + pos)) {
+                matches++;
+
+                if (fn && fn(pos, ctx) != 0) {
+                    return matches;
+                }
+            }
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (a[i] == p->bytes[p->first] && b[i] == p->bytes[p->last] && verify(p, data + i)) {
+            matches++;
+
+            if (fn && fn(i, ctx) != 0) {
+                return matches;
+            }
+        }
+    }
+
+    return matches;
+}
+
+static int print_hit(size_t offset, void *ctx)
+{
+    search *s = ctx;
+    long address = container_address(s->file, offset);
+
+    fprintf(s->out, "%s: ", s->path);
+    if (s->file->name) {
+        fprintf(s->out, "\"%s\" ", s->file->name);
+    }
+
+    fprintf(s->out, "offset %zu", offset);
+    if (address >= 0) {
+        fprintf(s->out, " address $%04lx", address);
+    }
+    fprintf(s->out, "\n");
+
+    return 0;
+}
+
+static int search_file(const container_file *file, void *ctx)
+{
+    search *s = ctx;
+
+    s->file = file;
+    s->matches += grep_scan(s->pattern, file->data, file->size, print_hit, s);
+
+    return 0;
+}
+
+long grep(FILE *out, const grep_pattern *p, const char *path, container_kind kind,
+        const uint8_t *buffer, size_t size)
+{
+    search s = {out, p, path, NULL, 0};
+
+    if (container_files(kind, buffer, size, search_file, &s) != 0) {
+        return -1;
+    }
+
+    return s.matches;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define GREP_MAX_PATTERN 256
+
+// A byte pattern where ?? matches any byte. The scan looks for the first
+// and last fixed bytes together and only verifies positions where both hit.
+typedef struct
+{
+    uint8_t bytes[GREP_MAX_PATTERN];
+    uint8_t fixed[GREP_MAX_PATTERN];    // non-zero where bytes[] must match
+    size_t len;
+    size_t first;                       // first and last fixed positions
+    size_t last;
+} grep_pattern;
+
+typedef int (*grep_hit_fn)(size_t offset, void *ctx);
+
+// Parses hex digits with optional whitespace, e.g. "a9 ?? 8d 20 d0"
+int grep_compile(grep_pattern *p, const char *hex);
+
+// Calls fn with every match offset; fn returning non-zero stops the scan.
+// Returns the number of matches.
+long grep_scan(const grep_pattern *p, const uint8_t *data, size_t size,
+        grep_hit_fn fn, void *ctx);
+
+// Searches every file in a container and prints one line per match.
+// Returns the number of matches or -1 if the container can't be read.
+long grep(FILE *out, const grep_pattern *p, const char *path, container_kind kind,
+        const uint8_t *buffer, size_t size);
@@ -0,0 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "histogram.h"
+#include "disasm.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define KERNAL_TABLE 0xff81
+#define KERNAL_STRIDE 3
+
+// The KERNAL jump table from $ff81, one entry every three bytes
+static const char *kernal_names[] = {
+    "CINT", "IOINIT", "RAMTAS", "RESTOR", "VECTOR", "SETMSG", "SECOND", "TKSA",
+    "MEMTOP", "MEMBOT", "SCNKEY", "SETTMO", "ACPTR", "CIOUT", "UNTLK", "UNLSN",
+    "LISTEN", "TALK", "READST", "SETLFS", "SETNAM", "OPEN", "CLOSE", "CHKIN",
+    "CHKOUT", "CLRCHN", "CHRIN", "CHROUT", "LOAD", "SAVE", "SETTIM", "RDTIM",
+    "STOP", "GETIN", "CLALL", "UDTIM", "SCREEN", "PLOT", "IOBASE"
+};
+
+typedef struct
+{
+    char **paths;
+    const container_kind *kinds;
+    int count;
+    int next;                   // next input to claim
+    pthread_mutex_t lock;       // image walkers keep state in globals
+} histogram_job;
+
+// A program of an image, copied out while the walker is locked
+typedef struct held_file
+{
+    const uint8_t *data;
+    size_t size;
+    struct held_file *next;
+} held_file;
+
+typedef struct
+{
+    histogram_job *job;
+    disasm_counts counts;
+    unsigned long files;
+    unsigned long failed;
+    uint64_t bytes;
+    int holding;                // copy files out instead of decoding them
+    arena arena;                // copies of the current input
+    held_file *held;
+    held_file *held_last;
+} histogram_worker;
+
+static int count_file(const container_file *f, void *ctx)
+{
+    histogram_worker *w = ctx;
+    const uint8_t *code = f->data + f->header;
+    size_t size = f->size > f->header ? f->size - f->header : 0;
+
+    // Only programs inside images, data files would skew the counts
+    if (w->holding && f->load < 0) {
+        return 0;
+    }
+
+    if (!w->holding) {
+        disasm_count(&w->counts, code, size);
+        w->files++;
+        w->bytes += size;
+        return 0;
+    }
+
+    held_file *h = arena_alloc(&w->arena, sizeof(held_file));
+    if (!h || (h->data = arena_copy(&w->arena, code, size)) == NULL) {
+        return -1;
+    }
+
+    h->size = size;
+    h->next = NULL;
+
+    if (w->held_last) {
+        w->held_last->next = h;
+    } else {
+        w->held = h;
+    }
+    w->held_last = h;
+
+    return 0;
+}
+
+static void count_input(histogram_worker *w, int i)
+{
+    histogram_job *j = w->job;
+    container_kind kind = j->kinds[i];
+    struct stat st;
+    int fd = open(j->paths[i], O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", j->paths[i]);
+        w->failed++;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    // Nothing to decode
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", j->paths[i]);
+        w->failed++;
+        return;
+    }
+
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    // Images are walked under the lock and decoded after it
+    w->holding = kind != CONTAINER_RAW && kind != CONTAINER_PRG && kind != CONTAINER_P00;
+
+    if (w->holding) {
+        w->held = NULL;
+        w->held_last = NULL;
+
+        pthread_mutex_lock(&j->lock);
+        container_files_arena(&w->arena, kind, map, (size_t)st.st_size, count_file, w);
+        pthread_mutex_unlock(&j->lock);
+
+        for (const held_file *h = w->held; h; h = h->next) {
+            disasm_count(&w->counts, h->data, h->size);
+            w->bytes += h->size;
+            w->files++;
+        }
+
+        arena_reset(&w->arena);
+    } else {
+        container_files(kind, map, (size_t)st.st_size, count_file, w);
+    }
+
+    munmap(map, (size_t)st.st_size);
+}
+
+static void *worker(void *arg)
+{
+    histogram_worker *w = arg;
+    histogram_job *j = w->job;
+    int i;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->count) {
+        count_input(w, i);
+    }
+
+    arena_free(&w->arena);
+
+    return NULL;
+}
+
+static const char *kernal_name(int address)
+{
+    int k = address - KERNAL_TABLE;
+
+    if (k < 0 || k % KERNAL_STRIDE != 0 ||
+            k / KERNAL_STRIDE >= (int)(sizeof(kernal_names) / sizeof(kernal_names[0]))) {
+        return "";
+    }
+
+    return kernal_names[k / KERNAL_STRIDE];
+}
+
+static void write_csv(FILE *out, const histogram_worker *w, const uint64_t *modes,
+        uint64_t instructions, uint64_t illegal, int inputs)
+{
+    const disasm_counts *c = &w->counts;
+
+    fprintf(out, "kind,key,name,count\n");
+    fprintf(out, "total,inputs,,%d\n", inputs);
+    fprintf(out, "total,files,,%lu\n", w->files);
+    fprintf(out, "total,bytes,,%llu\n", (unsigned long long)w->bytes);
+    fprintf(out, "total,instructions,,%llu\n", (unsigned long long)instructions);
+    fprintf(out, "total,illegal,,%llu\n", (unsigned long long)illegal);
+
+    for (int op = 0; op < 256; ++op) {
+        if (c->opcodes[op]) {
+            fprintf(out, "%s,%02x,\"%s %s\",%llu\n", disasm_illegal((uint8_t)op) ? "illegal" : "opcode",
+                op, disasm_mnemonic((uint8_t)op), disasm_mode_name(disasm_mode((uint8_t)op)),
+                (unsigned long long)c->opcodes[op]);
+        }
+    }
+
+    for (int m = 0; m < DISASM_MODES; ++m) {
+        if (modes[m]) {
+            fprintf(out, "mode,\"%s\",,%llu\n", disasm_mode_name(m), (unsigned long long)modes[m]);
+        }
+    }
+
+    for (int a = 0; a < 65536; ++a) {
+        if (c->jsr[a]) {
+            fprintf(out, "jsr,%04x,%s,%llu\n", a, kernal_name(a), (unsigned long long)c->jsr[a]);
+        }
+    }
+
+    for (int a = 0; a < 65536; ++a) {
+        if (c->jmp[a]) {
+            fprintf(out, "jmp,%04x,%s,%llu\n", a, kernal_name(a), (unsigned long long)c->jmp[a]);
+        }
+    }
+}
+
+static void write_targets(FILE *out, const char *key, const uint64_t *targets)
+{
+    const char *sep = "";
+
+    fprintf(out, ",\"%s\":{", key);
+    for (int a = 0; a < 65536; ++a) {
+        if (targets[a]) {
+            fprintf(out, "%s\"%04x\":%llu", sep, a, (unsigned long long)targets[a]);
+            sep = ",";
+        }
+    }
+    fprintf(out, "}");
+}
+
+static void write_json(FILE *out, const histogram_worker *w, const uint64_t *modes,
+        uint64_t instructions, uint64_t illegal, int inputs)
+{
+    const disasm_counts *c = &w->counts;
+    const char *sep = "";
+
+    fprintf(out, "{\"inputs\":%d,\"files\":%lu,\"bytes\":%llu,\"instructions\":%llu,\"illegal\":%llu",
+        inputs, w->files, (unsigned long long)w->bytes, (unsigned long long)instructions,
+        (unsigned long long)illegal);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        fprintf(out, ",\"%s\":{", pass ? "illegal_opcodes" : "opcodes");
+        sep = "";
+        for (int op = 0; op < 256; ++op) {
+            if (c->opcodes[op] && disasm_illegal((uint8_t)op) == pass) {
+                fprintf(out, "%s\"%02x\":{\"mnemonic\":\"%s\",\"mode\":\"%s\",\"count\":%llu}", sep,
+                    op, disasm_mnemonic((uint8_t)op), disasm_mode_name(disasm_mode((uint8_t)op)),
+                    (unsigned long long)c->opcodes[op]);
+                sep = ",";
+            }
+        }
+        fprintf(out, "}");
+    }
+
+    fprintf(out, ",\"modes\":{");
+    sep = "";
+    for (int m = 0; m < DISASM_MODES; ++m) {
+        if (modes[m]) {
+            fprintf(out, "%s\"%s\":%llu", sep, disasm_mode_name(m), (unsigned long long)modes[m]);
+            sep = ",";
+        }
+    }
+    fprintf(out, "}");
+
+    write_targets(out, "jsr", c->jsr);
+    write_targets(out, "jmp", c->jmp);
+
+    // Calls and jumps into the KERNAL jump table by entry name
+    fprintf(out, ",\"kernal\":{");
+    sep = "";
+    for (size_t k = 0; k < sizeof(kernal_names) / sizeof(kernal_names[0]); ++k) {
+        int a = KERNAL_TABLE + (int)k * KERNAL_STRIDE;
+        uint64_t n = c->jsr[a] + c->jmp[a];
+
+        if (n) {
+            fprintf(out, "%s\"%s\":%llu", sep, kernal_names[k], (unsigned long long)n);
+            sep = ",";
+        }
+    }
+    fprintf(out, "}}\n");
+}
+
+int histogram(FILE *out, char **paths, const container_kind *kinds, int count, int json)
+{
+    histogram_job j;
+    histogram_worker *w;
+    pthread_t threads[MAX_THREADS];
+    // The calling thread is one of the workers
+    long threads_len = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (threads_len > count - 1) {
+        threads_len = count - 1;
+    }
+    if (threads_len > MAX_THREADS) {
+        threads_len = MAX_THREADS;
+    }
+    if (threads_len < 0) {
+        threads_len = 0;
+    }
+
+    w = calloc((size_t)threads_len + 1, sizeof(histogram_worker));
+    if (!w) {
+        perror("Error");
+        return -1;
+    }
+
+    j.paths = paths;
+    j.kinds = kinds;
+    j.count = count;
+    j.next = 0;
+    pthread_mutex_init(&j.lock, NULL);
+
+    for (long t = 0; t <= threads_len; ++t) {
+        w[t].job = &j;
+        arena_init(&w[t].arena);
+    }
+
+    long started = 0;
+    while (started < threads_len &&
+            pthread_create(&threads[started], NULL, worker, &w[started + 1]) == 0) {
+        started++;
+    }
+
+    // Whatever no thread claims is done here
+    worker(&w[0]);
+
+    for (long t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&j.lock);
+
+    // Merged into the first worker's counters
+    for (long t = 1; t <= started; ++t) {
+        for (int op = 0; op < 256; ++op) {
+            w[0].counts.opcodes[op] += w[t].counts.opcodes[op];
+        }
+
+        for (int a = 0; a < 65536; ++a) {
+            w[0].counts.jsr[a] += w[t].counts.jsr[a];
+            w[0].counts.jmp[a] += w[t].counts.jmp[a];
+        }
+
+        w[0].files += w[t].files;
+        w[0].failed += w[t].failed;
+        w[0].bytes += w[t].bytes;
+    }
+
+    // Addressing modes and totals follow from the opcodes
+    uint64_t modes[DISASM_MODES] = {0};
+    uint64_t instructions = 0;
+    uint64_t illegal = 0;
+
+    for (int op = 0; op < 256; ++op) {
+        uint64_t n = w[0].counts.opcodes[op];
+
+        modes[disasm_mode((uint8_t)op)] += n;
+        instructions += n;
+        illegal += disasm_illegal((uint8_t)op) ? n : 0;
+    }
+
+    if (json) {
+        write_json(out, &w[0], modes, instructions, illegal, count);
+    } else {
+        write_csv(out, &w[0], modes, instructions, illegal, count);
+    }
+
+    int status = w[0].failed ? -1 : 0;
+
+    free(w);
+
+    return status;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+
+// Instruction statistics over a corpus: opcode, illegal opcode and
+// addressing mode counts and JSR/JMP targets, with KERNAL jump table
+// entries named. Files are decoded in parallel into per-thread counters
+// that are merged at the end; nothing is formatted per file.
+
+// Decodes the inputs, and the files inside container images, and writes
+// the totals as CSV or as a JSON object. Returns 0, or -1 if an input
+// couldn't be read.
+int histogram(FILE *out, char **paths, const container_kind *kinds, int count, int json);
@@ -0,0 +1,634 @@
+#define _DEFAULT_SOURCE
+
+#include "index.h"
+#include "disk.h"
+#include "util.h"
+#include "petscii.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "D64INDEX"
+#define INDEX_MAGIC_LEN 8
+#define INDEX_VERSION 1
+#define PETSCII_PAD 0xA0
+#define TRIGRAM_LEN 3
+
+typedef struct
+{
+    char magic[INDEX_MAGIC_LEN];
+    uint32_t version;
+    uint32_t images;
+    uint32_t entries;
+    uint32_t trigrams;
+    uint64_t images_off;
+    uint64_t entries_off;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t strings_off;
+    uint64_t size;
+} index_header;
+
+typedef struct
+{
+    uint32_t name;              // normalized name in the string pool
+    uint32_t image;
+    uint8_t raw[DISK_NAME_LEN];
+    uint8_t raw_len;
+    uint8_t type;
+    uint16_t blocks;
+} index_entry;
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t count;
+    uint64_t postings;          // index of the first entry id
+} index_trigram;
+
+struct index_builder
+{
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    uint32_t *images;
+    size_t images_len;
+    size_t images_cap;
+    index_entry *entries;
+    size_t entries_len;
+    size_t entries_cap;
+    uint32_t current_image;
+};
+
+static int grow(void **ptr, size_t *cap, size_t need, size_t elem)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap : 1024;
+    while (n < need) {
+        n *= 2;
+    }
+
+    void *p = realloc(*ptr, n * elem);
+    if (!p) {
+        return -1;
+    }
+
+    *ptr = p;
+    *cap = n;
+
+    return 0;
+}
+
+static long add_string(index_builder *b, const char *str, size_t len)
+{
+    if (grow((void **)&b->strings, &b->strings_cap, b->strings_len + len + 1, 1) != 0) {
+        return -1;
+    }
+
+    size_t off = b->strings_len;
+    memcpy(b->strings + off, str, len);
+    b->strings[off + len] = '\0';
+    b->strings_len += len + 1;
+
+    return (long)off;
+}
+
+index_builder *index_builder_new(void)
+{
+    return calloc(1, sizeof(index_builder));
+}
+
+void index_builder_free(index_builder *b)
+{
+    if (!b) {
+        return;
+    }
+
+    free(b->strings);
+    free(b->images);
+    free(b->entries);
+    free(b);
+}
+
+static int add_entry(const disk_dirent *e, void *ctx)
+{
+    index_builder *b = ctx;
+    char name[DISK_NAME_LEN + 1];
+    size_t len = petscii_name(e->name, DISK_NAME_LEN, name);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    long off = add_string(b, name, len);
+    if (off < 0 || grow((void **)&b->entries, &b->entries_cap, b->entries_len + 1, sizeof(index_entry)) != 0) {
+        return -1;
+    }
+
+    index_entry *ie = &b->entries[b->entries_len++];
+    memset(ie, 0, sizeof(*ie));
+    ie->name = (uint32_t)off;
+    ie->image = b->current_image;
+    ie->raw_len = 0;
+    while (ie->raw_len < DISK_NAME_LEN && e->name[ie->raw_len] != PETSCII_PAD) {
+        ie->raw_len++;
+    }
+    memcpy(ie->raw, e->name, ie->raw_len);
+    ie->type = e->type;
+    ie->blocks = (uint16_t)e->blocks;
+
+    return 0;
+}
+
+int index_add_image(index_builder *b, const char *path, const uint8_t *buffer, size_t size)
+{
+    long off = add_string(b, path, strlen(path));
+    if (off < 0 || grow((void **)&b->images, &b->images_cap, b->images_len + 1, sizeof(uint32_t)) != 0) {
+        return -1;
+    }
+
+    b->current_image = (uint32_t)b->images_len;
+    b->images[b->images_len++] = (uint32_t)off;
+
+    return disk_directory(buffer, size, add_entry, b);
+}
+
+// qsort has no context argument
+static const char *g_sort_strings;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const index_entry *ea = a;
+    const index_entry *eb = b;
+    int c = strcmp(g_sort_strings + ea->name, g_sort_strings + eb->name);
+
+    if (c != 0) {
+        return c;
+    }
+
+    return (ea->image > eb->image) - (ea->image < eb->image);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t trigram_key(const char *p)
+{
+    return ((uint32_t)(uint8_t)p[0] << 16) | ((uint32_t)(uint8_t)p[1] << 8) | (uint8_t)p[2];
+}
+
+int index_write(index_builder *b, const char *path)
+{
+    g_sort_strings = b->strings;
+    qsort(b->entries, b->entries_len, sizeof(index_entry), compare_entries);
+
+    // (trigram << 32 | entry id) pairs, sorted and deduplicated
+    size_t pairs_len = 0;
+    size_t pairs_cap = 0;
+    uint64_t *pairs = NULL;
+
+    for (size_t i = 0; i < b->entries_len; ++i) {
+        const char *name = b->strings + b->entries[i].name;
+        size_t len = strlen(name);
+
+        for (size_t j = 0; j + TRIGRAM_LEN <= len; ++j) {
+            if (grow((void **)&pairs, &pairs_cap, pairs_len + 1, sizeof(uint64_t)) != 0) {
+                free(pairs);
+                return -1;
+            }
+
+            pairs[pairs_len++] = ((uint64_t)trigram_key(&name[j]) << 32) | i;
+        }
+    }
+
+    qsort(pairs, pairs_len, sizeof(uint64_t), compare_u64);
+
+    size_t unique = 0;
+    size_t trigrams = 0;
+    for (size_t i = 0; i < pairs_len; ++i) {
+        if (unique > 0 && pairs[unique - 1] == pairs[i]) {
+            continue;
+        }
+
+        if (unique == 0 || (pairs[unique - 1] >> 32) != (pairs[i] >> 32)) {
+            trigrams++;
+        }
+
+        pairs[unique++] = pairs[i];
+    }
+
+    // Offsets, counts and entry ids are stored in 32 bits
+    if (b->strings_len > UINT32_MAX || b->images_len > UINT32_MAX || b->entries_len > UINT32_MAX) {
+        free(pairs);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    hdr.version = INDEX_VERSION;
+    hdr.images = (uint32_t)b->images_len;
+    hdr.entries = (uint32_t)b->entries_len;
+    hdr.trigrams = (uint32_t)trigrams;
+    hdr.images_off = sizeof(hdr);
+    hdr.entries_off = hdr.images_off + b->images_len * sizeof(uint32_t);
+    hdr.trigrams_off = hdr.entries_off + b->entries_len * sizeof(index_entry);
+    hdr.postings_off = hdr.trigrams_off + trigrams * sizeof(index_trigram);
+    hdr.strings_off = hdr.postings_off + unique * sizeof(uint32_t);
+    hdr.size = hdr.strings_off + b->strings_len;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        free(pairs);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(b->images, sizeof(uint32_t), b->images_len, f);
+    fwrite(b->entries, sizeof(index_entry), b->entries_len, f);
+
+    for (size_t i = 0; i < unique; ) {
+        index_trigram t;
+        size_t j = i;
+
+        while (j < unique && (pairs[j] >> 32) == (pairs[i] >> 32)) {
+            j++;
+        }
+
+        t.key = (uint32_t)(pairs[i] >> 32);
+        t.count = (uint32_t)(j - i);
+        t.postings = i;
+        fwrite(&t, sizeof(t), 1, f);
+        i = j;
+    }
+
+    for (size_t i = 0; i < unique; ++i) {
+        uint32_t id = (uint32_t)pairs[i];
+        fwrite(&id, sizeof(id), 1, f);
+    }
+
+    fwrite(b->strings, 1, b->strings_len, f);
+    free(pairs);
+
+    int status = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+// CBM wildcards: '*' matches any run of characters, '?' any single one
+static int wildcard_match(const char *pattern, const char *name)
+{
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return 0;
+        }
+    }
+
+    while (*pattern == '*') {
+        pattern++;
+    }
+
+    return *pattern == '\0';
+}
+
+typedef struct
+{
+    const uint8_t *map;
+    const index_header *hdr;
+    const uint32_t *images;
+    const index_entry *entries;
+    const index_trigram *trigrams;
+    const uint32_t *postings;
+    const char *strings;
+} index_view;
+
+// Checks that every section lies inside the file and every offset, id
+// and count stored in them points inside its section
+static int index_valid(const index_view *v, uint64_t size)
+{
+    const index_header *h = v->hdr;
+
+    if (h->images_off < sizeof(index_header) || h->images_off > size ||
+            (size - h->images_off) / sizeof(uint32_t) < h->images ||
+            h->entries_off < h->images_off + (uint64_t)h->images * sizeof(uint32_t) || h->entries_off > size ||
+            (size - h->entries_off) / sizeof(index_entry) < h->entries ||
+            h->trigrams_off < h->entries_off + (uint64_t)h->entries * sizeof(index_entry) || h->trigrams_off > size ||
+            (size - h->trigrams_off) / sizeof(index_trigram) < h->trigrams ||
+            h->postings_off < h->trigrams_off + (uint64_t)h->trigrams * sizeof(index_trigram) ||
+            h->strings_off < h->postings_off || h->strings_off > size ||
+            (h->strings_off - h->postings_off) % sizeof(uint32_t) != 0) {
+        return 0;
+    }
+
+    // A terminated pool keeps every in-range name within the file
+    uint64_t strings_len = size - h->strings_off;
+    if (strings_len > 0 && v->strings[strings_len - 1] != '\0') {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < h->images; ++i) {
+        if (v->images[i] >= strings_len) {
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < h->entries; ++i) {
+        const index_entry *e = &v->entries[i];
+
+        if (e->name >= strings_len || e->image >= h->images || e->raw_len > DISK_NAME_LEN) {
+            return 0;
+        }
+    }
+
+    uint64_t postings = (h->strings_off - h->postings_off) / sizeof(uint32_t);
+    for (uint32_t i = 0; i < h->trigrams; ++i) {
+        const index_trigram *t = &v->trigrams[i];
+
+        if (t->postings > postings || t->count > postings - t->postings) {
+            return 0;
+        }
+    }
+
+    for (uint64_t i = 0; i < postings; ++i) {
+        if (v->postings[i] >= h->entries) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static const char *entry_name(const index_view *v, uint32_t id)
+{
+    return v->strings + v->entries[id].name;
+}
+
+// First entry whose name is not less than the prefix
+static uint32_t lower_bound(const index_view *v, const char *prefix, size_t len)
+{
+    uint32_t lo = 0;
+    uint32_t hi = v->hdr->entries;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strncmp(entry_name(v, mid), prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// First entry past those starting with prefix
+static uint32_t upper_bound(const index_view *v, const char *prefix, size_t len)
+{
+    uint32_t lo = 0;
+    uint32_t hi = v->hdr->entries;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strncmp(entry_name(v, mid), prefix, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static const index_trigram *find_trigram(const index_view *v, uint32_t key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = v->hdr->trigrams;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (v->trigrams[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < v->hdr->trigrams && v->trigrams[lo].key == key) {
+        return &v->trigrams[lo];
+    }
+
+    return NULL;
+}
+
+// Intersects the sorted id list in place with a posting list
+static size_t intersect(uint32_t *ids, size_t len, const uint32_t *list, size_t list_len)
+{
+    size_t n = 0;
+    size_t j = 0;
+
+    for (size_t i = 0; i < len && j < list_len; ) {
+        if (ids[i] < list[j]) {
+            i++;
+        } else if (ids[i] > list[j]) {
+            j++;
+        } else {
+            ids[n++] = ids[i];
+            i++;
+            j++;
+        }
+    }
+
+    return n;
+}
+
+static void print_match(FILE *out, const index_view *v, uint32_t id)
+{
+    const index_entry *e = &v->entries[id];
+
+    fprintf(out, "%s: %-5u\"%s\" %s\n", v->strings + v->images[e->image], e->blocks,
+        entry_name(v, id), get_filetype(e->type));
+}
+
+// Candidates from the trigrams of the literal runs in the pattern. Returns
+// -1 when the pattern has no usable trigram, otherwise the list length.
+static long trigram_candidates(const index_view *v, const char *pattern, uint32_t **out)
+{
+    const index_trigram *lists[DISK_NAME_LEN * 4];
+    size_t count = 0;
+    size_t run = 0;
+
+    for (const char *p = pattern; ; ++p) {
+        if (*p == '*' || *p == '?' || *p == '\0') {
+            run = 0;
+
+            if (*p == '\0') {
+                break;
+            }
+            continue;
+        }
+
+        if (++run < TRIGRAM_LEN) {
+            continue;
+        }
+
+        const index_trigram *t = find_trigram(v, trigram_key(p - TRIGRAM_LEN + 1));
+        if (!t) {
+            *out = NULL;
+            return 0;
+        }
+
+        if (count < sizeof(lists) / sizeof(lists[0])) {
+            lists[count++] = t;
+        }
+    }
+
+    if (count == 0) {
+        return -1;
+    }
+
+    // Start from the shortest list
+    size_t shortest = 0;
+    for (size_t i = 1; i < count; ++i) {
+        if (lists[i]->count < lists[shortest]->count) {
+            shortest = i;
+        }
+    }
+
+    uint32_t *ids = malloc((lists[shortest]->count + 1) * sizeof(uint32_t));
+    if (!ids) {
+        return -1;
+    }
+
+    size_t len = lists[shortest]->count;
+    memcpy(ids, v->postings + lists[shortest]->postings, len * sizeof(uint32_t));
+
+    for (size_t i = 0; i < count && len > 0; ++i) {
+        if (i != shortest) {
+            len = intersect(ids, len, v->postings + lists[i]->postings, lists[i]->count);
+        }
+    }
+
+    *out = ids;
+
+    return (long)len;
+}
+
+long index_find(FILE *out, const char *path, const char *pattern)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(index_header)) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    index_view v;
+    v.map = map;
+    v.hdr = (const index_header *)map;
+
+    if (memcmp(v.hdr->magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0 ||
+            v.hdr->version != INDEX_VERSION || v.hdr->size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Not a valid index file: %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    v.images = (const uint32_t *)(map + v.hdr->images_off);
+    v.entries = (const index_entry *)(map + v.hdr->entries_off);
+    v.trigrams = (const index_trigram *)(map + v.hdr->trigrams_off);
+    v.postings = (const uint32_t *)(map + v.hdr->postings_off);
+    v.strings = (const char *)(map + v.hdr->strings_off);
+
+    if (!index_valid(&v, v.hdr->size)) {
+        fprintf(stderr, "Not a valid index file: %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Names are stored lowercase
+    size_t plen = strlen(pattern);
+    char lowered[plen + 1];
+    for (size_t i = 0; i <= plen; ++i) {
+        char c = pattern[i];
+        lowered[i] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+    }
+
+    size_t prefix_len = strcspn(lowered, "*?");
+    uint32_t first = 0;
+    uint32_t last = v.hdr->entries;
+
+    // Without a literal prefix every entry is in range
+    if (prefix_len > 0) {
+        first = lower_bound(&v, lowered, prefix_len);
+        last = upper_bound(&v, lowered, prefix_len);
+    }
+
+    uint32_t *ids = NULL;
+    long candidates = trigram_candidates(&v, lowered, &ids);
+    long matches = 0;
+
+    if (candidates >= 0 && (prefix_len == 0 || (uint32_t)candidates < last - first)) {
+        for (long i = 0; i < candidates; ++i) {
+            if (wildcard_match(lowered, entry_name(&v, ids[i]))) {
+                print_match(out, &v, ids[i]);
+                matches++;
+            }
+        }
+    } else {
+        for (uint32_t id = first; id < last; ++id) {
+            if (wildcard_match(lowered, entry_name(&v, id))) {
+                print_match(out, &v, id);
+                matches++;
+            }
+        }
+    }
+
+    free(ids);
+    munmap(map, (size_t)st.st_size);
+
+    return matches;
+}
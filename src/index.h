@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Collection-wide filename index. Directory entry names are stored raw
+// and normalized to lowercase ASCII, sorted by name for prefix lookups
+// and with trigram posting lists for patterns starting with a wildcard.
+
+typedef struct index_builder index_builder;
+
+index_builder *index_builder_new(void);
+void index_builder_free(index_builder *b);
+
+int index_add_image(index_builder *b, const char *path, const uint8_t *buffer, size_t size);
+int index_write(index_builder *b, const char *path);
+
+// Prints every entry matching a CBM pattern ('*' and '?' wildcards).
+// Returns the number of matches or -1 on error.
+long index_find(FILE *out, const char *path, const char *pattern);
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include "disk.h"
 #include "disasm.h"
 #include "basic.h"
@@ -5,12 +7,28 @@
 #include "crt.h"
 #include "t64.h"
 #include "pxx.h"
+#include "tap.h"
+#include "cache.h"
+#include "index.h"
+#include "pack.h"
+#include "bulk.h"
+#include "dat.h"
+#include "grep.h"
+#include "histogram.h"
+#include "similar.h"
+#include "serve.h"
+#include "watch.h"
+#include "fill.h"
+#include "stats.h"
+#include "petscii.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <sys/types.h>
@@ -18,17 +36,147 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+
+typedef enum {BIN, D64, BAS, SID, CRT, T64, PXX, TAP} filetype;
+
+// Long-only options
+enum {
+    OPT_CACHE_COMPACT = 256,
+    OPT_CACHE_VERIFY,
+    OPT_INDEX,
+    OPT_FIND,
+    OPT_GREP,
+    OPT_STATS,
+    OPT_CHARSET,
+    OPT_RECOVER,
+    OPT_RECORD,
+    OPT_TAP_THRESHOLDS,
+    OPT_CREATE,
+    OPT_WRITE,
+    OPT_TITLE,
+    OPT_TRACKS,
+    OPT_DIFF,
+    OPT_PACK,
+    OPT_UNPACK,
+    OPT_VERIFY_DAT,
+    OPT_DAT_CONTENTS,
+    OPT_FINGERPRINT,
+    OPT_HISTOGRAM,
+    OPT_SIMILAR_INDEX,
+    OPT_SIMILAR,
+    OPT_TOP,
+    OPT_SERVE,
+    OPT_WATCH,
+    OPT_PACK_D64,
+    OPT_BRIEF
+};
+
+typedef struct
+{
+    int force;
+    int illegal;
+    int bam;
+    int brief;
+    uint16_t address;
+    int headers;
+    cache *cache;
+    int cache_verify;
+} options;
 
-typedef enum {BIN, D64, BAS, SID, CRT, T64, PXX} filetype;
+static const struct option long_options[] = {
+    {"address",       required_argument, NULL, 'a'},
+    {"force",         no_argument,       NULL, 'f'},
+    {"illegal",       no_argument,       NULL, 'i'},
+    {"bam",           no_argument,       NULL, 'b'},
+    {"brief",         no_argument,       NULL, OPT_BRIEF},
+    {"cache",         required_argument, NULL, 'c'},
+    {"cache-compact", no_argument,       NULL, OPT_CACHE_COMPACT},
+    {"cache-verify",  no_argument,       NULL, OPT_CACHE_VERIFY},
+    {"index",         required_argument, NULL, OPT_INDEX},
+    {"find",          required_argument, NULL, OPT_FIND},
+    {"grep",          required_argument, NULL, OPT_GREP},
+    {"stats",         optional_argument, NULL, OPT_STATS},
+    {"charset",       required_argument, NULL, OPT_CHARSET},
+    {"recover",       no_argument,       NULL, OPT_RECOVER},
+    {"extract",       required_argument, NULL, 'x'},
+    {"record",        required_argument, NULL, OPT_RECORD},
+    {"tap-thresholds", required_argument, NULL, OPT_TAP_THRESHOLDS},
+    {"create",        required_argument, NULL, OPT_CREATE},
+    {"write",         required_argument, NULL, OPT_WRITE},
+    {"title",         required_argument, NULL, OPT_TITLE},
+    {"tracks",        required_argument, NULL, OPT_TRACKS},
+    {"diff",          no_argument,       NULL, OPT_DIFF},
+    {"pack",          required_argument, NULL, OPT_PACK},
+    {"unpack",        required_argument, NULL, OPT_UNPACK},
+    {"verify-dat",    required_argument, NULL, OPT_VERIFY_DAT},
+    {"dat-contents",  no_argument,       NULL, OPT_DAT_CONTENTS},
+    {"fingerprint",   no_argument,       NULL, OPT_FINGERPRINT},
+    {"histogram",     optional_argument, NULL, OPT_HISTOGRAM},
+    {"similar-index", required_argument, NULL, OPT_SIMILAR_INDEX},
+    {"similar",       required_argument, NULL, OPT_SIMILAR},
+    {"top",           required_argument, NULL, OPT_TOP},
+    {"serve",         required_argument, NULL, OPT_SERVE},
+    {"watch",         required_argument, NULL, OPT_WATCH},
+    {"pack-d64",      required_argument, NULL, OPT_PACK_D64},
+    {"help",          no_argument,       NULL, 'h'},
+    {NULL,            0,                 NULL, 0}
+};
 
 static void printhelp(char *program)
 {
-    printf("Usage: %s [options] file\n" \
-        "  -a address  disassemble from address\n" \
-        "  -f          force disassembly\n" \
-        "  -i          show illegal opcodes\n" \
-        "  -b          show disk BAM\n" \
-        "  -h          this help text\n", basename(program));
+    printf("Usage: %s [options] file...\n" \
+        "  -a, --address address  disassemble from address\n" \
+        "  -f, --force            force disassembly\n" \
+        "  -i, --illegal          show illegal opcodes\n" \
+        "  -b, --bam              show disk BAM\n" \
+        "      --brief            list disk images without sizes, load addresses\n" \
+        "                         and REL records, walking no file chains\n" \
+        "  -c, --cache file       cache D64/SID/CRT/T64 results in file\n" \
+        "      --cache-compact    compact the cache file and exit\n" \
+        "      --cache-verify     check cached files against a content hash\n" \
+        "      --index file       write a filename index of the given disk images\n" \
+        "      --find pattern     search an index for a CBM pattern (* and ?)\n" \
+        "      --grep hex         search files and image contents for bytes (?? any)\n" \
+        "      --stats[=json]     print timings and counters to stderr\n" \
+        "      --charset name     PETSCII output: ascii, lower, upper or utf8\n" \
+        "      --recover          list scratched and orphaned files in disk images\n" \
+        "  -x, --extract dir      write disk image and tape files to dir (GEOS files\n" \
+        "                         as CVT) or recovered files with --recover\n" \
+        "      --record n         dump record n (from 1) of every REL file\n" \
+        "      --tap-thresholds a,b,c,d\n" \
+        "                         TAP pulse boundaries: turbo 0/1, turbo/short,\n" \
+        "                         short/medium and medium/long (0x20,0x2c,0x3a,0x4c)\n" \
+        "      --create image     format a new D64 and write the given files to it\n" \
+        "      --write image      write the given files to an existing D64\n" \
+        "      --title name,id    disk name and id for --create and --pack-d64\n" \
+        "      --tracks n         35 or 40 tracks for --create and --pack-d64\n" \
+        "                         (default 35)\n" \
+        "      --diff a b         compare two disk images sector by sector\n" \
+        "      --pack store       store the given images deduplicated in one file\n" \
+        "      --unpack store     restore images from a store to -x dir (default .),\n" \
+        "                         all or the given names; image:file for one file\n" \
+        "      --verify-dat dat   check files against a DAT by size, CRC32 and SHA-1\n" \
+        "      --dat-contents     with --verify-dat, check the files inside images too\n" \
+        "      --fingerprint      group disk images with the same used sectors and\n" \
+        "                         directory; - reads the names from stdin\n" \
+        "      --histogram[=json] count opcodes, addressing modes and JSR/JMP targets\n" \
+        "                         over all files and image contents as CSV or JSON;\n" \
+        "                         - reads the names from stdin\n" \
+        "      --similar-index file\n" \
+        "                         write a MinHash index of the given files and the\n" \
+        "                         programs in images; - reads the names from stdin\n" \
+        "      --similar index    list the indexed programs most like the given files\n" \
+        "      --top n            matches listed per program by --similar (default 10)\n" \
+        "      --serve socket     answer list, info, extract and disassemble requests\n" \
+        "                         on a Unix domain socket until interrupted\n" \
+        "      --watch dir        print a JSON line for every file in the tree and\n" \
+        "                         again whenever one is added, changed or removed\n" \
+        "      --pack-d64 prefix  spread PRG, P00 and T64 files over as few images,\n" \
+        "                         prefix-001.d64 on, as they fit; - reads the names\n" \
+        "                         from stdin\n" \
+        "  -h, --help             this help text\n", basename(program));
 }
 
 static filetype get_ftype(const uint8_t *buffer, const char *filename)
@@ -39,9 +187,11 @@ static filetype get_ftype(const uint8_t *buffer, const char *filename)
     if (flen < 4)
         return BIN;
 
-    // D64
+    // D64, G64 is decoded to the same layout
     if ((strncmp(&filename[flen - 3], "d64", 3) == 0 ||
-            strncmp(&filename[flen - 3], "D64", 3) == 0))
+            strncmp(&filename[flen - 3], "D64", 3) == 0 ||
+            strncmp(&filename[flen - 3], "g64", 3) == 0 ||
+            strncmp(&filename[flen - 3], "G64", 3) == 0))
         return D64;
 
     // SID
@@ -59,6 +209,11 @@ static filetype get_ftype(const uint8_t *buffer, const char *filename)
             strncmp(&filename[flen - 3], "T64", 3) == 0))
         return T64;
 
+    // TAP
+    if ((strncmp(&filename[flen - 3], "tap", 3) == 0 ||
+            strncmp(&filename[flen - 3], "TAP", 3) == 0))
+        return TAP;
+
     // PXX
     if ((strncmp(&filename[flen - 3], "p", 1) == 0 ||
           strncmp(&filename[flen - 3], "P", 1) == 0)) {
@@ -71,115 +226,1637 @@ static filetype get_ftype(const uint8_t *buffer, const char *filename)
             return PXX;
     }
 
-    // Basic
-    if (buffer[0] == 0x01 && buffer[1] == 0x08)
+    // Basic, only known once the file has been mapped
+    if (buffer && buffer[0] == 0x01 && buffer[1] == 0x08)
       return BAS;
 
     // Default disassemble
     return BIN;
 }
 
-int main(int argc, char **argv)
+static void render(FILE *out, const uint8_t *buffer, const size_t size, filetype type, const options *opt)
 {
-    int optforce = 0;
-    int optillegal = 0;
-    int optbam = 0;
-    uint16_t address = UINT16_MAX;
-    char c;
-    char *end;
-    while ((c = getopt(argc, argv, "bfiha:")) != -1) {
-        switch (c) {
-            case 'a':
-                address = strtol(optarg, &end, 0);
-                if (end == optarg) {
-                    errno = EINVAL;
-                    perror("Error");
-                    return EXIT_FAILURE;
-                }
-                break;
+    if (opt->force) {
+        disasm(out, buffer, size, opt->address, opt->illegal);
+        return;
+    }
 
-            case 'f':
-                optforce = 1;
-                break;
+    switch (type) {
+        case D64:
+            disk(out, buffer, size, opt->bam, !opt->brief);
+            break;
 
-            case 'i':
-                optillegal = 1;
+        case BAS:
+            basic(out, buffer, size);
+            break;
+
+        case SID:
+            sid(out, buffer, size);
+            break;
+
+        case CRT:
+            crt(out, buffer, size);
+            break;
+
+        case T64:
+            t64(out, buffer, size);
+            break;
+
+        case PXX:
+            pxx(out, buffer, size);
+            break;
+
+        case TAP:
+            tap(out, buffer, size);
+            break;
+
+        case BIN:
+        default:
+            disasm(out, buffer, size, opt->address, opt->illegal);
+            break;
+    }
+}
+
+static void cache_key_from_stat(cache_key *key, const struct stat *st, filetype type, const options *opt)
+{
+    key->dev = (uint64_t)st->st_dev;
+    key->ino = (uint64_t)st->st_ino;
+    key->size = (uint64_t)st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    // Everything besides the file itself that changes the output
+    key->variant = (uint32_t)type | (opt->bam ? 0x100 : 0) |
+        (uint32_t)petscii_get_charset() << 9 | (opt->brief ? 0x800 : 0);
+}
+
+static int cache_prefix_matches(const char *path, uint64_t content_hash)
+{
+    uint8_t prefix[4096];
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    ssize_t len = pread(fd, prefix, sizeof(prefix), 0);
+    close(fd);
+
+    return len >= 0 && cache_content_hash(prefix, (size_t)len) == content_hash;
+}
+
+typedef struct
+{
+    int fd;
+    uint8_t *buffer;
+    size_t size;
+    int mapped;                 // else read into memory of our own
+    struct stat st;
+} mapped_file;
+
+static int open_input(const char *path, mapped_file *m)
+{
+    m->buffer = NULL;
+    m->size = 0;
+    m->mapped = 0;
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) {
+        perror("Error");
+        return -1;
+    }
+
+    if (fstat(m->fd, &m->st) < 0) {
+        perror("Error");
+        close(m->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Pipes, FIFOs, /dev/stdin and files the kernel can't map are read into
+// a buffer that doubles as needed, with zeroed padding as in a mapping
+static int read_input(mapped_file *m)
+{
+    size_t cap = 64 * 1024;
+    uint8_t *buffer = malloc(cap + BULK_PAD);
+
+    while (buffer) {
+        ssize_t n = read(m->fd, buffer + m->size, cap - m->size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            if (n < 0 || m->size == 0) {
+                // Empty input fails as it does to mmap
+                errno = n < 0 ? errno : EINVAL;
                 break;
+            }
 
-            case 'b':
-                optbam = 1;
+            memset(buffer + m->size, 0, BULK_PAD);
+            m->buffer = buffer;
+            return 0;
+        }
+
+        m->size += (size_t)n;
+
+        if (m->size == cap) {
+            uint8_t *grown = realloc(buffer, cap * 2 + BULK_PAD);
+
+            if (!grown) {
                 break;
+            }
 
-            case 'h':
-            default:
-                printhelp(argv[0]);
-                return EXIT_SUCCESS;
+            buffer = grown;
+            cap *= 2;
         }
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "Missing filename\n");
-        printhelp(argv[0]);
-        return EXIT_FAILURE;
+    perror("Error");
+    free(buffer);
+
+    return -1;
+}
+
+static int load_input(mapped_file *m)
+{
+    if (S_ISREG(m->st.st_mode) && m->st.st_size > 0) {
+        m->buffer = mmap(NULL, (size_t)m->st.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+
+        if (m->buffer != MAP_FAILED) {
+            m->size = (size_t)m->st.st_size;
+            m->mapped = 1;
+            return 0;
+        }
     }
 
-    int fd = open(argv[optind], O_RDONLY);
-    if (fd < 0) {
+    if (read_input(m) != 0) {
+        close(m->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int map_file(const char *path, mapped_file *m)
+{
+    return open_input(path, m) == 0 ? load_input(m) : -1;
+}
+
+static void unmap_file(mapped_file *m)
+{
+    if (m->mapped) {
+        munmap(m->buffer, m->size);
+    } else {
+        free(m->buffer);
+    }
+
+    close(m->fd);
+}
+
+static int build_index(const char *index_path, char **paths, int count)
+{
+    index_builder *b = index_builder_new();
+    if (!b) {
         perror("Error");
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
+    for (int i = 0; i < count; ++i) {
+        mapped_file m;
+
+        if (get_ftype(NULL, paths[i]) != D64) {
+            continue;
+        }
+
+        if (map_file(paths[i], &m) != 0) {
+            continue;
+        }
+
+        if (index_add_image(b, paths[i], m.buffer, m.size) != 0) {
+            fprintf(stderr, "Failed to index %s\n", paths[i]);
+        }
+
+        unmap_file(&m);
+    }
+
+    int status = index_write(b, index_path);
+    if (status != 0) {
         perror("Error");
-        close(fd);
-        return EXIT_FAILURE;
     }
 
-    uint8_t *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) {
+    index_builder_free(b);
+
+    return status;
+}
+
+static int build_pack(const char *store, char **paths, int count)
+{
+    pack_builder *b = pack_builder_new();
+    if (!b) {
         perror("Error");
-        close(fd);
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    if (optforce)
-        disasm(buffer, st.st_size, address, optillegal);
-    else {
-        switch (get_ftype(buffer, argv[optind])) {
-            case D64:
-                disk(buffer, st.st_size, optbam);
-                break;
+    int status = 0;
 
-            case BAS:
-                basic(buffer, st.st_size);
-                break;
+    for (int i = 0; i < count; ++i) {
+        mapped_file m;
 
-            case SID:
-                sid(buffer, st.st_size);
-                break;
+        if (map_file(paths[i], &m) != 0) {
+            status = -1;
+            continue;
+        }
 
-            case CRT:
-                crt(buffer, st.st_size);
-                break;
+        if (pack_add_image(b, paths[i], m.buffer, m.size) != 0) {
+            fprintf(stderr, "Failed to pack %s\n", paths[i]);
+            status = -1;
+        }
 
-            case T64:
-                t64(buffer, st.st_size);
-                break;
+        unmap_file(&m);
+    }
 
-            case PXX:
-                pxx(buffer, st.st_size);
-                break;
+    if (pack_write(b, store) != 0) {
+        perror("Error");
+        status = -1;
+    } else {
+        pack_report(stdout, b);
+    }
 
-            case BIN:
-            default:
-                disasm(buffer, st.st_size, address, optillegal);
-                break;
+    pack_builder_free(b);
+
+    return status;
+}
+
+static container_kind get_container(filetype type)
+{
+    switch (type) {
+        case D64:
+            return CONTAINER_D64;
+        case T64:
+            return CONTAINER_T64;
+        case TAP:
+            return CONTAINER_TAP;
+        case CRT:
+            return CONTAINER_CRT;
+        case PXX:
+            return CONTAINER_P00;
+        case BIN:
+        case BAS:
+            return CONTAINER_PRG;
+        case SID:
+        default:
+            return CONTAINER_RAW;
+    }
+}
+
+static int verify_dat(const char *dat_path, int contents, char **paths, int count)
+{
+    dat *d = dat_load(dat_path);
+    container_kind *kinds = NULL;
+
+    if (!d) {
+        return -1;
+    }
+
+    if (contents && (kinds = malloc((size_t)count * sizeof(container_kind))) == NULL) {
+        perror("Error");
+        dat_free(d);
+        return -1;
+    }
+
+    for (int i = 0; kinds && i < count; ++i) {
+        kinds[i] = get_container(get_ftype(NULL, paths[i]));
+    }
+
+    long problems = dat_verify(stdout, d, paths, kinds, count);
+
+    free(kinds);
+    dat_free(d);
+
+    return problems == 0 ? 0 : -1;
+}
+
+static long grep_files(const grep_pattern *pattern, char **paths, int count)
+{
+    long matches = 0;
+
+    for (int i = 0; i < count; ++i) {
+        mapped_file m;
+
+        STATS_PHASE(STATS_OPEN);
+        if (map_file(paths[i], &m) != 0) {
+            continue;
         }
+
+        STATS_ADD(files, 1);
+        STATS_PHASE(STATS_DETECT);
+        container_kind kind = get_container(get_ftype(m.buffer, paths[i]));
+
+        STATS_PHASE(STATS_PARSE);
+        long n = grep(stdout, pattern, paths[i], kind, m.buffer, m.size);
+
+        if (n > 0) {
+            matches += n;
+        }
+
+        unmap_file(&m);
     }
 
-    munmap(buffer, st.st_size);
-    close(fd);
+    STATS_PHASE_END();
+
+    return matches;
+}
+
+typedef struct
+{
+    const char *dir;
+    const char *image;
+    uint8_t *buffer;
+    int count;
+} extraction;
+
+static int write_file(const char *path, const uint8_t *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (!f || fwrite(data, 1, len, f) != len) {
+        perror("Error");
+        if (f) {
+            fclose(f);
+        }
+        return -1;
+    }
+
+    fclose(f);
+    printf("%s\n", path);
+
+    return 0;
+}
+
+// Keeps names usable on the host file system
+static void host_name(char *name)
+{
+    for (char *p = name; *p; ++p) {
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-') {
+            *p = '_';
+        }
+    }
+}
+
+// Names the file if reading it since before crossed bad sectors
+static void flag_bad_reads(const char *path, long before)
+{
+    int track = 0;
+    int sector = 0;
+    long bad = disk_bad_reads(&track, &sector) - before;
+
+    if (bad > 0) {
+        fprintf(stderr, "Read %ld bad sector%s, last %d/%d error %d: %s\n", bad,
+            bad == 1 ? "" : "s", track, sector, disk_sector_error(track, sector), path);
+    }
+}
+
+static int extract_entry(const disk_dirent *e, void *ctx)
+{
+    extraction *x = ctx;
+    char name[DISK_NAME_LEN + 1];
+    char path[PATH_MAX];
+    disk_geos geos;
+    long len;
+    long bad = disk_bad_reads(NULL, NULL);
+
+    if (e->track == 0) {
+        return 0;
+    }
+
+    if (petscii_name(e->name, DISK_NAME_LEN, name) == 0) {
+        snprintf(name, sizeof(name), "unnamed");
+    }
+    host_name(name);
+
+    if (disk_geos_info(e, &geos)) {
+        snprintf(path, sizeof(path), "%s/%s.cvt", x->dir, name);
+        len = disk_geos_cvt(e, x->buffer);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s.%s", x->dir, name, get_filetype(e->type));
+        len = disk_read_chain(e->track, e->sector, x->buffer);
+    }
+
+    // Plain chains end at the first unreadable sector, flagged below
+    if (len == DISK_GEOS_UNREADABLE) {
+        fprintf(stderr, "Unreadable GEOS VLIR index: %s\n", name);
+    } else if (len == DISK_GEOS_SHARED) {
+        fprintf(stderr, "GEOS VLIR records share sectors: %s\n", name);
+    } else if (write_file(path, x->buffer, (size_t)len) == 0) {
+        x->count++;
+        flag_bad_reads(path, bad);
+    }
+
+    return 0;
+}
+
+static int extract_tape_file(const tap_file *f, void *ctx)
+{
+    extraction *x = ctx;
+    char name[TAP_NAME_LEN + 1];
+    char path[PATH_MAX];
+    size_t len = petscii_name(f->name, TAP_NAME_LEN, name);
+
+    while (len > 0 && name[len - 1] == ' ') {
+        name[--len] = '\0';
+    }
+
+    if (len == 0) {
+        snprintf(name, sizeof(name), "unnamed");
+    }
+    host_name(name);
+
+    // Numbered by position, tapes often hold several files of one name
+    int seq = f->format == TAP_CBM && f->type == TAP_CBM_SEQ;
+    snprintf(path, sizeof(path), "%s/%02d-%s.%s", x->dir, x->count + 1, name,
+        seq ? "seq" : "prg");
+
+    // SEQ data has no load address
+    size_t header = seq ? 0 : 2;
+    if (f->size + header > DISK_MAX_CVT_SIZE) {
+        fprintf(stderr, "File too large: %s\n", path);
+        return 0;
+    }
+
+    x->buffer[0] = f->start & 0xFF;
+    x->buffer[1] = f->start >> 8;
+    memcpy(&x->buffer[header], f->data, f->size);
+
+    if (write_file(path, x->buffer, f->size + header) == 0) {
+        x->count++;
+    }
+
+    return 0;
+}
+
+static int extract_image(const char *path, const char *extract_dir)
+{
+    mapped_file m;
+    filetype type = get_ftype(NULL, path);
+
+    if (type != D64 && type != TAP) {
+        fprintf(stderr, "Not a D64 disk image or TAP file: %s\n", path);
+        return -1;
+    }
+
+    if (map_file(path, &m) != 0) {
+        return -1;
+    }
+
+    extraction x = {extract_dir, path, malloc(DISK_MAX_CVT_SIZE), 0};
+    int status = -1;
+
+    if (x.buffer && type == TAP) {
+        status = tap_files(m.buffer, m.size, extract_tape_file, &x);
+    } else if (x.buffer) {
+        status = disk_directory(m.buffer, m.size, extract_entry, &x);
+    }
+    free(x.buffer);
+
+    unmap_file(&m);
+
+    return status;
+}
+
+static int extract_recovered(const disk_recovered *r, void *ctx)
+{
+    extraction *x = ctx;
+    char name[DISK_NAME_LEN + 1] = "";
+    char path[PATH_MAX];
+
+    if (r->name) {
+        petscii_name(r->name, DISK_NAME_LEN, name);
+    }
+
+    host_name(name);
+
+    snprintf(path, sizeof(path), "%s/%s-t%02ds%02d%s%s.%s", x->dir, x->image,
+        r->track, r->sector, name[0] ? "-" : "", name, r->load >= 0 ? "prg" : "seq");
+
+    long bad = disk_bad_reads(NULL, NULL);
+    long len = disk_read_chain(r->track, r->sector, x->buffer);
+
+    if (write_file(path, x->buffer, (size_t)len) == 0) {
+        x->count++;
+        flag_bad_reads(path, bad);
+    }
+
+    return 0;
+}
+
+static int recover_file(const char *path, const char *extract_dir)
+{
+    mapped_file m;
+
+    if (map_file(path, &m) != 0) {
+        return -1;
+    }
+
+    if (!extract_dir) {
+        disk_recover_list(stdout, m.buffer, m.size);
+        unmap_file(&m);
+        return 0;
+    }
+
+    char image[PATH_MAX];
+    snprintf(image, sizeof(image), "%s", path);
+
+    extraction x = {extract_dir, basename(image), malloc(DISK_MAX_FILE_SIZE), 0};
+    int status = -1;
+
+    if (x.buffer) {
+        status = disk_recover(m.buffer, m.size, extract_recovered, &x);
+        free(x.buffer);
+    }
+
+    unmap_file(&m);
+
+    return status;
+}
+
+// Directory type byte from a host file extension, PRG by default
+static uint8_t host_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    static const char *types[] = {"del", "seq", "prg", "usr"};
+
+    for (size_t i = 0; ext && i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (strcasecmp(ext + 1, types[i]) == 0) {
+            return (uint8_t)(0x80 | i);
+        }
+    }
+
+    return 0x82;
+}
+
+// Disk name and id from --title; name needs DISK_NAME_LEN + 1 bytes
+static const char *split_title(const char *title, char *name)
+{
+    // The id follows the last comma of the title
+    const char *comma = strrchr(title, ',');
+    snprintf(name, DISK_NAME_LEN + 1, "%.*s", comma ? (int)(comma - title) : (int)strlen(title), title);
+
+    return comma ? comma + 1 : "00";
+}
+
+static int write_image(const char *image, int create, const char *title, int tracks,
+        char **paths, int count)
+{
+    char name[DISK_NAME_LEN + 1];
+    const char *id = split_title(title, name);
+    disk_image *img = NULL;
+
+    if (create) {
+        img = disk_image_new(name, id, tracks);
+    } else {
+        mapped_file m;
+
+        if (map_file(image, &m) != 0) {
+            return -1;
+        }
+
+        img = disk_image_load(m.buffer, m.size);
+        unmap_file(&m);
+    }
+
+    if (!img) {
+        return -1;
+    }
+
+    int status = 0;
+    int written = 0;
+
+    for (int i = 0; i < count; ++i) {
+        char file[PATH_MAX];
+        mapped_file m;
+
+        if (open_input(paths[i], &m) != 0) {
+            status = -1;
+            continue;
+        }
+
+        // Empty files make a one block entry but can't be mapped
+        if ((!S_ISREG(m.st.st_mode) || m.st.st_size > 0) && load_input(&m) != 0) {
+            status = -1;
+            continue;
+        }
+
+        // The C64 name is the host name without its extension
+        snprintf(file, sizeof(file), "%s", paths[i]);
+        char *base = basename(file);
+        char *ext = strrchr(base, '.');
+        if (ext && ext != base) {
+            *ext = '\0';
+        }
+
+        if (disk_image_add(img, base, host_type(paths[i]), m.buffer, m.size) == 0) {
+            written++;
+        } else {
+            status = -1;
+        }
+
+        unmap_file(&m);
+    }
+
+    if (disk_image_write(img, image) != 0) {
+        status = -1;
+    } else {
+        printf("%d files written, %d blocks free.\n", written, disk_image_blocks_free(img));
+    }
+
+    disk_image_free(img);
+
+    return status;
+}
+
+static int diff_images(const char *path_a, const char *path_b)
+{
+    mapped_file a;
+    mapped_file b;
+
+    if (map_file(path_a, &a) != 0) {
+        return -1;
+    }
+
+    if (map_file(path_b, &b) != 0) {
+        unmap_file(&a);
+        return -1;
+    }
+
+    int changed = disk_diff(stdout, path_a, a.buffer, a.size, path_b, b.buffer, b.size);
+
+    unmap_file(&a);
+    unmap_file(&b);
+
+    return changed;
+}
+
+typedef struct
+{
+    const char *path;
+    uint64_t key;
+    uint8_t fp[DISK_FINGERPRINT_LEN];
+} fingerprint;
+
+static int compare_key(const void *a, const void *b)
+{
+    const fingerprint *x = a;
+    const fingerprint *y = b;
+
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int compare_fp(const void *a, const void *b)
+{
+    const fingerprint *x = a;
+    const fingerprint *y = b;
+    int c = memcmp(x->fp, y->fp, DISK_FINGERPRINT_LEN);
+
+    return c ? c : strcmp(x->path, y->path);
+}
+
+static int fingerprint_file(fingerprint *f, int full)
+{
+    mapped_file m;
+
+    if (map_file(f->path, &m) != 0) {
+        return -1;
+    }
+
+    int status = disk_fingerprint(m.buffer, m.size, &f->key, full ? f->fp : NULL);
+
+    unmap_file(&m);
+
+    return status;
+}
+
+// Groups images with the same content. Only images sharing the cheap
+// BAM key with another one are read in full.
+static int fingerprint_images(char **paths, int count)
+{
+    fingerprint *f = malloc((count ? count : 1) * sizeof(fingerprint));
+    int n = 0;
+    int hashed = 0;
+    int distinct = 0;
+
+    if (!f) {
+        perror("Error");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (get_ftype(NULL, paths[i]) != D64) {
+            continue;
+        }
+
+        f[n].path = paths[i];
+
+        if (fingerprint_file(&f[n], 0) != 0) {
+            fprintf(stderr, "Failed to fingerprint %s\n", paths[i]);
+            continue;
+        }
+
+        n++;
+    }
+
+    qsort(f, n, sizeof(fingerprint), compare_key);
+
+    for (int i = 0, next; i < n; i = next) {
+        int k = i;
+
+        for (next = i + 1; next < n && f[next].key == f[i].key; ++next) {
+        }
+
+        if (next - i == 1) {
+            distinct++;
+            continue;
+        }
+
+        // Failures fall out of the comparison as unique
+        for (int j = i; j < next; ++j) {
+            if (fingerprint_file(&f[j], 1) != 0) {
+                fprintf(stderr, "Failed to fingerprint %s\n", f[j].path);
+                distinct++;
+                continue;
+            }
+
+            f[k++] = f[j];
+            hashed++;
+        }
+
+        qsort(&f[i], k - i, sizeof(fingerprint), compare_fp);
+
+        for (int a = i, b; a < k; a = b) {
+            for (b = a + 1; b < k && memcmp(f[b].fp, f[a].fp, DISK_FINGERPRINT_LEN) == 0; ++b) {
+            }
+
+            distinct++;
+
+            for (int j = a; b - a > 1 && j < b; ++j) {
+                for (int x = 0; x < DISK_FINGERPRINT_LEN; ++x) {
+                    printf("%02x", f[j].fp[x]);
+                }
+
+                printf("  %s\n", f[j].path);
+            }
+
+            if (b - a > 1) {
+                printf("\n");
+            }
+        }
+    }
+
+    printf("%d images, %d distinct, %d hashed in full\n", n, distinct, hashed);
+    free(f);
+
+    return 0;
+}
+
+static int histogram_files(char **paths, int count, int json)
+{
+    container_kind *kinds = malloc((count ? count : 1) * sizeof(container_kind));
+
+    if (!kinds) {
+        perror("Error");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        kinds[i] = get_container(get_ftype(NULL, paths[i]));
+    }
+
+    int status = histogram(stdout, paths, kinds, count, json);
+
+    free(kinds);
+
+    return status;
+}
+
+static int pack_d64(const char *prefix, const char *title, int tracks, char **paths, int count)
+{
+    char name[DISK_NAME_LEN + 1];
+    const char *id = split_title(title, name);
+    container_kind *kinds = malloc((count ? count : 1) * sizeof(container_kind));
+
+    if (!kinds) {
+        perror("Error");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        kinds[i] = get_container(get_ftype(NULL, paths[i]));
+    }
+
+    int status = fill_images(stdout, prefix, name, id, tracks, paths, kinds, count);
+
+    free(kinds);
+
+    return status;
+}
+
+static int build_similar(const char *index_path, char **paths, int count)
+{
+    container_kind *kinds = malloc((count ? count : 1) * sizeof(container_kind));
+
+    if (!kinds) {
+        perror("Error");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        kinds[i] = get_container(get_ftype(NULL, paths[i]));
+    }
+
+    int status = similar_index(index_path, paths, kinds, count);
+
+    free(kinds);
+
+    return status;
+}
+
+static long find_similar(const char *index_path, char **paths, int count, int top)
+{
+    long matches = 0;
+
+    for (int i = 0; i < count; ++i) {
+        mapped_file m;
+
+        if (map_file(paths[i], &m) != 0) {
+            return -1;
+        }
+
+        container_kind kind = get_container(get_ftype(m.buffer, paths[i]));
+        long found = similar_find(stdout, index_path, paths[i], m.buffer, m.size, kind, top);
+
+        unmap_file(&m);
+
+        if (found < 0) {
+            return -1;
+        }
+
+        matches += found;
+    }
+
+    return matches;
+}
+
+// Container kind from the name and, when there is one, the load address
+static container_kind detect_kind(const char *path, const uint8_t *buffer, size_t size)
+{
+    return get_container(get_ftype(size >= 2 ? buffer : NULL, path));
+}
+
+static void serve_list(FILE *out, const char *path, const uint8_t *buffer, size_t size)
+{
+    options opt;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.address = UINT16_MAX;
+    render(out, buffer, size, get_ftype(buffer, path), &opt);
+}
+
+// Newline separated names for lists too long for the command line
+static char **read_paths(FILE *in, int *count)
+{
+    char **paths = NULL;
+    int cap = 0;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t got;
+
+    *count = 0;
+
+    while ((got = getline(&line, &len, in)) > 0) {
+        if (line[got - 1] == '\n') {
+            line[--got] = '\0';
+        }
+
+        if (got == 0) {
+            continue;
+        }
+
+        if (*count == cap) {
+            int grown = cap ? cap * 2 : 1024;
+            char **p = realloc(paths, grown * sizeof(char *));
+
+            if (!p) {
+                break;
+            }
+
+            paths = p;
+            cap = grown;
+        }
+
+        if ((paths[*count] = strdup(line)) == NULL) {
+            break;
+        }
+
+        (*count)++;
+    }
+
+    free(line);
+
+    return paths;
+}
+
+static int unpack_image(const pack_view *v, long image, const char *dir)
+{
+    size_t size = pack_image_size(v, image);
+    uint8_t *buffer = malloc(size ? size : 1);
+    char name[PATH_MAX];
+    char path[PATH_MAX];
+    int status = -1;
+
+    snprintf(name, sizeof(name), "%s", pack_image_name(v, image));
+    snprintf(path, sizeof(path), "%s/%s", dir, basename(name));
+
+    if (!buffer) {
+        perror("Error");
+    } else if (pack_unpack_image(v, image, buffer) == 0) {
+        status = write_file(path, buffer, size);
+    }
+
+    free(buffer);
+
+    return status;
+}
+
+// Names are stored images, or image:file for a single file
+static int unpack_store(const char *store, const char *dir, char **names, int count)
+{
+    pack_view *v = pack_open(store);
+    if (!v) {
+        return -1;
+    }
+
+    int status = 0;
+
+    for (long i = 0; count == 0 && i < pack_images(v); ++i) {
+        if (unpack_image(v, i, dir) != 0) {
+            status = -1;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        char image[PATH_MAX];
+        char *file = NULL;
+        long id = pack_find_image(v, names[i]);
+
+        snprintf(image, sizeof(image), "%s", names[i]);
+        if (id < 0 && (file = strrchr(image, ':'))) {
+            *file++ = '\0';
+            id = pack_find_image(v, image);
+        }
+
+        if (id < 0) {
+            fprintf(stderr, "Not in store: %s\n", image);
+            status = -1;
+            continue;
+        }
+
+        if (!file) {
+            status |= unpack_image(v, id, dir);
+            continue;
+        }
+
+        uint8_t type;
+        size_t len;
+        const uint8_t *data = pack_file(v, id, file, &type, &len);
+        char path[PATH_MAX];
+
+        if (!data) {
+            fprintf(stderr, "No such file: %s\n", names[i]);
+            status = -1;
+            continue;
+        }
+
+        host_name(file);
+        snprintf(path, sizeof(path), "%s/%s.%s", dir, file, get_filetype(type));
+        status |= write_file(path, data, len);
+    }
+
+    pack_close(v);
+
+    return status;
+}
+
+// Renders a file in memory; the result is cached if st is given
+static void render_file(const char *path, const uint8_t *buffer, size_t size,
+        const struct stat *st, const options *opt)
+{
+    STATS_PHASE(STATS_DETECT);
+    filetype type = get_ftype(buffer, path);
+    int cacheable = st && opt->cache && !opt->force &&
+        (type == D64 || type == SID || type == CRT || type == T64);
+    cache_key key;
+
+    // Output is collected in memory for the cache, and for --stats so
+    // rendering and writing can be told apart
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = (cacheable || g_stats.enabled) ? open_memstream(&text, &len) : NULL;
+
+    STATS_PHASE(STATS_PARSE);
+    if (mem) {
+        unsigned long reported = diagnostics();
+
+        render(mem, buffer, size, type, opt);
+        fclose(mem);
+
+        // A hit replays stdout only, so renders that reported problems
+        // are done again next time rather than cached without them
+        if (cacheable && diagnostics() == reported) {
+            cache_key_from_stat(&key, st, type, opt);
+            cache_store(opt->cache, &key, cache_content_hash(buffer, size), path,
+                (const uint8_t *)text, len);
+        }
+
+        STATS_PHASE(STATS_WRITE);
+        fwrite(text, 1, len, stdout);
+        STATS_ADD(bytes_emitted, len);
+        free(text);
+    } else {
+        render(stdout, buffer, size, type, opt);
+    }
+
+    STATS_PHASE_END();
+}
+
+// Maps or reads a file and renders it. Raw code too large to map at once
+// goes through the disassembler's sliding window instead.
+static int render_path(const char *path, const options *opt)
+{
+    mapped_file m;
+
+    if (open_input(path, &m) != 0) {
+        STATS_PHASE_END();
+        return -1;
+    }
+
+    if ((opt->force || get_ftype(NULL, path) == BIN) && S_ISREG(m.st.st_mode) &&
+            (uint64_t)m.st.st_size > DISASM_WINDOW) {
+        STATS_PHASE(STATS_PARSE);
+        int status = disasm_file(stdout, m.fd, (uint64_t)m.st.st_size, opt->address,
+            opt->illegal);
+
+        if (status != 0) {
+            perror("Error");
+        }
+
+        STATS_PHASE_END();
+        close(m.fd);
+
+        return status;
+    }
+
+    if (load_input(&m) != 0) {
+        STATS_PHASE_END();
+        return -1;
+    }
+
+    // Only files have a stable identity to cache under
+    render_file(path, m.buffer, m.size, S_ISREG(m.st.st_mode) ? &m.st : NULL, opt);
+    unmap_file(&m);
+
+    return 0;
+}
+
+static int process_file(const char *path, const options *opt)
+{
+    filetype type = get_ftype(NULL, path);
+    int cacheable = opt->cache && !opt->force &&
+        (type == D64 || type == SID || type == CRT || type == T64);
+    cache_key key;
+    struct stat st;
+
+    if (opt->headers) {
+        printf("==> %s <==\n", path);
+    }
+
+    STATS_ADD(files, 1);
+
+    // Unchanged files are answered from the cache without opening them
+    STATS_PHASE(STATS_OPEN);
+    if (cacheable && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        cache_entry entry;
+
+        cache_key_from_stat(&key, &st, type, opt);
+
+        if (cache_lookup(opt->cache, &key, &entry) &&
+                (!opt->cache_verify || cache_prefix_matches(path, entry.content_hash))) {
+            STATS_PHASE(STATS_WRITE);
+            fwrite(entry.data, 1, entry.length, stdout);
+            STATS_ADD(bytes_emitted, entry.length);
+            STATS_PHASE_END();
+            return 0;
+        }
+    }
+
+    return render_path(path, opt);
+}
+
+// Many files are read ahead in batches while earlier ones render; the
+// cache needs no reading for its hits and keeps the one by one path
+static int process_files(char **paths, int count, const options *opt)
+{
+    bulk_reader *r = bulk_open(paths, count);
+    const bulk_file *f;
+    int status = 0;
+
+    if (!r) {
+        perror("Error");
+        return -1;
+    }
+
+    STATS_PHASE(STATS_OPEN);
+    while ((f = bulk_next(r)) != NULL) {
+        if (f->index > 0) {
+            printf("\n");
+        }
+
+        if (opt->headers) {
+            printf("==> %s <==\n", f->path);
+        }
+
+        STATS_ADD(files, 1);
+
+        // Empty files fail as they do to mmap; what the reader leaves,
+        // large files and anything but regular files, is opened here
+        if (f->error || (f->data && f->size == 0)) {
+            errno = f->error ? f->error : EINVAL;
+            perror("Error");
+            status = -1;
+        } else if (!f->data) {
+            status |= render_path(f->path, opt);
+        } else {
+            render_file(f->path, f->data, f->size, NULL, opt);
+        }
+
+        STATS_PHASE(STATS_OPEN);
+    }
+
+    STATS_PHASE_END();
+    bulk_close(r);
+
+    return status;
+}
+
+// --stats output: -1 off, 0 text, 1 JSON
+static int g_stats_json = -1;
+
+// Runs at exit so every mode reports, however it returns
+static void report_stats(void)
+{
+    fflush(stdout);
+    stats_report(stderr, g_stats_json);
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.address = UINT16_MAX;
+
+    const char *cache_path = NULL;
+    const char *index_path = NULL;
+    const char *find_pattern = NULL;
+    const char *grep_hex = NULL;
+    int optrecover = 0;
+    const char *extract_dir = NULL;
+    long record = 0;
+    int optcompact = 0;
+    const char *image_path = NULL;
+    int optcreate = 0;
+    const char *title = "";
+    int tracks = 35;
+    int optdiff = 0;
+    const char *pack_path = NULL;
+    const char *unpack_path = NULL;
+    const char *dat_path = NULL;
+    int optcontents = 0;
+    int optfingerprint = 0;
+    int histogram_json = -1;
+    const char *similar_index_path = NULL;
+    const char *similar_path = NULL;
+    long top = SIMILAR_TOP;
+    const char *serve_path = NULL;
+    const char *watch_dir = NULL;
+    const char *pack_d64_prefix = NULL;
+    int c;
+    char *end;
+    while ((c = getopt_long(argc, argv, "bfiha:c:x:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'a':
+                opt.address = strtol(optarg, &end, 0);
+                if (end == optarg) {
+                    errno = EINVAL;
+                    perror("Error");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'f':
+                opt.force = 1;
+                break;
+
+            case 'i':
+                opt.illegal = 1;
+                break;
+
+            case 'b':
+                opt.bam = 1;
+                break;
+
+            case OPT_BRIEF:
+                opt.brief = 1;
+                break;
+
+            case 'c':
+                cache_path = optarg;
+                break;
+
+            case OPT_CACHE_COMPACT:
+                optcompact = 1;
+                break;
+
+            case OPT_CACHE_VERIFY:
+                opt.cache_verify = 1;
+                break;
+
+            case OPT_INDEX:
+                index_path = optarg;
+                break;
+
+            case OPT_FIND:
+                find_pattern = optarg;
+                break;
+
+            case OPT_GREP:
+                grep_hex = optarg;
+                break;
+
+            case OPT_STATS:
+                g_stats_json = optarg && strcmp(optarg, "json") == 0;
+                break;
+
+            case OPT_RECOVER:
+                optrecover = 1;
+                break;
+
+            case 'x':
+                extract_dir = optarg;
+                break;
+
+            case OPT_RECORD:
+                record = strtol(optarg, &end, 0);
+                if (end == optarg || record < 1 || record > DISK_REL_RECORDS_MAX) {
+                    errno = EINVAL;
+                    perror("Error");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case OPT_CREATE:
+            case OPT_WRITE:
+                image_path = optarg;
+                optcreate = c == OPT_CREATE;
+                break;
+
+            case OPT_TITLE:
+                title = optarg;
+                break;
+
+            case OPT_TRACKS: {
+                long n = strtol(optarg, &end, 10);
+
+                if (end == optarg || *end != '\0' || (n != 35 && n != 40)) {
+                    fprintf(stderr, "Invalid track count, 35 or 40: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                tracks = (int)n;
+                break;
+            }
+
+            case OPT_DIFF:
+                optdiff = 1;
+                break;
+
+            case OPT_PACK:
+                pack_path = optarg;
+                break;
+
+            case OPT_UNPACK:
+                unpack_path = optarg;
+                break;
+
+            case OPT_VERIFY_DAT:
+                dat_path = optarg;
+                break;
+
+            case OPT_DAT_CONTENTS:
+                optcontents = 1;
+                break;
+
+            case OPT_FINGERPRINT:
+                optfingerprint = 1;
+                break;
+
+            case OPT_HISTOGRAM:
+                histogram_json = optarg && strcmp(optarg, "json") == 0;
+                break;
+
+            case OPT_SIMILAR_INDEX:
+                similar_index_path = optarg;
+                break;
+
+            case OPT_SIMILAR:
+                similar_path = optarg;
+                break;
+
+            case OPT_SERVE:
+                serve_path = optarg;
+                break;
+
+            case OPT_WATCH:
+                watch_dir = optarg;
+                break;
+
+            case OPT_PACK_D64:
+                pack_d64_prefix = optarg;
+                break;
+
+            case OPT_TOP:
+                top = strtol(optarg, &end, 0);
+                if (end == optarg || top < 1 || top > INT_MAX) {
+                    errno = EINVAL;
+                    perror("Error");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case OPT_TAP_THRESHOLDS: {
+                uint8_t thresholds[TAP_THRESHOLDS];
+
+                if (tap_thresholds_parse(optarg, thresholds) != 0) {
+                    fprintf(stderr, "Invalid TAP thresholds: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                tap_set_thresholds(thresholds);
+                break;
+            }
+
+            case OPT_CHARSET: {
+                int charset = petscii_charset_parse(optarg);
+
+                if (charset < 0) {
+                    fprintf(stderr, "Unknown charset: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                petscii_set_charset((petscii_charset)charset);
+                break;
+            }
+
+            case 'h':
+            default:
+                printhelp(argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if (g_stats_json >= 0) {
+        stats_enable();
+        atexit(report_stats);
+    }
+
+    if (optcompact) {
+        long kept = 0;
+        long dropped = 0;
+
+        if (!cache_path) {
+            fprintf(stderr, "Missing cache file\n");
+            return EXIT_FAILURE;
+        }
+
+        if (cache_compact(cache_path, &kept, &dropped) != 0) {
+            perror("Error");
+            return EXIT_FAILURE;
+        }
+
+        printf("Cache compacted: %ld kept, %ld dropped\n", kept, dropped);
+        return EXIT_SUCCESS;
+    }
+
+    // Creating an image needs no input files
+    if (image_path) {
+        return write_image(image_path, optcreate, title, tracks, &argv[optind],
+            argc - optind) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Without names every image in the store is restored
+    if (unpack_path) {
+        return unpack_store(unpack_path, extract_dir ? extract_dir : ".", &argv[optind],
+            argc - optind) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Files are named by each request
+    if (serve_path) {
+        const serve_handlers handlers = {detect_kind, serve_list};
+
+        return serve(serve_path, &handlers) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (watch_dir) {
+        return watch(stdout, watch_dir, detect_kind) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing filename\n");
+        printhelp(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Exit status as for diff(1): 0 same, 1 different, 2 trouble
+    if (optdiff) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "--diff needs two disk images\n");
+            return 2;
+        }
+
+        int changed = diff_images(argv[optind], argv[optind + 1]);
+
+        return changed < 0 ? 2 : changed > 0;
+    }
+
+    if (pack_path) {
+        return build_pack(pack_path, &argv[optind], argc - optind) == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (dat_path) {
+        int status = verify_dat(dat_path, optcontents, &argv[optind], argc - optind);
+
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (optfingerprint || histogram_json >= 0 || similar_index_path || pack_d64_prefix) {
+        char **paths = &argv[optind];
+        int count = argc - optind;
+
+        // A sole - reads the names from stdin
+        if (count == 1 && strcmp(paths[0], "-") == 0) {
+            paths = read_paths(stdin, &count);
+        }
+
+        int status;
+
+        if (optfingerprint) {
+            status = fingerprint_images(paths, count);
+        } else if (similar_index_path) {
+            status = build_similar(similar_index_path, paths, count);
+        } else if (pack_d64_prefix) {
+            status = pack_d64(pack_d64_prefix, title, tracks, paths, count);
+        } else {
+            status = histogram_files(paths, count, histogram_json);
+        }
+
+        if (paths != &argv[optind]) {
+            for (int i = 0; i < count; ++i) {
+                free(paths[i]);
+            }
+
+            free(paths);
+        }
+
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (index_path) {
+        return build_index(index_path, &argv[optind], argc - optind) == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (find_pattern) {
+        long matches = index_find(stdout, argv[optind], find_pattern);
+
+        if (matches < 0) {
+            perror("Error");
+            return EXIT_FAILURE;
+        }
+
+        return matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (similar_path) {
+        long matches = find_similar(similar_path, &argv[optind], argc - optind, (int)top);
+
+        if (matches < 0) {
+            perror("Error");
+            return EXIT_FAILURE;
+        }
+
+        return matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (grep_hex) {
+        grep_pattern pattern;
+
+        if (grep_compile(&pattern, grep_hex) != 0) {
+            fprintf(stderr, "Invalid byte pattern: %s\n", grep_hex);
+            return EXIT_FAILURE;
+        }
+
+        long matches = grep_files(&pattern, &argv[optind], argc - optind);
+
+        return matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (optrecover) {
+        int status = EXIT_SUCCESS;
+
+        for (int i = optind; i < argc; ++i) {
+            if (argc - optind > 1) {
+                printf("%s==> %s <==\n", i > optind ? "\n" : "", argv[i]);
+            }
+
+            if (recover_file(argv[i], extract_dir) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+
+        return status;
+    }
+
+    if (extract_dir) {
+        int status = EXIT_SUCCESS;
+
+        for (int i = optind; i < argc; ++i) {
+            if (extract_image(argv[i], extract_dir) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+
+        return status;
+    }
+
+    if (record > 0) {
+        int status = EXIT_SUCCESS;
+
+        for (int i = optind; i < argc; ++i) {
+            mapped_file m;
+
+            if (argc - optind > 1) {
+                printf("%s==> %s <==\n", i > optind ? "\n" : "", argv[i]);
+            }
+
+            if (map_file(argv[i], &m) != 0) {
+                status = EXIT_FAILURE;
+                continue;
+            }
+
+            disk_records(stdout, m.buffer, m.size, record - 1);
+            unmap_file(&m);
+        }
+
+        return status;
+    }
+
+    if (cache_path) {
+        opt.cache = cache_open(cache_path);
+        if (!opt.cache) {
+            perror("Error");
+            return EXIT_FAILURE;
+        }
+    }
+
+    opt.headers = (argc - optind) > 1;
+
+    int status = EXIT_SUCCESS;
+    if (opt.headers && !opt.cache) {
+        status = process_files(&argv[optind], argc - optind, &opt) == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+    } else {
+        for (int i = optind; i < argc; ++i) {
+            if (i > optind) {
+                printf("\n");
+            }
+
+            if (process_file(argv[i], &opt) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    cache_close(opt.cache);
 
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -0,0 +1,879 @@
+#define _DEFAULT_SOURCE
+
+#include "pack.h"
+#include "disk.h"
+#include "g64.h"
+#include "petscii.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PACK_MAGIC "D64STORE"
+#define PACK_MAGIC_LEN 8
+#define PACK_VERSION 1
+#define SECTOR_SIZE 256
+#define FILE_DATA_BYTES 254
+#define TABLE_MIN 4096
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+
+typedef struct
+{
+    char magic[PACK_MAGIC_LEN];
+    uint32_t version;
+    uint32_t images;
+    uint64_t chunks;
+    uint64_t images_off;
+    uint64_t chunks_off;
+    uint64_t recipes_off;
+    uint64_t data_off;
+    uint64_t strings_off;
+    uint64_t size;
+} pack_header;
+
+typedef struct
+{
+    uint32_t name;              // stored path in the string pool
+    uint32_t recipe_len;
+    uint64_t recipe;            // offset in the recipe area
+    uint64_t size;
+    uint64_t hash;              // of the whole image, checked on unpacking
+} pack_image;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t offset;            // in the data area
+    uint64_t len;
+} pack_chunk;
+
+// A recipe is a run of varints:
+//   sectors, tail chunk + 1 (error bytes or a partial last block, 0 if none)
+//   per chain: chunk + 1, type, 16 name bytes, sectors, exact, the two
+//       link bytes of the last sector, trailer chunk + 1, then track and
+//       sector byte of every sector; 0 ends the list
+//   per run: chunk, count, over the sectors no exact chain prefix restores
+
+struct pack_builder
+{
+    uint8_t *data;
+    size_t data_len;
+    size_t data_cap;
+    pack_chunk *chunks;
+    size_t chunks_len;
+    size_t chunks_cap;
+    uint32_t *table;            // chunk id + 1 per slot, 0 if free
+    size_t table_cap;
+    pack_image *images;
+    size_t images_len;
+    size_t images_cap;
+    uint8_t *recipes;
+    size_t recipes_len;
+    size_t recipes_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    uint64_t input;
+    uint8_t *payload;           // chain data, DISK_MAX_FILE_SIZE bytes
+};
+
+static int grow(void **ptr, size_t *cap, size_t need, size_t elem)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap : 1024;
+    while (n < need) {
+        n *= 2;
+    }
+
+    void *p = realloc(*ptr, n * elem);
+    if (!p) {
+        return -1;
+    }
+
+    *ptr = p;
+    *cap = n;
+
+    return 0;
+}
+
+// Eight bytes per step; it only has to spread chunks over the table, as
+// equal hashes are confirmed by comparing the data
+static uint64_t pack_hash(const uint8_t *p, size_t len)
+{
+    uint64_t h = (uint64_t)len * HASH_MUL;
+    uint64_t w;
+    size_t i = 0;
+
+    for (; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * HASH_MUL;
+        h ^= h >> 32;
+    }
+
+    w = 0;
+    memcpy(&w, p + i, len - i);
+    h = (h ^ w) * HASH_MUL;
+
+    return h ^ h >> 29;
+}
+
+static int rehash(pack_builder *b)
+{
+    size_t cap = b->table_cap ? 2 * b->table_cap : TABLE_MIN;
+    uint32_t *table = calloc(cap, sizeof(uint32_t));
+
+    if (!table) {
+        return -1;
+    }
+
+    for (size_t id = 0; id < b->chunks_len; ++id) {
+        size_t i = b->chunks[id].hash & (cap - 1);
+
+        while (table[i] != 0) {
+            i = (i + 1) & (cap - 1);
+        }
+
+        table[i] = (uint32_t)id + 1;
+    }
+
+    free(b->table);
+    b->table = table;
+    b->table_cap = cap;
+
+    return 0;
+}
+
+// Returns the id of the chunk holding these bytes, adding it if new
+static long add_chunk(pack_builder *b, const uint8_t *p, size_t len)
+{
+    if (2 * (b->chunks_len + 1) > b->table_cap && rehash(b) != 0) {
+        return -1;
+    }
+
+    uint64_t h = pack_hash(p, len);
+    size_t mask = b->table_cap - 1;
+    size_t i = h & mask;
+
+    for (; b->table[i] != 0; i = (i + 1) & mask) {
+        const pack_chunk *c = &b->chunks[b->table[i] - 1];
+
+        if (c->hash == h && c->len == len && memcmp(b->data + c->offset, p, len) == 0) {
+            return (long)b->table[i] - 1;
+        }
+    }
+
+    if (grow((void **)&b->data, &b->data_cap, b->data_len + len, 1) != 0 ||
+            grow((void **)&b->chunks, &b->chunks_cap, b->chunks_len + 1, sizeof(pack_chunk)) != 0) {
+        return -1;
+    }
+
+    pack_chunk *c = &b->chunks[b->chunks_len];
+    c->hash = h;
+    c->offset = b->data_len;
+    c->len = len;
+    memcpy(b->data + b->data_len, p, len);
+    b->data_len += len;
+    b->table[i] = (uint32_t)++b->chunks_len;
+
+    return (long)b->chunks_len - 1;
+}
+
+static int put_bytes(pack_builder *b, const void *p, size_t len)
+{
+    if (grow((void **)&b->recipes, &b->recipes_cap, b->recipes_len + len, 1) != 0) {
+        return -1;
+    }
+
+    memcpy(b->recipes + b->recipes_len, p, len);
+    b->recipes_len += len;
+
+    return 0;
+}
+
+static int put_varint(pack_builder *b, uint64_t v)
+{
+    uint8_t buf[10];
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+
+    return put_bytes(b, buf, n);
+}
+
+typedef struct
+{
+    const uint8_t *data;        // file contents
+    size_t len;
+    uint8_t type;
+    const uint8_t *name;
+    int count;                  // sectors in the chain
+    int exact;                  // leading sectors rebuilt from data and links
+    uint8_t link[2];            // link of the last sector, track 0 at end of file
+    const uint8_t *trail;       // last sector bytes after the end of file
+    size_t trail_len;           // up to the last non-zero one
+    const uint8_t *ts;          // track/sector of every sector
+} chain_record;
+
+// Data bytes in the last sector of a chain; one that ends in a bad link
+// instead of the end of file is full
+static size_t last_bytes(const uint8_t link[2])
+{
+    if (link[0] != 0) {
+        return FILE_DATA_BYTES;
+    }
+
+    return link[1] >= 2 ? link[1] - 1u : 0;
+}
+
+// Sector b of a chain rebuilt from the file data and the chain's links
+static void chain_sector(const chain_record *r, int b, uint8_t *out)
+{
+    size_t off = (size_t)b * FILE_DATA_BYTES;
+    size_t n = FILE_DATA_BYTES;
+
+    memset(out, 0, SECTOR_SIZE);
+
+    if (b + 1 < r->count) {
+        out[0] = r->ts[2 * b + 2];
+        out[1] = r->ts[2 * b + 3];
+    } else {
+        out[0] = r->link[0];
+        out[1] = r->link[1];
+        n = last_bytes(r->link);
+
+        // Most recipes have no trailer chunk, and no trail to copy
+        if (r->trail_len) {
+            memcpy(out + 2 + n, r->trail, r->trail_len);
+        }
+    }
+
+    if (off + n > r->len) {
+        n = off < r->len ? r->len - off : 0;
+    }
+
+    memcpy(out + 2, r->data + off, n);
+}
+
+pack_builder *pack_builder_new(void)
+{
+    pack_builder *b = calloc(1, sizeof(pack_builder));
+
+    if (b && !(b->payload = malloc(DISK_MAX_FILE_SIZE))) {
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+void pack_builder_free(pack_builder *b)
+{
+    if (!b) {
+        return;
+    }
+
+    free(b->data);
+    free(b->chunks);
+    free(b->table);
+    free(b->images);
+    free(b->recipes);
+    free(b->strings);
+    free(b->payload);
+    free(b);
+}
+
+typedef struct
+{
+    pack_builder *b;
+    const uint8_t *image;
+    uint8_t *covered;
+    int tracks;
+    int status;
+    uint8_t ts[2 * DISK_MAX_SECTORS];
+    uint8_t seen[DISK_MAX_SECTORS];
+} chain_walk;
+
+static long chain_index(const chain_walk *w, int b)
+{
+    return disk_sector_offset(w->tracks, w->ts[2 * b], w->ts[2 * b + 1]) / SECTOR_SIZE;
+}
+
+static int add_chain(const disk_dirent *e, void *ctx)
+{
+    chain_walk *w = ctx;
+    pack_builder *b = w->b;
+    uint8_t sec[SECTOR_SIZE];
+
+    if (e->track == 0) {
+        return 0;
+    }
+
+    chain_record r;
+    r.count = disk_chain(e->track, e->sector, w->ts);
+    r.ts = w->ts;
+
+    // A chain looping back on itself ends before the repeat
+    memset(w->seen, 0, sizeof(w->seen));
+    for (int i = 0; i < r.count; ++i) {
+        long idx = chain_index(w, i);
+
+        if (w->seen[idx]) {
+            r.count = i;
+            break;
+        }
+
+        w->seen[idx] = 1;
+    }
+
+    if (r.count == 0) {
+        return 0;
+    }
+
+    r.data = b->payload;
+    r.len = (size_t)disk_read_chain(e->track, e->sector, b->payload);
+    if (r.len > (size_t)r.count * FILE_DATA_BYTES) {
+        r.len = (size_t)r.count * FILE_DATA_BYTES;
+    }
+
+    // Junk the DOS left after the end of file is kept with the chain
+    const uint8_t *end = &w->image[chain_index(w, r.count - 1) * SECTOR_SIZE];
+    r.link[0] = end[0];
+    r.link[1] = end[1];
+    r.trail = end + 2 + last_bytes(r.link);
+    r.trail_len = 0;
+    for (size_t i = 0; r.trail + i < end + SECTOR_SIZE; ++i) {
+        if (r.trail[i] != 0) {
+            r.trail_len = i + 1;
+        }
+    }
+
+    // Leading sectors the chain reproduces exactly; whatever follows a
+    // mismatch or a cross link is kept raw
+    for (r.exact = 0; r.exact < r.count; ++r.exact) {
+        long idx = chain_index(w, r.exact);
+
+        chain_sector(&r, r.exact, sec);
+        if (w->covered[idx] || memcmp(sec, &w->image[idx * SECTOR_SIZE], SECTOR_SIZE) != 0) {
+            break;
+        }
+
+        w->covered[idx] = 1;
+    }
+
+    long chunk = add_chunk(b, r.data, r.len);
+    long trail = r.trail_len ? add_chunk(b, r.trail, r.trail_len) : -1;
+
+    if (chunk < 0 || (r.trail_len && trail < 0) ||
+            put_varint(b, (uint64_t)chunk + 1) != 0 || put_varint(b, e->type) != 0 ||
+            put_bytes(b, e->name, DISK_NAME_LEN) != 0 || put_varint(b, (uint64_t)r.count) != 0 ||
+            put_varint(b, (uint64_t)r.exact) != 0 || put_bytes(b, r.link, 2) != 0 ||
+            put_varint(b, (uint64_t)(trail + 1)) != 0 ||
+            put_bytes(b, w->ts, 2 * (size_t)r.count) != 0) {
+        w->status = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+int pack_add_image(pack_builder *b, const char *name, const uint8_t *buffer, size_t size)
+{
+    chain_walk w;
+    size_t name_len = strlen(name);
+
+    // Only plain D64 layouts have chains to follow, anything else is
+    // stored as 256 byte blocks
+    w.tracks = 0;
+    size_t data = g64_detect(buffer, size) ? 0 : disk_layout(size, &w.tracks);
+    size_t sectors = (data ? data : size) / SECTOR_SIZE;
+    size_t tail = size - sectors * SECTOR_SIZE;
+
+    if (grow((void **)&b->strings, &b->strings_cap, b->strings_len + name_len + 1, 1) != 0 ||
+            grow((void **)&b->images, &b->images_cap, b->images_len + 1, sizeof(pack_image)) != 0) {
+        return -1;
+    }
+
+    w.b = b;
+    w.image = buffer;
+    w.covered = calloc(sectors + 1, 1);
+    w.status = 0;
+    if (!w.covered) {
+        return -1;
+    }
+
+    size_t recipe = b->recipes_len;
+    long tail_chunk = tail ? add_chunk(b, &buffer[sectors * SECTOR_SIZE], tail) : -1;
+
+    if ((tail && tail_chunk < 0) || put_varint(b, sectors) != 0 ||
+            put_varint(b, (uint64_t)(tail_chunk + 1)) != 0) {
+        w.status = -1;
+    }
+
+    if (w.status == 0 && data) {
+        disk_directory(buffer, size, add_chain, &w);
+    }
+
+    if (w.status == 0 && put_varint(b, 0) != 0) {
+        w.status = -1;
+    }
+
+    // Identical neighbours (mostly blank sectors) collapse into one run
+    long run = -1;
+    uint64_t run_len = 0;
+
+    for (size_t s = 0; s <= sectors && w.status == 0; ++s) {
+        long chunk = -1;
+
+        if (s < sectors && w.covered[s]) {
+            continue;
+        }
+
+        if (s < sectors && (chunk = add_chunk(b, &buffer[s * SECTOR_SIZE], SECTOR_SIZE)) < 0) {
+            w.status = -1;
+            break;
+        }
+
+        if (chunk == run && s < sectors) {
+            run_len++;
+            continue;
+        }
+
+        if (run_len > 0 && (put_varint(b, (uint64_t)run) != 0 || put_varint(b, run_len) != 0)) {
+            w.status = -1;
+        }
+
+        run = chunk;
+        run_len = 1;
+    }
+
+    free(w.covered);
+
+    if (w.status != 0) {
+        b->recipes_len = recipe;
+        return -1;
+    }
+
+    pack_image *im = &b->images[b->images_len++];
+    im->name = (uint32_t)b->strings_len;
+    im->recipe = recipe;
+    im->recipe_len = (uint32_t)(b->recipes_len - recipe);
+    im->size = size;
+    im->hash = pack_hash(buffer, size);
+
+    memcpy(b->strings + b->strings_len, name, name_len + 1);
+    b->strings_len += name_len + 1;
+    b->input += size;
+
+    return 0;
+}
+
+// qsort has no context argument
+static const char *g_sort_strings;
+
+static int compare_images(const void *a, const void *b)
+{
+    const pack_image *ia = a;
+    const pack_image *ib = b;
+
+    return strcmp(g_sort_strings + ia->name, g_sort_strings + ib->name);
+}
+
+int pack_write(pack_builder *b, const char *path)
+{
+    g_sort_strings = b->strings;
+    qsort(b->images, b->images_len, sizeof(pack_image), compare_images);
+
+    pack_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, PACK_MAGIC_LEN);
+    hdr.version = PACK_VERSION;
+    hdr.images = (uint32_t)b->images_len;
+    hdr.chunks = b->chunks_len;
+    hdr.images_off = sizeof(hdr);
+    hdr.chunks_off = hdr.images_off + b->images_len * sizeof(pack_image);
+    hdr.recipes_off = hdr.chunks_off + b->chunks_len * sizeof(pack_chunk);
+    hdr.data_off = hdr.recipes_off + b->recipes_len;
+    hdr.strings_off = hdr.data_off + b->data_len;
+    hdr.size = hdr.strings_off + b->strings_len;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(b->images, sizeof(pack_image), b->images_len, f);
+    fwrite(b->chunks, sizeof(pack_chunk), b->chunks_len, f);
+    fwrite(b->recipes, 1, b->recipes_len, f);
+    fwrite(b->data, 1, b->data_len, f);
+    fwrite(b->strings, 1, b->strings_len, f);
+
+    int status = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+void pack_report(FILE *out, const pack_builder *b)
+{
+    size_t stored = sizeof(pack_header) + b->images_len * sizeof(pack_image) +
+        b->chunks_len * sizeof(pack_chunk) + b->recipes_len + b->data_len + b->strings_len;
+
+    fprintf(out, "%zu images, %llu bytes packed into %zu chunks, %zu bytes (%zu in recipes)\n",
+        b->images_len, (unsigned long long)b->input, b->chunks_len, stored, b->recipes_len);
+}
+
+struct pack_view
+{
+    uint8_t *map;
+    size_t size;
+    const pack_header *hdr;
+    const pack_image *images;
+    const pack_chunk *chunks;
+    const uint8_t *recipes;
+    const uint8_t *data;
+    const char *strings;
+};
+
+pack_view *pack_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header)) {
+        close(fd);
+        fprintf(stderr, "Not a valid pack store: %s\n", path);
+        return NULL;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        return NULL;
+    }
+
+    const pack_header *hdr = (const pack_header *)map;
+    pack_view *v = NULL;
+
+    if (memcmp(hdr->magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0 ||
+            hdr->version != PACK_VERSION || hdr->size != (uint64_t)st.st_size ||
+            hdr->strings_off > hdr->size || hdr->data_off > hdr->strings_off ||
+            hdr->recipes_off > hdr->data_off ||
+            hdr->chunks_off + hdr->chunks * sizeof(pack_chunk) > hdr->recipes_off ||
+            hdr->images_off + hdr->images * sizeof(pack_image) > hdr->chunks_off ||
+            !(v = malloc(sizeof(pack_view)))) {
+        fprintf(stderr, "Not a valid pack store: %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+
+    v->map = map;
+    v->size = (size_t)st.st_size;
+    v->hdr = hdr;
+    v->images = (const pack_image *)(map + hdr->images_off);
+    v->chunks = (const pack_chunk *)(map + hdr->chunks_off);
+    v->recipes = map + hdr->recipes_off;
+    v->data = map + hdr->data_off;
+    v->strings = (const char *)(map + hdr->strings_off);
+
+    return v;
+}
+
+void pack_close(pack_view *v)
+{
+    if (!v) {
+        return;
+    }
+
+    munmap(v->map, v->size);
+    free(v);
+}
+
+long pack_images(const pack_view *v)
+{
+    return v->hdr->images;
+}
+
+const char *pack_image_name(const pack_view *v, long image)
+{
+    return v->strings + v->images[image].name;
+}
+
+size_t pack_image_size(const pack_view *v, long image)
+{
+    return v->images[image].size;
+}
+
+long pack_find_image(const pack_view *v, const char *name)
+{
+    long lo = 0;
+    long hi = v->hdr->images;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        if (strcmp(pack_image_name(v, mid), name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < (long)v->hdr->images && strcmp(pack_image_name(v, lo), name) == 0) {
+        return lo;
+    }
+
+    for (long i = 0; i < (long)v->hdr->images; ++i) {
+        const char *stored = pack_image_name(v, i);
+        const char *base = strrchr(stored, '/');
+
+        if (strcmp(base ? base + 1 : stored, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+typedef struct
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    int bad;
+} cursor;
+
+static uint64_t get_varint(cursor *c)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (c->p >= c->end) {
+            break;
+        }
+
+        uint8_t byte = *c->p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) {
+            return v;
+        }
+    }
+
+    c->bad = 1;
+
+    return 0;
+}
+
+static const uint8_t *get_bytes(cursor *c, size_t len)
+{
+    const uint8_t *p = c->p;
+
+    if ((size_t)(c->end - c->p) < len) {
+        c->bad = 1;
+        return NULL;
+    }
+
+    c->p += len;
+
+    return p;
+}
+
+static const uint8_t *chunk_data(const pack_view *v, uint64_t id, size_t *len)
+{
+    if (id >= v->hdr->chunks) {
+        return NULL;
+    }
+
+    const pack_chunk *c = &v->chunks[id];
+
+    if (c->offset + c->len > v->hdr->strings_off - v->hdr->data_off) {
+        return NULL;
+    }
+
+    *len = c->len;
+
+    return v->data + c->offset;
+}
+
+// Returns 1 for a chain, 0 at the end of the list and -1 if damaged
+static int next_chain(const pack_view *v, cursor *c, chain_record *r)
+{
+    uint64_t chunk = get_varint(c);
+
+    if (chunk == 0) {
+        return c->bad ? -1 : 0;
+    }
+
+    r->data = chunk_data(v, chunk - 1, &r->len);
+    r->type = (uint8_t)get_varint(c);
+    r->name = get_bytes(c, DISK_NAME_LEN);
+    r->count = (int)get_varint(c);
+    r->exact = (int)get_varint(c);
+    const uint8_t *link = get_bytes(c, 2);
+    uint64_t trail = get_varint(c);
+    r->ts = get_bytes(c, 2 * (size_t)r->count);
+    r->trail = NULL;
+    r->trail_len = 0;
+
+    if (trail && !(r->trail = chunk_data(v, trail - 1, &r->trail_len))) {
+        return -1;
+    }
+
+    if (c->bad || !r->data || r->count > DISK_MAX_SECTORS || r->exact > r->count) {
+        return -1;
+    }
+
+    memcpy(r->link, link, 2);
+    if (2 + last_bytes(r->link) + r->trail_len > SECTOR_SIZE) {
+        return -1;
+    }
+
+    return 1;
+}
+
+static cursor recipe(const pack_view *v, long image)
+{
+    const pack_image *im = &v->images[image];
+    const uint8_t *p = v->recipes + im->recipe;
+    cursor c = {p, p + im->recipe_len, 0};
+
+    if (im->recipe + im->recipe_len > v->hdr->data_off - v->hdr->recipes_off) {
+        c.end = p;
+        c.bad = 1;
+    }
+
+    return c;
+}
+
+static int unpack(const pack_view *v, long image, uint8_t *out, uint8_t *covered, uint64_t sectors,
+        cursor *c)
+{
+    const pack_image *im = &v->images[image];
+    uint64_t tail = get_varint(c);
+    const uint8_t *p;
+    size_t len;
+    int tracks = 0;
+    chain_record r;
+    int more;
+
+    disk_layout(im->size, &tracks);
+
+    while ((more = next_chain(v, c, &r)) > 0) {
+        for (int b = 0; b < r.exact; ++b) {
+            long off = disk_sector_offset(tracks, r.ts[2 * b], r.ts[2 * b + 1]);
+
+            if (off < 0 || (uint64_t)off / SECTOR_SIZE >= sectors) {
+                return -1;
+            }
+
+            chain_sector(&r, b, &out[off]);
+            covered[off / SECTOR_SIZE] = 1;
+        }
+    }
+
+    if (more < 0) {
+        return -1;
+    }
+
+    uint64_t s = 0;
+    while (!c->bad) {
+        while (s < sectors && covered[s]) {
+            s++;
+        }
+
+        if (s == sectors) {
+            break;
+        }
+
+        p = chunk_data(v, get_varint(c), &len);
+        uint64_t count = get_varint(c);
+
+        if (!p || len != SECTOR_SIZE) {
+            return -1;
+        }
+
+        for (; count > 0 && s < sectors; ++s) {
+            if (!covered[s]) {
+                memcpy(&out[s * SECTOR_SIZE], p, SECTOR_SIZE);
+                count--;
+            }
+        }
+    }
+
+    if (tail) {
+        p = chunk_data(v, tail - 1, &len);
+
+        if (!p || sectors * SECTOR_SIZE + len != im->size) {
+            return -1;
+        }
+
+        memcpy(&out[sectors * SECTOR_SIZE], p, len);
+    }
+
+    return c->bad || s != sectors ? -1 : 0;
+}
+
+int pack_unpack_image(const pack_view *v, long image, uint8_t *out)
+{
+    const pack_image *im = &v->images[image];
+    cursor c = recipe(v, image);
+    uint64_t sectors = get_varint(&c);
+    uint8_t *covered = NULL;
+    int status = -1;
+
+    if (!c.bad && sectors <= im->size / SECTOR_SIZE && (covered = calloc(sectors + 1, 1))) {
+        status = unpack(v, image, out, covered, sectors, &c);
+    }
+
+    free(covered);
+
+    if (status != 0) {
+        fprintf(stderr, "Damaged recipe: %s\n", pack_image_name(v, image));
+    } else if (pack_hash(out, im->size) != im->hash) {
+        fprintf(stderr, "Checksum mismatch: %s\n", pack_image_name(v, image));
+        status = -1;
+    }
+
+    return status;
+}
+
+const uint8_t *pack_file(const pack_view *v, long image, const char *name,
+        uint8_t *type, size_t *len)
+{
+    cursor c = recipe(v, image);
+    chain_record r;
+    char ascii[DISK_NAME_LEN + 1];
+
+    get_varint(&c);
+    get_varint(&c);
+
+    while (!c.bad && next_chain(v, &c, &r) > 0) {
+        petscii_name(r.name, DISK_NAME_LEN, ascii);
+
+        if (strcasecmp(ascii, name) == 0) {
+            *type = r.type;
+            *len = r.len;
+            return r.data;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Content addressed store for image collections. Every image is split
+// into file payloads (from the directory's sector chains) and the 256
+// byte sectors no chain reproduces; each unique chunk is stored once and
+// an image is a short recipe of chunk references. The store is read
+// through mmap, so single files come straight out of the mapping.
+
+typedef struct pack_builder pack_builder;
+
+pack_builder *pack_builder_new(void);
+void pack_builder_free(pack_builder *b);
+
+int pack_add_image(pack_builder *b, const char *name, const uint8_t *buffer, size_t size);
+int pack_write(pack_builder *b, const char *path);
+
+// Image count, input and stored bytes so far
+void pack_report(FILE *out, const pack_builder *b);
+
+typedef struct pack_view pack_view;
+
+// Maps a store; prints the reason and returns NULL on failure
+pack_view *pack_open(const char *path);
+void pack_close(pack_view *v);
+
+long pack_images(const pack_view *v);
+const char *pack_image_name(const pack_view *v, long image);
+size_t pack_image_size(const pack_view *v, long image);
+
+// Image by stored name, or by base name if no stored name matches; -1
+// if there is none
+long pack_find_image(const pack_view *v, const char *name);
+
+// Rebuilds an image into out, which needs pack_image_size() bytes, and
+// checks it against the hash taken when packing. Returns 0 or -1.
+int pack_unpack_image(const pack_view *v, long image, uint8_t *out);
+
+// Data of a file of an image, by case insensitive ASCII name, pointing
+// into the mapping. type receives the directory type byte. NULL if the
+// image has no such file.
+const uint8_t *pack_file(const pack_view *v, long image, const char *name,
+        uint8_t *type, size_t *len);
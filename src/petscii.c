@@ -0,0 +1,453 @@
+#include "petscii.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <pthread.h>
+#endif
+
+#define PETSCII_PAD 0xA0
+#define NAME_LEN 16
+#define UTF8_MAX 4
+#define CHUNK 256
+#define MAX_RUNS 4
+
+static petscii_charset g_charset = PETSCII_ASCII;
+
+static const char *charset_names[] = {"ascii", "lower", "upper", "utf8"};
+
+// Borrowed from petcom version 1.00 by Craig Bruce, 18-May-1995
+const uint8_t pet_asc[256] = {
+    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x14,0x09,0x0d,0x11,0x93,0x0a,0x0e,0x0f,
+    0x10,0x0b,0x12,0x13,0x08,0x15,0x16,0x17,0x18,0x19,0x1a,0x1b,0x1c,0x1d,0x1e,0x1f,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0xc0,0xc1,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xcb,0xcc,0xcd,0xce,0xcf,
+    0xd0,0xd1,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xdb,0xdc,0xdd,0xde,0xdf,
+    0x80,0x81,0x82,0x83,0x84,0x85,0x86,0x87,0x88,0x89,0x8a,0x8b,0x8c,0x8d,0x8e,0x8f,
+    0x90,0x91,0x92,0x0c,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0x9b,0x9c,0x9d,0x9e,0x9f,
+    0xa0,0xa1,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xab,0xac,0xad,0xae,0xaf,
+    0xb0,0xb1,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xbb,0xbc,0xbd,0xbe,0xbf,
+    0x60,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x7b,0x7c,0x7d,0x7e,0x7f,
+    0xa0,0xa1,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xab,0xac,0xad,0xae,0xaf,
+    0xb0,0xb1,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xbb,0xbc,0xbd,0xbe,0xbf
+};
+
+// Listing text: pet_asc where printable, space otherwise
+const uint8_t petscii_text[256] = {
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x60,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x7b,0x7c,0x7d,0x7e,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20
+};
+
+// Names already stored as ASCII: printable or space
+const uint8_t petscii_raw[256] = {
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0x60,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x7b,0x7c,0x7d,0x7e,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20
+};
+
+// Disk titles: lowercase, pad as space, ? for anything unprintable
+const uint8_t petscii_title[256] = {
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x20,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x60,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x7b,0x7c,0x7d,0x7e,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,
+    0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f,0x3f
+};
+
+// Search keys: lowercase, . for anything unprintable
+const uint8_t petscii_key[256] = {
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x60,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x7b,0x7c,0x7d,0x7e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e
+};
+
+// Directory names: graphics seen in directory art as letters and dots
+const uint8_t petscii_dirname[256] = {
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x5c,0x5d,0x5e,0x5f,
+    0x2e,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x20,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x7b,0x7c,0x7d,0x7e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,
+    0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e
+};
+
+// Lower/upper case charset as ASCII, # for graphics without a likeness
+const uint8_t petscii_lower[256] = {
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x5b,0x23,0x5d,0x5e,0x5f,
+    0x2d,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x2b,0x23,0x7c,0x23,0x23,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x2b,0x2b,0x23,
+    0x2b,0x2b,0x2b,0x2b,0x23,0x23,0x23,0x23,0x23,0x23,0x76,0x23,0x23,0x2b,0x23,0x23,
+    0x2d,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x2b,0x23,0x7c,0x23,0x23,
+    0x20,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x2b,0x2b,0x23,
+    0x2b,0x2b,0x2b,0x2b,0x23,0x23,0x23,0x23,0x23,0x23,0x76,0x23,0x23,0x2b,0x23,0x23
+};
+
+// Upper case/graphics charset as ASCII, # for graphics without a likeness
+const uint8_t petscii_upper[256] = {
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+    0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x5b,0x23,0x5d,0x5e,0x5f,
+    0x2d,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x2b,0x2b,0x23,0x5c,0x2f,0x23,
+    0x23,0x6f,0x23,0x23,0x23,0x2b,0x58,0x6f,0x23,0x23,0x23,0x2b,0x23,0x7c,0x70,0x23,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,
+    0x20,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x2b,0x2b,0x23,
+    0x2b,0x2b,0x2b,0x2b,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x23,
+    0x2d,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x2b,0x2b,0x23,0x5c,0x2f,0x23,
+    0x23,0x6f,0x23,0x23,0x23,0x2b,0x58,0x6f,0x23,0x23,0x23,0x2b,0x23,0x7c,0x70,0x23,
+    0x20,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x2b,0x2b,0x23,
+    0x2b,0x2b,0x2b,0x2b,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x23,0x2b,0x23,0x70
+};
+
+// Upper case/graphics charset as UTF-8, Unicode 13 Symbols for Legacy
+// Computing where the glyph has no older equivalent
+static const char utf8_upper[256][5] = {
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", "!", "\"", "#", "$", "%", "&", "'",
+    "(", ")", "*", "+", ",", "-", ".", "/",
+    "0", "1", "2", "3", "4", "5", "6", "7",
+    "8", "9", ":", ";", "<", "=", ">", "?",
+    "@", "A", "B", "C", "D", "E", "F", "G",
+    "H", "I", "J", "K", "L", "M", "N", "O",
+    "P", "Q", "R", "S", "T", "U", "V", "W",
+    "X", "Y", "Z", "[", "\xc2\xa3", "]", "\xe2\x86\x91", "\xe2\x86\x90",
+    "\xe2\x94\x80", "\xe2\x99\xa0", "\xf0\x9f\xad\xb2", "\xf0\x9f\xad\xb8", "\xf0\x9f\xad\xb7", "\xf0\x9f\xad\xb6", "\xf0\x9f\xad\xba", "\xf0\x9f\xad\xb1",
+    "\xf0\x9f\xad\xb4", "\xe2\x95\xae", "\xe2\x95\xb0", "\xe2\x95\xaf", "\xf0\x9f\xad\xbc", "\xe2\x95\xb2", "\xe2\x95\xb1", "\xf0\x9f\xad\xbd",
+    "\xf0\x9f\xad\xbe", "\xe2\x97\x8f", "\xf0\x9f\xad\xbb", "\xe2\x99\xa5", "\xf0\x9f\xad\xb0", "\xe2\x95\xad", "\xe2\x95\xb3", "\xe2\x97\x8b",
+    "\xe2\x99\xa3", "\xf0\x9f\xad\xb5", "\xe2\x99\xa6", "\xe2\x94\xbc", "\xf0\x9f\xae\x8c", "\xe2\x94\x82", "\xcf\x80", "\xe2\x97\xa5",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    " ", " ", " ", " ", " ", " ", " ", " ",
+    "\xc2\xa0", "\xe2\x96\x8c", "\xe2\x96\x84", "\xe2\x96\x94", "\xe2\x96\x81", "\xe2\x96\x8f", "\xe2\x96\x92", "\xe2\x96\x95",
+    "\xf0\x9f\xae\x8f", "\xe2\x97\xa4", "\xf0\x9f\xae\x87", "\xe2\x94\x9c", "\xe2\x96\x97", "\xe2\x94\x94", "\xe2\x94\x90", "\xe2\x96\x82",
+    "\xe2\x94\x8c", "\xe2\x94\xb4", "\xe2\x94\xac", "\xe2\x94\xa4", "\xe2\x96\x8e", "\xe2\x96\x8d", "\xf0\x9f\xae\x88", "\xf0\x9f\xae\x82",
+    "\xf0\x9f\xae\x83", "\xe2\x96\x83", "\xf0\x9f\xad\xbf", "\xe2\x96\x96", "\xe2\x96\x9d", "\xe2\x94\x98", "\xe2\x96\x98", "\xe2\x96\x9a",
+    "\xe2\x94\x80", "\xe2\x99\xa0", "\xf0\x9f\xad\xb2", "\xf0\x9f\xad\xb8", "\xf0\x9f\xad\xb7", "\xf0\x9f\xad\xb6", "\xf0\x9f\xad\xba", "\xf0\x9f\xad\xb1",
+    "\xf0\x9f\xad\xb4", "\xe2\x95\xae", "\xe2\x95\xb0", "\xe2\x95\xaf", "\xf0\x9f\xad\xbc", "\xe2\x95\xb2", "\xe2\x95\xb1", "\xf0\x9f\xad\xbd",
+    "\xf0\x9f\xad\xbe", "\xe2\x97\x8f", "\xf0\x9f\xad\xbb", "\xe2\x99\xa5", "\xf0\x9f\xad\xb0", "\xe2\x95\xad", "\xe2\x95\xb3", "\xe2\x97\x8b",
+    "\xe2\x99\xa3", "\xf0\x9f\xad\xb5", "\xe2\x99\xa6", "\xe2\x94\xbc", "\xf0\x9f\xae\x8c", "\xe2\x94\x82", "\xcf\x80", "\xe2\x97\xa5",
+    "\xc2\xa0", "\xe2\x96\x8c", "\xe2\x96\x84", "\xe2\x96\x94", "\xe2\x96\x81", "\xe2\x96\x8f", "\xe2\x96\x92", "\xe2\x96\x95",
+    "\xf0\x9f\xae\x8f", "\xe2\x97\xa4", "\xf0\x9f\xae\x87", "\xe2\x94\x9c", "\xe2\x96\x97", "\xe2\x94\x94", "\xe2\x94\x90", "\xe2\x96\x82",
+    "\xe2\x94\x8c", "\xe2\x94\xb4", "\xe2\x94\xac", "\xe2\x94\xa4", "\xe2\x96\x8e", "\xe2\x96\x8d", "\xf0\x9f\xae\x88", "\xf0\x9f\xae\x82",
+    "\xf0\x9f\xae\x83", "\xe2\x96\x83", "\xf0\x9f\xad\xbf", "\xe2\x96\x96", "\xe2\x96\x9d", "\xe2\x94\x98", "\xe2\x96\x98", "\xcf\x80"
+};
+
+void petscii_set_charset(petscii_charset charset)
+{
+    g_charset = charset;
+}
+
+petscii_charset petscii_get_charset(void)
+{
+    return g_charset;
+}
+
+int petscii_charset_parse(const char *name)
+{
+    for (size_t i = 0; i < sizeof(charset_names) / sizeof(charset_names[0]); ++i) {
+        if (strcmp(name, charset_names[i]) == 0) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+#ifdef __SSE2__
+// Stretches of a table that add the same constant to every byte, so a
+// 16 byte block inside them translates with compares and adds
+typedef struct
+{
+    const uint8_t *table;
+    __m128i lo[MAX_RUNS];
+    __m128i span[MAX_RUNS];     // last byte minus lo
+    __m128i delta[MAX_RUNS];
+} table_runs;
+
+static table_runs g_runs[8];
+static pthread_once_t g_runs_once = PTHREAD_ONCE_INIT;
+
+// The runs holding digits and punctuation, both sets of letters and the
+// name padding, which is what names and BASIC text are made of
+static void find_runs(table_runs *r, const uint8_t *table)
+{
+    static const uint8_t seeds[MAX_RUNS] = {0x20, 0x41, 0xC1, PETSCII_PAD};
+
+    uint8_t found[MAX_RUNS][3];
+    int len = 0;
+
+    r->table = table;
+
+    for (int k = 0; k < MAX_RUNS; ++k) {
+        int lo = seeds[k];
+        int hi = seeds[k];
+        uint8_t delta = (uint8_t)(table[lo] - lo);
+
+        while (lo > 0 && (uint8_t)(table[lo - 1] - (lo - 1)) == delta) {
+            lo--;
+        }
+        while (hi < 255 && (uint8_t)(table[hi + 1] - (hi + 1)) == delta) {
+            hi++;
+        }
+
+        // Runs are maximal, so two seeds share a run or don't overlap
+        int seen = 0;
+        for (int i = 0; i < len; ++i) {
+            seen |= found[i][0] == lo;
+        }
+
+        if (!seen) {
+            found[len][0] = (uint8_t)lo;
+            found[len][1] = (uint8_t)(hi - lo);
+            found[len][2] = delta;
+            len++;
+        }
+    }
+
+    // Repeating the first run keeps every slot in use
+    for (int k = 0; k < MAX_RUNS; ++k) {
+        const uint8_t *f = found[k < len ? k : 0];
+
+        r->lo[k] = _mm_set1_epi8((char)f[0]);
+        r->span[k] = _mm_set1_epi8((char)f[1]);
+        r->delta[k] = _mm_set1_epi8((char)f[2]);
+    }
+}
+
+static void init_runs(void)
+{
+    const uint8_t *tables[] = {pet_asc, petscii_text, petscii_raw, petscii_title,
+        petscii_key, petscii_dirname, petscii_lower, petscii_upper};
+
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); ++i) {
+        find_runs(&g_runs[i], tables[i]);
+    }
+}
+
+static const table_runs *runs_of(const uint8_t *table)
+{
+    pthread_once(&g_runs_once, init_runs);
+
+    for (size_t i = 0; i < sizeof(g_runs) / sizeof(g_runs[0]); ++i) {
+        if (g_runs[i].table == table) {
+            return &g_runs[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+void petscii_map(const uint8_t *table, const uint8_t *in, size_t len, char *out)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const table_runs *r = len >= 16 ? runs_of(table) : NULL;
+
+    for (; r && i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i mapped = _mm_setzero_si128();
+        __m128i covered = _mm_setzero_si128();
+
+        // Bytes in a run get its constant added; runs are equal or disjoint
+        for (int k = 0; k < MAX_RUNS; ++k) {
+            __m128i t = _mm_sub_epi8(v, r->lo[k]);
+            __m128i in_run = _mm_cmpeq_epi8(_mm_min_epu8(t, r->span[k]), t);
+            __m128i sum = _mm_add_epi8(v, r->delta[k]);
+
+            mapped = _mm_or_si128(mapped, _mm_and_si128(in_run, sum));
+            covered = _mm_or_si128(covered, in_run);
+        }
+
+        if (_mm_movemask_epi8(covered) == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)(out + i), mapped);
+            continue;
+        }
+
+        for (size_t j = i; j < i + 16; ++j) {
+            out[j] = (char)table[in[j]];
+        }
+    }
+#endif
+
+    for (; i < len; ++i) {
+        out[i] = (char)table[in[i]];
+    }
+}
+
+void petscii_name16(const uint8_t *table, const uint8_t *in, char *out)
+{
+    petscii_map(table, in, NAME_LEN, out);
+    out[NAME_LEN] = '\0';
+}
+
+static size_t encode_utf8(const uint8_t *in, size_t len, char *out)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        const char *glyph = utf8_upper[in[i]];
+
+        // Single byte glyphs are the common case
+        if (!glyph[1]) {
+            out[n++] = glyph[0];
+            continue;
+        }
+
+        size_t glen = strlen(glyph);
+        memcpy(out + n, glyph, glen);
+        n += glen;
+    }
+
+    return n;
+}
+
+void petscii_write(FILE *out, const uint8_t *ascii, const uint8_t *in, size_t len)
+{
+    char buf[CHUNK * UTF8_MAX];
+
+    switch (g_charset) {
+        case PETSCII_LOWER:
+            ascii = petscii_lower;
+            break;
+
+        case PETSCII_UPPER:
+            ascii = petscii_upper;
+            break;
+
+        case PETSCII_UTF8:
+            for (size_t i = 0; i < len; i += CHUNK) {
+                size_t n = len - i < CHUNK ? len - i : CHUNK;
+                fwrite(buf, 1, encode_utf8(in + i, n, buf), out);
+            }
+            return;
+
+        case PETSCII_ASCII:
+        default:
+            break;
+    }
+
+    for (size_t i = 0; i < len; i += CHUNK) {
+        size_t n = len - i < CHUNK ? len - i : CHUNK;
+        petscii_map(ascii, in + i, n, buf);
+        fwrite(buf, 1, n, out);
+    }
+}
+
+size_t petscii_name(const uint8_t *raw, size_t len, char *out)
+{
+    size_t n = 0;
+
+    while (n < len && raw[n] != PETSCII_PAD) {
+        n++;
+    }
+
+    petscii_map(petscii_key, raw, n, out);
+    out[n] = '\0';
+
+    return n;
+}
+
+void petscii_encode_name(const char *ascii, uint8_t *out, size_t len)
+{
+    size_t n = 0;
+
+    // Same mapping as c1541: lower case becomes the unshifted letters
+    for (; n < len && ascii[n]; ++n) {
+        uint8_t c = (uint8_t)ascii[n];
+
+        if (c >= 'a' && c <= 'z') {
+            c = (uint8_t)(c - 'a' + 0x41);
+        } else if (c >= 'A' && c <= 'Z') {
+            c = (uint8_t)(c - 'A' + 0xC1);
+        }
+
+        out[n] = c;
+    }
+
+    memset(&out[n], PETSCII_PAD, len - n);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Table driven PETSCII conversion. Every rendering is a 256 entry table.
+// With SSE2 the few runs of a table that add one constant to a stretch of
+// codes (digits and punctuation, both sets of letters, name padding) map
+// whole 16 byte blocks with compares and adds; other blocks use the table.
+
+typedef enum
+{
+    PETSCII_ASCII,              // per-module ASCII approximations (default)
+    PETSCII_LOWER,              // lower/upper case charset as ASCII
+    PETSCII_UPPER,              // upper case/graphics charset as ASCII
+    PETSCII_UTF8                // upper case/graphics charset as UTF-8
+} petscii_charset;
+
+extern const uint8_t pet_asc[256];
+extern const uint8_t petscii_text[256];
+extern const uint8_t petscii_raw[256];
+extern const uint8_t petscii_title[256];
+extern const uint8_t petscii_key[256];
+extern const uint8_t petscii_dirname[256];
+extern const uint8_t petscii_lower[256];
+extern const uint8_t petscii_upper[256];
+
+// Output charset for listings, set once at startup
+void petscii_set_charset(petscii_charset charset);
+petscii_charset petscii_get_charset(void);
+
+// Returns the charset for a name (ascii, lower, upper, utf8) or -1
+int petscii_charset_parse(const char *name);
+
+// Maps len bytes through table into out, which needs len bytes
+void petscii_map(const uint8_t *table, const uint8_t *in, size_t len, char *out);
+
+// Converts a 16 byte directory name into a NUL terminated string
+void petscii_name16(const uint8_t *table, const uint8_t *in, char *out);
+
+// Writes len bytes in the selected charset; ascii is the table used
+// when the charset is PETSCII_ASCII
+void petscii_write(FILE *out, const uint8_t *ascii, const uint8_t *in, size_t len);
+
+// PETSCII name up to the first pad as lowercase ASCII; out needs len + 1
+// bytes. Returns the name length.
+size_t petscii_name(const uint8_t *raw, size_t len, char *out);
+
+// ASCII name as a PETSCII name of len bytes, 0xA0 padded
+void petscii_encode_name(const char *ascii, uint8_t *out, size_t len);
@@ -1,9 +1,10 @@
 #include "pxx.h"
 #include "basic.h"
 #include "util.h"
+#include "petscii.h"
+#include "stats.h"
 
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 
 #define SIG_LEN 7
@@ -19,30 +20,30 @@ typedef struct
     uint8_t start;
 } PACKED pheader;
 
-void pxx(const uint8_t *buffer, const int size)
+void pxx(FILE *out, const uint8_t *buffer, const size_t size)
 {
     pheader *p = (pheader*)&buffer[0];
 
-    if (size < (int)sizeof(pheader) ||
+    // The header is followed by at least a load address
+    if (size < sizeof(pheader) + 2 ||
         strncmp(p->signature, "C64File", SIG_LEN) != 0) {
-        fprintf(stderr, "Not a valid Pxx file\n");
+        diagnostic("Not a valid Pxx file\n");
         return;
     }
 
-    printf("Contents:\n");
-    for (int i = 0; i < FNAME_LEN; i++) {
-        uint8_t c = pet_asc[p->filename[i]];
-        printf("%c", isprint(c) ? c : ' ');
-    }
+    STATS_PHASE(STATS_RENDER);
+
+    fprintf(out, "Contents:\n");
+    petscii_write(out, petscii_text, p->filename, FNAME_LEN);
 
     uint8_t *data = (uint8_t *)&buffer[sizeof(pheader)];
     uint16_t startaddr = (uint16_t)(data[0] + ((data[1] & 0xff) << 8));
 
-    printf("   $%04x - $%04lx\n", startaddr,
+    fprintf(out, "   $%04x - $%04zx\n", startaddr,
         (size - sizeof(pheader)) - startaddr);
 
     if (p->rel_size == 0) {
-        printf("\nListing:\n");
-        basic(data, size - sizeof(pheader));
+        fprintf(out, "\nListing:\n");
+        basic(out, data, size - sizeof(pheader));
     }
 }
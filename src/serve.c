@@ -0,0 +1,1027 @@
+#define _GNU_SOURCE
+
+#include "serve.h"
+#include "disasm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_THREADS 64
+#define MAX_EVENTS 64
+#define MAX_FILE (64 * 1024 * 1024)
+#define CACHE_BUCKETS 8192
+#define CACHE_ENTRIES 4096
+#define CACHE_BYTES (256 * 1024 * 1024)
+#define LENGTH_LEN 4
+
+static const char *kind_names[] = {"raw", "prg", "p00", "d64", "t64", "tap", "crt"};
+
+typedef struct
+{
+    size_t name;                // offset in names
+    size_t data;                // offset in data
+    size_t size;
+    size_t header;
+    long load;
+} served_file;
+
+// A parsed file. The listing and the files are filled in by the first
+// request that needs them.
+typedef struct entry
+{
+    char *path;
+    uint64_t hash;
+    struct timespec mtime;
+    off_t size;
+    container_kind kind;
+    uint8_t *content;
+    char *listing;
+    size_t listing_len;
+    int parsed;                 // files below are valid
+    served_file *files;
+    size_t files_len;
+    char *names;
+    uint8_t *data;
+    size_t bytes;               // memory held
+    struct entry *prev;         // LRU order, most recent first
+    struct entry *next;
+    struct entry *chain;        // hash bucket
+} entry;
+
+typedef struct conn
+{
+    int fd;
+    uint8_t length[LENGTH_LEN];
+    size_t length_got;
+    char *request;
+    size_t request_len;
+    size_t request_got;
+    uint8_t *response;          // framed, set by a worker
+    size_t response_len;
+    size_t response_sent;
+    int busy;                   // request with the workers
+    int closed;                 // peer gone while busy
+    struct conn *next;          // job, done and dead lists
+} conn;
+
+typedef struct
+{
+    const serve_handlers *h;
+    int epoll;
+    int wake;                   // eventfd, finished requests
+    pthread_mutex_t parse_lock; // image parsers keep state in globals
+    pthread_mutex_t cache_lock;
+    entry *buckets[CACHE_BUCKETS];
+    entry *lru_head;
+    entry *lru_tail;
+    size_t entries;
+    size_t bytes;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    conn *jobs;
+    conn *jobs_tail;
+    conn *done;
+    conn *dead;                 // freed after the current batch of events
+    int stop;
+} server;
+
+// Buffer for a response being built
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} reply;
+
+static int reply_add(reply *r, const void *data, size_t len)
+{
+    if (r->len + len > r->cap) {
+        size_t n = r->cap ? r->cap : 4096;
+        while (n < r->len + len) {
+            n *= 2;
+        }
+
+        uint8_t *p = realloc(r->data, n);
+        if (!p) {
+            return -1;
+        }
+
+        r->data = p;
+        r->cap = n;
+    }
+
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+
+    return 0;
+}
+
+static int reply_status(reply *r, uint8_t status)
+{
+    uint8_t head[LENGTH_LEN] = {0};
+
+    r->len = 0;
+
+    return reply_add(r, head, LENGTH_LEN) != 0 ? -1 : reply_add(r, &status, 1);
+}
+
+static void reply_error(reply *r, const char *message)
+{
+    reply_status(r, SERVE_STATUS_ERROR);
+    reply_add(r, message, strlen(message));
+}
+
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *path; ++path) {
+        h = (h ^ (uint8_t)*path) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static void entry_free(entry *e)
+{
+    free(e->path);
+    free(e->content);
+    free(e->listing);
+    free(e->files);
+    free(e->names);
+    free(e->data);
+    free(e);
+}
+
+static void lru_unlink(server *s, entry *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        s->lru_head = e->next;
+    }
+
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        s->lru_tail = e->prev;
+    }
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(server *s, entry *e)
+{
+    e->prev = NULL;
+    e->next = s->lru_head;
+
+    if (s->lru_head) {
+        s->lru_head->prev = e;
+    } else {
+        s->lru_tail = e;
+    }
+
+    s->lru_head = e;
+}
+
+static void cache_remove(server *s, entry *e)
+{
+    entry **p = &s->buckets[e->hash % CACHE_BUCKETS];
+
+    while (*p != e) {
+        p = &(*p)->chain;
+    }
+
+    *p = e->chain;
+    lru_unlink(s, e);
+    s->entries--;
+    s->bytes -= e->bytes;
+    entry_free(e);
+}
+
+// The entry for a path, NULL if not cached or changed since; the caller
+// holds the cache lock
+static entry *cache_find(server *s, const char *path, uint64_t hash, const struct stat *st)
+{
+    for (entry *e = s->buckets[hash % CACHE_BUCKETS]; e; e = e->chain) {
+        if (e->hash != hash || strcmp(e->path, path) != 0) {
+            continue;
+        }
+
+        if (e->mtime.tv_sec != st->st_mtim.tv_sec || e->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+                e->size != st->st_size) {
+            cache_remove(s, e);
+            return NULL;
+        }
+
+        lru_unlink(s, e);
+        lru_push(s, e);
+
+        return e;
+    }
+
+    return NULL;
+}
+
+static void cache_insert(server *s, entry *e)
+{
+    entry **bucket = &s->buckets[e->hash % CACHE_BUCKETS];
+
+    e->chain = *bucket;
+    *bucket = e;
+    lru_push(s, e);
+    s->entries++;
+    s->bytes += e->bytes;
+
+    // The newest entry stays even if it alone is over the limit
+    while (s->lru_tail != e && (s->entries > CACHE_ENTRIES || s->bytes > CACHE_BYTES)) {
+        cache_remove(s, s->lru_tail);
+    }
+}
+
+static entry *load_entry(server *s, const char *path, uint64_t hash, const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (st->st_size == 0 || st->st_size > MAX_FILE) {
+        errno = st->st_size ? EFBIG : EINVAL;
+        return NULL;
+    }
+
+    entry *e = calloc(1, sizeof(entry));
+    if (!e) {
+        return NULL;
+    }
+
+    e->path = strdup(path);
+    e->hash = hash;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->content = malloc((size_t)st->st_size);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    size_t got = 0;
+
+    while (fd >= 0 && e->content && got < (size_t)st->st_size) {
+        ssize_t n = read(fd, e->content + got, (size_t)st->st_size - got);
+
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            break;
+        }
+
+        got += (size_t)n;
+    }
+
+    int saved = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (!e->path || !e->content || got < (size_t)st->st_size) {
+        entry_free(e);
+        errno = saved;
+        return NULL;
+    }
+
+    e->kind = s->h->kind(path, e->content, (size_t)st->st_size);
+    e->bytes = (size_t)st->st_size + strlen(path);
+
+    return e;
+}
+
+// Moves what fresh has and e lacks over to e; the caller holds the cache
+// lock
+static void entry_adopt(server *s, entry *e, entry *fresh)
+{
+    size_t before = e->bytes;
+
+    if (!e->listing && fresh->listing) {
+        e->listing = fresh->listing;
+        e->listing_len = fresh->listing_len;
+        e->bytes += fresh->listing_len;
+        fresh->listing = NULL;
+    }
+
+    if (!e->parsed && fresh->parsed) {
+        e->parsed = 1;
+        e->files = fresh->files;
+        e->files_len = fresh->files_len;
+        e->names = fresh->names;
+        e->data = fresh->data;
+        e->bytes += fresh->bytes - (size_t)fresh->size - strlen(fresh->path) - fresh->listing_len;
+        fresh->files = NULL;
+        fresh->names = NULL;
+        fresh->data = NULL;
+    }
+
+    s->bytes += e->bytes - before;
+    entry_free(fresh);
+}
+
+static int render_listing(server *s, entry *e)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&text, &len);
+
+    if (!mem) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&s->parse_lock);
+    s->h->list(mem, e->path, e->content, (size_t)e->size);
+    pthread_mutex_unlock(&s->parse_lock);
+
+    if (fclose(mem) != 0) {
+        free(text);
+        return -1;
+    }
+
+    e->listing = text;
+    e->listing_len = len;
+    e->bytes += len;
+
+    return 0;
+}
+
+typedef struct
+{
+    entry *e;
+    size_t files_cap;
+    size_t names_len;
+    size_t names_cap;
+    size_t data_len;
+    size_t data_cap;
+    int failed;
+} file_walk;
+
+static int grow(void **buffer, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap : 64;
+    while (n < need) {
+        n *= 2;
+    }
+
+    void *p = realloc(*buffer, n * size);
+    if (!p) {
+        return -1;
+    }
+
+    *buffer = p;
+    *cap = n;
+
+    return 0;
+}
+
+static int add_file(const container_file *f, void *ctx)
+{
+    file_walk *w = ctx;
+    entry *e = w->e;
+    const char *name = f->name ? f->name : "";
+    size_t name_len = strlen(name) + 1;
+
+    if (grow((void **)&e->files, &w->files_cap, e->files_len + 1, sizeof(served_file)) != 0 ||
+            grow((void **)&e->names, &w->names_cap, w->names_len + name_len, 1) != 0 ||
+            grow((void **)&e->data, &w->data_cap, w->data_len + f->size, 1) != 0) {
+        w->failed = 1;
+        return -1;
+    }
+
+    served_file *sf = &e->files[e->files_len++];
+    sf->name = w->names_len;
+    sf->data = w->data_len;
+    sf->size = f->size;
+    sf->header = f->header;
+    sf->load = f->load;
+
+    memcpy(e->names + w->names_len, name, name_len);
+    memcpy(e->data + w->data_len, f->data, f->size);
+    w->names_len += name_len;
+    w->data_len += f->size;
+
+    return 0;
+}
+
+// Copies out every file of the container, so later requests need neither
+// the parsers nor their lock
+static int parse_files(server *s, entry *e)
+{
+    file_walk w;
+
+    memset(&w, 0, sizeof(w));
+    w.e = e;
+
+    pthread_mutex_lock(&s->parse_lock);
+    container_files(e->kind, e->content, (size_t)e->size, add_file, &w);
+    pthread_mutex_unlock(&s->parse_lock);
+
+    if (w.failed) {
+        return -1;
+    }
+
+    e->parsed = 1;
+    e->bytes += e->files_len * sizeof(served_file) + w.names_len + w.data_len;
+
+    return 0;
+}
+
+// Answers from the cached entry; the caller holds the cache lock
+static int answer(const entry *e, const char *command, const char *name, reply *r)
+{
+    if (strcmp(command, "list") == 0) {
+        return reply_status(r, SERVE_STATUS_OK) != 0 ? -1 : reply_add(r, e->listing, e->listing_len);
+    }
+
+    if (strcmp(command, "info") == 0) {
+        char text[256];
+        int len = snprintf(text, sizeof(text), "kind %s\nsize %lld\nmtime %lld.%09ld\nfiles %zu\n",
+            kind_names[e->kind], (long long)e->size, (long long)e->mtime.tv_sec,
+            e->mtime.tv_nsec, e->files_len);
+
+        return reply_status(r, SERVE_STATUS_OK) != 0 ? -1 : reply_add(r, text, (size_t)len);
+    }
+
+    // Without a name the first file, the only one of a plain file
+    const served_file *f = NULL;
+    for (size_t i = 0; i < e->files_len && !f; ++i) {
+        if (!name || strcmp(e->names + e->files[i].name, name) == 0) {
+            f = &e->files[i];
+        }
+    }
+
+    if (!f) {
+        reply_error(r, "No such file in image");
+        return 0;
+    }
+
+    const uint8_t *data = e->data + f->data;
+
+    if (strcmp(command, "extract") == 0) {
+        return reply_status(r, SERVE_STATUS_OK) != 0 ? -1 : reply_add(r, data, f->size);
+    }
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&text, &len);
+
+    if (!mem) {
+        return -1;
+    }
+
+    if (f->header == 2 && f->load >= 0) {
+        disasm(mem, data, f->size, UINT16_MAX, 0);
+    } else {
+        disasm(mem, data + f->header, f->size - f->header,
+            (uint16_t)(f->load >= 0 ? f->load : 0), 0);
+    }
+
+    int status = fclose(mem) != 0 || reply_status(r, SERVE_STATUS_OK) != 0 ||
+        reply_add(r, text, len) != 0 ? -1 : 0;
+    free(text);
+
+    return status;
+}
+
+static void handle(server *s, char *request, size_t len, reply *r)
+{
+    const char *fields[3] = {NULL, NULL, NULL};
+    size_t count = 0;
+
+    // The fields are NUL separated, the last one may be unterminated
+    request[len] = '\0';
+    for (size_t i = 0; i < len && count < 3; i += strlen(&request[i]) + 1) {
+        fields[count++] = &request[i];
+    }
+
+    const char *command = fields[0];
+    const char *path = fields[1];
+    const char *name = fields[2];
+
+    if (!command || !path || (strcmp(command, "list") != 0 && strcmp(command, "info") != 0 &&
+            strcmp(command, "extract") != 0 && strcmp(command, "disassemble") != 0)) {
+        reply_error(r, "Bad request");
+        return;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        reply_error(r, strerror(errno));
+        return;
+    }
+
+    int listing = strcmp(command, "list") == 0;
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&s->cache_lock);
+    entry *e = cache_find(s, path, hash, &st);
+
+    if (e && (listing ? e->listing != NULL : e->parsed)) {
+        if (answer(e, command, name, r) != 0) {
+            reply_error(r, strerror(ENOMEM));
+        }
+
+        pthread_mutex_unlock(&s->cache_lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&s->cache_lock);
+
+    // Parsed outside the cache lock, so hits are never held up by a miss
+    entry *fresh = load_entry(s, path, hash, &st);
+    if (!fresh) {
+        reply_error(r, strerror(errno));
+        return;
+    }
+
+    if ((listing ? render_listing(s, fresh) : parse_files(s, fresh)) != 0) {
+        entry_free(fresh);
+        reply_error(r, strerror(ENOMEM));
+        return;
+    }
+
+    pthread_mutex_lock(&s->cache_lock);
+
+    // Another request may have cached the file meanwhile
+    e = cache_find(s, path, hash, &st);
+    if (e) {
+        entry_adopt(s, e, fresh);
+    } else {
+        cache_insert(s, fresh);
+        e = fresh;
+    }
+
+    if (answer(e, command, name, r) != 0) {
+        reply_error(r, strerror(ENOMEM));
+    }
+
+    pthread_mutex_unlock(&s->cache_lock);
+}
+
+static void *worker(void *arg)
+{
+    server *s = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&s->queue_lock);
+        while (!s->jobs && !s->stop) {
+            pthread_cond_wait(&s->queue_cond, &s->queue_lock);
+        }
+
+        conn *c = s->jobs;
+        if (!c) {
+            pthread_mutex_unlock(&s->queue_lock);
+            return NULL;
+        }
+
+        s->jobs = c->next;
+        if (!s->jobs) {
+            s->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&s->queue_lock);
+
+        reply r = {NULL, 0, 0};
+        handle(s, c->request, c->request_len, &r);
+
+        if (r.len >= LENGTH_LEN) {
+            uint32_t body = (uint32_t)(r.len - LENGTH_LEN);
+
+            for (int i = 0; i < LENGTH_LEN; ++i) {
+                r.data[i] = (uint8_t)(body >> (8 * i));
+            }
+        }
+
+        c->response = r.data;
+        c->response_len = r.len;
+        c->response_sent = 0;
+
+        pthread_mutex_lock(&s->queue_lock);
+        c->next = s->done;
+        s->done = c;
+        pthread_mutex_unlock(&s->queue_lock);
+
+        uint64_t one = 1;
+        if (write(s->wake, &one, sizeof(one)) < 0) {
+            perror("Error");
+        }
+    }
+}
+
+static void conn_free(conn *c)
+{
+    free(c->request);
+    free(c->response);
+    free(c);
+}
+
+// Later events of the same batch may still name the connection
+static void conn_bury(server *s, conn *c)
+{
+    c->next = s->dead;
+    s->dead = c;
+}
+
+static void conn_close(server *s, conn *c)
+{
+    epoll_ctl(s->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+
+    // A worker still owns it
+    if (c->busy) {
+        c->closed = 1;
+    } else {
+        conn_bury(s, c);
+    }
+}
+
+static void conn_watch(server *s, conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Sends what the socket takes; returns -1 if the peer is gone
+static int conn_send(server *s, conn *c)
+{
+    while (c->response_sent < c->response_len) {
+        ssize_t n = send(c->fd, c->response + c->response_sent,
+            c->response_len - c->response_sent, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_watch(s, c, EPOLLOUT);
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        c->response_sent += (size_t)n;
+    }
+
+    free(c->response);
+    c->response = NULL;
+    conn_watch(s, c, EPOLLIN | EPOLLRDHUP);
+
+    return 0;
+}
+
+// Reads the length and then the request; returns -1 to drop the peer
+static int conn_receive(server *s, conn *c)
+{
+    for (;;) {
+        ssize_t n;
+
+        if (c->length_got < LENGTH_LEN) {
+            n = recv(c->fd, c->length + c->length_got, LENGTH_LEN - c->length_got, 0);
+        } else {
+            n = recv(c->fd, c->request + c->request_got, c->request_len - c->request_got, 0);
+        }
+
+        if (n == 0) {
+            return -1;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        if (c->length_got < LENGTH_LEN) {
+            c->length_got += (size_t)n;
+            if (c->length_got < LENGTH_LEN) {
+                continue;
+            }
+
+            c->request_len = (size_t)c->length[0] | (size_t)c->length[1] << 8 |
+                (size_t)c->length[2] << 16 | (size_t)c->length[3] << 24;
+            if (c->request_len == 0 || c->request_len > SERVE_MAX_REQUEST) {
+                return -1;
+            }
+
+            // Room for the terminating NUL
+            c->request = malloc(c->request_len + 1);
+            if (!c->request) {
+                return -1;
+            }
+            c->request_got = 0;
+        } else {
+            c->request_got += (size_t)n;
+        }
+
+        if (c->length_got == LENGTH_LEN && c->request_got == c->request_len) {
+            break;
+        }
+    }
+
+    // Nothing more is read until the answer is sent; a hangup is still
+    // reported
+    c->busy = 1;
+    c->length_got = 0;
+    conn_watch(s, c, 0);
+
+    pthread_mutex_lock(&s->queue_lock);
+    c->next = NULL;
+    if (s->jobs_tail) {
+        s->jobs_tail->next = c;
+    } else {
+        s->jobs = c;
+    }
+    s->jobs_tail = c;
+    pthread_cond_signal(&s->queue_cond);
+    pthread_mutex_unlock(&s->queue_lock);
+
+    return 0;
+}
+
+static void finish_requests(server *s)
+{
+    uint64_t count;
+
+    if (read(s->wake, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->queue_lock);
+    conn *c = s->done;
+    s->done = NULL;
+    pthread_mutex_unlock(&s->queue_lock);
+
+    while (c) {
+        conn *next = c->next;
+
+        free(c->request);
+        c->request = NULL;
+        c->busy = 0;
+
+        if (c->closed) {
+            conn_bury(s, c);
+        } else if (conn_send(s, c) != 0) {
+            conn_close(s, c);
+        }
+
+        c = next;
+    }
+}
+
+static void accept_peers(server *s, int listener)
+{
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error");
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        conn *c = calloc(1, sizeof(conn));
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+
+        if (!c || epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+    }
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier run
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+int serve(const char *socket_path, const serve_handlers *h)
+{
+    // Their addresses tell the event sources apart from connections
+    static int listener_tag;
+    static int wake_tag;
+    static int signal_tag;
+
+    server *s = calloc(1, sizeof(server));
+    if (!s) {
+        perror("Error");
+        return -1;
+    }
+
+    s->h = h;
+    pthread_mutex_init(&s->parse_lock, NULL);
+    pthread_mutex_init(&s->cache_lock, NULL);
+    pthread_mutex_init(&s->queue_lock, NULL);
+    pthread_cond_init(&s->queue_cond, NULL);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    // Blocked before the workers start so they inherit it
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int listener = open_socket(socket_path);
+    int signals = signalfd(-1, &mask, SFD_CLOEXEC);
+    s->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    struct epoll_event ev;
+    int status = listener < 0 || signals < 0 || s->wake < 0 || s->epoll < 0 ? -1 : 0;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_tag;
+    if (status == 0 && epoll_ctl(s->epoll, EPOLL_CTL_ADD, listener, &ev) != 0) {
+        status = -1;
+    }
+
+    ev.data.ptr = &wake_tag;
+    if (status == 0 && epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->wake, &ev) != 0) {
+        status = -1;
+    }
+
+    ev.data.ptr = &signal_tag;
+    if (status == 0 && epoll_ctl(s->epoll, EPOLL_CTL_ADD, signals, &ev) != 0) {
+        status = -1;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    long threads_len = sysconf(_SC_NPROCESSORS_ONLN);
+    long started = 0;
+
+    if (threads_len > MAX_THREADS) {
+        threads_len = MAX_THREADS;
+    }
+    if (threads_len < 1) {
+        threads_len = 1;
+    }
+
+    if (status != 0) {
+        perror("Error");
+    } else {
+        while (started < threads_len &&
+                pthread_create(&threads[started], NULL, worker, s) == 0) {
+            started++;
+        }
+
+        if (started == 0) {
+            perror("Error");
+            status = -1;
+        }
+    }
+
+    while (status == 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(s->epoll, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error");
+            break;
+        }
+
+        int quit = 0;
+
+        for (int i = 0; i < n; ++i) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &listener_tag) {
+                accept_peers(s, listener);
+            } else if (tag == &wake_tag) {
+                finish_requests(s);
+            } else if (tag == &signal_tag) {
+                quit = 1;
+            } else {
+                conn *c = tag;
+
+                if (c->fd < 0) {
+                    continue;
+                }
+
+                if (c->response && (events[i].events & EPOLLOUT)) {
+                    if (conn_send(s, c) != 0) {
+                        conn_close(s, c);
+                    }
+                } else if (!c->busy && !c->response && (events[i].events & EPOLLIN)) {
+                    if (conn_receive(s, c) != 0) {
+                        conn_close(s, c);
+                    }
+                } else if (events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                    conn_close(s, c);
+                }
+            }
+        }
+
+        while (s->dead) {
+            conn *c = s->dead;
+
+            s->dead = c->next;
+            conn_free(c);
+        }
+
+        if (quit) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&s->queue_lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->queue_cond);
+    pthread_mutex_unlock(&s->queue_lock);
+
+    for (long t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Connections still open are closed with the process
+    while (s->lru_head) {
+        cache_remove(s, s->lru_head);
+    }
+
+    if (listener >= 0) {
+        close(listener);
+        unlink(socket_path);
+    }
+
+    if (signals >= 0) {
+        close(signals);
+    }
+    if (s->wake >= 0) {
+        close(s->wake);
+    }
+    if (s->epoll >= 0) {
+        close(s->epoll);
+    }
+
+    pthread_mutex_destroy(&s->parse_lock);
+    pthread_mutex_destroy(&s->cache_lock);
+    pthread_mutex_destroy(&s->queue_lock);
+    pthread_cond_destroy(&s->queue_cond);
+    free(s);
+
+    return status;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Query daemon on a Unix domain socket. Parsed files are kept in an LRU
+// cache keyed by path, mtime and size, so repeated queries on the same
+// images skip reading and parsing them.
+//
+// A request is a little-endian uint32 length followed by NUL separated
+// fields:
+//
+//   list PATH                  the listing the command line prints
+//   info PATH                  kind, size, mtime and file count
+//   extract PATH [NAME]        a file inside an image as stored, or the
+//                              whole file
+//   disassemble PATH [NAME]    the same disassembled from its load address
+//
+// The response is a little-endian uint32 length followed by a status byte
+// (0 on success, 1 with a message on error) and the body. Requests on one
+// connection are answered in order; connections are served in parallel.
+
+#define SERVE_MAX_REQUEST (64 * 1024)
+#define SERVE_STATUS_OK 0
+#define SERVE_STATUS_ERROR 1
+
+typedef struct
+{
+    // Container kind of a file, from its name and contents
+    container_kind (*kind)(const char *path, const uint8_t *buffer, size_t size);
+
+    // Writes the listing of a file; called with the parsers' lock held
+    void (*list)(FILE *out, const char *path, const uint8_t *buffer, size_t size);
+} serve_handlers;
+
+// Serves requests until SIGINT or SIGTERM. Returns 0, or -1 after printing
+// the reason if the socket couldn't be set up.
+int serve(const char *socket_path, const serve_handlers *h);
@@ -1,5 +1,6 @@
 #include "sid.h"
 #include "util.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -38,21 +39,23 @@ typedef struct
 
 #define MIN_FILE_LENGTH 0x76
 
-void sid(const uint8_t *buffer, const int size)
+void sid(FILE *out, const uint8_t *buffer, const size_t size)
 {
     sid_header *header = (sid_header*)buffer;
 
     if (strncmp(header->psid, "PSID", 4) != 0 || size < MIN_FILE_LENGTH) {
-        fprintf(stderr, "Not a valid SID file\n");
+        diagnostic("Not a valid SID file\n");
         return;
     }
 
-    printf("Name:            %s\n", header->name);
-    printf("Author:          %s\n", header->author);
-    printf("Copyright:       %s\n", header->copyright);
-    printf("Number of songs: %d\n", ntohs(header->songs));
-    printf("Default song:    %d\n", ntohs(header->dsong));
-    printf("Speed:           %sHz\n", (ntohl(header->speed) == 0) ? "50" : "60");
+    STATS_PHASE(STATS_RENDER);
+
+    fprintf(out, "Name:            %s\n", header->name);
+    fprintf(out, "Author:          %s\n", header->author);
+    fprintf(out, "Copyright:       %s\n", header->copyright);
+    fprintf(out, "Number of songs: %d\n", ntohs(header->songs));
+    fprintf(out, "Default song:    %d\n", ntohs(header->dsong));
+    fprintf(out, "Speed:           %sHz\n", (ntohl(header->speed) == 0) ? "50" : "60");
 
     uint8_t *c64;
     if (ntohs(header->version) == 1)
@@ -66,8 +69,8 @@ void sid(const uint8_t *buffer, const int size)
     else
         laddr = ntohs(header->laddr);
 
-    printf("Load address:    0x%04x\n", laddr);
-    printf("Init address:    0x%04x\n", ntohs(header->iaddr));
-    printf("Play address:    0x%04x\n", ntohs(header->paddr));
+    fprintf(out, "Load address:    0x%04x\n", laddr);
+    fprintf(out, "Init address:    0x%04x\n", ntohs(header->iaddr));
+    fprintf(out, "Play address:    0x%04x\n", ntohs(header->paddr));
 
 }
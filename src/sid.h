@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 
-void sid(const uint8_t *buffer, const int size);
+void sid(FILE *out, const uint8_t *buffer, const size_t size);
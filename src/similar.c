@@ -0,0 +1,764 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "similar.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMILAR_X86
+#endif
+
+#define SIMILAR_MAGIC "D64SIMIX"
+#define SIMILAR_MAGIC_LEN 8
+#define SIMILAR_VERSION 1
+#define MAX_THREADS 64
+#define SHINGLE_LEN 4
+#define HASHES 64                   // signature length
+#define ROWS 4                      // hashes per band, candidates from ~50% similar
+#define BANDS (HASHES / ROWS)
+#define LANES 8                     // hashes per AVX2 register
+
+typedef struct
+{
+    char magic[SIMILAR_MAGIC_LEN];
+    uint32_t version;
+    uint32_t items;
+    uint32_t hashes;
+    uint32_t rows;
+    uint64_t items_off;
+    uint64_t signatures_off;
+    uint64_t keys_off;              // band keys, sorted
+    uint64_t ids_off;               // item of each band key
+    uint64_t strings_off;
+    uint64_t size;
+} similar_header;
+
+typedef struct
+{
+    uint32_t name;                  // offset in the string pool
+    uint32_t size;                  // bytes loaded
+} similar_item;
+
+typedef void (*minhash_fn)(uint32_t sig[HASHES], const uint8_t *data, size_t len);
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static uint32_t g_mul[HASHES];
+static uint32_t g_add[HASHES];
+static minhash_fn g_minhash = NULL;
+static const char *g_impl = "generic";
+
+// Murmur3 finalizer, spreads every shingle bit over the hash
+static uint32_t mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+
+    return x;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+static uint32_t shingle(const uint8_t *p)
+{
+    return mix32((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+        (uint32_t)p[3] << 24);
+}
+
+// The permutations are a * x + b modulo 2^32, one per signature slot
+static void minhash_generic(uint32_t sig[HASHES], const uint8_t *data, size_t len)
+{
+    for (int i = 0; i < HASHES; ++i) {
+        sig[i] = UINT32_MAX;
+    }
+
+    for (size_t p = 0; p + SHINGLE_LEN <= len; ++p) {
+        uint32_t x = shingle(&data[p]);
+
+        for (int i = 0; i < HASHES; ++i) {
+            uint32_t h = g_mul[i] * x + g_add[i];
+
+            sig[i] = h < sig[i] ? h : sig[i];
+        }
+    }
+}
+
+#ifdef SIMILAR_X86
+
+// The whole signature stays in eight registers
+__attribute__((target("avx2")))
+static void minhash_avx2(uint32_t sig[HASHES], const uint8_t *data, size_t len)
+{
+    __m256i min[HASHES / LANES];
+
+    for (int r = 0; r < HASHES / LANES; ++r) {
+        min[r] = _mm256_set1_epi32(-1);
+    }
+
+    for (size_t p = 0; p + SHINGLE_LEN <= len; ++p) {
+        __m256i x = _mm256_set1_epi32((int)shingle(&data[p]));
+
+        for (int r = 0; r < HASHES / LANES; ++r) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&g_mul[r * LANES]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&g_add[r * LANES]);
+            __m256i h = _mm256_add_epi32(_mm256_mullo_epi32(a, x), b);
+
+            min[r] = _mm256_min_epu32(min[r], h);
+        }
+    }
+
+    for (int r = 0; r < HASHES / LANES; ++r) {
+        _mm256_storeu_si256((__m256i *)&sig[r * LANES], min[r]);
+    }
+}
+
+#endif
+
+static void init(void)
+{
+    // Fixed seed, indexes must agree with every later query
+    uint64_t state = 0x64d64d64d64d64d6ULL;
+
+    for (int i = 0; i < HASHES; ++i) {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t r = mix64(state);
+
+        g_mul[i] = (uint32_t)r | 1;
+        g_add[i] = (uint32_t)(r >> 32);
+    }
+
+    g_minhash = minhash_generic;
+
+#ifdef SIMILAR_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        g_minhash = minhash_avx2;
+        g_impl = "avx2";
+    }
+#endif
+}
+
+const char *similar_impl(void)
+{
+    pthread_once(&g_once, init);
+
+    return g_impl;
+}
+
+static void minhash(uint32_t sig[HASHES], const uint8_t *data, size_t len)
+{
+    pthread_once(&g_once, init);
+    g_minhash(sig, data, len);
+}
+
+static uint64_t band_key(const uint32_t sig[HASHES], int band)
+{
+    uint64_t key = mix64((uint64_t)band + 1);
+
+    for (int r = 0; r < ROWS; ++r) {
+        key = mix64(key ^ sig[band * ROWS + r]);
+    }
+
+    return key;
+}
+
+static int grow(void **buffer, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap : 1024;
+    while (n < need) {
+        n *= 2;
+    }
+
+    void *p = realloc(*buffer, n * size);
+    if (!p) {
+        return -1;
+    }
+
+    *buffer = p;
+    *cap = n;
+
+    return 0;
+}
+
+typedef struct
+{
+    uint32_t input;
+    uint32_t seq;                   // position within the input
+    size_t name;                    // offset in the worker's strings
+    const uint8_t *held;            // copy of an image's file until hashed
+    uint32_t size;
+    uint32_t sig[HASHES];
+} program;
+
+typedef struct
+{
+    char **paths;
+    const container_kind *kinds;
+    int count;
+    int next;                       // next input to claim
+    pthread_mutex_t lock;           // image walkers keep state in globals
+} similar_job;
+
+typedef struct
+{
+    similar_job *job;
+    int input;
+    int image;                      // walking a container image
+    program *programs;
+    size_t programs_len;
+    size_t programs_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    arena arena;                    // image contents copied out under the lock
+    unsigned long failed;
+} similar_worker;
+
+static int add_program(const container_file *f, void *ctx)
+{
+    similar_worker *w = ctx;
+    const char *path = w->job->paths[w->input];
+    size_t size = f->size > f->header ? f->size - f->header : 0;
+
+    // Only programs inside images, and none too short for a shingle
+    if ((w->image && f->load < 0) || size < SHINGLE_LEN || size > UINT32_MAX) {
+        return 0;
+    }
+
+    size_t len = strlen(path) + 1;
+    if (w->image) {
+        len += strlen(f->name ? f->name : "") + 2;
+    }
+
+    if (grow((void **)&w->programs, &w->programs_cap, w->programs_len + 1, sizeof(program)) != 0 ||
+            grow((void **)&w->strings, &w->strings_cap, w->strings_len + len, 1) != 0) {
+        return -1;
+    }
+
+    program *p = &w->programs[w->programs_len];
+    p->input = (uint32_t)w->input;
+    p->seq = (uint32_t)w->programs_len;
+    p->name = w->strings_len;
+    p->size = (uint32_t)size;
+
+    if (w->image) {
+        snprintf(w->strings + w->strings_len, len, "%s: %s", path, f->name ? f->name : "");
+
+        // Hashed once the lock is released
+        if ((p->held = arena_copy(&w->arena, f->data + f->header, size)) == NULL) {
+            return -1;
+        }
+    } else {
+        memcpy(w->strings + w->strings_len, path, len);
+        minhash(p->sig, f->data + f->header, size);
+    }
+
+    w->strings_len += len;
+    w->programs_len++;
+
+    return 0;
+}
+
+static void hash_input(similar_worker *w, int i)
+{
+    similar_job *j = w->job;
+    container_kind kind = j->kinds[i];
+    struct stat st;
+    int fd = open(j->paths[i], O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", j->paths[i]);
+        w->failed++;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error");
+        fprintf(stderr, "Failed to read %s\n", j->paths[i]);
+        w->failed++;
+        return;
+    }
+
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    w->input = i;
+    w->image = kind != CONTAINER_RAW && kind != CONTAINER_PRG && kind != CONTAINER_P00;
+
+    size_t first = w->programs_len;
+
+    if (w->image) {
+        pthread_mutex_lock(&j->lock);
+    }
+
+    if (container_files_arena(&w->arena, kind, map, (size_t)st.st_size, add_program, w) != 0) {
+        fprintf(stderr, "Failed to index %s\n", j->paths[i]);
+    }
+
+    if (w->image) {
+        pthread_mutex_unlock(&j->lock);
+
+        for (size_t k = first; k < w->programs_len; ++k) {
+            program *p = &w->programs[k];
+
+            minhash(p->sig, p->held, p->size);
+            p->held = NULL;
+        }
+
+        arena_reset(&w->arena);
+    }
+
+    munmap(map, (size_t)st.st_size);
+}
+
+static void *worker(void *arg)
+{
+    similar_worker *w = arg;
+    similar_job *j = w->job;
+    int i;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->count) {
+        hash_input(w, i);
+    }
+
+    arena_free(&w->arena);
+
+    return NULL;
+}
+
+typedef struct
+{
+    const program *program;
+    const char *strings;
+} program_ref;
+
+static int compare_refs(const void *a, const void *b)
+{
+    const program *x = ((const program_ref *)a)->program;
+    const program *y = ((const program_ref *)b)->program;
+
+    if (x->input != y->input) {
+        return x->input < y->input ? -1 : 1;
+    }
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t id;
+} band_entry;
+
+static int compare_bands(const void *a, const void *b)
+{
+    const band_entry *x = a;
+    const band_entry *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int write_index(const char *path, const program_ref *refs, size_t len)
+{
+    band_entry *bands = malloc((len ? len : 1) * BANDS * sizeof(band_entry));
+    if (!bands) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        for (int b = 0; b < BANDS; ++b) {
+            bands[i * BANDS + b].key = band_key(refs[i].program->sig, b);
+            bands[i * BANDS + b].id = (uint32_t)i;
+        }
+    }
+
+    qsort(bands, len * BANDS, sizeof(band_entry), compare_bands);
+
+    uint64_t strings_len = 0;
+    for (size_t i = 0; i < len; ++i) {
+        strings_len += strlen(refs[i].strings + refs[i].program->name) + 1;
+    }
+
+    similar_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SIMILAR_MAGIC, SIMILAR_MAGIC_LEN);
+    hdr.version = SIMILAR_VERSION;
+    hdr.items = (uint32_t)len;
+    hdr.hashes = HASHES;
+    hdr.rows = ROWS;
+    hdr.items_off = sizeof(hdr);
+    hdr.signatures_off = hdr.items_off + len * sizeof(similar_item);
+    hdr.keys_off = hdr.signatures_off + len * HASHES * sizeof(uint32_t);
+    hdr.ids_off = hdr.keys_off + len * BANDS * sizeof(uint64_t);
+    hdr.strings_off = hdr.ids_off + len * BANDS * sizeof(uint32_t);
+    hdr.size = hdr.strings_off + strings_len;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        free(bands);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint32_t name = 0;
+    for (size_t i = 0; i < len; ++i) {
+        similar_item item = {name, refs[i].program->size};
+
+        fwrite(&item, sizeof(item), 1, f);
+        name += (uint32_t)strlen(refs[i].strings + refs[i].program->name) + 1;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        fwrite(refs[i].program->sig, sizeof(uint32_t), HASHES, f);
+    }
+
+    for (size_t i = 0; i < len * BANDS; ++i) {
+        fwrite(&bands[i].key, sizeof(uint64_t), 1, f);
+    }
+
+    for (size_t i = 0; i < len * BANDS; ++i) {
+        fwrite(&bands[i].id, sizeof(uint32_t), 1, f);
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        const char *s = refs[i].strings + refs[i].program->name;
+
+        fwrite(s, 1, strlen(s) + 1, f);
+    }
+
+    free(bands);
+
+    int status = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+int similar_index(const char *path, char **paths, const container_kind *kinds, int count)
+{
+    similar_job j;
+    similar_worker *w;
+    pthread_t threads[MAX_THREADS];
+    // The calling thread is one of the workers
+    long threads_len = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (threads_len > count - 1) {
+        threads_len = count - 1;
+    }
+    if (threads_len > MAX_THREADS) {
+        threads_len = MAX_THREADS;
+    }
+    if (threads_len < 0) {
+        threads_len = 0;
+    }
+
+    w = calloc((size_t)threads_len + 1, sizeof(similar_worker));
+    if (!w) {
+        perror("Error");
+        return -1;
+    }
+
+    j.paths = paths;
+    j.kinds = kinds;
+    j.count = count;
+    j.next = 0;
+    pthread_mutex_init(&j.lock, NULL);
+
+    for (long t = 0; t <= threads_len; ++t) {
+        w[t].job = &j;
+        arena_init(&w[t].arena);
+    }
+
+    long started = 0;
+    while (started < threads_len &&
+            pthread_create(&threads[started], NULL, worker, &w[started + 1]) == 0) {
+        started++;
+    }
+
+    worker(&w[0]);
+
+    for (long t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&j.lock);
+
+    // Input order, whichever worker hashed a file
+    size_t len = 0;
+    unsigned long failed = 0;
+    for (long t = 0; t <= threads_len; ++t) {
+        len += w[t].programs_len;
+        failed += w[t].failed;
+    }
+
+    int status = -1;
+    program_ref *refs = malloc((len ? len : 1) * sizeof(program_ref));
+
+    if (refs) {
+        size_t n = 0;
+        for (long t = 0; t <= threads_len; ++t) {
+            for (size_t i = 0; i < w[t].programs_len; ++i) {
+                refs[n].program = &w[t].programs[i];
+                refs[n].strings = w[t].strings;
+                n++;
+            }
+        }
+
+        qsort(refs, len, sizeof(program_ref), compare_refs);
+        status = write_index(path, refs, len);
+    }
+
+    if (status != 0) {
+        perror("Error");
+    } else {
+        printf("%zu programs from %d files indexed (%s)\n", len, count, similar_impl());
+    }
+
+    free(refs);
+    for (long t = 0; t <= threads_len; ++t) {
+        free(w[t].programs);
+        free(w[t].strings);
+    }
+    free(w);
+
+    return status == 0 && failed == 0 ? 0 : -1;
+}
+
+typedef struct
+{
+    const uint8_t *map;
+    const similar_header *hdr;
+    const similar_item *items;
+    const uint32_t *signatures;
+    const uint64_t *keys;
+    const uint32_t *ids;
+    const char *strings;
+} similar_view;
+
+typedef struct
+{
+    similar_view *view;
+    FILE *out;
+    const char *name;
+    int image;
+    int top;
+    long matches;
+    uint32_t *candidates;           // scratch for one query
+    size_t candidates_cap;
+} similar_query;
+
+typedef struct
+{
+    uint32_t id;
+    int same;                       // signature slots in agreement
+} similar_score;
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_scores(const void *a, const void *b)
+{
+    const similar_score *x = a;
+    const similar_score *y = b;
+
+    if (x->same != y->same) {
+        return y->same - x->same;
+    }
+
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// First band key not less than key
+static uint64_t lower_bound(const similar_view *v, uint64_t key)
+{
+    uint64_t lo = 0;
+    uint64_t hi = (uint64_t)v->hdr->items * BANDS;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (v->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static int query_program(const container_file *f, void *ctx)
+{
+    similar_query *q = ctx;
+    const similar_view *v = q->view;
+    size_t size = f->size > f->header ? f->size - f->header : 0;
+    uint32_t sig[HASHES];
+    size_t len = 0;
+
+    if ((q->image && f->load < 0) || size < SHINGLE_LEN) {
+        return 0;
+    }
+
+    minhash(sig, f->data + f->header, size);
+
+    // Every program sharing a band is a candidate
+    for (int b = 0; b < BANDS; ++b) {
+        uint64_t key = band_key(sig, b);
+        uint64_t end = (uint64_t)v->hdr->items * BANDS;
+
+        for (uint64_t k = lower_bound(v, key); k < end && v->keys[k] == key; ++k) {
+            if (grow((void **)&q->candidates, &q->candidates_cap, len + 1, sizeof(uint32_t)) != 0) {
+                return -1;
+            }
+
+            q->candidates[len++] = v->ids[k];
+        }
+    }
+
+    qsort(q->candidates, len, sizeof(uint32_t), compare_u32);
+
+    similar_score *scores = malloc((len ? len : 1) * sizeof(similar_score));
+    if (!scores) {
+        return -1;
+    }
+
+    size_t unique = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (i > 0 && q->candidates[i] == q->candidates[i - 1]) {
+            continue;
+        }
+
+        const uint32_t *other = &v->signatures[(size_t)q->candidates[i] * HASHES];
+        int same = 0;
+
+        for (int h = 0; h < HASHES; ++h) {
+            same += other[h] == sig[h];
+        }
+
+        scores[unique].id = q->candidates[i];
+        scores[unique].same = same;
+        unique++;
+    }
+
+    qsort(scores, unique, sizeof(similar_score), compare_scores);
+
+    if (q->image) {
+        fprintf(q->out, "%s: %s\n", q->name, f->name ? f->name : "");
+    } else {
+        fprintf(q->out, "%s\n", q->name);
+    }
+
+    for (size_t i = 0; i < unique && i < (size_t)q->top; ++i) {
+        const similar_item *item = &v->items[scores[i].id];
+
+        fprintf(q->out, "    %.3f  %s (%u bytes)\n", (double)scores[i].same / HASHES,
+            v->strings + item->name, item->size);
+        q->matches++;
+    }
+
+    free(scores);
+
+    return 0;
+}
+
+long similar_find(FILE *out, const char *path, const char *name, const uint8_t *buffer,
+        size_t size, container_kind kind, int top)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(similar_header)) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    similar_view v;
+    v.map = map;
+    v.hdr = (const similar_header *)map;
+
+    if (memcmp(v.hdr->magic, SIMILAR_MAGIC, SIMILAR_MAGIC_LEN) != 0 ||
+            v.hdr->version != SIMILAR_VERSION || v.hdr->size != (uint64_t)st.st_size ||
+            v.hdr->hashes != HASHES || v.hdr->rows != ROWS) {
+        fprintf(stderr, "Not a valid similarity index: %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    v.items = (const similar_item *)(map + v.hdr->items_off);
+    v.signatures = (const uint32_t *)(map + v.hdr->signatures_off);
+    v.keys = (const uint64_t *)(map + v.hdr->keys_off);
+    v.ids = (const uint32_t *)(map + v.hdr->ids_off);
+    v.strings = (const char *)(map + v.hdr->strings_off);
+
+    similar_query q;
+    memset(&q, 0, sizeof(q));
+    q.view = &v;
+    q.out = out;
+    q.name = name;
+    q.image = kind != CONTAINER_RAW && kind != CONTAINER_PRG && kind != CONTAINER_P00;
+    q.top = top;
+
+    int status = container_files(kind, buffer, size, query_program, &q);
+
+    free(q.candidates);
+    munmap(map, (size_t)st.st_size);
+
+    return status == 0 ? q.matches : -1;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Near-duplicate programs (cracked, trained or re-packed versions of the
+// same code) found by MinHash over 4-byte shingles of the loaded bytes.
+// Signatures are split into bands for locality sensitive hashing, so a
+// query only scores the programs sharing at least one band with it.
+
+#define SIMILAR_TOP 10
+
+// Writes an index of the inputs and the programs inside container images,
+// hashed in parallel. Returns 0, or -1 after printing the reason.
+int similar_index(const char *path, char **paths, const container_kind *kinds, int count);
+
+// Prints the top indexed programs most similar to each program in the
+// buffer with their estimated Jaccard similarity. Returns the number of
+// matches printed or -1 on error.
+long similar_find(FILE *out, const char *path, const char *name, const uint8_t *buffer,
+        size_t size, container_kind kind, int top);
+
+// "avx2" or "generic"
+const char *similar_impl(void);
@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+stats_counters g_stats;
+
+static const char *phase_names[STATS_PHASES] = {
+    "open", "detect", "parse", "render", "write"
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void stats_enable(void)
+{
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_stats.enabled = 1;
+    g_stats.phase = -1;
+    g_stats.started = now();
+}
+
+void stats_phase_begin(stats_phase p)
+{
+    double t = now();
+
+    if (g_stats.phase >= 0) {
+        g_stats.seconds[g_stats.phase] += t - g_stats.phase_start;
+    }
+
+    g_stats.phase = p;
+    g_stats.phase_start = t;
+}
+
+void stats_phase_end(void)
+{
+    if (g_stats.phase >= 0) {
+        g_stats.seconds[g_stats.phase] += now() - g_stats.phase_start;
+    }
+
+    g_stats.phase = -1;
+}
+
+void stats_report(FILE *out, int json)
+{
+    double total = now() - g_stats.started;
+    double fps = total > 0 ? (double)g_stats.files / total : 0;
+
+    if (json) {
+        fprintf(out, "{\"seconds\":%.6f", total);
+        for (int i = 0; i < STATS_PHASES; ++i) {
+            fprintf(out, ",\"%s_seconds\":%.6f", phase_names[i], g_stats.seconds[i]);
+        }
+        fprintf(out, ",\"files\":%lu,\"files_per_s\":%.1f,\"sectors_read\":%lu,"
+            "\"chain_steps\":%lu,\"bytes_emitted\":%lu,\"instructions\":%lu,"
+            "\"arena_blocks\":%lu,\"arena_bytes\":%lu,\"arena_peak\":%lu,\"arena_resets\":%lu}\n",
+            g_stats.files, fps, g_stats.sectors_read, g_stats.chain_steps,
+            g_stats.bytes_emitted, g_stats.instructions, g_stats.arena_blocks,
+            g_stats.arena_bytes, g_stats.arena_peak, g_stats.arena_resets);
+        return;
+    }
+
+    fprintf(out, "Total:          %10.6f s\n", total);
+    for (int i = 0; i < STATS_PHASES; ++i) {
+        fprintf(out, "  %-12s  %10.6f s\n", phase_names[i], g_stats.seconds[i]);
+    }
+    fprintf(out, "Files:          %10lu (%.1f files/s)\n", g_stats.files, fps);
+    fprintf(out, "Sectors read:   %10lu\n", g_stats.sectors_read);
+    fprintf(out, "Chain steps:    %10lu\n", g_stats.chain_steps);
+    fprintf(out, "Bytes emitted:  %10lu\n", g_stats.bytes_emitted);
+    fprintf(out, "Instructions:   %10lu\n", g_stats.instructions);
+    fprintf(out, "Arena blocks:   %10lu (%lu bytes, peak %lu per input, %lu resets)\n",
+        g_stats.arena_blocks, g_stats.arena_bytes, g_stats.arena_peak, g_stats.arena_resets);
+}
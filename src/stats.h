@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+
+// Run statistics for --stats. Every hook is a single well predicted
+// branch on g_stats.enabled, so instrumented code costs nothing
+// measurable when statistics are off.
+
+typedef enum
+{
+    STATS_OPEN,                 // open and mmap
+    STATS_DETECT,               // file type detection
+    STATS_PARSE,                // header and layout parsing
+    STATS_RENDER,               // formatting module output
+    STATS_WRITE,                // writing output
+    STATS_PHASES
+} stats_phase;
+
+typedef struct
+{
+    int enabled;
+    int phase;                  // running phase, -1 if none
+    double phase_start;
+    double started;
+    double seconds[STATS_PHASES];
+    unsigned long files;
+    unsigned long sectors_read;
+    unsigned long chain_steps;
+    unsigned long bytes_emitted;
+    unsigned long instructions;
+    unsigned long arena_blocks;     // parse arenas of all workers
+    unsigned long arena_bytes;
+    unsigned long arena_peak;       // most one input needed
+    unsigned long arena_resets;
+} stats_counters;
+
+extern stats_counters g_stats;
+
+#define STATS_ADD(counter, n) \
+    do { if (__builtin_expect(g_stats.enabled, 0)) g_stats.counter += (n); } while (0)
+
+// Ends the running phase and starts p
+#define STATS_PHASE(p) \
+    do { if (__builtin_expect(g_stats.enabled, 0)) stats_phase_begin(p); } while (0)
+
+#define STATS_PHASE_END() \
+    do { if (__builtin_expect(g_stats.enabled, 0)) stats_phase_end(); } while (0)
+
+void stats_enable(void);
+void stats_phase_begin(stats_phase p);
+void stats_phase_end(void);
+
+// Prints phase timings and counters as text or a single JSON object
+void stats_report(FILE *out, int json);
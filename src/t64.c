@@ -1,13 +1,14 @@
 #include "t64.h"
 #include "util.h"
+#include "petscii.h"
+#include "stats.h"
 
 #include <stdio.h>
-#include <ctype.h>
 #include <arpa/inet.h>
 
 #define DES_LEN 32
 #define USER_DES_LEN 24
-#define FNAME_LEN 16
+#define FNAME_LEN T64_NAME_LEN
 #define MIN_SIZE 86
 
 typedef struct
@@ -42,41 +43,79 @@ const char *types[] = {
     "Unknown"
 };
 
-void t64(const uint8_t *buffer, const int size)
+void t64(FILE *out, const uint8_t *buffer, const size_t size)
 {
     if (size < MIN_SIZE) {
-        fprintf(stderr, "Not a valid T64 file.\n");
+        diagnostic("Not a valid T64 file.\n");
         return;
     }
 
     tape_record *tape = (tape_record*)&buffer[0];
 
-    printf("Name: ");
-    for (int i = 0; i < USER_DES_LEN; i++) {
-        char c = tape->user_des[i];
-        printf("%c", isprint(c) ? c : ' ');
-    }
-    printf("\n");
+    STATS_PHASE(STATS_RENDER);
+
+    fprintf(out, "Name: ");
+    // The description is plain ASCII, not PETSCII
+    char des[USER_DES_LEN];
+    petscii_map(petscii_raw, (const uint8_t *)tape->user_des, USER_DES_LEN, des);
+    fwrite(des, 1, USER_DES_LEN, out);
+    fprintf(out, "\n");
 
     int type_size = sizeof(types) / sizeof(types[0]);
     int index = sizeof(tape_record);
 
-    printf("Contents:\n");
+    fprintf(out, "Contents:\n");
     for (int i = 0; i < tape->used; i++) {
         file_record *file = (file_record*)&buffer[index];
 
-        for (int j = 0; j < FNAME_LEN; j++) {
-            char c = file->fname[j];
-            printf("%c", isprint(c) ? c : ' ');
-        }
+        petscii_write(out, petscii_raw, (const uint8_t *)file->fname, FNAME_LEN);
 
-        printf("  %s", get_filetype(file->ftype));
-        printf("  %s", (file->type >= type_size) ?
+        fprintf(out, "  %s", get_filetype(file->ftype));
+        fprintf(out, "  %s", (file->type >= type_size) ?
                 types[type_size - 1] : types[file->type]);
 
-        printf("  0x%04x - 0x%04x", file->start_addr, file->end_addr);
-        printf("\n");
+        fprintf(out, "  0x%04x - 0x%04x", file->start_addr, file->end_addr);
+        fprintf(out, "\n");
+
+        index += sizeof(file_record);
+    }
+}
+
+int t64_entries(const uint8_t *buffer, size_t size, t64_entry_fn fn, void *ctx)
+{
+    if (size < MIN_SIZE) {
+        diagnostic("Not a valid T64 file.\n");
+        return -1;
+    }
+
+    const tape_record *tape = (const tape_record*)&buffer[0];
+    size_t index = sizeof(tape_record);
 
+    for (int i = 0; i < tape->used && index + sizeof(file_record) <= size; i++) {
+        const file_record *file = (const file_record*)&buffer[index];
         index += sizeof(file_record);
+
+        if (file->type == 0 || file->offset >= size) {
+            continue;
+        }
+
+        // End addresses written by old tools are often wrong, so clamp
+        // the entry to the image
+        size_t len = file->end_addr > file->start_addr ?
+            (size_t)(file->end_addr - file->start_addr) : 0;
+        if (len > size - file->offset) {
+            len = size - file->offset;
+        }
+
+        t64_entry e = {
+            (const uint8_t *)file->fname, file->ftype, file->start_addr,
+            &buffer[file->offset], len
+        };
+
+        if (fn(&e, ctx) != 0) {
+            break;
+        }
     }
+
+    return 0;
 }
@@ -1,5 +1,25 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-void t64(const uint8_t *buffer, const int size);
+#define T64_NAME_LEN 16
+
+// A used tape entry, valid for the duration of the callback
+typedef struct
+{
+    const uint8_t *name;        // raw PETSCII name, T64_NAME_LEN bytes
+    uint8_t ftype;              // C64 file type byte
+    uint16_t start;             // load address of data[0]
+    const uint8_t *data;        // file contents without load address
+    size_t size;
+} t64_entry;
+
+typedef int (*t64_entry_fn)(const t64_entry *entry, void *ctx);
+
+void t64(FILE *out, const uint8_t *buffer, const size_t size);
+
+// Calls fn for every used entry whose data lies inside the image; fn
+// returning non-zero stops the walk.
+int t64_entries(const uint8_t *buffer, size_t size, t64_entry_fn fn, void *ctx);
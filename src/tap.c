@@ -0,0 +1,775 @@
+#include "tap.h"
+#include "petscii.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TAP_SIGNATURE "C64-TAPE-RAW"
+#define TAP_VERSION_OFF 0x0C
+#define TAP_LENGTH_OFF 0x10
+#define TAP_HEADER_LEN 0x14
+#define TAP_MAX_VERSION 2
+#define TAP_PAUSE_LEN 3         // cycle count following a v1/v2 zero byte
+
+// Standard CBM ROM loader
+#define CBM_SYNC_LEN 9
+#define CBM_SYNC_FIRST 0x89     // countdown of the first block copy
+#define CBM_SYNC_REPEAT 0x09    // countdown of the repeated copy
+#define CBM_HEADER_LEN 192
+#define CBM_HEADER_PRG 0x01     // relocatable program
+#define CBM_HEADER_SEQ_DATA 0x02
+#define CBM_HEADER_PRG_ABS 0x03
+#define CBM_HEADER_SEQ TAP_CBM_SEQ
+#define CBM_HEADER_EOT 0x05
+#define CBM_START_OFF 1
+#define CBM_END_OFF 3
+#define CBM_NAME_OFF 5
+
+// Turbo Tape 64
+#define TURBO_PILOT 0x02
+#define TURBO_SYNC 0x09
+#define TURBO_HEADER 0x01
+#define TURBO_DATA 0x00
+#define TURBO_TYPE_OFF 4
+#define TURBO_NAME_OFF 5
+#define TURBO_HEADER_LEN (TURBO_NAME_OFF + TAP_NAME_LEN)
+
+#define POOL_INITIAL 4096
+
+// Pulse classes, the number of thresholds a pulse reaches
+enum {
+    PULSE_BIT0,                 // Turbo Tape bits
+    PULSE_BIT1,
+    PULSE_SHORT,                // CBM ROM loader pulses
+    PULSE_MEDIUM,
+    PULSE_LONG,
+    PULSE_PAUSE,                // zero byte
+    PULSE_SKIP                  // pause length bytes, not a pulse
+};
+
+static uint8_t g_thresholds[TAP_THRESHOLDS] = {0x20, 0x2C, 0x3A, 0x4C};
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} bytes;
+
+typedef struct
+{
+    tap_file file;              // name and data are pool offsets until sorted
+    size_t name;
+    size_t data;
+} found;
+
+typedef struct
+{
+    const uint8_t *pulses;
+    size_t count;
+    bytes pool;
+    found *files;
+    size_t nfiles;
+    size_t cap;
+    int error;
+} tape;
+
+typedef struct
+{
+    bytes data;                 // payload without sync and checksum
+    int ok;
+    int copy;                   // 1 or 2, 0 when empty
+    size_t pulse;
+} cbm_block;
+
+typedef struct
+{
+    cbm_block pending;          // first copy waiting for its repeat
+    cbm_block repeat;
+    uint8_t header[CBM_HEADER_LEN];
+    int have_header;            // header waiting for its data
+    int header_ok;
+    size_t header_pulse;
+    bytes seq;
+    int seq_ok;
+} cbm_state;
+
+void tap_set_thresholds(const uint8_t thresholds[TAP_THRESHOLDS])
+{
+    memcpy(g_thresholds, thresholds, TAP_THRESHOLDS);
+}
+
+int tap_thresholds_parse(const char *s, uint8_t thresholds[TAP_THRESHOLDS])
+{
+    long previous = 0;
+
+    for (int i = 0; i < TAP_THRESHOLDS; ++i) {
+        char *end;
+        long value = strtol(s, &end, 0);
+
+        if (end == s || value <= previous || value > UINT8_MAX) {
+            return -1;
+        }
+
+        if (i < TAP_THRESHOLDS - 1 ? *end != ',' : *end != '\0') {
+            return -1;
+        }
+
+        thresholds[i] = (uint8_t)value;
+        previous = value;
+        s = end + 1;
+    }
+
+    return 0;
+}
+
+static int reserve(bytes *b, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : POOL_INITIAL;
+
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+
+        uint8_t *p = realloc(b->data, cap);
+        if (!p) {
+            return -1;
+        }
+
+        b->data = p;
+        b->cap = cap;
+    }
+
+    return 0;
+}
+
+static int append(bytes *b, const uint8_t *data, size_t len)
+{
+    if (reserve(b, len) != 0) {
+        return -1;
+    }
+
+    if (len > 0) {
+        memcpy(&b->data[b->len], data, len);
+        b->len += len;
+    }
+
+    return 0;
+}
+
+// Class of every pulse in one branch free pass: each threshold reached
+// adds one
+static void classify(const uint8_t *in, size_t n, uint8_t *out)
+{
+    const uint8_t *t = g_thresholds;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i t0 = _mm_set1_epi8((char)t[0]);
+    __m128i t1 = _mm_set1_epi8((char)t[1]);
+    __m128i t2 = _mm_set1_epi8((char)t[2]);
+    __m128i t3 = _mm_set1_epi8((char)t[3]);
+
+    // v >= t exactly when max(v, t) == v; a match is -1, so subtract
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+        __m128i c = _mm_cmpeq_epi8(_mm_max_epu8(v, t0), v);
+
+        c = _mm_add_epi8(c, _mm_cmpeq_epi8(_mm_max_epu8(v, t1), v));
+        c = _mm_add_epi8(c, _mm_cmpeq_epi8(_mm_max_epu8(v, t2), v));
+        c = _mm_add_epi8(c, _mm_cmpeq_epi8(_mm_max_epu8(v, t3), v));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_sub_epi8(_mm_setzero_si128(), c));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        out[i] = (uint8_t)((in[i] >= t[0]) + (in[i] >= t[1]) +
+            (in[i] >= t[2]) + (in[i] >= t[3]));
+    }
+}
+
+// Zero bytes are rare, so they are patched up after classification
+static void mark_pauses(const uint8_t *in, size_t n, uint8_t *out, int skip)
+{
+    const uint8_t *p = in;
+
+    while (p < in + n && (p = memchr(p, 0, n - (size_t)(p - in)))) {
+        size_t i = (size_t)(p - in);
+
+        out[i] = PULSE_PAUSE;
+        for (int k = 1; k <= skip && i + k < n; ++k) {
+            out[i + k] = PULSE_SKIP;
+        }
+
+        p += 1 + skip;
+    }
+}
+
+// Version 2 stores half waves; pairs are summed into full pulses
+static size_t full_waves(const uint8_t *in, size_t n, uint8_t *out)
+{
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; ) {
+        if (in[i] == 0) {
+            out[len++] = 0;
+            i += 1 + TAP_PAUSE_LEN;
+        } else if (i + 1 < n && in[i + 1] != 0) {
+            unsigned wave = in[i] + in[i + 1];
+            out[len++] = wave > UINT8_MAX ? UINT8_MAX : (uint8_t)wave;
+            i += 2;
+        } else {
+            i++;
+        }
+    }
+
+    return len;
+}
+
+static void add_file(tape *t, const tap_file *f)
+{
+    if (t->nfiles == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        found *files = realloc(t->files, cap * sizeof(found));
+
+        if (!files) {
+            t->error = 1;
+            return;
+        }
+
+        t->files = files;
+        t->cap = cap;
+    }
+
+    found *n = &t->files[t->nfiles];
+    n->file = *f;
+    n->name = t->pool.len;
+    n->data = t->pool.len + TAP_NAME_LEN;
+
+    if (append(&t->pool, f->name, TAP_NAME_LEN) != 0 ||
+            append(&t->pool, f->data, f->size) != 0) {
+        t->error = 1;
+        return;
+    }
+
+    t->nfiles++;
+}
+
+static int pulse(const tape *t, size_t *i)
+{
+    while (*i < t->count && t->pulses[*i] == PULSE_SKIP) {
+        (*i)++;
+    }
+
+    return *i < t->count ? t->pulses[(*i)++] : -1;
+}
+
+// A CBM bit is a short/medium pulse pair, 0 or 1 depending on the order
+static int cbm_bit(const tape *t, size_t *i)
+{
+    int a = pulse(t, i);
+    int b = pulse(t, i);
+
+    if (a == PULSE_SHORT && b == PULSE_MEDIUM) {
+        return 0;
+    }
+
+    if (a == PULSE_MEDIUM && b == PULSE_SHORT) {
+        return 1;
+    }
+
+    return -1;
+}
+
+// Byte after its long/medium marker: eight bits LSB first and an odd
+// parity bit
+static int cbm_byte(const tape *t, size_t *i, int *parity_ok)
+{
+    int value = 0;
+    int check = 1;
+
+    for (int b = 0; b < 8; ++b) {
+        int bit = cbm_bit(t, i);
+
+        if (bit < 0) {
+            return -1;
+        }
+
+        value |= bit << b;
+        check ^= bit;
+    }
+
+    int parity = cbm_bit(t, i);
+    if (parity < 0) {
+        return -1;
+    }
+
+    *parity_ok = parity == check;
+
+    return value;
+}
+
+static void cbm_emit(tape *t, cbm_state *st, const uint8_t *data, size_t len, int ok)
+{
+    const uint8_t *h = st->header;
+    tap_file f = {
+        TAP_CBM, &h[CBM_NAME_OFF], h[0],
+        (uint16_t)(h[CBM_START_OFF] | h[CBM_START_OFF + 1] << 8),
+        (uint16_t)(h[CBM_END_OFF] | h[CBM_END_OFF + 1] << 8),
+        data, len, ok, st->header_pulse
+    };
+
+    add_file(t, &f);
+    st->have_header = 0;
+}
+
+// Finishes the current header: SEQ files end here, a program whose data
+// never showed up is listed empty
+static void cbm_flush(tape *t, cbm_state *st)
+{
+    if (!st->have_header) {
+        return;
+    }
+
+    if (st->header[0] == CBM_HEADER_SEQ) {
+        cbm_emit(t, st, st->seq.data, st->seq.len, st->header_ok && st->seq_ok);
+    } else {
+        cbm_emit(t, st, NULL, 0, 0);
+    }
+}
+
+static void cbm_resolve(tape *t, cbm_state *st, const cbm_block *b)
+{
+    const uint8_t *p = b->data.data;
+    size_t len = b->data.len;
+    int type = st->have_header ? st->header[0] : 0;
+
+    if (type == CBM_HEADER_PRG || type == CBM_HEADER_PRG_ABS) {
+        uint16_t start = st->header[CBM_START_OFF] | st->header[CBM_START_OFF + 1] << 8;
+        uint16_t end = st->header[CBM_END_OFF] | st->header[CBM_END_OFF + 1] << 8;
+
+        if (len == (uint16_t)(end - start)) {
+            cbm_emit(t, st, p, len, st->header_ok && b->ok);
+            return;
+        }
+    }
+
+    if (len == CBM_HEADER_LEN && p[0] >= CBM_HEADER_PRG && p[0] <= CBM_HEADER_EOT &&
+            p[0] != CBM_HEADER_SEQ_DATA) {
+        cbm_flush(t, st);
+
+        if (p[0] != CBM_HEADER_EOT) {
+            memcpy(st->header, p, CBM_HEADER_LEN);
+            st->have_header = 1;
+            st->header_ok = b->ok;
+            st->header_pulse = b->pulse;
+            st->seq.len = 0;
+            st->seq_ok = 1;
+        }
+        return;
+    }
+
+    if (type == CBM_HEADER_SEQ && len == CBM_HEADER_LEN && p[0] == CBM_HEADER_SEQ_DATA) {
+        if (append(&st->seq, &p[1], len - 1) != 0) {
+            t->error = 1;
+        }
+        st->seq_ok &= b->ok;
+    }
+
+    // Anything else belongs to a custom loader and is skipped
+}
+
+// Every block is recorded twice; the first copy with a good checksum wins
+static void cbm_pair(tape *t, cbm_state *st, const cbm_block *first, const cbm_block *repeat)
+{
+    if (!first->ok && repeat && repeat->ok && repeat->data.len == first->data.len) {
+        cbm_resolve(t, st, repeat);
+        return;
+    }
+
+    cbm_resolve(t, st, first);
+
+    if (repeat && repeat->data.len != first->data.len) {
+        cbm_resolve(t, st, repeat);
+    }
+}
+
+static void cbm_block_done(tape *t, cbm_state *st, const uint8_t *raw, size_t len,
+        int parity_errors, size_t position)
+{
+    int copy = 0;
+
+    if (len < CBM_SYNC_LEN + 1) {
+        return;
+    }
+
+    for (int k = 0; k < CBM_SYNC_LEN && raw[k] == CBM_SYNC_FIRST - k; ++k) {
+        copy = k == CBM_SYNC_LEN - 1 ? 1 : 0;
+    }
+
+    for (int k = 0; k < CBM_SYNC_LEN && raw[k] == CBM_SYNC_REPEAT - k; ++k) {
+        copy = k == CBM_SYNC_LEN - 1 ? 2 : 0;
+    }
+
+    if (!copy) {
+        return;
+    }
+
+    const uint8_t *payload = &raw[CBM_SYNC_LEN];
+    size_t plen = len - CBM_SYNC_LEN - 1;
+    uint8_t sum = 0;
+
+    for (size_t k = 0; k < plen; ++k) {
+        sum ^= payload[k];
+    }
+
+    cbm_block *b = &st->repeat;
+
+    b->data.len = 0;
+    if (append(&b->data, payload, plen) != 0) {
+        t->error = 1;
+        return;
+    }
+    b->ok = sum == raw[len - 1] && parity_errors == 0;
+    b->copy = copy;
+    b->pulse = position;
+
+    if (copy == 1) {
+        if (st->pending.copy) {
+            cbm_pair(t, st, &st->pending, NULL);
+        }
+
+        // Keep the first copy until its repeat arrives
+        cbm_block swap = st->pending;
+        st->pending = st->repeat;
+        st->repeat = swap;
+        return;
+    }
+
+    if (st->pending.copy) {
+        cbm_pair(t, st, &st->pending, b);
+        st->pending.copy = 0;
+    } else {
+        cbm_pair(t, st, b, NULL);
+    }
+}
+
+static void decode_cbm(tape *t)
+{
+    cbm_state st;
+    bytes block = {NULL, 0, 0};
+    size_t i = 0;
+
+    memset(&st, 0, sizeof(st));
+
+    while (i < t->count && !t->error) {
+        if (pulse(t, &i) != PULSE_LONG) {
+            continue;
+        }
+
+        size_t start = i - 1;
+        size_t mark = i;
+        if (pulse(t, &i) != PULSE_MEDIUM) {
+            i = mark;
+            continue;
+        }
+
+        int parity_errors = 0;
+        block.len = 0;
+
+        for (;;) {
+            int ok;
+            int value = cbm_byte(t, &i, &ok);
+
+            if (value < 0) {
+                break;
+            }
+
+            uint8_t byte = (uint8_t)value;
+            if (append(&block, &byte, 1) != 0) {
+                t->error = 1;
+                break;
+            }
+            parity_errors += !ok;
+
+            // Long/medium starts the next byte, long/short ends the block
+            mark = i;
+            int a = pulse(t, &i);
+            int b = pulse(t, &i);
+
+            if (a == PULSE_LONG && b == PULSE_MEDIUM) {
+                continue;
+            }
+
+            if (a != PULSE_LONG || b != PULSE_SHORT) {
+                i = mark;
+            }
+            break;
+        }
+
+        cbm_block_done(t, &st, block.data, block.len, parity_errors, start);
+    }
+
+    if (st.pending.copy) {
+        cbm_pair(t, &st, &st.pending, NULL);
+    }
+    cbm_flush(t, &st);
+
+    free(block.data);
+    free(st.pending.data.data);
+    free(st.repeat.data.data);
+    free(st.seq.data);
+}
+
+static int turbo_byte(const tape *t, size_t *i)
+{
+    int value = 0;
+
+    // MSB first, one pulse per bit
+    for (int b = 0; b < 8; ++b) {
+        int c = pulse(t, i);
+
+        if (c != PULSE_BIT0 && c != PULSE_BIT1) {
+            return -1;
+        }
+
+        value = value << 1 | c;
+    }
+
+    return value;
+}
+
+static int turbo_read(const tape *t, size_t *i, uint8_t *out, size_t len)
+{
+    for (size_t k = 0; k < len; ++k) {
+        int value = turbo_byte(t, i);
+
+        if (value < 0) {
+            return -1;
+        }
+
+        out[k] = (uint8_t)value;
+    }
+
+    return 0;
+}
+
+static void decode_turbo(tape *t)
+{
+    uint8_t header[TURBO_HEADER_LEN];
+    int have_header = 0;
+    size_t header_pulse = 0;
+    bytes data = {NULL, 0, 0};
+    unsigned shift = 0;
+    size_t i = 0;
+
+    while (i < t->count && !t->error) {
+        int c = pulse(t, &i);
+
+        if (c != PULSE_BIT0 && c != PULSE_BIT1) {
+            shift = 0;
+            continue;
+        }
+
+        // The pilot byte pattern only lines up on byte boundaries
+        shift = (shift << 1 | (unsigned)c) & 0xFF;
+        if (shift != TURBO_PILOT) {
+            continue;
+        }
+        shift = 0;
+
+        size_t start = i;
+        int value;
+        while ((value = turbo_byte(t, &i)) == TURBO_PILOT) {
+        }
+
+        int sync = TURBO_SYNC;
+        while (sync > 0 && value == sync) {
+            if (--sync > 0) {
+                value = turbo_byte(t, &i);
+            }
+        }
+
+        if (sync != 0) {
+            continue;
+        }
+
+        int id = turbo_byte(t, &i);
+
+        if (id == TURBO_HEADER) {
+            have_header = turbo_read(t, &i, header, TURBO_HEADER_LEN) == 0;
+            header_pulse = start;
+            continue;
+        }
+
+        if (id != TURBO_DATA || !have_header) {
+            continue;
+        }
+
+        uint16_t load = header[0] | header[1] << 8;
+        uint16_t end = header[2] | header[3] << 8;
+        size_t len = (uint16_t)(end - load);
+        uint8_t checksum[1];
+        uint8_t sum = 0;
+
+        have_header = 0;
+        if (reserve(&data, len) != 0) {
+            t->error = 1;
+            break;
+        }
+
+        if (turbo_read(t, &i, data.data, len) != 0) {
+            continue;
+        }
+
+        for (size_t k = 0; k < len; ++k) {
+            sum ^= data.data[k];
+        }
+
+        int ok = turbo_read(t, &i, checksum, 1) == 0 && checksum[0] == sum;
+        tap_file f = {
+            TAP_TURBO, &header[TURBO_NAME_OFF], header[TURBO_TYPE_OFF], load, end,
+            data.data, len, ok, header_pulse
+        };
+
+        add_file(t, &f);
+    }
+
+    free(data.data);
+}
+
+static int by_pulse(const void *a, const void *b)
+{
+    const found *x = a;
+    const found *y = b;
+
+    return (x->file.pulse > y->file.pulse) - (x->file.pulse < y->file.pulse);
+}
+
+static int valid(const uint8_t *buffer, size_t size)
+{
+    if (size < TAP_HEADER_LEN ||
+            memcmp(buffer, TAP_SIGNATURE, strlen(TAP_SIGNATURE)) != 0 ||
+            buffer[TAP_VERSION_OFF] > TAP_MAX_VERSION) {
+        fprintf(stderr, "Not a valid TAP file.\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int tap_files(const uint8_t *buffer, size_t size, tap_file_fn fn, void *ctx)
+{
+    if (!valid(buffer, size)) {
+        return -1;
+    }
+
+    int version = buffer[TAP_VERSION_OFF];
+    const uint8_t *in = &buffer[TAP_HEADER_LEN];
+    size_t n = (size_t)buffer[TAP_LENGTH_OFF] | (size_t)buffer[TAP_LENGTH_OFF + 1] << 8 |
+        (size_t)buffer[TAP_LENGTH_OFF + 2] << 16 | (size_t)buffer[TAP_LENGTH_OFF + 3] << 24;
+
+    // Truncated tapes are decoded as far as they go
+    if (n > size - TAP_HEADER_LEN) {
+        n = size - TAP_HEADER_LEN;
+    }
+
+    uint8_t *classes = malloc(n ? n : 1);
+    uint8_t *waves = NULL;
+    if (!classes) {
+        perror("Error");
+        return -1;
+    }
+
+    if (version == 2) {
+        waves = malloc(n ? n : 1);
+        if (!waves) {
+            perror("Error");
+            free(classes);
+            return -1;
+        }
+
+        n = full_waves(in, n, waves);
+        in = waves;
+    }
+
+    classify(in, n, classes);
+    mark_pauses(in, n, classes, version == 1 ? TAP_PAUSE_LEN : 0);
+    free(waves);
+
+    tape t = {classes, n, {NULL, 0, 0}, NULL, 0, 0, 0};
+
+    decode_cbm(&t);
+    decode_turbo(&t);
+    free(classes);
+
+    int status = t.error ? -1 : 0;
+    if (t.error) {
+        perror("Error");
+    }
+
+    qsort(t.files, t.nfiles, sizeof(found), by_pulse);
+
+    for (size_t k = 0; k < t.nfiles && status == 0; ++k) {
+        tap_file *f = &t.files[k].file;
+
+        f->name = &t.pool.data[t.files[k].name];
+        f->data = &t.pool.data[t.files[k].data];
+        status = fn(f, ctx);
+    }
+
+    free(t.files);
+    free(t.pool.data);
+
+    return status;
+}
+
+typedef struct
+{
+    FILE *out;
+    int count;
+} listing;
+
+static int list_file(const tap_file *f, void *ctx)
+{
+    listing *l = ctx;
+
+    l->count++;
+    petscii_write(l->out, petscii_raw, f->name, TAP_NAME_LEN);
+
+    fprintf(l->out, "  %s", f->format == TAP_CBM && f->type == CBM_HEADER_SEQ ? "seq" : "prg");
+    fprintf(l->out, "  %-5s", f->format == TAP_CBM ? "cbm" : "turbo");
+    fprintf(l->out, "  0x%04x - 0x%04x  %zu bytes", f->start, f->end, f->size);
+
+    if (!f->ok) {
+        fprintf(l->out, "  %s", f->size ? "checksum error" : "data missing");
+    }
+
+    fprintf(l->out, "\n");
+
+    return 0;
+}
+
+void tap(FILE *out, const uint8_t *buffer, const size_t size)
+{
+    listing l = {out, 0};
+
+    if (!valid(buffer, (size_t)size)) {
+        return;
+    }
+
+    fprintf(out, "Version: %d\n", buffer[TAP_VERSION_OFF]);
+    fprintf(out, "Contents:\n");
+
+    if (tap_files(buffer, (size_t)size, list_file, &l) == 0) {
+        STATS_PHASE(STATS_RENDER);
+        fprintf(out, "%d files\n", l.count);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TAP_NAME_LEN 16
+#define TAP_THRESHOLDS 4
+#define TAP_CBM_SEQ 0x04         // CBM header type of data files
+
+typedef enum {TAP_CBM, TAP_TURBO} tap_format;
+
+// A file decoded from the pulse stream, valid for the duration of the
+// callback
+typedef struct
+{
+    tap_format format;
+    const uint8_t *name;        // raw PETSCII name, TAP_NAME_LEN bytes
+    uint8_t type;               // header type byte
+    uint16_t start;             // load address of data[0]
+    uint16_t end;
+    const uint8_t *data;        // file contents without load address
+    size_t size;
+    int ok;                     // checksums matched
+    size_t pulse;               // pulse index the file header starts at
+} tap_file;
+
+typedef int (*tap_file_fn)(const tap_file *file, void *ctx);
+
+// Pulse length boundaries in TAP units (8 cycles), ascending: turbo
+// bit 0/1, turbo/CBM short, CBM short/medium and CBM medium/long
+void tap_set_thresholds(const uint8_t thresholds[TAP_THRESHOLDS]);
+int tap_thresholds_parse(const char *s, uint8_t thresholds[TAP_THRESHOLDS]);
+
+void tap(FILE *out, const uint8_t *buffer, const size_t size);
+
+// Decodes CBM ROM loader and Turbo Tape files and calls fn for each in
+// tape order; fn returning non-zero stops the walk.
+int tap_files(const uint8_t *buffer, size_t size, tap_file_fn fn, void *ctx);
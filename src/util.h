@@ -4,6 +4,9 @@
 
 #define PACKED __attribute__ ((__packed__))
 
-extern const uint8_t pet_asc[];
-
 const char *get_filetype(int ftype);
+
+// Prints a diagnostic about an input to stderr and counts it, so output
+// rendered alongside one can be told from a clean result
+void diagnostic(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+unsigned long diagnostics(void);
@@ -0,0 +1,570 @@
+#define _DEFAULT_SOURCE
+
+#include "watch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+#define RECORD_BUCKETS 65536
+#define EVENT_BUFFER 65536
+#define DIR_EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | \
+        IN_MOVED_TO | IN_DELETE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static const char *kind_names[] = {"raw", "prg", "p00", "d64", "t64", "tap", "crt"};
+
+// A file seen in the tree
+typedef struct record
+{
+    char *path;
+    uint64_t hash;
+    int known;                  // reported with the mtime and size below
+    struct timespec mtime;
+    off_t size;
+    int pending;                // on the pending list
+    int64_t due;                // when to look at it, monotonic ms
+    struct record *chain;       // hash bucket
+    struct record *next;        // pending list
+} record;
+
+typedef struct
+{
+    FILE *out;
+    watch_kind_fn kind;
+    int fd;                     // inotify
+    char **dirs;                // watched directory by watch descriptor
+    size_t dirs_cap;
+    record *buckets[RECORD_BUCKETS];
+    record *pending;
+    int full;                   // out of watches, reported once
+} watcher;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *path; ++path) {
+        h = (h ^ (uint8_t)*path) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+
+    if (path) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+
+    return path;
+}
+
+static record *find_record(watcher *w, const char *path, int create)
+{
+    uint64_t hash = hash_path(path);
+    record **bucket = &w->buckets[hash % RECORD_BUCKETS];
+
+    for (record *r = *bucket; r; r = r->chain) {
+        if (r->hash == hash && strcmp(r->path, path) == 0) {
+            return r;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    record *r = calloc(1, sizeof(record));
+    if (!r || (r->path = strdup(path)) == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    r->hash = hash;
+    r->chain = *bucket;
+    *bucket = r;
+
+    return r;
+}
+
+static void drop_record(watcher *w, record *r)
+{
+    record **p = &w->buckets[r->hash % RECORD_BUCKETS];
+
+    while (*p != r) {
+        p = &(*p)->chain;
+    }
+
+    *p = r->chain;
+    free(r->path);
+    free(r);
+}
+
+// Looked at once the path has been quiet for the debounce time; every
+// further event pushes that back
+static void schedule(watcher *w, const char *path, int64_t delay)
+{
+    record *r = find_record(w, path, 1);
+
+    if (!r) {
+        perror("Error");
+        return;
+    }
+
+    r->due = now_ms() + delay;
+
+    if (!r->pending) {
+        r->pending = 1;
+        r->next = w->pending;
+        w->pending = r;
+    }
+}
+
+static void schedule_tree(watcher *w, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    for (size_t b = 0; b < RECORD_BUCKETS; ++b) {
+        for (record *r = w->buckets[b]; r; r = r->chain) {
+            if (strncmp(r->path, dir, len) == 0 && r->path[len] == '/') {
+                schedule(w, r->path, 0);
+            }
+        }
+    }
+}
+
+static void drop_watches(watcher *w, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    for (size_t wd = 0; wd < w->dirs_cap; ++wd) {
+        const char *path = w->dirs[wd];
+
+        if (path && strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            inotify_rm_watch(w->fd, (int)wd);
+            free(w->dirs[wd]);
+            w->dirs[wd] = NULL;
+        }
+    }
+}
+
+static int add_watch(watcher *w, const char *dir)
+{
+    int wd = inotify_add_watch(w->fd, dir, DIR_EVENTS);
+
+    if (wd < 0) {
+        if (errno == ENOSPC && !w->full) {
+            fprintf(stderr, "Out of inotify watches, raise fs.inotify.max_user_watches\n");
+            w->full = 1;
+        }
+        return -1;
+    }
+
+    if ((size_t)wd >= w->dirs_cap) {
+        size_t n = w->dirs_cap ? w->dirs_cap : 256;
+        while (n <= (size_t)wd) {
+            n *= 2;
+        }
+
+        char **p = realloc(w->dirs, n * sizeof(char *));
+        if (!p) {
+            return -1;
+        }
+
+        memset(p + w->dirs_cap, 0, (n - w->dirs_cap) * sizeof(char *));
+        w->dirs = p;
+        w->dirs_cap = n;
+    }
+
+    // Watching an already watched directory returns the same descriptor
+    if (!w->dirs[wd] || strcmp(w->dirs[wd], dir) != 0) {
+        free(w->dirs[wd]);
+        w->dirs[wd] = strdup(dir);
+    }
+
+    return 0;
+}
+
+// Watches a directory and everything below it and schedules its files.
+// The watch comes first so nothing created during the walk is missed.
+static int add_tree(watcher *w, const char *dir, int64_t delay)
+{
+    if (add_watch(w, dir) != 0) {
+        return -1;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *path = join_path(dir, e->d_name);
+        struct stat st;
+
+        if (!path) {
+            continue;
+        }
+
+        if (lstat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                add_tree(w, path, delay);
+            } else if (S_ISREG(st.st_mode)) {
+                schedule(w, path, delay);
+            }
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+
+    return 0;
+}
+
+// Everything known is looked at again; only differences get reported
+static void rescan(watcher *w, const char *root)
+{
+    for (size_t b = 0; b < RECORD_BUCKETS; ++b) {
+        for (record *r = w->buckets[b]; r; r = r->chain) {
+            schedule(w, r->path, 0);
+        }
+    }
+
+    add_tree(w, root, 0);
+}
+
+static void write_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+typedef struct
+{
+    FILE *out;
+    int count;
+} file_list;
+
+static int write_file(const container_file *f, void *ctx)
+{
+    file_list *l = ctx;
+
+    fprintf(l->out, "%s{\"name\":", l->count++ ? "," : "");
+    if (f->name) {
+        write_string(l->out, f->name);
+    } else {
+        fprintf(l->out, "null");
+    }
+    fprintf(l->out, ",\"size\":%zu,\"load\":%ld}", f->size - f->header, f->load);
+
+    return 0;
+}
+
+static void write_update(watcher *w, const char *path, int fd, const struct stat *st)
+{
+    static const uint8_t empty[2] = {0, 0};
+    const uint8_t *buffer = empty;
+    size_t size = (size_t)st->st_size;
+    uint8_t *map = NULL;
+
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Error");
+            return;
+        }
+        buffer = map;
+    }
+
+    container_kind kind = w->kind(path, size >= 2 ? buffer : NULL, size);
+    file_list l = {w->out, 0};
+
+    fprintf(w->out, "{\"event\":\"update\",\"path\":");
+    write_string(w->out, path);
+    fprintf(w->out, ",\"kind\":\"%s\",\"size\":%zu,\"mtime\":%lld,\"files\":[",
+        kind_names[kind], size, (long long)st->st_mtim.tv_sec);
+
+    int status = size > 0 ? container_files(kind, buffer, size, write_file, &l) : -1;
+
+    fprintf(w->out, "],\"valid\":%s}\n", status == 0 ? "true" : "false");
+
+    if (map) {
+        munmap(map, size);
+    }
+}
+
+static void write_remove(watcher *w, const char *path)
+{
+    fprintf(w->out, "{\"event\":\"remove\",\"path\":");
+    write_string(w->out, path);
+    fprintf(w->out, "}\n");
+}
+
+// Reports the record if it changed; returns 1 if it's still being written
+static int settle(watcher *w, record *r)
+{
+    struct stat st;
+    int fd = open(r->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (r->known) {
+            write_remove(w, r->path);
+            r->known = 0;
+        }
+
+        return 0;
+    }
+
+    // Written to within the debounce time, without an event seen yet
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t age = ((int64_t)now.tv_sec - st.st_mtim.tv_sec) * 1000 +
+        (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+
+    if (age >= 0 && age < WATCH_DEBOUNCE_MS) {
+        close(fd);
+        return 1;
+    }
+
+    if (!r->known || r->size != st.st_size || r->mtime.tv_sec != st.st_mtim.tv_sec ||
+            r->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        write_update(w, r->path, fd, &st);
+        r->known = 1;
+        r->size = st.st_size;
+        r->mtime = st.st_mtim;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+// Looks at the paths that are due; returns the time until the next one,
+// -1 if none is pending
+static int flush(watcher *w)
+{
+    int64_t now = now_ms();
+    int64_t next = -1;
+    record *r = w->pending;
+    int wrote = 0;
+
+    w->pending = NULL;
+
+    while (r) {
+        record *following = r->next;
+
+        if (r->due <= now && settle(w, r) != 0) {
+            r->due = now + WATCH_DEBOUNCE_MS;
+        } else if (r->due <= now) {
+            r->pending = 0;
+            wrote = 1;
+
+            if (!r->known) {
+                drop_record(w, r);
+            }
+
+            r = following;
+            continue;
+        }
+
+        r->next = w->pending;
+        w->pending = r;
+
+        if (next < 0 || r->due - now < next) {
+            next = r->due - now;
+        }
+
+        r = following;
+    }
+
+    if (wrote) {
+        fflush(w->out);
+    }
+
+    return (int)next;
+}
+
+static void handle_event(watcher *w, const struct inotify_event *e)
+{
+    const char *dir = e->wd >= 0 && (size_t)e->wd < w->dirs_cap ? w->dirs[e->wd] : NULL;
+
+    if (e->mask & IN_IGNORED) {
+        if (dir) {
+            free(w->dirs[e->wd]);
+            w->dirs[e->wd] = NULL;
+        }
+        return;
+    }
+
+    if (!dir || e->len == 0) {
+        return;
+    }
+
+    char *path = join_path(dir, e->name);
+    if (!path) {
+        return;
+    }
+
+    if (e->mask & IN_ISDIR) {
+        if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_tree(w, path, WATCH_DEBOUNCE_MS);
+        } else if (e->mask & IN_MOVED_FROM) {
+            // Its files are gone from the tree along with it
+            drop_watches(w, path);
+            schedule_tree(w, path);
+        }
+    } else {
+        schedule(w, path, WATCH_DEBOUNCE_MS);
+    }
+
+    free(path);
+}
+
+static int read_events(watcher *w, const char *root)
+{
+    char buffer[EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t n = read(w->fd, buffer, sizeof(buffer));
+
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+
+        for (char *p = buffer; p < buffer + n; ) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+
+            if (e->mask & IN_Q_OVERFLOW) {
+                rescan(w, root);
+            } else {
+                handle_event(w, e);
+            }
+
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+}
+
+int watch(FILE *out, const char *dir, watch_kind_fn kind)
+{
+    watcher *w = calloc(1, sizeof(watcher));
+    if (!w) {
+        perror("Error");
+        return -1;
+    }
+
+    w->out = out;
+    w->kind = kind;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    int signals = signalfd(-1, &mask, SFD_CLOEXEC);
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // Trailing slashes would end up doubled in the paths
+    char *root = strdup(dir);
+    for (size_t len = root ? strlen(root) : 0; len > 1 && root[len - 1] == '/'; --len) {
+        root[len - 1] = '\0';
+    }
+
+    int status = 0;
+    if (signals < 0 || w->fd < 0 || !root || add_tree(w, root, 0) != 0) {
+        perror("Error");
+        status = -1;
+    }
+
+    while (status == 0) {
+        struct pollfd fds[2] = {{w->fd, POLLIN, 0}, {signals, POLLIN, 0}};
+        int timeout = flush(w);
+
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error");
+            status = -1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && read_events(w, root) != 0) {
+            perror("Error");
+            status = -1;
+        }
+    }
+
+    for (size_t b = 0; b < RECORD_BUCKETS; ++b) {
+        while (w->buckets[b]) {
+            drop_record(w, w->buckets[b]);
+        }
+    }
+
+    for (size_t wd = 0; wd < w->dirs_cap; ++wd) {
+        free(w->dirs[wd]);
+    }
+
+    if (signals >= 0) {
+        close(signals);
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+
+    free(root);
+    free(w->dirs);
+    free(w);
+
+    return status;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Follows a directory tree with inotify and writes one JSON record per
+// line whenever a file appears, changes or goes away:
+//
+//   {"event":"update","path":...,"kind":"d64","size":...,"mtime":...,
+//    "files":[{"name":...,"size":...,"load":...},...],"valid":true}
+//   {"event":"remove","path":...}
+//
+// Every file is reported once at start. Events for a path are coalesced
+// until it has been quiet for WATCH_DEBOUNCE_MS, so a file still being
+// written is parsed once, and files whose size and mtime are unchanged
+// aren't reported again. When the kernel's event queue overflows the tree
+// is rescanned and only the differences are reported.
+
+#define WATCH_DEBOUNCE_MS 200
+
+typedef container_kind (*watch_kind_fn)(const char *path, const uint8_t *buffer, size_t size);
+
+// Runs until SIGINT or SIGTERM. Returns 0, or -1 after printing the reason
+// if the tree couldn't be watched.
+int watch(FILE *out, const char *dir, watch_kind_fn kind);